@@ -0,0 +1,1149 @@
+/* Microbenchmarks for the server's data layer and request path.
+ *
+ * The server is a single translation unit, so the harness includes it whole and calls its static
+ * functions directly; nothing listens on a port. Build next to server.c with
+ *   gcc -O2 bench.c -o bench -lsqlite3 -lpthread -lssl -lcrypto
+ */
+#define main server_main
+#include "server.c"
+#undef main
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+
+#define BENCH_SIZES_MAX 8
+#define BENCH_CATEGORIES 10
+/* Consecutive entries share a site, so FIND_BY_URL finds this many */
+#define BENCH_SITE_ENTRIES 10
+#define BENCH_SEED_BATCH 5000
+#define BENCH_PASSWORD "Str0ng!Pass"
+#define BENCH_MAX_ITERS (1 << 24)
+/* The incremental SYNC picks up this many logged changes */
+#define BENCH_SYNC_CHANGES 10
+/* WATCH fan-out is timed for one watcher and for this many */
+#define BENCH_WATCHERS 16
+
+/* One synthetic vault plus the connection state its commands run under */
+typedef struct
+{
+    int size;
+    client_ctx *ctx;
+    sqlite3_int64 user_id;
+    sqlite3_int64 cat_id;
+    char username[32];
+    char stored_hash[KDF_HASH_LEN];
+    unsigned char key[DATA_KEY_LEN];
+    /* The vault's notes and passwords, plain and sealed, for the throughput runs */
+    batch_item *rows;
+    blob_ref *sealed, *scratch;
+    unsigned char *sealed_buf;
+    size_t row_bytes;
+    unsigned long counter;
+    sqlite3_int64 sync_from; /* a revision BENCH_SYNC_CHANGES behind, found on first use */
+} bench_env;
+
+typedef struct
+{
+    char name[64];
+    int size;
+    double median, mad, min;
+} bench_result;
+
+static int bench_reps = 15;
+static int bench_warmup = 2;
+static double bench_min_ms = 20;
+static const char *bench_filter;
+static bench_result *baseline;
+static int baseline_count;
+static FILE *bench_csv;
+static const char *bench_db_path;
+
+static int bench_drain_fd;
+static event_loop bench_loop; /* only its wake_fd and lists are used; nothing runs epoll on it */
+
+
+/* Harness */
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median_of(double *v, int n)
+{
+    qsort(v, n, sizeof(double), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static const bench_result *baseline_find(const char *name, int size)
+{
+    for (int i = 0; i < baseline_count; ++i)
+    {
+        if (baseline[i].size == size && strcmp(baseline[i].name, name) == 0)
+        {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+/* Times op in batches long enough to read the clock reliably; reports the median and MAD of ns/op over the batches
+   and returns the median, or 0 if the filter skipped it */
+static double bench_run(const char *name, bench_env *env, void (*op)(bench_env *))
+{
+    int size = env ? env->size : 0;
+    if (bench_filter && strstr(name, bench_filter) == NULL)
+    {
+        return 0;
+    }
+
+    long iters = 1;
+    for (;;)
+    {
+        uint64_t start = now_ns();
+        for (long i = 0; i < iters; ++i)
+        {
+            op(env);
+        }
+        double ms = (now_ns() - start) / 1e6;
+        if (ms >= bench_min_ms || iters >= BENCH_MAX_ITERS)
+        {
+            break;
+        }
+        iters = ms < bench_min_ms / 16 ? iters * 16 : iters * 2;
+    }
+
+    double *per_op = calloc(bench_reps, sizeof(double));
+    double *dev = calloc(bench_reps, sizeof(double));
+    for (int rep = -bench_warmup; rep < bench_reps; ++rep)
+    {
+        uint64_t start = now_ns();
+        for (long i = 0; i < iters; ++i)
+        {
+            op(env);
+        }
+        if (rep >= 0)
+        {
+            per_op[rep] = (double)(now_ns() - start) / iters;
+        }
+    }
+
+    bench_result r = {.size = size};
+    snprintf(r.name, sizeof(r.name), "%s", name);
+    r.min = per_op[0];
+    for (int i = 0; i < bench_reps; ++i)
+    {
+        r.min = per_op[i] < r.min ? per_op[i] : r.min;
+    }
+    r.median = median_of(per_op, bench_reps);
+    for (int i = 0; i < bench_reps; ++i)
+    {
+        dev[i] = per_op[i] > r.median ? per_op[i] - r.median : r.median - per_op[i];
+    }
+    r.mad = median_of(dev, bench_reps);
+    free(per_op);
+    free(dev);
+
+    printf("%-44s %7d %14.1f %10.1f %14.1f %9ld", r.name, r.size, r.median, r.mad, r.min, iters);
+    const bench_result *old = baseline_find(r.name, r.size);
+    if (old && old->median > 0)
+    {
+        /* Differences inside three MADs of either run are marked as noise */
+        double change = (r.median - old->median) / old->median * 100;
+        double noise = 3 * (r.mad > old->mad ? r.mad : old->mad);
+        double delta = r.median > old->median ? r.median - old->median : old->median - r.median;
+        printf(" %+8.1f%%%s", change, delta <= noise ? " (noise)" : "");
+    }
+    printf("\n");
+    fflush(stdout);
+    if (bench_csv)
+    {
+        fprintf(bench_csv, "%s,%d,%.1f,%.1f,%.1f,%d,%ld\n", r.name, r.size, r.median, r.mad, r.min, bench_reps, iters);
+    }
+    return r.median;
+}
+
+/* Restates a median of ns for rows rows of bytes plaintext bytes as throughput */
+static void bench_rate(double ns, long rows, size_t bytes)
+{
+    if (ns > 0)
+    {
+        printf("%-44s %7s %14.0f rows/s %10.1f MB/s\n", "", "", rows * 1e9 / ns, bytes * 1e3 / ns);
+    }
+}
+
+static int baseline_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return 1;
+    }
+    char line[256];
+    int cap = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        bench_result r = {0};
+        if (sscanf(line, "%63[^,],%d,%lf,%lf,%lf", r.name, &r.size, &r.median, &r.mad, &r.min) != 5)
+        {
+            continue;
+        }
+        if (baseline_count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            baseline = realloc(baseline, cap * sizeof(bench_result));
+        }
+        baseline[baseline_count++] = r;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/* Synthetic vaults */
+
+/* Replies are written to a socketpair whose far end is read and discarded, as a client would */
+static void *bench_drain_run(void *arg)
+{
+    (void)arg;
+    char buf[65536];
+    while (read(bench_drain_fd, buf, sizeof(buf)) > 0)
+    {
+    }
+    return NULL;
+}
+
+static client_ctx *bench_ctx_new(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+        return NULL;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    bench_drain_fd = sv[1];
+    pthread_t tid;
+    pthread_create(&tid, NULL, bench_drain_run, NULL);
+
+    client_ctx *ctx = calloc(1, sizeof(client_ctx));
+    ctx->client_fd = sv[0];
+    ctx->loopback = 1;
+    pthread_mutex_init(&ctx->lock, NULL);
+    return ctx;
+}
+
+/* Registers bench<size> with size entries spread over BENCH_CATEGORIES categories, unless it exists */
+static int bench_env_init(bench_env *env, client_ctx *ctx, int size)
+{
+    env->size = size;
+    env->ctx = ctx;
+    snprintf(env->username, sizeof(env->username), "bench%d", size);
+
+    credentials cred = {0};
+    unsigned char kek[KDF_KEY_LEN];
+    int upgrade;
+    if (db_fetch_credentials(env->username, &cred) != 0)
+    {
+        char hash[KDF_HASH_LEN];
+        unsigned char wrapped[WRAPPED_KEY_LEN];
+        if (kdf_hash(BENCH_PASSWORD, hash, kek) != 0 || RAND_bytes(env->key, DATA_KEY_LEN) != 1 ||
+            data_key_wrap(kek, 0, env->key, wrapped) != 0 || db_register(env->username, hash, wrapped) != 0 ||
+            db_fetch_credentials(env->username, &cred) != 0)
+        {
+            return 1;
+        }
+        env->user_id = cred.user_id;
+
+        batch_item *items = calloc(BENCH_SEED_BATCH, sizeof(batch_item));
+        unsigned char *status = calloc(BENCH_SEED_BATCH, 1);
+        char (*titles)[16] = calloc(BENCH_SEED_BATCH, 16);
+        char (*urls)[48] = calloc(BENCH_SEED_BATCH, 48);
+        static char cats[BENCH_CATEGORIES][16];
+        for (int k = 0; k < BENCH_CATEGORIES; ++k)
+        {
+            snprintf(cats[k], sizeof(cats[k]), "cat%d", k);
+        }
+        for (int done = 0; done < size;)
+        {
+            int n = 0;
+            for (; n < BENCH_SEED_BATCH && done < size; ++n, ++done)
+            {
+                snprintf(titles[n], 16, "e%d", done);
+                snprintf(urls[n], 48, "https://login.site%d.example/", done / BENCH_SITE_ENTRIES);
+                items[n] = (batch_item){cats[done % BENCH_CATEGORIES], titles[n], "user", urls[n], "synthetic entry",
+                                        BENCH_PASSWORD};
+                status[n] = BATCH_OK;
+            }
+            if (db_insert_entry_batch(env->user_id, env->key, items, n, status, 1) != 0)
+            {
+                return 1;
+            }
+        }
+        free(items);
+        free(status);
+        free(titles);
+        free(urls);
+    }
+    /* A kept database opens with the key stored under the bench password */
+    else if (kdf_verify(BENCH_PASSWORD, cred.master, &upgrade, kek) != 0 || cred.has_wrapped[0] <= 0 ||
+             data_key_unwrap(kek, 0, cred.wrapped[0], env->key) != 0)
+    {
+        return 1;
+    }
+    env->user_id = cred.user_id;
+    strcpy(env->stored_hash, cred.master);
+
+    env->rows = calloc(size, sizeof(batch_item));
+    env->scratch = calloc(2 * (size_t)size, sizeof(blob_ref));
+    env->sealed = calloc(2 * (size_t)size, sizeof(blob_ref));
+    if (env->rows == NULL || env->scratch == NULL || env->sealed == NULL)
+    {
+        return 1;
+    }
+    for (int i = 0; i < size; ++i)
+    {
+        env->rows[i] = (batch_item){"", "", "", "", "synthetic entry", BENCH_PASSWORD};
+        env->row_bytes += strlen(env->rows[i].notes) + strlen(env->rows[i].pass);
+    }
+    env->sealed_buf = field_seal_items(env->key, env->user_id, env->rows, size, NULL, env->sealed);
+    if (env->sealed_buf == NULL)
+    {
+        return 1;
+    }
+    return db_fetch_category_by_name(env->user_id, "cat0", &env->cat_id);
+}
+
+/* Waits for the drain thread to bring the output down to below bytes, as a stalled connection waits for EPOLLOUT */
+static void bench_wait(client_ctx *ctx, size_t below)
+{
+    while (ctx->out_len > below)
+    {
+        struct pollfd pfd = {ctx->client_fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        conn_flush(ctx);
+    }
+}
+
+/* Hands the reply to the connection and sends it, as conn_run_commands does at the end of a batch; a stream that
+   stopped for the client is run again once it has caught up, as the loop would */
+static void bench_send(client_ctx *ctx)
+{
+    while (ctx->stream)
+    {
+        stream_job *sj = ctx->stream;
+        ctx->stream = NULL;
+        conn_queue_reply(ctx);
+        conn_flush(ctx);
+        bench_wait(ctx, STREAM_LOW_WATER);
+        stream_job_run(ctx, sj);
+    }
+    reply_close(&ctx->reply, 0);
+    conn_queue_reply(ctx);
+    conn_flush(ctx);
+    bench_wait(ctx, STREAM_HIGH_WATER);
+}
+
+/* Runs one request the way conn_run_commands does, including queueing and sending the reply */
+static void bench_request(bench_env *env, const char *cmd)
+{
+    client_ctx *ctx = env->ctx;
+    char request[512];
+    size_t len = strlen(cmd);
+    memcpy(request, cmd, len + 1);
+
+    snprintf(ctx->active_user, sizeof(ctx->active_user), "%s", env->username);
+    ctx->user_id = env->user_id;
+    memcpy(ctx->data_key, env->key, DATA_KEY_LEN);
+    reply_open(&ctx->reply);
+    process_command(ctx, request, len, &ctx->reply);
+    bench_send(ctx);
+}
+
+
+/* Data layer */
+
+static void op_fetch_user(bench_env *env)
+{
+    db_fetch_user_by_username(env->username);
+}
+
+static void op_fetch_credentials(bench_env *env)
+{
+    credentials cred;
+    db_fetch_credentials(env->username, &cred);
+}
+
+static void op_fetch_category(bench_env *env)
+{
+    sqlite3_int64 id;
+    db_fetch_category_by_name(env->user_id, "cat0", &id);
+}
+
+static void op_fetch_entry(bench_env *env)
+{
+    char title[32];
+    snprintf(title, sizeof(title), "e%lu", env->counter++ % env->size);
+    db_fetch_entry_by_title(env->user_id, title);
+}
+
+static void fetch_entries(bench_env *env, int limit)
+{
+    reply_stream rs;
+    sqlite3_int64 next;
+    stream_begin(&rs, env->ctx);
+    db_fetch_entries(env->user_id, env->key, "cat0", 0, limit, &rs, &next);
+    stream_end(&rs);
+    bench_send(env->ctx);
+}
+
+static void op_fetch_entries_page(bench_env *env)
+{
+    fetch_entries(env, 50);
+}
+
+static void op_fetch_entries_all(bench_env *env)
+{
+    fetch_entries(env, -1);
+}
+
+/* Steps the LOGIN credentials lookup or a 50-entry LIST_ENTRIES page to the end. Pooled, it runs on a cached
+   statement; otherwise it opens the file and compiles the SQL each time, as every db_* call did before the pool */
+static void query_rows(bench_env *env, enum stmt_id id, int pooled)
+{
+    db_conn *c = NULL;
+    sqlite3 *db = NULL;
+    sqlite3_stmt *res = NULL;
+    if (pooled)
+    {
+        c = db_acquire();
+        res = db_stmt(c, id);
+    }
+    else if (db_open(bench_db_path, SQLITE_OPEN_READONLY, &db) == SQLITE_OK)
+    {
+        sqlite3_prepare_v2(db, stmt_sql[id], -1, &res, NULL);
+    }
+
+    if (res && id == STMT_FETCH_CREDENTIALS)
+    {
+        sqlite3_bind_text(res, 1, env->username, -1, SQLITE_STATIC);
+    }
+    else if (res)
+    {
+        sqlite3_bind_int64(res, 1, env->user_id);
+        sqlite3_bind_text(res, 2, "cat0", -1, SQLITE_STATIC);
+        sqlite3_bind_int64(res, 3, 0);
+        sqlite3_bind_int(res, 4, 50);
+    }
+    while (res && sqlite3_step(res) == SQLITE_ROW)
+    {
+        env->counter++;
+    }
+
+    if (pooled)
+    {
+        db_stmt_done(res);
+        db_release(c);
+    }
+    else
+    {
+        sqlite3_finalize(res);
+        sqlite3_close(db);
+    }
+}
+
+static void op_login_query_pooled(bench_env *env)
+{
+    query_rows(env, STMT_FETCH_CREDENTIALS, 1);
+}
+
+static void op_login_query_unpooled(bench_env *env)
+{
+    query_rows(env, STMT_FETCH_CREDENTIALS, 0);
+}
+
+static void op_list_query_pooled(bench_env *env)
+{
+    query_rows(env, STMT_FETCH_ENTRIES, 1);
+}
+
+static void op_list_query_unpooled(bench_env *env)
+{
+    query_rows(env, STMT_FETCH_ENTRIES, 0);
+}
+
+static void op_fetch_categories(bench_env *env)
+{
+    reply_stream rs;
+    sqlite3_int64 next;
+    stream_begin(&rs, env->ctx);
+    db_fetch_categories(env->user_id, 0, MAX_PAGE_LIMIT, &rs, &next);
+    stream_end(&rs);
+    bench_send(env->ctx);
+}
+
+/* What vault_search and vault_find_url do when the vault is not cached */
+static void scan(bench_env *env, entry_match match, const void *query)
+{
+    vault_row *rows[SEARCH_DEFAULT_LIMIT];
+    uint32_t score[SEARCH_DEFAULT_LIMIT];
+    search_hits hits = {rows, score, 0, SEARCH_DEFAULT_LIMIT};
+    reply_stream rs;
+    stream_begin(&rs, env->ctx);
+    db_match_entries(env->user_id, env->key, match, query, &hits);
+    search_hits_finish(&hits);
+    for (int i = 0; i < hits.count; ++i)
+    {
+        stream_entry(&rs, rows[i]->f);
+        vault_row_release(rows[i]);
+    }
+    stream_end(&rs);
+    bench_send(env->ctx);
+}
+
+/* Cached vaults answer from their index, the rest from a scan of SQLite */
+static void search(bench_env *env, const char *query, int from_db)
+{
+    search_query q;
+    search_parse(query, &q);
+    if (from_db)
+    {
+        scan(env, search_match, &q);
+        return;
+    }
+    reply_stream rs;
+    stream_begin(&rs, env->ctx);
+    vault_search(env->user_id, env->key, &q, SEARCH_DEFAULT_LIMIT, &rs);
+    stream_end(&rs);
+    bench_send(env->ctx);
+}
+
+/* Titles with the most digits, which prefix no other title */
+static void search_title(bench_env *env, int from_db)
+{
+    char query[32];
+    unsigned long top = env->size >= 10 ? env->size / 10 : 0;
+    snprintf(query, sizeof(query), "e%lu", top + env->counter++ % (env->size - top));
+    search(env, query, from_db);
+}
+
+/* A whole title, the titles starting with e12 (about 1% of the vault), a word every entry contains, and the index build */
+static void op_search_title(bench_env *env)
+{
+    search_title(env, 0);
+}
+
+static void op_search_prefix(bench_env *env)
+{
+    search(env, env->size >= 100 ? "e12" : "e1", 0);
+}
+
+static void op_search_common(bench_env *env)
+{
+    search(env, "synth", 0);
+}
+
+static void op_search_rebuild(bench_env *env)
+{
+    vault_shard *s = vault_shard_for(env->user_id);
+    pthread_mutex_lock(&s->lock);
+    vault *v = vault_find(s, env->user_id);
+    if (v && v->index)
+    {
+        v->bytes -= v->index->bytes;
+        s->bytes -= v->index->bytes;
+        search_index_free(v->index);
+        v->index = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+    search_title(env, 0);
+}
+
+static void op_scan_title(bench_env *env)
+{
+    search_title(env, 1);
+}
+
+static void op_scan_common(bench_env *env)
+{
+    search(env, "synth", 1);
+}
+
+/* A page on one of the vault's sites, which has BENCH_SITE_ENTRIES entries */
+static void find_url(bench_env *env, int from_db)
+{
+    char url[64];
+    url_query q;
+    snprintf(url, sizeof(url), "https://www.site%lu.example/account", env->counter++ % env->size / BENCH_SITE_ENTRIES);
+    url_parse(url, &q);
+    if (from_db)
+    {
+        scan(env, url_match, &q);
+        return;
+    }
+    reply_stream rs;
+    stream_begin(&rs, env->ctx);
+    vault_find_url(env->user_id, env->key, &q, URL_DEFAULT_LIMIT, &rs);
+    stream_end(&rs);
+    bench_send(env->ctx);
+}
+
+static void op_find_url(bench_env *env)
+{
+    find_url(env, 0);
+}
+
+static void op_find_url_rebuild(bench_env *env)
+{
+    vault_shard *s = vault_shard_for(env->user_id);
+    pthread_mutex_lock(&s->lock);
+    vault *v = vault_find(s, env->user_id);
+    if (v && v->sites)
+    {
+        v->bytes -= v->sites->bytes;
+        s->bytes -= v->sites->bytes;
+        site_index_free(v->sites);
+        v->sites = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+    find_url(env, 0);
+}
+
+static void op_scan_url(bench_env *env)
+{
+    find_url(env, 1);
+}
+
+static void op_load_vault(bench_env *env)
+{
+    vault *v = calloc(1, sizeof(vault));
+    v->user_id = env->user_id;
+    db_load_vault(env->user_id, env->key, v);
+    vault_free(v);
+}
+
+static void op_export_csv(bench_env *env)
+{
+    reply_stream rs;
+    sqlite3_int64 after[2] = {0, 0};
+    stream_begin(&rs, env->ctx);
+    while (db_export_entries(env->user_id, env->key, VAULT_CSV, after, &rs) > 0)
+    {
+        bench_wait(env->ctx, STREAM_LOW_WATER);
+        rs.stalled = 0;
+    }
+    stream_end(&rs);
+    bench_send(env->ctx);
+}
+
+/* Each iteration is one committed insert and one committed delete */
+static void op_insert_remove(bench_env *env)
+{
+    char title[32];
+    snprintf(title, sizeof(title), "tmp%lu", env->counter++);
+    db_insert_entry(env->user_id, env->key, env->cat_id, title, "user", "https://example.com", "notes", BENCH_PASSWORD);
+    db_remove_entry(env->user_id, title);
+}
+
+static void op_update_entry(bench_env *env)
+{
+    char notes[32];
+    snprintf(notes, sizeof(notes), "revision %lu", env->counter++);
+    db_update_entry(env->user_id, env->key, "e0", "e0", "user", "https://example.com/login", notes, BENCH_PASSWORD);
+}
+
+
+/* Request path */
+
+static void op_cmd_list_page(bench_env *env)
+{
+    bench_request(env, "LIST_ENTRIES|cat0|50|0");
+}
+
+static void op_cmd_list_all(bench_env *env)
+{
+    bench_request(env, "LIST_ENTRIES|cat0");
+}
+
+static void op_cmd_list_cats(bench_env *env)
+{
+    bench_request(env, "LIST_CATS");
+}
+
+static void op_cmd_search(bench_env *env)
+{
+    char cmd[64];
+    unsigned long top = env->size >= 10 ? env->size / 10 : 0;
+    snprintf(cmd, sizeof(cmd), "SEARCH|e%lu", top + env->counter++ % (env->size - top));
+    bench_request(env, cmd);
+}
+
+static void op_cmd_find_by_url(bench_env *env)
+{
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "FIND_BY_URL|https://site%lu.example/", env->counter++ % env->size / BENCH_SITE_ENTRIES);
+    bench_request(env, cmd);
+}
+
+/* What a client that synced BENCH_SYNC_CHANGES writes ago asks for */
+static void op_cmd_sync_recent(bench_env *env)
+{
+    if (env->sync_from == 0)
+    {
+        db_conn *c = db_acquire();
+        sqlite3_stmt *res = db_stmt(c, STMT_SYNC_STATE);
+        sqlite3_bind_int64(res, 1, env->user_id);
+        if (sqlite3_step(res) == SQLITE_ROW)
+        {
+            env->sync_from = sqlite3_column_int64(res, 0) - BENCH_SYNC_CHANGES;
+        }
+        db_stmt_done(res);
+        db_release(c);
+    }
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "SYNC|%lld", (long long)env->sync_from);
+    bench_request(env, cmd);
+}
+
+static void op_cmd_sync_all(bench_env *env)
+{
+    bench_request(env, "SYNC|0");
+}
+
+static void op_cmd_new_del(bench_env *env)
+{
+    char cmd[128];
+    unsigned long n = env->counter++;
+    snprintf(cmd, sizeof(cmd), "NEW_ENTRY|cat0|tmp%lu|user|https://example.com|notes|%s", n, BENCH_PASSWORD);
+    bench_request(env, cmd);
+    snprintf(cmd, sizeof(cmd), "DEL_ENTRY|tmp%lu", n);
+    bench_request(env, cmd);
+}
+
+static void op_cmd_del_miss(bench_env *env)
+{
+    bench_request(env, "DEL_ENTRY|no such entry");
+}
+
+static void op_cmd_invalid(bench_env *env)
+{
+    bench_request(env, "NO_SUCH_COMMAND|a|b");
+}
+
+
+/* Parse and dispatch */
+
+/* parse_command alone, no handler run. Splitting is destructive, so each call first copies the request the way
+   it would sit in the connection's input buffer */
+static void parse_request(bench_env *env, const char *cmd)
+{
+    char request[512];
+    size_t len = strlen(cmd);
+    memcpy(request, cmd, len + 1);
+
+    cmd_field args[MAX_COMMAND_ARGS];
+    int count = 0;
+    const command_def *def = parse_command(request, len, args, &count);
+    env->counter += count + (def != NULL);
+}
+
+static void op_parse_list(bench_env *env)
+{
+    parse_request(env, "LIST_ENTRIES|web|10|0");
+}
+
+static void op_parse_new(bench_env *env)
+{
+    parse_request(env, "NEW_ENTRY|web|title1|me|https://example.com/login|notes|" BENCH_PASSWORD);
+}
+
+static void op_parse_login(bench_env *env)
+{
+    parse_request(env, "LOGIN|alice|" BENCH_PASSWORD);
+}
+
+static void op_parse_del(bench_env *env)
+{
+    parse_request(env, "DEL_ENTRY|t1");
+}
+
+static void op_parse_list_cats(bench_env *env)
+{
+    parse_request(env, "LIST_CATS");
+}
+
+static void op_parse_import_end(bench_env *env)
+{
+    parse_request(env, "IMPORT_END");
+}
+
+
+/* Push notifications */
+
+/* Adds watchers of env's vault, up to n, on bench_loop; their pushes go to the same drained socketpair */
+static int bench_watch(bench_env *env, int n)
+{
+    static int watching;
+    if (watching == 0)
+    {
+        bench_loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&bench_loop.reap_lock, NULL);
+        if (bench_loop.wake_fd == -1)
+        {
+            return 1;
+        }
+    }
+    for (; watching < n; ++watching)
+    {
+        client_ctx *w = calloc(1, sizeof(client_ctx));
+        if (w == NULL)
+        {
+            return 1;
+        }
+        w->client_fd = env->ctx->client_fd;
+        w->loop = &bench_loop;
+        w->user_id = env->user_id;
+        pthread_mutex_init(&w->lock, NULL);
+        watch_add(w);
+    }
+    return 0;
+}
+
+/* One commit's fan-out: the commit thread's share, then the woken loop pushing the revision to every watcher */
+static void op_watch_push(bench_env *env)
+{
+    watch_notify(env->user_id, (sqlite3_int64)++env->counter);
+    event_loop_drain_reaps(&bench_loop);
+    event_loop_drain_notify(&bench_loop);
+}
+
+
+/* Passwords */
+
+/* The verdict is written to an open frame that the next call empties again */
+static void op_strength_strong(bench_env *env)
+{
+    evaluate_password_strength(env->ctx, "Correct-Horse-Battery-Staple-42", &env->ctx->reply);
+}
+
+static void op_strength_weak(bench_env *env)
+{
+    evaluate_password_strength(env->ctx, "password", &env->ctx->reply);
+}
+
+static void op_kdf_hash(bench_env *env)
+{
+    (void)env;
+    char out[KDF_HASH_LEN];
+    kdf_hash(BENCH_PASSWORD, out, NULL);
+}
+
+static void op_kdf_verify(bench_env *env)
+{
+    int upgrade;
+    kdf_verify(BENCH_PASSWORD, env->stored_hash, &upgrade, NULL);
+}
+
+static void op_kdf_verify_legacy(bench_env *env)
+{
+    (void)env;
+    static char legacy[32];
+    int upgrade;
+    if (!legacy[0])
+    {
+        snprintf(legacy, sizeof(legacy), "%lu", simple_hash(BENCH_PASSWORD));
+    }
+    kdf_verify(BENCH_PASSWORD, legacy, &upgrade, NULL);
+}
+
+
+/* Encryption at rest */
+
+/* What NEW_ENTRY and the import path do per chunk, over the whole vault */
+static void op_seal_vault(bench_env *env)
+{
+    free(field_seal_items(env->key, env->user_id, env->rows, env->size, NULL, env->scratch));
+}
+
+/* What db_fetch_entries and db_load_vault do per row: one key schedule, then both fields opened */
+static void op_open_vault(bench_env *env)
+{
+    field_cipher fc;
+    if (field_cipher_init(&fc, env->key, env->user_id, 0) == 0)
+    {
+        for (int i = 0; i < 2 * env->size; ++i)
+        {
+            field_open(&fc, i % 2, env->sealed[i].p, env->sealed[i].len);
+        }
+    }
+    field_cipher_free(&fc);
+}
+
+static void op_seal_row(bench_env *env)
+{
+    batch_item item = {"cat0", "e0", "user", "https://login.site0.example/", "synthetic entry", BENCH_PASSWORD};
+    blob_ref blobs[2];
+    free(field_seal_items(env->key, env->user_id, &item, 1, NULL, blobs));
+}
+
+/* Opens one sealed value of len plaintext bytes with a cipher set up per call, as a listing does per page */
+static void open_sealed(bench_env *env, int len)
+{
+    static unsigned char *sealed;
+    static int sealed_len;
+    if (sealed_len != len)
+    {
+        char *plain = malloc(len + 1);
+        memset(plain, 'n', len);
+        plain[len] = '\0';
+        batch_item item = {"", "", "", "", plain, ""};
+        blob_ref blobs[2];
+        free(sealed);
+        sealed = field_seal_items(env->key, env->user_id, &item, 1, NULL, blobs);
+        sealed_len = len;
+        free(plain);
+    }
+
+    field_cipher fc;
+    if (field_cipher_init(&fc, env->key, env->user_id, 0) == 0)
+    {
+        field_open(&fc, SEAL_NOTES, sealed, len + SEAL_OVERHEAD);
+    }
+    field_cipher_free(&fc);
+}
+
+static void op_open_row(bench_env *env)
+{
+    open_sealed(env, (int)strlen("synthetic entry"));
+}
+
+static void op_open_4k(bench_env *env)
+{
+    open_sealed(env, 4096);
+}
+
+static void op_wrap_key(bench_env *env)
+{
+    unsigned char wrapped[WRAPPED_KEY_LEN], key[DATA_KEY_LEN];
+    data_key_wrap(env->key, 0, env->key, wrapped);
+    data_key_unwrap(env->key, 0, wrapped, key);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int sizes[BENCH_SIZES_MAX] = {10, 1000, 100000};
+    int nsizes = 3;
+    const char *dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    const char *csv_path = NULL, *baseline_path = NULL;
+    int keep = 0, cache_mb = DEFAULT_CACHE_MB, opt;
+
+    while ((opt = getopt(argc, argv, "n:r:w:m:b:d:o:c:s:C:k")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            nsizes = 0;
+            for (char *tok = strtok(optarg, ","); tok && nsizes < BENCH_SIZES_MAX; tok = strtok(NULL, ","))
+            {
+                sizes[nsizes++] = atoi(tok);
+            }
+            break;
+        case 'r':
+            bench_reps = atoi(optarg);
+            break;
+        case 'w':
+            bench_warmup = atoi(optarg);
+            break;
+        case 'm':
+            bench_min_ms = atof(optarg);
+            break;
+        case 'b':
+            bench_filter = optarg;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'o':
+            csv_path = optarg;
+            break;
+        case 'c':
+            baseline_path = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%d,%d,%d", &kdf_log_n, &kdf_r, &kdf_p) != 3)
+            {
+                kdf_log_n = 0;
+            }
+            break;
+        case 'C':
+            cache_mb = atoi(optarg);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n sizes,...] [-r reps] [-w warmup_reps] [-m min_ms_per_rep] [-b name_filter] "
+                            "[-d db_dir] [-o results.csv] [-c baseline.csv] [-s log2_N,r,p] [-C cache_mb] [-k keep db]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (bench_reps <= 0 || bench_warmup < 0 || bench_min_ms <= 0 || nsizes == 0 || cache_mb < 0 ||
+        !kdf_cost_ok(kdf_log_n, kdf_r, kdf_p))
+    {
+        fprintf(stderr, "Repetitions, batch time and sizes must be positive, the cache size not negative, and the scrypt cost valid.\n");
+        return 1;
+    }
+    for (int i = 0; i < nsizes; ++i)
+    {
+        if (sizes[i] <= 0)
+        {
+            fprintf(stderr, "Vault sizes must be positive.\n");
+            return 1;
+        }
+    }
+    if (baseline_path && baseline_load(baseline_path) != 0)
+    {
+        perror("Cannot read baseline.\n");
+        return 1;
+    }
+    if (csv_path)
+    {
+        bench_csv = fopen(csv_path, "w");
+        if (bench_csv == NULL)
+        {
+            perror("Cannot open results file.\n");
+            return 1;
+        }
+        fprintf(bench_csv, "name,size,median_ns,mad_ns,min_ns,reps,iters\n");
+    }
+
+    /* The database lives on tmpfs so the numbers measure the code, not the disk */
+    char db_path[PATH_MAX];
+    snprintf(db_path, sizeof(db_path), "%s/pm_bench.db", dir);
+    bench_db_path = db_path;
+    if (!keep)
+    {
+        char path[PATH_MAX + 8];
+        unlink(db_path);
+        snprintf(path, sizeof(path), "%s-wal", db_path);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s-shm", db_path);
+        unlink(path);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    vault_cache_init((size_t)cache_mb << 20);
+    session_init();
+    watch_init();
+    commands_init();
+    if (crypt_init() != 0)
+    {
+        fprintf(stderr, "AES-256-GCM is not available from OpenSSL.\n");
+        return 1;
+    }
+    if (init_db(db_path, DEFAULT_WORKERS) != SQLITE_OK)
+    {
+        fprintf(stderr, "Database initialization failed.\n");
+        return 1;
+    }
+    client_ctx *ctx = bench_ctx_new();
+    if (ctx == NULL)
+    {
+        perror("Socketpair error.\n");
+        return 1;
+    }
+
+    bench_env *envs = calloc(nsizes, sizeof(bench_env));
+    for (int i = 0; i < nsizes; ++i)
+    {
+        uint64_t start = now_ns();
+        if (bench_env_init(&envs[i], ctx, sizes[i]) != 0)
+        {
+            fprintf(stderr, "Seeding a vault of %d entries failed.\n", sizes[i]);
+            return 1;
+        }
+        fprintf(stderr, "Vault of %d entries ready in %.1f s\n", sizes[i], (now_ns() - start) / 1e9);
+    }
+
+    printf("# %s, %d reps of >= %.0f ms after %d warmup, scrypt ln=%d r=%d p=%d\n",
+           db_path, bench_reps, bench_min_ms, bench_warmup, kdf_log_n, kdf_r, kdf_p);
+    printf("%-44s %7s %14s %10s %14s %9s%s\n", "name", "size", "median_ns", "mad_ns", "min_ns", "iters",
+           baseline ? "   change" : "");
+
+    for (int i = 0; i < nsizes; ++i)
+    {
+        bench_env *env = &envs[i];
+        bench_run("db_fetch_user_by_username", env, op_fetch_user);
+        bench_run("db_fetch_credentials", env, op_fetch_credentials);
+        bench_run("db_fetch_category_by_name", env, op_fetch_category);
+        bench_run("db_fetch_entry_by_title", env, op_fetch_entry);
+        bench_run("db_fetch_entries/page50", env, op_fetch_entries_page);
+        bench_run("db_fetch_entries/category", env, op_fetch_entries_all);
+        bench_run("db_fetch_categories", env, op_fetch_categories);
+        bench_run("vault_search/title", env, op_search_title);
+        bench_run("vault_search/prefix", env, op_search_prefix);
+        bench_run("vault_search/every entry", env, op_search_common);
+        bench_run("vault_search/index build", env, op_search_rebuild);
+        bench_run("db_match_entries/SEARCH title", env, op_scan_title);
+        bench_run("db_match_entries/SEARCH every entry", env, op_scan_common);
+        bench_run("vault_find_url", env, op_find_url);
+        bench_run("vault_find_url/index build", env, op_find_url_rebuild);
+        bench_run("db_match_entries/FIND_BY_URL", env, op_scan_url);
+        bench_run("db_load_vault", env, op_load_vault);
+        bench_run("db_export_entries/csv", env, op_export_csv);
+        bench_run("db_insert_entry+db_remove_entry", env, op_insert_remove);
+        bench_run("db_update_entry", env, op_update_entry);
+        bench_run("LOGIN query/pooled", env, op_login_query_pooled);
+        bench_run("LOGIN query/open per call", env, op_login_query_unpooled);
+        bench_run("LIST_ENTRIES page50 query/pooled", env, op_list_query_pooled);
+        bench_run("LIST_ENTRIES page50 query/open per call", env, op_list_query_unpooled);
+        bench_run("process_command/LIST_ENTRIES page50", env, op_cmd_list_page);
+        bench_run("process_command/LIST_ENTRIES category", env, op_cmd_list_all);
+        bench_run("process_command/LIST_CATS", env, op_cmd_list_cats);
+        bench_run("process_command/SEARCH", env, op_cmd_search);
+        bench_run("process_command/FIND_BY_URL", env, op_cmd_find_by_url);
+        bench_run("process_command/SYNC 10 changes", env, op_cmd_sync_recent);
+        bench_run("process_command/SYNC full", env, op_cmd_sync_all);
+        bench_run("process_command/NEW_ENTRY+DEL_ENTRY", env, op_cmd_new_del);
+        bench_run("process_command/DEL_ENTRY miss", env, op_cmd_del_miss);
+        bench_run("process_command/invalid", env, op_cmd_invalid);
+        bench_rate(bench_run("field_seal_items/vault", env, op_seal_vault), env->size, env->row_bytes);
+        bench_rate(bench_run("field_open/vault", env, op_open_vault), env->size, env->row_bytes);
+    }
+
+    bench_env *env = &envs[0];
+    bench_env fixed = *env;
+    fixed.size = 0;
+    bench_run("parse_command/LIST_ENTRIES", &fixed, op_parse_list);
+    bench_run("parse_command/NEW_ENTRY", &fixed, op_parse_new);
+    bench_run("parse_command/LOGIN", &fixed, op_parse_login);
+    bench_run("parse_command/DEL_ENTRY", &fixed, op_parse_del);
+    bench_run("parse_command/LIST_CATS", &fixed, op_parse_list_cats);
+    bench_run("parse_command/IMPORT_END", &fixed, op_parse_import_end);
+    bench_run("evaluate_password_strength/strong", &fixed, op_strength_strong);
+    bench_run("evaluate_password_strength/weak", &fixed, op_strength_weak);
+    bench_run("kdf_verify/legacy", &fixed, op_kdf_verify_legacy);
+    bench_run("kdf_verify/scrypt", &fixed, op_kdf_verify);
+    bench_run("kdf_hash", &fixed, op_kdf_hash);
+    bench_run("field_seal_items/row", &fixed, op_seal_row);
+    bench_run("field_open/row notes", &fixed, op_open_row);
+    bench_rate(bench_run("field_open/4KiB notes", &fixed, op_open_4k), 1, 4096);
+    bench_run("data_key_wrap+data_key_unwrap", &fixed, op_wrap_key);
+    if (bench_watch(env, 1) == 0)
+    {
+        bench_run("watch_notify+push/1 watcher", &fixed, op_watch_push);
+    }
+    if (bench_watch(env, BENCH_WATCHERS) == 0)
+    {
+        bench_run("watch_notify+push/16 watchers", &fixed, op_watch_push);
+    }
+
+    if (bench_csv)
+    {
+        fclose(bench_csv);
+    }
+    return 0;
+}
@@ -8,9 +8,344 @@
 #include <stdlib.h>
 #include <netdb.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* Every message in either direction is a 4-byte big-endian length followed by the payload */
+#define FRAME_HEADER_LEN 4
+/* Set on every frame of a streamed reply except the last */
+#define FRAME_MORE 0x80000000u
+/* Set on frames the server sends unasked, such as WATCH notifications */
+#define FRAME_PUSH 0x40000000u
+/* Commands read from a pipe are sent this far ahead of their replies */
+#define PIPELINE_DEPTH 64
+/* Vault imports are sent in chunks of this size, a few at a time */
+#define IMPORT_CHUNK (256 * 1024)
+#define IMPORT_WINDOW 8
 
 extern int errno;
 int port;
+/* Set by -t; every read and write then goes through it instead of the socket */
+static SSL *tls;
+static const char *session_file;
+
+static ssize_t tls_result(int ret) {
+    switch (SSL_get_error(tls, ret)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        return errno == 0 ? 0 : -1;
+    default:
+        ERR_print_errors_fp(stderr);
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        size_t sent;
+        ssize_t n = !tls ? write(fd, buf, len)
+                  : SSL_write_ex(tls, buf, len, &sent) == 1 ? (ssize_t)sent : tls_result(0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        size_t got;
+        ssize_t n = !tls ? read(fd, buf, len)
+                  : SSL_read_ex(tls, buf, len, &got) == 1 ? (ssize_t)got : tls_result(0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, const char *payload, size_t len) {
+    uint32_t header = htonl((uint32_t)len);
+    if (write_all(fd, (const char *)&header, FRAME_HEADER_LEN) != 0)
+        return -1;
+    return write_all(fd, payload, len);
+}
+
+/* Returns a malloc'd, NUL-terminated payload, or NULL if the connection failed */
+static char *read_frame(int fd, int *more, int *push) {
+    uint32_t header;
+    if (read_all(fd, (char *)&header, FRAME_HEADER_LEN) != 0)
+        return NULL;
+
+    header = ntohl(header);
+    *more = (header & FRAME_MORE) != 0;
+    *push = (header & FRAME_PUSH) != 0;
+    size_t len = header & ~(FRAME_MORE | FRAME_PUSH);
+    char *payload = malloc(len + 1);
+    if (!payload)
+        return NULL;
+    if (read_all(fd, payload, len) != 0) {
+        free(payload);
+        return NULL;
+    }
+    payload[len] = '\0';
+    return payload;
+}
+
+/* Like read_frame, but notifications that arrive ahead of the reply are printed and skipped */
+static char *recv_frame(int fd, int *more) {
+    int push;
+    char *payload;
+    while ((payload = read_frame(fd, more, &push)) && push) {
+        printf("Server (push): %s", payload);
+        free(payload);
+    }
+    return payload;
+}
+
+// Waits for a line on stdin; notifications that come in meanwhile are printed above a fresh prompt
+static int wait_for_input(int sd) {
+    struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = sd, .events = POLLIN}};
+    while (1) {
+        if (!tls || SSL_pending(tls) == 0) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (fds[0].revents)
+                return 0;
+        }
+
+        int more, push;
+        char *payload = read_frame(sd, &more, &push);
+        if (!payload)
+            return -1;
+        printf("\rServer (push): %sPasswordManager> ", payload);
+        fflush(stdout);
+        free(payload);
+    }
+}
+
+/* Sends the lines of path as one BATCH_ENTRIES request */
+static int send_batch_file(int fd, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("Cannot open batch file.\n");
+        return 1;
+    }
+
+    static const char prefix[] = "BATCH_ENTRIES\n";
+    size_t cap = 65536, len = strlen(prefix);
+    char *body = malloc(cap);
+    if (!body) {
+        fclose(f);
+        return 1;
+    }
+    memcpy(body, prefix, len);
+
+    size_t n;
+    while ((n = fread(body + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            char *bigger = realloc(body, cap * 2);
+            if (!bigger) {
+                free(body);
+                fclose(f);
+                return 1;
+            }
+            body = bigger;
+            cap *= 2;
+        }
+    }
+    fclose(f);
+
+    int rc = send_frame(fd, body, len) != 0 ? -1 : 0;
+    free(body);
+    return rc;
+}
+
+/* Long listings arrive as several frames; each chunk is printed as soon as it lands */
+static int print_reply(int sd) {
+    int more;
+    const char *prefix = "Server: ";
+    do {
+        char *chunk = recv_frame(sd, &more);
+        if (!chunk) {
+            perror("Read from server failed.\n");
+            return -1;
+        }
+        printf("%s%s", prefix, chunk);
+        prefix = "";
+        free(chunk);
+    } while (more);
+    printf("\n");
+    return 0;
+}
+
+/* Prints one reply unless it starts with quiet, which keeps bulk progress off the terminal */
+static int print_reply_unless(int sd, const char *quiet) {
+    int more;
+    char *reply = recv_frame(sd, &more);
+    if (!reply)
+        return -1;
+    if (strncmp(reply, quiet, strlen(quiet)) != 0 || more)
+        printf("Server: %s%s", reply, more ? "" : "\n");
+    free(reply);
+    while (more) {
+        reply = recv_frame(sd, &more);
+        if (!reply)
+            return -1;
+        fputs(reply, stdout);
+        free(reply);
+    }
+    return 0;
+}
+
+/* Saves a streamed EXPORT reply to path without holding it in memory */
+static int export_to_file(int fd, const char *format, const char *path) {
+    char cmd[4200];
+    snprintf(cmd, sizeof(cmd), "EXPORT|%s", format);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror("Cannot open export file.\n");
+        return 1;
+    }
+    if (send_frame(fd, cmd, strlen(cmd)) != 0) {
+        fclose(f);
+        return -1;
+    }
+
+    int more;
+    size_t total = 0;
+    do {
+        char *chunk = recv_frame(fd, &more);
+        if (!chunk) {
+            fclose(f);
+            return -1;
+        }
+        size_t len = strlen(chunk);
+        fwrite(chunk, 1, len, f);
+        total += len;
+        free(chunk);
+    } while (more);
+
+    fclose(f);
+    printf("Server: exported %zu bytes to %s\n", total, path);
+    return 1;
+}
+
+/* Sends a local file as IMPORT_DATA chunks; only a few chunks are unacknowledged at any time */
+static int import_from_file(int fd, const char *format, const char *path) {
+    char cmd[4200];
+    snprintf(cmd, sizeof(cmd), "IMPORT_BEGIN|%s", format);
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("Cannot open import file.\n");
+        return 1;
+    }
+
+    static const char prefix[] = "IMPORT_DATA\n";
+    size_t plen = strlen(prefix);
+    char *chunk = malloc(plen + IMPORT_CHUNK);
+    if (!chunk || send_frame(fd, cmd, strlen(cmd)) != 0) {
+        free(chunk);
+        fclose(f);
+        return -1;
+    }
+    memcpy(chunk, prefix, plen);
+
+    int in_flight = 1, failed = 0;
+    size_t n;
+    while (!failed && (n = fread(chunk + plen, 1, IMPORT_CHUNK, f)) > 0) {
+        if (send_frame(fd, chunk, plen + n) != 0)
+            failed = 1;
+        in_flight++;
+        while (!failed && in_flight >= IMPORT_WINDOW) {
+            failed = print_reply_unless(fd, "Chunk committed") != 0;
+            in_flight--;
+        }
+    }
+    free(chunk);
+    fclose(f);
+
+    if (failed || send_frame(fd, "IMPORT_END", 10) != 0)
+        return -1;
+    in_flight++;
+    while (in_flight-- > 0) {
+        if (print_reply_unless(fd, "Chunk committed") != 0)
+            return -1;
+    }
+    return 1;
+}
+
+/* Stores every ticket the server sends, so the next run can resume instead of repeating the full handshake */
+static int save_session(SSL *ssl, SSL_SESSION *sess) {
+    int fd = open(session_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!f) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    PEM_write_SSL_SESSION(f, sess);
+    fclose(f);
+    (void)ssl;
+    return 0;
+}
+
+/* TLS 1.3 over sd, verifying the server against ca_file; returns 0 once the handshake is done */
+static int tls_connect(int sd, const char *ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx || SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) != 1 ||
+        SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    /* Lets the kernel do the record encryption when it has the tls module loaded */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    if (session_file) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, save_session);
+    }
+
+    tls = SSL_new(ctx);
+    SSL_CTX_free(ctx);
+    if (!tls || SSL_set_fd(tls, sd) != 1)
+        return -1;
+
+    FILE *f = session_file ? fopen(session_file, "r") : NULL;
+    if (f) {
+        SSL_SESSION *sess = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+        fclose(f);
+        if (sess) {
+            SSL_set_session(tls, sess);
+            SSL_SESSION_free(sess);
+        }
+    }
+
+    if (SSL_connect(tls) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    fprintf(stderr, "%s, %s handshake%s\n", SSL_get_version(tls), SSL_session_reused(tls) ? "resumed" : "full",
+            BIO_get_ktls_send(SSL_get_wbio(tls)) ? ", kernel TLS" : "");
+    return 0;
+}
 
 /* Update client-side command help */
 static void show_usage() {
@@ -18,16 +353,28 @@ static void show_usage() {
     printf(" REGISTER|username|masterPass\n");
     printf(" REGISTER_SEC|username|masterPass|securityQ|securityA\n");
     printf(" LOGIN|username|masterPass\n");
+    printf(" RESUME|token   ---   restores a login on a new connection with the Session token LOGIN returned\n");
     printf(" SEC_QUESTION|username\n");
     printf(" RECOVER_PASS|username|securityA   ---   this will change the password of the user to \"password\"\n");
     printf(" CHANGE_PASS|username|oldPass|newPass\n");
     printf(" NEW_CAT|categoryName\n");
     printf(" LIST_CATS\n");
+    printf(" LIST_CATS|limit|cursor\n");
     printf(" NEW_ENTRY|categoryName|title|user|url|notes|password\n");
+    printf(" BATCH_ENTRIES|file   ---   file holds one categoryName|title|user|url|notes|password per line, added in one transaction\n");
     printf(" LIST_ENTRIES|categoryName\n");
+    printf(" LIST_ENTRIES|categoryName|limit|cursor   ---   pass 0 as the first cursor, then the \"Next cursor\" value\n");
+    printf(" SEARCH|query   or   SEARCH|query|limit   ---   entries whose title, user, URL or notes have words starting with every query word\n");
+    printf(" FIND_BY_URL|url   or   FIND_BY_URL|url|limit   ---   entries for the same site as url, exact host first\n");
+    printf(" SYNC|revision   or   SYNC|revision|limit   ---   categories and entries changed or deleted after revision, SYNC|0 for everything\n");
+    printf(" WATCH   ---   prints a notice with the new revision whenever another session changes the vault, until UNWATCH\n");
+    printf(" UNWATCH\n");
     printf(" MOD_ENTRY|oldTitle|newTitle|newUser|newURL|newNotes|newPass\n");
     printf(" DEL_ENTRY|title\n");
     printf(" DEL_CAT|categoryName\n");
+    printf(" EXPORT|csv|file   or   EXPORT|json|file   ---   saves the whole vault, JSON is one object per line\n");
+    printf(" IMPORT|csv|file   or   IMPORT|json|file   ---   columns/keys: category,title,user,url,notes,password\n");
+    printf(" STATS   ---   per-command latency summary, only from localhost\n");
     printf(" LOGOUT\n");
     printf(" EXIT\n");
 }
@@ -37,11 +384,26 @@ int main(int argc, char *argv[])
     int sd;
     struct sockaddr_in server;
     char buffer[4096];
+    const char *ca_file = NULL;
+    int opt;
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            ca_file = optarg;
+            break;
+        case 's':
+            session_file = optarg;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-t ca.pem [-s session.pem]] <server_ip> <port>\n", argv[0]);
         return -1;
     }
+    argv += optind - 1;
 
     port = atoi(argv[2]);
 
@@ -58,14 +420,33 @@ int main(int argc, char *argv[])
         perror("Connect error.\n");
         return errno;
     }
+    if (ca_file && tls_connect(sd, ca_file) != 0) {
+        fprintf(stderr, "TLS handshake failed.\n");
+        return -1;
+    }
+
+    // Interactive sessions wait for each reply; piped input keeps several commands in flight
+    int interactive = isatty(STDIN_FILENO);
+    int in_flight = 0;
+    // Set by WATCH; an idle prompt then also listens for notifications
+    int watching = 0;
 
-    show_usage();
+    if (interactive)
+        show_usage();
 
     while (1) {
-        printf("PasswordManager> ");
-        fflush(stdout);
+        if (interactive) {
+            printf("PasswordManager> ");
+            fflush(stdout);
+        }
 
+        if (interactive && watching && wait_for_input(sd) != 0) {
+            perror("Read from server failed.\n");
+            break;
+        }
         if (!fgets(buffer, sizeof(buffer), stdin)) {
+            if (!interactive)
+                break;
             perror("Input error.\n");
             break;
         }
@@ -73,8 +454,30 @@ int main(int argc, char *argv[])
         // Remove trailing newline
         buffer[strcspn(buffer, "\n")] = '\0';
 
+        // Imports and exports wait for their own replies, so settle the pipeline first
+        int bulk = strncmp(buffer, "IMPORT|", 7) == 0 || strncmp(buffer, "EXPORT|", 7) == 0;
+        char *path = bulk ? strchr(buffer + 7, '|') : NULL;
+        if (bulk && path) {
+            for (; in_flight > 0; in_flight--) {
+                if (print_reply(sd) != 0)
+                    goto done;
+            }
+            *path++ = '\0';
+        }
+
         // Send command to server
-        if (write(sd, buffer, strlen(buffer)) <= 0) {
+        int sent;
+        if (strncmp(buffer, "BATCH_ENTRIES|", 14) == 0)
+            sent = send_batch_file(sd, buffer + 14);
+        else if (bulk && path && buffer[0] == 'I')
+            sent = import_from_file(sd, buffer + 7, path);
+        else if (bulk && path)
+            sent = export_to_file(sd, buffer + 7, path);
+        else
+            sent = send_frame(sd, buffer, strlen(buffer));
+        if (sent > 0)
+            continue;
+        if (sent < 0) {
             perror("Write to server failed.\n");
             break;
         }
@@ -83,17 +486,31 @@ int main(int argc, char *argv[])
             printf("Exiting client...\n");
             break;
         }
+        if (strcmp(buffer, "WATCH") == 0)
+            watching = 1;
+        else if (strcmp(buffer, "UNWATCH") == 0 || strcmp(buffer, "LOGOUT") == 0)
+            watching = 0;
+        in_flight++;
 
-        // Await server response
-        int recv_len = read(sd, buffer, sizeof(buffer) - 1);
-        if (recv_len < 0) {
-            perror("Read from server failed.\n");
-            break;
+        // Await server response once the pipeline window is full
+        while (in_flight >= (interactive ? 1 : PIPELINE_DEPTH)) {
+            if (print_reply(sd) != 0)
+                goto done;
+            in_flight--;
         }
-        buffer[recv_len] = '\0';
-        printf("Server: %s\n", buffer);
     }
 
+    while (in_flight-- > 0) {
+        if (print_reply(sd) != 0)
+            break;
+    }
+
+done:
+
+    if (tls) {
+        SSL_shutdown(tls);
+        SSL_free(tls);
+    }
     close(sd);
     return 0;
 }
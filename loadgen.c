@@ -0,0 +1,808 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* Same framing as client.c: a 4-byte big-endian length, MORE set on all but the last frame of a reply */
+#define FRAME_HEADER_LEN 4
+#define FRAME_MORE 0x80000000u
+/* Synthetic users are lg0, lg1, ... with this master password and LG_CATEGORIES categories each */
+#define LG_PASSWORD "Str0ng!Pass"
+#define LG_CATEGORIES 4
+/* Seeded entries are sent as BATCH_ENTRIES requests of at most this many lines */
+#define SEED_BATCH 5000
+/* Replies still missing this long after the run ends are given up on */
+#define DRAIN_SEC 5.0
+
+enum { OP_LIST, OP_NEW, OP_LOGIN, OP_COUNT };
+
+/* A LOGIN on a logged-in connection is refused, so each one is sent as LOGOUT + LOGIN and timed to the second reply */
+static const struct op_kind {
+    const char *name;
+    const char *key;
+    const char *ok;
+    int replies;
+} ops[OP_COUNT] = {
+    [OP_LIST] = {"LIST_ENTRIES", "list", "Entries:", 1},
+    [OP_NEW] = {"NEW_ENTRY", "new", "Entry added", 1},
+    [OP_LOGIN] = {"LOGIN", "login", "Login successful", 2},
+};
+
+struct pending {
+    int kind;
+    int replies_left;
+    int ok;
+    double start;
+};
+
+struct conn {
+    int fd;
+    SSL *ssl;              /* NULL without -t */
+    SSL_SESSION *session;  /* last ticket, offered on the next connect with -R */
+    int index;
+    int user;
+    long seq;
+    char *out;
+    size_t out_len, out_off, out_cap;
+    char *in;
+    size_t in_len, in_cap;
+    int in_reply; /* a frame with MORE was seen, so the next one continues the same reply */
+    int want_out;
+    struct pending *q;
+    size_t q_head, q_len, q_cap;
+    double next_send;
+};
+
+struct samples {
+    double *us;
+    size_t len, cap;
+    long errors;
+};
+
+struct worker {
+    pthread_t thread;
+    int first, count;
+    struct conn *conns;
+    struct samples stats[OP_COUNT];
+    struct samples connects;
+    long resumed;
+    uint64_t rng;
+    int failed;
+};
+
+static struct sockaddr_in server;
+static int conns = 16, threads = 1, users = 0, entries = 100, seed = 0, depth = 1;
+static int handshakes = 0, resume = 0;
+static SSL_CTX *tls_ctx;
+static double rate = 0, duration = 10, warmup = 2;
+static int mix[OP_COUNT] = {70, 20, 10};
+static int mix_total = 100;
+static long run_id;
+static double t_start, t_measure, t_end;
+static pthread_barrier_t ready, go;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_rand(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* Maps a failed TLS call onto read()/write() results: EAGAIN while it waits on the socket, 0 at EOF */
+static ssize_t tls_result(SSL *ssl, int ret) {
+    switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        return errno == 0 ? 0 : -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static ssize_t conn_write(struct conn *c, const char *buf, size_t len) {
+    if (!c->ssl)
+        return write(c->fd, buf, len);
+    size_t n;
+    ERR_clear_error();
+    int ret = SSL_write_ex(c->ssl, buf, len, &n);
+    return ret == 1 ? (ssize_t)n : tls_result(c->ssl, ret);
+}
+
+static ssize_t conn_read(struct conn *c, char *buf, size_t len) {
+    if (!c->ssl)
+        return read(c->fd, buf, len);
+    size_t n;
+    ERR_clear_error();
+    int ret = SSL_read_ex(c->ssl, buf, len, &n);
+    return ret == 1 ? (ssize_t)n : tls_result(c->ssl, ret);
+}
+
+static int write_all(struct conn *c, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = conn_write(c, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(struct conn *c, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = conn_read(c, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_frame(struct conn *c, const char *payload, size_t len) {
+    uint32_t header = htonl((uint32_t)len);
+    if (write_all(c, (const char *)&header, FRAME_HEADER_LEN) != 0)
+        return -1;
+    return write_all(c, payload, len);
+}
+
+/* Sends one command and waits for its whole reply; returns 1 if its first frame contains ok */
+static int round_trip(struct conn *c, const char *cmd, size_t len, const char *ok) {
+    if (send_frame(c, cmd, len) != 0)
+        return -1;
+    int matched = -1, more;
+    do {
+        uint32_t header;
+        if (read_all(c, (char *)&header, FRAME_HEADER_LEN) != 0)
+            return -1;
+        header = ntohl(header);
+        more = (header & FRAME_MORE) != 0;
+        size_t n = header & ~FRAME_MORE;
+        char *payload = malloc(n + 1);
+        if (!payload || read_all(c, payload, n) != 0) {
+            free(payload);
+            return -1;
+        }
+        payload[n] = '\0';
+        if (matched < 0)
+            matched = strstr(payload, ok) != NULL;
+        free(payload);
+    } while (more);
+    return matched;
+}
+
+/* Connects c, with a blocking TLS handshake under -t that offers c->session if there is one */
+static int open_conn(struct conn *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0)
+        return -1;
+    if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) != 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!tls_ctx)
+        return 0;
+
+    if (!(c->ssl = SSL_new(tls_ctx)) || SSL_set_fd(c->ssl, c->fd) != 1)
+        return -1;
+    if (c->session)
+        SSL_set_session(c->ssl, c->session);
+    ERR_clear_error();
+    if (SSL_connect(c->ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_conn(struct conn *c) {
+    if (c->ssl) {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/* Registers user u with its categories and entries; users that already exist are left as they are */
+static int seed_user(struct conn *c, int u) {
+    char cmd[256];
+    int n = snprintf(cmd, sizeof(cmd), "REGISTER|lg%d|%s", u, LG_PASSWORD);
+    int rc = round_trip(c, cmd, n, "Registration successful");
+    if (rc <= 0)
+        return rc;
+    n = snprintf(cmd, sizeof(cmd), "LOGIN|lg%d|%s", u, LG_PASSWORD);
+    if (round_trip(c, cmd, n, "Login successful") != 1)
+        return -1;
+    for (int cat = 0; cat < LG_CATEGORIES; cat++) {
+        n = snprintf(cmd, sizeof(cmd), "NEW_CAT|c%d", cat);
+        if (round_trip(c, cmd, n, "Category added") != 1)
+            return -1;
+    }
+
+    size_t cap = 64 + (size_t)SEED_BATCH * 96;
+    char *body = malloc(cap);
+    if (!body)
+        return -1;
+    for (int done = 0; done < entries;) {
+        size_t len = (size_t)snprintf(body, cap, "BATCH_ENTRIES\n");
+        for (int i = 0; i < SEED_BATCH && done < entries; i++, done++)
+            len += snprintf(body + len, cap - len, "c%d|seed-%d|user%d|https://example.com/%d|synthetic|%s\n",
+                            done % LG_CATEGORIES, done, done, done, LG_PASSWORD);
+        if (round_trip(c, body, len, "Batch committed") != 1) {
+            free(body);
+            return -1;
+        }
+    }
+    free(body);
+    return round_trip(c, "LOGOUT", 6, "Logged out") == 1 ? 1 : -1;
+}
+
+static int pick_kind(uint64_t *rng) {
+    int r = (int)(next_rand(rng) % mix_total);
+    for (int k = 0; k < OP_COUNT; k++) {
+        if (r < mix[k])
+            return k;
+        r -= mix[k];
+    }
+    return OP_LIST;
+}
+
+static int reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap)
+        return 0;
+    size_t n = *cap ? *cap : 4096;
+    while (n < need)
+        n *= 2;
+    char *bigger = realloc(*buf, n);
+    if (!bigger)
+        return -1;
+    *buf = bigger;
+    *cap = n;
+    return 0;
+}
+
+static int queue_frame(struct conn *c, const char *payload, size_t len) {
+    if (reserve(&c->out, &c->out_cap, c->out_len + FRAME_HEADER_LEN + len) != 0)
+        return -1;
+    uint32_t header = htonl((uint32_t)len);
+    memcpy(c->out + c->out_len, &header, FRAME_HEADER_LEN);
+    memcpy(c->out + c->out_len + FRAME_HEADER_LEN, payload, len);
+    c->out_len += FRAME_HEADER_LEN + len;
+    return 0;
+}
+
+/* Queues one operation; start is when it was due, so open-loop latency includes any backlog */
+static int issue(struct worker *w, struct conn *c, double start) {
+    int kind = pick_kind(&w->rng);
+    char cmd[512];
+    int n;
+    switch (kind) {
+    case OP_LIST:
+        n = snprintf(cmd, sizeof(cmd), "LIST_ENTRIES|c%d", (int)(next_rand(&w->rng) % LG_CATEGORIES));
+        break;
+    case OP_NEW:
+        n = snprintf(cmd, sizeof(cmd), "NEW_ENTRY|c%d|lg-%ld-%d-%ld|user|https://example.com|load|%s",
+                     (int)(next_rand(&w->rng) % LG_CATEGORIES), run_id, c->index, c->seq++, LG_PASSWORD);
+        break;
+    default:
+        if (queue_frame(c, "LOGOUT", 6) != 0)
+            return -1;
+        n = snprintf(cmd, sizeof(cmd), "LOGIN|lg%d|%s", c->user, LG_PASSWORD);
+        break;
+    }
+    if (queue_frame(c, cmd, n) != 0)
+        return -1;
+
+    if (c->q_len == c->q_cap) {
+        size_t cap = c->q_cap ? c->q_cap * 2 : 16;
+        struct pending *bigger = malloc(cap * sizeof(*bigger));
+        if (!bigger)
+            return -1;
+        for (size_t i = 0; i < c->q_len; i++)
+            bigger[i] = c->q[(c->q_head + i) % c->q_cap];
+        free(c->q);
+        c->q = bigger;
+        c->q_head = 0;
+        c->q_cap = cap;
+    }
+    c->q[(c->q_head + c->q_len++) % c->q_cap] = (struct pending){kind, ops[kind].replies, 0, start};
+    return 0;
+}
+
+static void record(struct samples *s, double us, int ok) {
+    if (!ok)
+        s->errors++;
+    if (s->len == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        double *bigger = realloc(s->us, cap * sizeof(double));
+        if (!bigger)
+            return;
+        s->us = bigger;
+        s->cap = cap;
+    }
+    s->us[s->len++] = us;
+}
+
+static int flush_out(int ep, struct conn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = conn_write(c, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return -1;
+        c->out_off += n;
+    }
+    if (c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+
+    int want = c->out_len > 0;
+    if (want != c->want_out) {
+        struct epoll_event ev = {.events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c};
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want;
+    }
+    return 0;
+}
+
+/* Consumes every complete frame; returns the number of operations that finished, or -1 */
+static int read_replies(struct worker *w, struct conn *c) {
+    for (;;) {
+        if (reserve(&c->in, &c->in_cap, c->in_len + 65536) != 0)
+            return -1;
+        ssize_t n = conn_read(c, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return -1;
+        c->in_len += n;
+        // A TLS read returns one record at a time, so a short one says nothing about the socket
+        if ((size_t)n < 65536 && !c->ssl)
+            break;
+    }
+
+    int finished = 0;
+    size_t off = 0;
+    double t = now();
+    while (c->in_len - off >= FRAME_HEADER_LEN) {
+        uint32_t header;
+        memcpy(&header, c->in + off, FRAME_HEADER_LEN);
+        header = ntohl(header);
+        size_t len = header & ~FRAME_MORE;
+        if (c->in_len - off - FRAME_HEADER_LEN < len)
+            break;
+        if (c->q_len == 0)
+            return -1;
+
+        struct pending *p = &c->q[c->q_head];
+        const char *payload = c->in + off + FRAME_HEADER_LEN;
+        // Only the first frame of the reply that ends the operation decides whether it succeeded
+        if (!c->in_reply && p->replies_left == 1) {
+            const char *ok = ops[p->kind].ok;
+            p->ok = len >= strlen(ok) && memcmp(payload, ok, strlen(ok)) == 0;
+        }
+        off += FRAME_HEADER_LEN + len;
+        c->in_reply = (header & FRAME_MORE) != 0;
+        if (c->in_reply || --p->replies_left > 0)
+            continue;
+
+        if (t >= t_measure && t < t_end)
+            record(&w->stats[p->kind], (t - p->start) * 1e6, p->ok);
+        c->q_head = (c->q_head + 1) % c->q_cap;
+        c->q_len--;
+        finished++;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return finished;
+}
+
+/* -H: connect, handshake, one command, close, over and over; each thread has one connection open at a time */
+static void handshake_run(struct worker *w) {
+    for (int i = 0; !w->failed && now() < t_end; i = (i + 1) % w->count) {
+        struct conn *c = &w->conns[i];
+        double start = now();
+        // LOGOUT without a login is about the cheapest command with a reply
+        if (open_conn(c) != 0 || round_trip(c, "LOGOUT", 6, "Not logged in") != 1) {
+            fprintf(stderr, "Connection %d failed\n", c->index);
+            w->failed = 1;
+        }
+        int reused = c->ssl && SSL_session_reused(c->ssl);
+        // The ticket arrives after the handshake, so it has been read along with the reply
+        if (resume && c->ssl) {
+            SSL_SESSION_free(c->session);
+            c->session = SSL_get1_session(c->ssl);
+        }
+        close_conn(c);
+
+        double t = now();
+        if (t >= t_measure && t < t_end) {
+            record(&w->connects, (t - start) * 1e6, 1);
+            w->resumed += reused;
+        }
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    int ep = epoll_create1(0);
+
+    if (handshakes) {
+        pthread_barrier_wait(&ready);
+        pthread_barrier_wait(&go);
+        handshake_run(w);
+        goto out;
+    }
+
+    // Setup is blocking: seed this worker's share of users, then log every connection in
+    for (int i = 0; i < w->count && !w->failed; i++) {
+        struct conn *c = &w->conns[i];
+        if (open_conn(c) != 0) {
+            perror("Connect error");
+            w->failed = 1;
+            break;
+        }
+        for (int u = c->index; seed && u < users; u += conns) {
+            if (seed_user(c, u) < 0) {
+                fprintf(stderr, "Seeding user lg%d failed\n", u);
+                w->failed = 1;
+            }
+        }
+        char cmd[256];
+        int n = snprintf(cmd, sizeof(cmd), "LOGIN|lg%d|%s", c->user, LG_PASSWORD);
+        if (!w->failed && round_trip(c, cmd, n, "Login successful") != 1) {
+            fprintf(stderr, "LOGIN as lg%d failed, run with -S to create the users\n", c->user);
+            w->failed = 1;
+        }
+    }
+    for (int i = 0; i < w->count && !w->failed; i++) {
+        struct conn *c = &w->conns[i];
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&go);
+    if (w->failed)
+        goto out;
+
+    // Open loop spreads every connection's fixed schedule evenly over one interval
+    double interval = rate > 0 ? conns / rate : 0;
+    for (int i = 0; i < w->count; i++) {
+        struct conn *c = &w->conns[i];
+        if (rate > 0) {
+            c->next_send = t_start + interval * c->index / conns;
+            continue;
+        }
+        for (int d = 0; d < depth; d++)
+            if (issue(w, c, now()) != 0)
+                w->failed = 1;
+        if (flush_out(ep, c) != 0)
+            w->failed = 1;
+    }
+
+    struct epoll_event events[256];
+    while (!w->failed) {
+        double t = now();
+        int outstanding = 0;
+        double wake = t + 0.1;
+        for (int i = 0; i < w->count; i++) {
+            struct conn *c = &w->conns[i];
+            outstanding += c->q_len > 0;
+            if (rate <= 0 || t >= t_end)
+                continue;
+            int queued = 0;
+            while (c->next_send <= t && c->next_send < t_end) {
+                if (issue(w, c, c->next_send) != 0)
+                    w->failed = 1;
+                c->next_send += interval;
+                queued = 1;
+            }
+            if (queued && flush_out(ep, c) != 0)
+                w->failed = 1;
+            if (c->next_send < wake)
+                wake = c->next_send;
+        }
+        if (t >= t_end && (outstanding == 0 || t >= t_end + DRAIN_SEC))
+            break;
+
+        int timeout = wake > t ? (int)((wake - t) * 1000) : 0;
+        int n = epoll_wait(ep, events, 256, timeout);
+        for (int i = 0; i < n && !w->failed; i++) {
+            struct conn *c = events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && flush_out(ep, c) != 0)
+                w->failed = 1;
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                continue;
+            int finished = read_replies(w, c);
+            if (finished < 0) {
+                fprintf(stderr, "Connection %d lost\n", c->index);
+                w->failed = 1;
+                break;
+            }
+            // Closed loop keeps depth operations outstanding until the run ends
+            if (rate <= 0 && now() < t_end)
+                for (int k = 0; k < finished; k++)
+                    if (issue(w, c, now()) != 0)
+                        w->failed = 1;
+            if (flush_out(ep, c) != 0)
+                w->failed = 1;
+        }
+    }
+
+out:
+    for (int i = 0; i < w->count; i++) {
+        struct conn *c = &w->conns[i];
+        close_conn(c);
+        SSL_SESSION_free(c->session);
+        free(c->out);
+        free(c->in);
+        free(c->q);
+    }
+    close(ep);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of a sorted array */
+static double percentile(const double *v, size_t n, double q) {
+    if (n == 0)
+        return 0;
+    size_t rank = (size_t)(q * n + 0.999999);
+    return v[rank ? rank - 1 : 0];
+}
+
+static void report_line(FILE *text, FILE *csv, const char *name, struct samples *s, double secs) {
+    qsort(s->us, s->len, sizeof(double), cmp_double);
+    double sum = 0;
+    for (size_t i = 0; i < s->len; i++)
+        sum += s->us[i];
+    double mean = s->len ? sum / s->len : 0;
+    double max = s->len ? s->us[s->len - 1] : 0;
+    double p50 = percentile(s->us, s->len, 0.50), p99 = percentile(s->us, s->len, 0.99);
+    double p999 = percentile(s->us, s->len, 0.999);
+
+    fprintf(text, "%-14s %9zu %10.1f %7ld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            name, s->len, s->len / secs, s->errors, mean, p50, p99, p999, max);
+    if (csv)
+        fprintf(csv, "%s,%zu,%.1f,%ld,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                name, s->len, s->len / secs, s->errors, mean, p50, p99, p999, max);
+}
+
+static int parse_mix(char *spec) {
+    int parsed[OP_COUNT] = {0};
+    char *item;
+    while ((item = strsep(&spec, ",")) != NULL) {
+        char *eq = strchr(item, '=');
+        if (!eq)
+            return -1;
+        *eq = '\0';
+        int k;
+        for (k = 0; k < OP_COUNT && strcmp(item, ops[k].key) != 0; k++)
+            ;
+        if (k == OP_COUNT || atoi(eq + 1) < 0)
+            return -1;
+        parsed[k] = atoi(eq + 1);
+    }
+    mix_total = 0;
+    for (int k = 0; k < OP_COUNT; k++) {
+        mix[k] = parsed[k];
+        mix_total += mix[k];
+    }
+    return mix_total > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <server_ip> <port>\n"
+            " -c conns      concurrent connections (16)\n"
+            " -T threads    client threads sharing the connections (1)\n"
+            " -u users      synthetic users lg0..lgN-1, spread over the connections (= conns)\n"
+            " -S            create the users first, with -e entries each over %d categories\n"
+            " -e entries    entries per seeded user (100)\n"
+            " -m mix        operation weights (list=70,new=20,login=10)\n"
+            " -r rate       open loop at this many operations/s in total; 0 is closed loop (0)\n"
+            " -p depth      operations each connection keeps outstanding in closed loop (1)\n"
+            " -d seconds    measured duration (10)\n"
+            " -w seconds    warmup before measuring (2)\n"
+            " -o file.csv   also write the results as CSV\n"
+            " -t ca.pem     TLS 1.3, verifying the server's certificate against ca.pem\n"
+            " -H            time connection setup instead: each thread connects, sends one command and closes in a loop\n"
+            " -R            with -H and -t, resume with the previous connection's session ticket\n",
+            prog, LG_CATEGORIES);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *csv_path = NULL, *ca_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:T:u:Se:m:r:p:d:w:o:t:HR")) != -1) {
+        switch (opt) {
+        case 'c': conns = atoi(optarg); break;
+        case 'T': threads = atoi(optarg); break;
+        case 'u': users = atoi(optarg); break;
+        case 'S': seed = 1; break;
+        case 'e': entries = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) != 0) {
+                fprintf(stderr, "Bad mix, expected e.g. list=70,new=20,login=10\n");
+                return 1;
+            }
+            break;
+        case 'r': rate = atof(optarg); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'o': csv_path = optarg; break;
+        case 't': ca_file = optarg; break;
+        case 'H': handshakes = 1; break;
+        case 'R': resume = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || conns <= 0 || threads <= 0 || depth <= 0 || entries < 0 || duration <= 0 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (users <= 0)
+        users = conns;
+    if (threads > conns)
+        threads = conns;
+    if (ca_file) {
+        tls_ctx = SSL_CTX_new(TLS_client_method());
+        if (!tls_ctx || SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION) != 1 ||
+            SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL) != 1) {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+        SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+        // Output buffers grow by realloc between a write that would block and its retry
+        SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(argv[optind]);
+    server.sin_port = htons(atoi(argv[optind + 1]));
+    run_id = (long)time(NULL) ^ ((long)getpid() << 16);
+
+    struct conn *all = calloc(conns, sizeof(struct conn));
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if (!all || !workers)
+        return 1;
+    for (int i = 0; i < conns; i++)
+        all[i] = (struct conn){.fd = -1, .index = i, .user = i % users};
+
+    pthread_barrier_init(&ready, NULL, threads + 1);
+    pthread_barrier_init(&go, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        struct worker *w = &workers[t];
+        w->first = (int)((long)conns * t / threads);
+        w->count = (int)((long)conns * (t + 1) / threads) - w->first;
+        w->conns = all + w->first;
+        w->rng = 0x9E3779B97F4A7C15ull ^ ((uint64_t)run_id * (t + 1));
+        pthread_create(&w->thread, NULL, worker_run, w);
+    }
+
+    // Timing starts only once every connection is set up
+    pthread_barrier_wait(&ready);
+    t_start = now();
+    t_measure = t_start + warmup;
+    t_end = t_measure + duration;
+    pthread_barrier_wait(&go);
+
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        failed |= workers[t].failed;
+    }
+    if (failed)
+        return 1;
+
+    if (handshakes) {
+        struct samples all_connects = {0};
+        long resumed = 0;
+        for (int t = 0; t < threads; t++) {
+            struct samples *s = &workers[t].connects;
+            for (size_t i = 0; i < s->len; i++)
+                record(&all_connects, s->us[i], 1);
+            resumed += workers[t].resumed;
+            free(s->us);
+        }
+        FILE *csv = csv_path ? fopen(csv_path, "w") : NULL;
+        if (csv)
+            fprintf(csv, "command,count,ops_per_sec,errors,mean_us,p50_us,p99_us,p999_us,max_us\n");
+        printf("%d thread(s) connecting, %.1f s after %.1f s warmup, %ld of %zu TLS sessions resumed\n",
+               threads, duration, warmup, resumed, all_connects.len);
+        printf("%-14s %9s %10s %7s %10s %10s %10s %10s %10s\n",
+               "connect", "count", "conns/s", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+        report_line(stdout, csv, !tls_ctx ? "TCP" : resume ? "TLS_RESUMED" : "TLS_FULL", &all_connects, duration);
+        if (csv)
+            fclose(csv);
+        free(all_connects.us);
+        free(all);
+        free(workers);
+        return 0;
+    }
+
+    struct samples total[OP_COUNT + 1] = {{0}};
+    for (int k = 0; k < OP_COUNT; k++) {
+        for (int t = 0; t < threads; t++) {
+            struct samples *s = &workers[t].stats[k];
+            for (size_t i = 0; i < s->len; i++)
+                record(&total[k], s->us[i], 1);
+            total[k].errors += s->errors;
+            free(s->us);
+        }
+        for (size_t i = 0; i < total[k].len; i++)
+            record(&total[OP_COUNT], total[k].us[i], 1);
+        total[OP_COUNT].errors += total[k].errors;
+    }
+
+    FILE *csv = NULL;
+    if (csv_path && !(csv = fopen(csv_path, "w")))
+        perror("Cannot open CSV file");
+    if (csv)
+        fprintf(csv, "command,count,ops_per_sec,errors,mean_us,p50_us,p99_us,p999_us,max_us\n");
+
+    if (rate > 0)
+        printf("%d connections, open loop at %.0f ops/s, %.1f s after %.1f s warmup\n", conns, rate, duration, warmup);
+    else
+        printf("%d connections, closed loop with %d outstanding each, %.1f s after %.1f s warmup\n", conns, depth, duration, warmup);
+    printf("%-14s %9s %10s %7s %10s %10s %10s %10s %10s\n",
+           "command", "count", "ops/s", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int k = 0; k < OP_COUNT; k++)
+        if (mix[k] > 0)
+            report_line(stdout, csv, ops[k].name, &total[k], duration);
+    report_line(stdout, csv, "all", &total[OP_COUNT], duration);
+
+    if (csv)
+        fclose(csv);
+    for (int k = 0; k <= OP_COUNT; k++)
+        free(total[k].us);
+    free(all);
+    free(workers);
+    return 0;
+}
@@ -1,1251 +1,9976 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <sqlite3.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <ctype.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
 
 #define SERVER_PORT 2500
+#define DB_NAME "PasswordManager.db"
+#define MAX_EVENTS 256
+#define READ_CHUNK 4096
+#define DEFAULT_WORKERS 32
+#define DEFAULT_QUEUE_DEPTH 1024
+#define STATS_INTERVAL_SEC 60
+#define BUSY_REPLY "Server busy, try again later.\n"
+/* A connection to resume that the full queue turned away is retried by its loop this often */
+#define RESUME_RETRY_MS 5
+
+/* Every message in either direction is a 4-byte big-endian length followed by the payload */
+#define FRAME_HEADER_LEN 4
+#define MAX_FRAME_LEN (1u << 20)
+#define MAX_INPUT_BUFFERED (4u << 20)
+/* A drained input buffer that a large frame grew past this is given back instead of kept */
+#define INPUT_KEEP_MAX (16 * READ_CHUNK)
+#define OVERSIZE_REPLY "Command too large.\n"
+
+/* No command takes more than this many '|'-separated arguments */
+#define MAX_COMMAND_ARGS 6
+/* Replies are built in pooled chunks of this size and sent from them as they are; longer values get a chunk of their own */
+#define REPLY_CHUNK 16384
+#define REPLY_POOL_MAX 256  /* idle chunks kept for reuse */
+#define FLUSH_IOV 64        /* chunks handed to one writev */
+#define REPLY_COPY_MAX 1024 /* smaller replies are copied behind output still queued */
+
+/*
+ * Binary protocol, negotiated with HELLO|bin1 and framed exactly like text:
+ *   request: opcode (1 byte), request ID (varint), then one STR item per argument
+ *   reply:   request ID (varint), then items; the last one is always a STATUS
+ *   item:    tag (1 byte), length (varint), value
+ * Varints are unsigned LEB128. A streamed reply continues across frames; only the first starts with the ID.
+ * Frames flagged FRAME_PUSH were not asked for (WATCH notifications) and carry request ID 0.
+ */
+#define PROTO_TEXT "text"
+#define PROTO_BINARY "bin1"
+#define DATA_HEAD 4 /* tag and a 3-byte varint, patched in when a DATA item is closed */
+
+enum tlv_tag
+{
+    TLV_STR = 1,    /* UTF-8 text */
+    TLV_INT = 2,    /* varint */
+    TLV_STATUS = 3, /* one byte, an enum reply_code */
+    TLV_ROW = 4,    /* nested items, one listed record */
+    TLV_DATA = 5    /* a piece of free-form output such as an export */
+};
+
+/* Set on every frame of a streamed reply except the last */
+#define FRAME_MORE 0x80000000u
+/* Set on frames the server sends unasked; they only ever go out between replies, never inside a streamed one */
+#define FRAME_PUSH 0x40000000u
+#define STREAM_CHUNK 16384
+/* A stream stops at its next batch once this much output waits on the client, and resumes below the low mark */
+#define STREAM_HIGH_WATER (4 * STREAM_CHUNK)
+#define STREAM_LOW_WATER STREAM_CHUNK
+/* Rows read per pooled reader hold when a reply streams a whole table */
+#define STREAM_BATCH 64
+#define MAX_PAGE_LIMIT 1000
+/* SEARCH answers with this many best matches unless asked for a limit; longer queries are cut at SEARCH_MAX_TERMS words */
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_TERMS 8
+/* Indexed words and query terms are cut to this many bytes */
+#define SEARCH_WORD_MAX 32
+/* Words added since the index was last sorted are scanned linearly until there are this many */
+#define SEARCH_TAIL 256
+/* FIND_BY_URL answers with this many entries unless asked for a limit */
+#define URL_DEFAULT_LIMIT 50
+#define URL_HOST_MAX 256
+
+/* WAL housekeeping: the checkpointer wakes on this many new pages or this many seconds */
+#define DB_BUSY_TIMEOUT_MS 5000
+#define CHECKPOINT_PAGES 1000
+#define CHECKPOINT_INTERVAL_SEC 5
+/* Steady readers can keep the WAL from ever restarting; past this size it is truncated while no reader is checked out.
+   The truncation holds the writer lock while it waits for readers, so it gives up after WAL_TRUNCATE_WAIT_MS */
+#define WAL_TRUNCATE_PAGES 8000
+#define WAL_TRUNCATE_WAIT_MS 100
+/* Tombstones stay in the change log this long (-r) for SYNC; the compactor drops older ones in batches */
+#define DEFAULT_TOMBSTONE_TTL_SEC (30 * 24 * 3600)
+#define COMPACT_INTERVAL_SEC 60
+#define COMPACT_BATCH 1000
+
+/* A commit group closes after this many writes or this long after its first one */
+#define GROUP_COMMIT_MAX 512
+#define GROUP_COMMIT_WINDOW_US 500
+
+/* Vault cache: byte budget is split evenly across shards; vaults expire when untouched */
+#define VAULT_SHARDS 16
+#define VAULT_BUCKETS 256
+#define DEFAULT_CACHE_MB 64
+#define VAULT_IDLE_SEC 300
+#define VAULT_LOGOUT_IDLE_SEC 30
+#define VAULT_SWEEP_SEC 10
+#define VAULT_BATCH 64
+
+/* Master passwords and security answers: scrypt, on a pool of its own so logins cannot tie up the workers */
+#define DEFAULT_KDF_LOG_N 15
+#define DEFAULT_KDF_R 8
+#define DEFAULT_KDF_P 1
+#define KDF_MAX_MEM (1ull << 30)
+#define KDF_QUEUE_DEPTH 256
+#define KDF_SALT_LEN 16
+#define KDF_KEY_LEN 32
+#define KDF_HASH_LEN 128 /* "$scrypt$ln=15,r=8,p=1$<salt>$<key>", both base64 */
+#define KDF_MAX_TASKS 2
+#define B64_LEN(n) (((n) + 2) / 3 * 4)
+
+/*
+ * Notes and PassVal are stored AES-256-GCM sealed under a random per-user data key. Users keeps that key
+ * wrapped under a KEK from the same scrypt run that checks the master password (and the security answer),
+ * so LOGIN unwraps it for no extra hashing. Sealed value: version, nonce, ciphertext, tag.
+ */
+#define DATA_KEY_LEN 32
+#define SEAL_VERSION 1
+#define SEAL_NONCE_LEN 12
+#define SEAL_TAG_LEN 16
+#define SEAL_OVERHEAD (1 + SEAL_NONCE_LEN + SEAL_TAG_LEN)
+#define SEAL_AAD_LEN 9 /* owner's user ID and the column, so values cannot be moved between users or fields */
+#define WRAPPED_KEY_LEN (DATA_KEY_LEN + SEAL_OVERHEAD)
+#define SEAL_BATCH 1024 /* rows written before encryption are sealed this many per write */
+
+/* Sessions: LOGIN issues a random token that RESUME trades back for the login on any later connection */
+#define SESSION_SHARDS 16
+#define SESSION_BUCKETS 4096
+#define SESSION_MAX_PER_SHARD 65536
+#define SESSION_TOKEN_LEN 16 /* random bytes, sent as hex */
+#define DEFAULT_SESSION_TTL_SEC (12 * 3600)
+#define SESSION_SWEEP_SEC 60
+
+/* WATCH: connections subscribed to their user's changes, sharded by user ID like the vault cache */
+#define WATCH_SHARDS 16
+#define WATCH_BUCKETS 64
+
+/* Metrics: per-thread latency histograms, merged when read from the admin port or STATS */
+#define DEFAULT_ADMIN_PORT 2501
+#define ADMIN_TIMEOUT_SEC 2
+#define METRIC_SLOTS 32 /* one per opcode; slot 0 counts requests that named no command */
+#define HIST_SUB 8      /* sub-buckets per power of two, so a bucket spans at most 12.5% */
+#define HIST_MAX_EXP 40 /* nanoseconds; anything past ~18 minutes lands in the last bucket */
+#define HIST_BUCKETS ((HIST_MAX_EXP - 1) * HIST_SUB)
 
 extern int errno;
 
+static int listen_fd;
+static int next_conn_id = 0;
+
+/* One epoll instance and thread per core; each owns the sockets it accepted */
+typedef struct event_loop
+{
+    int id;
+    int epfd;
+    int wake_fd; /* eventfd signalled when workers hand back connections to close, or watchers have news */
+    pthread_t thread;
+    pthread_mutex_t reap_lock;
+    struct client_ctx *reap_list;
+    struct client_ctx *resume_list; /* waiting for room in the job queue; also under reap_lock */
+    _Atomic(struct client_ctx *) notify_list; /* watchers with a revision to push; the commit thread adds them lock-free */
+} event_loop;
+
+/* A piece of pending output; chunks are used back to back but a frame never waits on a chunk it did not fill */
+typedef struct reply_chunk
+{
+    struct reply_chunk *next;
+    size_t len, cap;
+    char data[];
+} reply_chunk;
+
+/* Replies a worker is writing: frames back to back over a chunk chain, handed to the connection by splicing */
 typedef struct
 {
-    int thread_id;
+    reply_chunk *head, *tail;
+    reply_chunk *frame; /* holds the open frame's header, at frame_off */
+    size_t frame_off;
+    size_t frame_len; /* payload written to the open frame */
+    int open;
+    int failed; /* out of memory; the connection is closed */
+} reply_buf;
+
+typedef struct client_ctx
+{
+    int conn_id;
     int client_fd;
+    event_loop *loop;
     char active_user[64];
+    sqlite3_int64 user_id; /* resolved once by LOGIN, so data queries key on integers */
+    unsigned char data_key[DATA_KEY_LEN]; /* unwrapped by LOGIN, seals and opens Notes and PassVal */
+
+    /* Shared by the owning loop and at most one worker at a time */
+    pthread_mutex_t lock;
+    int busy;    /* a worker owns the command stream */
+    int closing; /* close once no worker holds the connection */
+    int stalled; /* still busy, but no worker runs it until the client reads and EPOLLOUT requeues it */
+    struct client_ctx *reap_next;
+    struct client_ctx *resume_next;
+    int binary;       /* HELLO negotiated the binary protocol */
+    uint64_t req_id;  /* ID of the binary request being run */
+    reply_buf reply;  /* owned by the worker holding busy; a parked command keeps its frame open here */
+    struct import_state *import; /* set between IMPORT_BEGIN and IMPORT_END */
+    struct kdf_job *kdf;         /* the command waiting on a password hash */
+    struct stream_job *stream;   /* a streamed reply that stopped for the client to catch up */
+    int has_session;             /* LOGOUT revokes this token */
+    int loopback;                /* admin commands are only taken from local clients */
+    SSL *tls;                    /* NULL unless the server runs with -T */
+    int tls_ready;               /* handshake done; only the owning loop drives the handshake */
+    unsigned char session[SESSION_TOKEN_LEN];
+
+    /* Buffered I/O. The loop reads into in; the worker holding busy swaps the complete frames out into run and
+       splits them there in place, so both buffers are reused for the life of the connection */
+    char *in;
+    size_t in_len, in_cap;
+    char *run;
+    size_t run_off, run_len, run_cap; /* frames before run_off were already taken */
+    size_t run_end;                   /* the taken command's terminator, over the byte saved in run_saved */
+    char run_saved;
+    reply_chunk *out_head, *out_tail;
+    size_t out_off; /* already sent from out_head */
+    size_t out_len; /* queued and not yet sent */
+
+    /* WATCH: the commit thread sets watch_rev and queues the connection on its loop, which pushes it */
+    sqlite3_int64 watch_user;        /* registered under this user, 0 when not watching */
+    struct client_ctx *watch_next;   /* registry bucket chain */
+    _Atomic sqlite3_int64 watch_rev; /* newest revision not pushed yet, 0 for none */
+    _Atomic int watch_queued;        /* on the loop's notify_list */
+    struct client_ctx *notify_next;
 } client_ctx;
 
-/* Thread function */
-static void *client_handler(void *arg);
+/* A connection with input ready, stamped for queue-wait accounting */
+typedef struct
+{
+    client_ctx *ctx;
+    uint64_t enqueued_ns;
+} job;
+
+/* Bounded lock-free MPMC ring: a cell's sequence number tells producers and consumers whose turn it is */
+typedef struct
+{
+    _Atomic size_t seq;
+    job value;
+} job_cell;
+
+typedef struct
+{
+    job_cell *cells;
+    size_t mask;
+    _Alignas(64) _Atomic size_t enqueue_pos;
+    _Alignas(64) _Atomic size_t dequeue_pos;
+    sem_t ready; /* counts published jobs so idle workers sleep */
+} job_queue;
+
+typedef struct
+{
+    _Atomic unsigned long jobs;
+    _Atomic unsigned long rejected;
+    _Atomic unsigned long long wait_ns_total;
+    _Atomic unsigned long long wait_ns_max;
+} pool_stats;
+
+/* Where a command's time went; KDF is only set for commands that waited on a password hash */
+enum metric_phase
+{
+    PHASE_TOTAL,
+    PHASE_PARSE,
+    PHASE_DB,
+    PHASE_FORMAT,
+    PHASE_KDF,
+    PHASE_COUNT
+};
+
+typedef struct
+{
+    int slot;
+    uint64_t started;
+    uint64_t ns[PHASE_COUNT];
+} command_timing;
+
+/* Written only by its own thread, so updates are plain relaxed stores; readers sum every thread's copy */
+typedef struct thread_metrics
+{
+    _Atomic uint64_t count[METRIC_SLOTS];
+    _Atomic uint64_t sum_ns[METRIC_SLOTS][PHASE_COUNT];
+    _Atomic uint64_t hist[METRIC_SLOTS][PHASE_COUNT][HIST_BUCKETS];
+    struct thread_metrics *next;
+} thread_metrics;
+
+typedef struct
+{
+    uint64_t count[METRIC_SLOTS];
+    uint64_t sum_ns[METRIC_SLOTS][PHASE_COUNT];
+    uint64_t hist[METRIC_SLOTS][PHASE_COUNT][HIST_BUCKETS];
+    long open_conns, sessions, watchers;
+    int db_in_use, db_total;
+    unsigned long tls_handshakes, tls_resumed, tls_ktls;
+    unsigned long reply_chunks, watch_pushes;
+} metrics_totals;
+
+/* A growable text buffer for rendered metrics */
+typedef struct
+{
+    char *p;
+    size_t len, cap;
+} text_buf;
+
+/* One hash a command waits on: a fresh one for secret, or a check of secret against stored */
+typedef struct
+{
+    const char *secret;
+    int verify;
+    char stored[KDF_HASH_LEN];
+    char fresh[KDF_HASH_LEN]; /* after a check, set only if stored is legacy or below the current cost */
+    unsigned char kek[KDF_KEY_LEN];       /* wraps the data key; matches stored if has_kek */
+    unsigned char fresh_kek[KDF_KEY_LEN]; /* matches fresh */
+    int has_kek; /* legacy hashes have none */
+    int ok;
+} kdf_task;
+
+/* What Users holds for one account; a wrapped key is 0: not set, 1: in wrapped, -1: present but malformed */
+typedef struct
+{
+    sqlite3_int64 user_id;
+    char master[KDF_HASH_LEN], answer[KDF_HASH_LEN];
+    unsigned char wrapped[2][WRAPPED_KEY_LEN]; /* under the master password, under the security answer */
+    int has_wrapped[2];
+} credentials;
+
+/* A command parked on the KDF pool; its connection stays busy until done has run on a worker */
+typedef struct kdf_job
+{
+    void (*done)(client_ctx *ctx, struct kdf_job *kj, reply_buf *response);
+    _Atomic int holds; /* the parking worker and the KDF thread; whichever lets go last resumes the command */
+    kdf_task task[KDF_MAX_TASKS];
+    int ntasks;
+    credentials cred; /* read before parking */
+    const char *arg[4]; /* copies of the command fields, stored in data */
+    command_timing timing;
+    uint64_t parked_ns;
+    size_t size;
+    char data[];
+} kdf_job;
+
+/* One line of a BATCH_ENTRIES request: category|title|user|url|notes|password */
+typedef struct
+{
+    const char *cat, *title, *usr, *url, *notes, *pass;
+} batch_item;
+
+enum batch_status
+{
+    BATCH_OK,
+    BATCH_BAD_LINE,
+    BATCH_NO_CATEGORY,
+    BATCH_DUPLICATE,
+    BATCH_FAILED
+};
+
+enum vault_format
+{
+    VAULT_CSV,
+    VAULT_JSON
+};
+
+/* An import in progress: records may straddle IMPORT_DATA frames, so the tail is carried over */
+typedef struct import_state
+{
+    enum vault_format format;
+    char *carry;
+    size_t carry_len;
+    int header_checked;
+    long added, skipped;
+} import_state;
+
+/* Writes a long reply into the connection's reply_buf, sending every STREAM_CHUNK bytes as a continuation frame */
+typedef struct
+{
+    client_ctx *ctx;
+    int failed;
+    size_t sent; /* bytes already handed to the connection */
+    unsigned char *data_at; /* binary: header of the open DATA item, or NULL */
+    reply_chunk *data_chunk;
+    size_t data_from; /* frame length where the DATA item's value starts */
+    int status_sent;
+    int stalled; /* the client is behind; the command stops at its next batch and resumes from its stream_job */
+} reply_stream;
+
+/* A listing, SYNC or EXPORT in progress: what its step needs to pick up where the last batch ended */
+typedef struct stream_job
+{
+    int (*step)(client_ctx *ctx, struct stream_job *sj); /* 1 when it stopped for the client, 0 once the reply is closed */
+    reply_stream rs;
+    sqlite3_int64 cursor[2]; /* listings and SYNC use the first; EXPORT's is (category ID, entry ID) */
+    sqlite3_int64 since, state[2];
+    int limit, rows;
+    enum vault_format format;
+    const char *cat; /* a copy in data, or NULL for categories */
+    char data[];
+} stream_job;
+
+/* Typed outcome of a command: binary clients get the code, text clients the message in reply_defs.
+   The numbers are part of the binary protocol, so new codes go at the end */
+enum reply_code
+{
+    ST_OK = 0,
+    ST_EMPTY_COMMAND,
+    ST_INVALID_COMMAND,
+    ST_FIELDS_REQUIRED,
+    ST_USERNAME_REQUIRED,
+    ST_OUT_OF_MEMORY,
+    ST_BUSY,
+    ST_HELLO,
+    ST_LOGIN_REQUIRED,
+    ST_LOGOUT_REQUIRED,
+    ST_ALREADY_LOGGED_IN,
+    ST_NOT_LOGGED_IN,
+    ST_LOGIN_OK,
+    ST_LOGIN_FAILED,
+    ST_LOGGED_OUT,
+    ST_PASSWORD_STRONG,
+    ST_PASSWORD_WEAK,
+    ST_MASTER_REJECTED,
+    ST_NEW_PASSWORD_REJECTED,
+    ST_USER_EXISTS,
+    ST_USER_NOT_FOUND,
+    ST_REGISTERED,
+    ST_REGISTER_FAILED,
+    ST_SECURITY_QUESTION,
+    ST_NO_SECURITY_QUESTION,
+    ST_BAD_SECURITY_ANSWER,
+    ST_PASSWORD_RESET,
+    ST_PASSWORD_RESET_FAILED,
+    ST_BAD_OLD_PASSWORD,
+    ST_PASSWORD_UPDATED,
+    ST_PASSWORD_UPDATE_FAILED,
+    ST_CATEGORY_EXISTS,
+    ST_CATEGORY_ADDED,
+    ST_CATEGORY_ADD_FAILED,
+    ST_CATEGORY_NOT_FOUND,
+    ST_CATEGORY_DELETED,
+    ST_CATEGORY_DELETE_FAILED,
+    ST_ENTRY_EXISTS,
+    ST_ENTRY_ADDED,
+    ST_ENTRY_ADD_FAILED,
+    ST_ENTRY_NOT_FOUND,
+    ST_ENTRY_UPDATED,
+    ST_ENTRY_UPDATE_FAILED,
+    ST_ENTRY_DELETED,
+    ST_ENTRY_DELETE_FAILED,
+    ST_INVALID_PAGE,
+    ST_NEXT_CURSOR,
+    ST_NO_CATEGORIES,
+    ST_NO_MORE_CATEGORIES,
+    ST_CATEGORIES_ERROR,
+    ST_NO_ENTRIES,
+    ST_NO_MORE_ENTRIES,
+    ST_ENTRIES_ERROR,
+    ST_EMPTY_BATCH,
+    ST_BATCH_FAILED,
+    ST_BATCH_BAD_LINE,
+    ST_BATCH_COMMITTED,
+    ST_UNKNOWN_FORMAT,
+    ST_EXPORT_ERROR,
+    ST_IMPORT_IN_PROGRESS,
+    ST_IMPORT_STARTED,
+    ST_NO_IMPORT,
+    ST_IMPORT_CHUNK_FAILED,
+    ST_IMPORT_TOO_LARGE,
+    ST_CHUNK_COMMITTED,
+    ST_IMPORT_FINAL_FAILED,
+    ST_IMPORT_FINISHED,
+    ST_RESUMED,
+    ST_SESSION_INVALID,
+    ST_ADMIN_ONLY,
+    ST_SEARCH_EMPTY,
+    ST_NO_MATCHES,
+    ST_URL_INVALID,
+    ST_RECOVERY_UNAVAILABLE,
+    ST_INVALID_REVISION,
+    ST_SYNCED,
+    ST_SYNC_RESET,
+    ST_WATCHING,
+    ST_WATCH_FAILED,
+    ST_UNWATCHED,
+    ST_VAULT_CHANGED,
+    ST_COUNT
+};
+
+/* Reply messages; args lists the printf arguments each takes, which binary replies send as typed TLVs */
+static const struct
+{
+    const char *text;
+    const char *args; /* s: const char *, i: int, l: long, L: long long */
+} reply_defs[ST_COUNT] = {
+    [ST_OK] = {"", ""},
+    [ST_EMPTY_COMMAND] = {"Empty command.\n", ""},
+    [ST_INVALID_COMMAND] = {"Invalid command or parameters.\n", ""},
+    [ST_FIELDS_REQUIRED] = {"All fields are required.\n", ""},
+    [ST_USERNAME_REQUIRED] = {"Username is required.\n", ""},
+    [ST_OUT_OF_MEMORY] = {"Out of memory.\n", ""},
+    [ST_BUSY] = {"Server busy, try again later.\n", ""},
+    [ST_HELLO] = {"HELLO|%s\n", "s"},
+    [ST_LOGIN_REQUIRED] = {"Login required.\n", ""},
+    [ST_LOGOUT_REQUIRED] = {"Logout required.\n", ""},
+    [ST_ALREADY_LOGGED_IN] = {"Already logged in.\n", ""},
+    [ST_NOT_LOGGED_IN] = {"Not logged in.\n", ""},
+    [ST_LOGIN_OK] = {"Login successful: %s\nSession: %s\n", "ss"},
+    [ST_LOGIN_FAILED] = {"Login failed: invalid credentials.\n", ""},
+    [ST_LOGGED_OUT] = {"Logged out.\n", ""},
+    [ST_PASSWORD_STRONG] = {"Password strength: Strong\n", ""},
+    [ST_PASSWORD_WEAK] = {"Password strength: Weak - Consider using a longer password with uppercase, lowercase, digits, and special characters.\n", ""},
+    [ST_MASTER_REJECTED] = {"Master password not accepted.\n", ""},
+    [ST_NEW_PASSWORD_REJECTED] = {"New password not accepted.\n", ""},
+    [ST_USER_EXISTS] = {"User already exists.\n", ""},
+    [ST_USER_NOT_FOUND] = {"User not found.\n", ""},
+    [ST_REGISTERED] = {"Registration successful.\n", ""},
+    [ST_REGISTER_FAILED] = {"Registration failed, possibly user exists.\n", ""},
+    [ST_SECURITY_QUESTION] = {"Security question: %s\n", "s"},
+    [ST_NO_SECURITY_QUESTION] = {"User does not have a security question.\n", ""},
+    [ST_BAD_SECURITY_ANSWER] = {"Invalid security answer.\n", ""},
+    [ST_PASSWORD_RESET] = {"Password reset to 'password'.\n", ""},
+    [ST_PASSWORD_RESET_FAILED] = {"Failed to reset password.\n", ""},
+    [ST_BAD_OLD_PASSWORD] = {"Invalid old password.\n", ""},
+    [ST_PASSWORD_UPDATED] = {"Password updated.\n", ""},
+    [ST_PASSWORD_UPDATE_FAILED] = {"Failed to update password.\n", ""},
+    [ST_CATEGORY_EXISTS] = {"Category already exists.\n", ""},
+    [ST_CATEGORY_ADDED] = {"Category added.\n", ""},
+    [ST_CATEGORY_ADD_FAILED] = {"Failed to add category. It may already exist.\n", ""},
+    [ST_CATEGORY_NOT_FOUND] = {"Category not found.\n", ""},
+    [ST_CATEGORY_DELETED] = {"Category deleted.\n", ""},
+    [ST_CATEGORY_DELETE_FAILED] = {"Failed to delete category.\n", ""},
+    [ST_ENTRY_EXISTS] = {"Entry with that title already exists.\n", ""},
+    [ST_ENTRY_ADDED] = {"Entry added.\n", ""},
+    [ST_ENTRY_ADD_FAILED] = {"Failed to add entry.\n", ""},
+    [ST_ENTRY_NOT_FOUND] = {"Entry not found.\n", ""},
+    [ST_ENTRY_UPDATED] = {"Entry updated.\n", ""},
+    [ST_ENTRY_UPDATE_FAILED] = {"Failed to update entry.\n", ""},
+    [ST_ENTRY_DELETED] = {"Entry deleted.\n", ""},
+    [ST_ENTRY_DELETE_FAILED] = {"Failed to delete entry.\n", ""},
+    [ST_INVALID_PAGE] = {"Invalid page: limit must be 1-%d and cursor a non-negative ID.\n", "i"},
+    [ST_NEXT_CURSOR] = {"Next cursor: %lld\n", "L"},
+    [ST_NO_CATEGORIES] = {"No categories found.\n", ""},
+    [ST_NO_MORE_CATEGORIES] = {"No more categories.\n", ""},
+    [ST_CATEGORIES_ERROR] = {"Error retrieving categories.\n", ""},
+    [ST_NO_ENTRIES] = {"No entries in that category.\n", ""},
+    [ST_NO_MORE_ENTRIES] = {"No more entries.\n", ""},
+    [ST_ENTRIES_ERROR] = {"Error retrieving entries.\n", ""},
+    [ST_EMPTY_BATCH] = {"Empty batch.\n", ""},
+    [ST_BATCH_FAILED] = {"Batch failed, no entries were added.\n", ""},
+    [ST_BATCH_BAD_LINE] = {"Expected category|title|user|url|notes|password\n", ""},
+    [ST_BATCH_COMMITTED] = {"Batch committed: %d added, %d failed.\n", "ii"},
+    [ST_UNKNOWN_FORMAT] = {"Unknown format, use csv or json.\n", ""},
+    [ST_EXPORT_ERROR] = {"Error exporting vault.\n", ""},
+    [ST_IMPORT_IN_PROGRESS] = {"Import already in progress.\n", ""},
+    [ST_IMPORT_STARTED] = {"Import started.\n", ""},
+    [ST_NO_IMPORT] = {"No import in progress.\n", ""},
+    [ST_IMPORT_CHUNK_FAILED] = {"Import chunk failed, nothing from it was added.\n", ""},
+    [ST_IMPORT_TOO_LARGE] = {"Import aborted: record too large.\n", ""},
+    [ST_CHUNK_COMMITTED] = {"Chunk committed: %ld added, %ld skipped.\n", "ll"},
+    [ST_IMPORT_FINAL_FAILED] = {"Import failed on the last records.\n", ""},
+    [ST_IMPORT_FINISHED] = {"Import finished: %ld added, %ld skipped.\n", "ll"},
+    [ST_RESUMED] = {"Session resumed: %s\n", "s"},
+    [ST_SESSION_INVALID] = {"Session expired or unknown, log in again.\n", ""},
+    [ST_ADMIN_ONLY] = {"Admin commands are only accepted from localhost.\n", ""},
+    [ST_SEARCH_EMPTY] = {"Search needs at least one letter or digit.\n", ""},
+    [ST_NO_MATCHES] = {"No matching entries.\n", ""},
+    [ST_URL_INVALID] = {"URL has no host name.\n", ""},
+    [ST_RECOVERY_UNAVAILABLE] = {"Recovery unavailable: this vault can only be unlocked with the master password.\n", ""},
+    [ST_INVALID_REVISION] = {"Invalid revision: expected a non-negative number.\n", ""},
+    [ST_SYNCED] = {"Synced to revision %lld.\n", "L"},
+    [ST_SYNC_RESET] = {"Deletions before revision %lld were compacted, SYNC|0 for the whole vault.\n", "L"},
+    [ST_WATCHING] = {"Watching for changes after revision %lld.\n", "L"},
+    [ST_WATCH_FAILED] = {"Could not start watching, try again.\n", ""},
+    [ST_UNWATCHED] = {"Stopped watching.\n", ""},
+    [ST_VAULT_CHANGED] = {"Vault changed: revision %lld, SYNC to catch up.\n", "L"},
+};
+
+/* One '|'-separated field of a request. It points into the request buffer, which is NUL-terminated after every field */
+typedef struct
+{
+    char *p;
+    size_t len;
+} cmd_field;
+
+typedef void (*cmd_handler)(client_ctx *ctx, cmd_field *args, reply_buf *response);
+
+/* args_ok and required are bitmasks over argument counts and argument positions */
+typedef struct
+{
+    const char *name;
+    unsigned char len;
+    unsigned char opcode;   /* binary protocol; never reuse a retired number */
+    unsigned char args_ok;  /* bit n: n arguments accepted */
+    unsigned char required; /* bit n: argument n may not be empty */
+    unsigned char raw;      /* the name ends at '\n' and the rest is handed over unsplit */
+    cmd_handler run;
+} command_def;
+
+/* Cached statements, one slot per query; stmt_sql holds the SQL for each id */
+enum stmt_id
+{
+    STMT_REGISTER,
+    STMT_REGISTER_SEC,
+    STMT_SEC_QUESTION,
+    STMT_FETCH_CREDENTIALS,
+    STMT_CREATE_CATEGORY,
+    STMT_FETCH_CATEGORIES,
+    STMT_FETCH_ENTRY_BY_TITLE,
+    STMT_FETCH_ENTRIES,
+    STMT_UPDATE_ENTRY,
+    STMT_UPDATE_PASSWORD,
+    STMT_REHASH_MASTER,
+    STMT_REHASH_ANSWER,
+    STMT_REMOVE_ENTRY,
+    STMT_FETCH_USER,
+    STMT_FETCH_CATEGORY,
+    STMT_REMOVE_CATEGORY_ENTRIES,
+    STMT_REMOVE_CATEGORY,
+    STMT_INSERT_ENTRY,
+    STMT_EXPORT_ENTRIES,
+    STMT_LOAD_CATEGORIES,
+    STMT_LOAD_ENTRIES,
+    STMT_LOAD_PLAINTEXT,
+    STMT_SEAL_ENTRY,
+    STMT_SAVE_REVISION,
+    STMT_LOG_CHANGE,
+    STMT_SYNC_STATE,
+    STMT_SYNC_CHANGES,
+    STMT_OLD_TOMBSTONES,
+    STMT_RAISE_FLOOR,
+    STMT_DROP_CHANGE,
+    STMT_COUNT
+};
+
+/* What a change-log row describes; SYNC rows in binary send this, plus 2 for a tombstone */
+enum change_kind
+{
+    CHANGE_CATEGORY = 0,
+    CHANGE_ENTRY = 1
+};
+
+/* Pooled connection, opened once at startup, with its prepared statement cache */
+typedef struct
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmts[STMT_COUNT];
+} db_conn;
+
+/* A BLOB parameter; p == NULL binds NULL */
+typedef struct
+{
+    const unsigned char *p;
+    int len;
+} blob_ref;
+
+/* One user's data key with its AES key schedule expanded once; each value only sets a fresh nonce */
+typedef struct
+{
+    EVP_CIPHER_CTX *evp;
+    sqlite3_int64 user_id;
+    char *scratch[2]; /* opened Notes and PassVal of the current row */
+    size_t cap[2];
+} field_cipher;
+
+/* Columns a sealed value is bound to */
+enum seal_column
+{
+    SEAL_NOTES,
+    SEAL_PASS,
+    SEAL_MASTER_KEY,
+    SEAL_ANSWER_KEY
+};
+
+/* A mutation handed to the commit thread; the submitter sleeps on done until its group is durable */
+typedef struct write_op
+{
+    int (*apply)(db_conn *c, struct write_op *op);
+    void (*committed)(const struct write_op *op); /* runs on the commit thread, in commit order */
+    const char *text[7];
+    sqlite3_int64 id[2];
+    blob_ref blob[2];         /* sealed Notes and PassVal, or wrapped data keys */
+    const blob_ref *blobs;    /* batch inserts and sealing: two per item */
+    const sqlite3_int64 *ids; /* sealing: the rows blobs belong to */
+    const batch_item *items; /* batch inserts only */
+    unsigned char *status;
+    int count, flag;
+
+    int rc;
+    sqlite3_int64 out[2];   /* row IDs the write touched, for the cache */
+    sqlite3_int64 revision; /* the user's revision after the write, if it logged a change */
+    sem_t done;
+    struct write_op *next;
+} write_op;
+
+/* An immutable cached row, shared by reference so listings can format it without holding a shard lock */
+typedef struct
+{
+    _Atomic int refs;
+    sqlite3_int64 id;
+    size_t bytes;
+    const char *f[5]; /* category: name; entry: title, user, url, notes, password */
+} vault_row;
+
+/* One indexed word; each posting is slot << 4 | the fields it appears in, in ascending slot order */
+typedef struct
+{
+    uint32_t *post;
+    int count, cap;
+    char text[];
+} search_word;
+
+/* Per-slot scratch for the running query; stale unless gen matches */
+typedef struct
+{
+    uint32_t gen;
+    uint16_t score; /* at most 30 per term */
+    uint8_t terms, mask;
+} search_acc;
+
+/*
+ * SEARCH index over one cached vault's titles, usernames, URLs and notes, never passwords. Entries
+ * take slots in arrival order; a removed entry leaves its slot empty and its postings are skipped
+ * until enough pile up to be worth a rebuild.
+ */
+typedef struct
+{
+    vault_row **slots;
+    sqlite3_int64 *ids; /* of each slot's entry, so ranking need not touch the rows */
+    search_acc *acc;
+    uint32_t *cand; /* slots the running query step has touched */
+    int nslots, slot_cap, dead;
+    uint32_t *by_id; /* open addressing on entry ID, slot + 1; 0 is free */
+    search_word **words;
+    uint32_t *word_hash; /* open addressing on text, word + 1 */
+    search_word **order; /* words[0..sorted) in text order; later words are not sorted yet */
+    int nwords, word_cap, sorted;
+    uint32_t gen;
+    size_t bytes;
+} search_index;
+
+/* Parsed SEARCH|query: lowercased words, every one of which must prefix some word of a match */
+typedef struct
+{
+    char term[SEARCH_MAX_TERMS][SEARCH_WORD_MAX + 1];
+    int len[SEARCH_MAX_TERMS];
+    int count;
+} search_query;
+
+/* The best matches so far as a min-heap, weakest on top; every row held is pinned */
+typedef struct
+{
+    vault_row **rows;
+    uint32_t *score;
+    int count, cap;
+} search_hits;
+
+/* Scores an entry's title, user, url and notes against a parsed query; 0 is no match */
+typedef uint32_t (*entry_match)(const char *const *f, const void *query);
+
+/* Entries whose URL host falls under one registrable domain (eTLD+1) */
+typedef struct site
+{
+    struct site *next;
+    vault_row **rows;
+    int count, cap;
+    char name[];
+} site;
+
+/* FIND_BY_URL index over one cached vault, from registrable domain to entries */
+typedef struct
+{
+    site **buckets;
+    int nbuckets, count;
+    size_t bytes;
+} site_index;
+
+/* Parsed FIND_BY_URL|url: the page's host, whose registrable domain starts at host + site */
+typedef struct
+{
+    char host[URL_HOST_MAX];
+    int len, site;
+} url_query;
+
+typedef struct
+{
+    vault_row **rows; /* ascending ID, the same order SQLite pages in */
+    int count, cap;
+} row_list;
+
+/* A change log row, read before any of its batch is streamed */
+typedef struct
+{
+    sqlite3_int64 revision, id, cat_id;
+    enum change_kind kind;
+    int deleted;
+    vault_row *row; /* the category or entry as it is now; NULL for a tombstone or a row whose category is gone */
+} sync_row;
+
+/* One user's categories and entries; entries[i] belongs to cats.rows[i] */
+typedef struct vault
+{
+    sqlite3_int64 user_id;
+    row_list cats;
+    row_list *entries;
+    search_index *index; /* built by the first SEARCH */
+    site_index *sites;   /* built by the first FIND_BY_URL */
+    size_t bytes;
+    time_t expires;
+    struct vault *hash_next;
+    struct vault *lru_prev, *lru_next;
+} vault;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    vault *buckets[VAULT_BUCKETS];
+    vault *lru_head, *lru_tail; /* most recently used first */
+    size_t bytes;
+    unsigned long epoch; /* bumped by every write, so a fill that raced one is not installed */
+} vault_shard;
+
+/* Every session lives the same TTL, so issue order is also expiry order */
+typedef struct session
+{
+    unsigned char token[SESSION_TOKEN_LEN];
+    sqlite3_int64 user_id;
+    char username[64];
+    unsigned char data_key[DATA_KEY_LEN]; /* RESUME needs no password to unwrap it again */
+    time_t expires;
+    struct session *hnext;       /* bucket chain */
+    struct session *prev, *next; /* issue order, oldest first */
+} session;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    session *buckets[SESSION_BUCKETS];
+    session *oldest, *newest;
+    int count;
+} session_shard;
+
+/* Watching connections chained by bucket; the commit thread walks a bucket under the lock to queue pushes */
+typedef struct
+{
+    pthread_mutex_t lock;
+    client_ctx *buckets[WATCH_BUCKETS];
+} watch_shard;
+
+static job_queue jobs;
+static pool_stats stats;
+
+static job_queue kdf_jobs;
+static pool_stats kdf_stats;
+static int kdf_log_n = DEFAULT_KDF_LOG_N, kdf_r = DEFAULT_KDF_R, kdf_p = DEFAULT_KDF_P;
+static EVP_CIPHER *seal_cipher; /* fetched once; an implicit fetch per init would dominate short values */
+
+static vault_shard vault_shards[VAULT_SHARDS];
+static size_t vault_shard_budget;
+static _Atomic unsigned long cache_hits, cache_misses, cache_evictions;
+
+static session_shard session_shards[SESSION_SHARDS];
+static int session_ttl = DEFAULT_SESSION_TTL_SEC;
+static int tombstone_ttl = DEFAULT_TOMBSTONE_TTL_SEC;
+
+static watch_shard watch_shards[WATCH_SHARDS];
+static _Atomic long watchers;
+static _Atomic unsigned long watch_pushes;
+
+static _Atomic(thread_metrics *) metrics_threads;
+static _Thread_local thread_metrics *metrics_mine;
+static _Thread_local uint64_t metrics_db_ns, metrics_db_since; /* DB time of the command this thread is running */
+static _Thread_local int metrics_db_depth;
+static _Atomic long open_conns;
+static SSL_CTX *tls_ctx; /* set by -T; every connection on the port is then TLS 1.3 */
+static _Atomic unsigned long tls_handshakes, tls_resumed, tls_ktls;
+
+/* Free reply chunks; after warm-up every reply is built and sent without a malloc */
+static struct
+{
+    pthread_mutex_t lock;
+    reply_chunk *free;
+    int count;
+} chunk_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+static _Atomic unsigned long chunk_allocs;
+static const char *const phase_names[PHASE_COUNT] = {"total", "parse", "db", "format", "kdf"};
+
+/* Worker pool */
+static void raise_fd_limit(void);
+static uint64_t now_ns(void);
+static int job_queue_init(job_queue *q, int depth);
+static int job_queue_push(job_queue *q, const job *j);
+static void job_queue_pop(job_queue *q, job *j);
+static void *worker_run(void *arg);
+static void *pool_stats_run(void *arg);
+static void pool_stats_record(pool_stats *s, uint64_t enqueued_ns);
+static void conn_run_commands(client_ctx *ctx);
+static void conn_login(client_ctx *ctx, const char *username, sqlite3_int64 user_id, const unsigned char *data_key);
+
+/* Event loops and connection I/O */
+static int event_loop_init(event_loop *loop);
+static void *event_loop_run(void *arg);
+static void event_loop_accept(event_loop *loop);
+static void event_loop_reap(event_loop *loop, client_ctx *ctx);
+static void event_loop_drain_reaps(event_loop *loop);
+static void event_loop_notify(event_loop *loop, client_ctx *ctx);
+static void event_loop_drain_notify(event_loop *loop);
+static void event_loop_resume(event_loop *loop, client_ctx *ctx);
+static int event_loop_drain_resumes(event_loop *loop);
+static int buf_reserve(char **buf, size_t *cap, size_t need);
+static int conn_on_readable(client_ctx *ctx);
+static int conn_read_available(client_ctx *ctx);
+static long frame_size(const char *p, size_t avail);
+static long conn_peek_frame(const client_ctx *ctx);
+static int conn_swap_input(client_ctx *ctx);
+static char *conn_take_command(client_ctx *ctx, size_t *len);
+static int conn_queue_output(client_ctx *ctx, const char *data, size_t len);
+static int conn_queue_frame(client_ctx *ctx, const char *data, size_t len, uint32_t flags);
+static int conn_queue_reply(client_ctx *ctx);
+static int conn_push_change(client_ctx *ctx);
+static void conn_consume(client_ctx *ctx, size_t n);
+static int conn_flush(client_ctx *ctx);
+static void conn_close(client_ctx *ctx);
+
+/* TLS */
+static int tls_init(const char *cert_file, const char *key_file);
+static int conn_tls_handshake(client_ctx *ctx);
+static ssize_t conn_recv(client_ctx *ctx, char *buf, size_t len);
+static ssize_t conn_sendv(client_ctx *ctx, const struct iovec *iov, int n);
+static ssize_t tls_io_result(SSL *ssl, int ret);
+
+/* Reply buffers */
+static reply_chunk *chunk_get(size_t need);
+static void chunk_put(reply_chunk *list);
+static void reply_open(reply_buf *rb);
+static void reply_close(reply_buf *rb, uint32_t flags);
+static char *reply_reserve(reply_buf *rb, size_t n);
+static void reply_commit(reply_buf *rb, size_t n);
+static void reply_append(reply_buf *rb, const void *data, size_t len);
+static void reply_vprintf(reply_buf *rb, const char *fmt, va_list ap);
+static void reply_encode(reply_buf *rb, enum reply_code code, va_list ap);
+static void reply_discard(reply_buf *rb);
+
+/* Streamed replies */
+static void stream_begin(reply_stream *rs, client_ctx *ctx);
+static void stream_append(reply_stream *rs, const char *data, size_t len);
+static void stream_printf(reply_stream *rs, const char *fmt, ...);
+static void stream_vprintf(reply_stream *rs, const char *fmt, va_list ap);
+static void stream_copy(reply_stream *rs, const char *data, size_t len, int as_data);
+static void stream_open_data(reply_stream *rs);
+static void stream_close_data(reply_stream *rs);
+static void stream_rewind(reply_stream *rs);
+static void stream_head(reply_stream *rs);
+static void stream_text(reply_stream *rs, const char *text, size_t len);
+static void stream_reply(reply_stream *rs, enum reply_code code, ...);
+static void stream_result(reply_stream *rs, int line, enum reply_code code, const char *reason);
+static void stream_category(reply_stream *rs, const char *name);
+static void stream_entry(reply_stream *rs, const char *const *f);
+static void stream_change(reply_stream *rs, enum change_kind kind, int deleted, sqlite3_int64 id, sqlite3_int64 cat_id, const char *const *f);
+static void stream_flush(reply_stream *rs);
+static void stream_end(reply_stream *rs);
+static stream_job *stream_job_new(client_ctx *ctx, int (*step)(client_ctx *, stream_job *), const char *cat);
+static void stream_job_run(client_ctx *ctx, stream_job *sj);
+
+/* Replies and the binary encoding */
+static void reply(client_ctx *ctx, reply_buf *response, enum reply_code code, ...);
+static void reply_more(client_ctx *ctx, reply_buf *response, enum reply_code code, ...);
+static void reply_format(client_ctx *ctx, reply_buf *response, int append, enum reply_code code, va_list ap);
+static unsigned char *encode_values(unsigned char *p, unsigned char *end, enum reply_code code, va_list ap);
+static size_t encode_status(char *buf, uint64_t req_id, enum reply_code code);
+static size_t encode_push(char *buf, size_t cap, enum reply_code code, ...);
+static unsigned char *varint_put(unsigned char *p, uint64_t v);
+static int varint_get(const unsigned char **p, const unsigned char *end, uint64_t *v);
+static size_t varint_len(uint64_t v);
 
 /* Protocol command processing */
-static void process_command(client_ctx *ctx, const char *cmd, char *response);
+static void process_command(client_ctx *ctx, char *cmd, size_t len, reply_buf *response);
+static void process_binary(client_ctx *ctx, char *cmd, size_t len, reply_buf *response);
+static const command_def *parse_command(char *cmd, size_t len, cmd_field *args, int *count);
+static void run_command(client_ctx *ctx, const command_def *def, cmd_field *args, int count, reply_buf *response, uint64_t started);
+static int split_fields(char *s, size_t len, cmd_field *fields, int max);
+static int split_items(char *s, size_t len, cmd_field *fields, int max);
+static void commands_init(void);
+static const command_def *command_lookup(const char *name, size_t len);
 
 /* Command handlers */
-static void cmd_register_user(client_ctx *ctx, const char *username, const char *masterPass, char *response);
-static void cmd_login_user(client_ctx *ctx, const char *username, const char *masterPass, char *response);
-static void cmd_del_category(client_ctx *ctx, const char *catName, char *response);
-static void cmd_new_category(client_ctx *ctx, const char *catName, char *response);
-static void cmd_list_categories(client_ctx *ctx, char *response);
-static void cmd_new_entry(client_ctx *ctx, const char *cat, const char *title, const char *usr, const char *url, const char *notes, const char *pass, char *response);
-static void cmd_list_entries(client_ctx *ctx, const char *cat, char *response);
-static void cmd_mod_entry(client_ctx *ctx, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass, char *response);
-static void cmd_del_entry(client_ctx *ctx, const char *title, char *response);
-static void cmd_logout_user(client_ctx *ctx, char *response);
-static void cmd_register_user_with_security(client_ctx *ctx, const char *username, const char *masterPass, const char *securityQ, const char *securityA, char *response);
-static void cmd_recover_password(client_ctx *ctx, const char *username, const char *securityA, char *response);
-static void cmd_change_password(client_ctx *ctx, const char *username, const char *oldPass, const char *newPass, char *response);
-static void cmd_see_security_question(client_ctx *ctx, const char *username, char *response);
+static void cmd_register_user(client_ctx *ctx, const char *username, const char *masterPass, reply_buf *response);
+static void cmd_register_user_done(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static void cmd_login_user(client_ctx *ctx, const char *username, const char *masterPass, reply_buf *response);
+static void cmd_login_user_done(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static int login_data_key(kdf_job *kj, const kdf_task *t, unsigned char *key, int *created);
+static void cmd_resume(client_ctx *ctx, const char *token, reply_buf *response);
+static void cmd_del_category(client_ctx *ctx, const char *catName, reply_buf *response);
+static void cmd_new_category(client_ctx *ctx, const char *catName, reply_buf *response);
+static void cmd_list_categories(client_ctx *ctx, const char *limit, const char *cursor, reply_buf *response);
+static void cmd_new_entry(client_ctx *ctx, const char *cat, const char *title, const char *usr, const char *url, const char *notes, const char *pass, reply_buf *response);
+static void cmd_list_entries(client_ctx *ctx, const char *cat, const char *limit, const char *cursor, reply_buf *response);
+static int stream_list_step(client_ctx *ctx, stream_job *sj);
+static void cmd_search(client_ctx *ctx, const char *query, const char *limit, reply_buf *response);
+static void cmd_find_by_url(client_ctx *ctx, const char *url, const char *limit, reply_buf *response);
+static void cmd_sync(client_ctx *ctx, const char *since, const char *limit, reply_buf *response);
+static int stream_sync_step(client_ctx *ctx, stream_job *sj);
+static void cmd_watch(client_ctx *ctx, reply_buf *response);
+static void cmd_unwatch(client_ctx *ctx, reply_buf *response);
+static void cmd_mod_entry(client_ctx *ctx, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass, reply_buf *response);
+static void cmd_del_entry(client_ctx *ctx, const char *title, reply_buf *response);
+static void cmd_logout_user(client_ctx *ctx, reply_buf *response);
+static void cmd_register_user_with_security(client_ctx *ctx, const char *username, const char *masterPass, const char *securityQ, const char *securityA, reply_buf *response);
+static void cmd_register_user_with_security_done(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static void cmd_recover_password(client_ctx *ctx, const char *username, const char *securityA, reply_buf *response);
+static void cmd_recover_password_done(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static void cmd_change_password(client_ctx *ctx, const char *username, const char *oldPass, const char *newPass, reply_buf *response);
+static void cmd_change_password_done(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static void cmd_see_security_question(client_ctx *ctx, const char *username, reply_buf *response);
+static void cmd_batch_entries(client_ctx *ctx, char *body, reply_buf *response);
+static void cmd_export(client_ctx *ctx, const char *format, reply_buf *response);
+static int stream_export_step(client_ctx *ctx, stream_job *sj);
+static void cmd_import_begin(client_ctx *ctx, const char *format, reply_buf *response);
+static void cmd_import_data(client_ctx *ctx, const char *data, size_t len, reply_buf *response);
+static void cmd_import_end(client_ctx *ctx, reply_buf *response);
+static void cmd_hello(client_ctx *ctx, const char *version, reply_buf *response);
+static void cmd_stats(client_ctx *ctx, reply_buf *response);
+static int import_records(client_ctx *ctx, char *buf, size_t len, int final, long *added, long *skipped);
+static int parse_vault_format(const char *name, enum vault_format *format);
+static char *csv_record_end(char *p, char *end, int final);
+static int csv_decode_record(char *p, char *end, char **fields, int max);
+static char *json_decode_string(char **pp, char *end);
+static int json_decode_record(char *p, char *end, batch_item *item);
+static void stream_csv_field(reply_stream *rs, const char *s, int last);
+static void stream_json_string(reply_stream *rs, const char *key, const char *s, int last);
+
+/* Vault cache */
+static void vault_cache_init(size_t budget);
+static vault_shard *vault_shard_for(sqlite3_int64 user_id);
+static vault *vault_find(vault_shard *s, sqlite3_int64 user_id);
+static vault *vault_fill(sqlite3_int64 user_id, const unsigned char *key);
+static void vault_touch(vault_shard *s, vault *v);
+static void vault_unlink(vault_shard *s, vault *v);
+static void vault_free(vault *v);
+static void vault_evict(vault_shard *s, time_t now);
+static void *vault_cache_run(void *arg);
+static void vault_cache_logout(sqlite3_int64 user_id);
+static int vault_list(sqlite3_int64 user_id, const unsigned char *key, const char *cat, sqlite3_int64 after_id, int limit, reply_stream *rs, sqlite3_int64 *next_cursor);
+static vault_row *vault_row_new(sqlite3_int64 id, const char *const *fields, int nfields);
+static void vault_row_release(vault_row *row);
+static int row_list_append(row_list *l, vault_row *row);
+static void row_list_free(row_list *l);
+static int row_list_find(const row_list *l, sqlite3_int64 id, int *pos);
+static void vault_on_category_added(const write_op *op);
+static void vault_on_category_removed(const write_op *op);
+static void vault_on_entry_added(const write_op *op);
+static void vault_on_entry_updated(const write_op *op);
+static void vault_on_entry_removed(const write_op *op);
+static void vault_on_invalidate(const write_op *op);
+static vault *vault_begin_update(const write_op *op, vault_shard **s);
+static void vault_end_update(vault_shard *s, vault *v, int failed);
+static void vault_index_patch(vault_shard *s, vault *v, const vault_row *removed, vault_row *added);
+static int vault_search(sqlite3_int64 user_id, const unsigned char *key, const search_query *q, int limit, reply_stream *rs);
+static vault_row **vault_pin_entries(vault_shard *s, vault *v, int *n);
+static vault *vault_index_build(vault_shard *s, vault *v);
+static int vault_find_url(sqlite3_int64 user_id, const unsigned char *key, const url_query *q, int limit, reply_stream *rs);
+static vault *vault_sites_build(vault_shard *s, vault *v);
+static int search_next_word(const char **p, char *word);
+static int search_parse(const char *query, search_query *q);
+static unsigned search_weight(unsigned mask);
+static uint32_t search_match(const char *const *f, const void *query);
+static uint32_t search_hash(const char *text);
+static uint32_t search_id_hash(sqlite3_int64 id);
+static search_word *search_index_word(search_index *ix, const char *text, int len);
+static int search_index_add(search_index *ix, vault_row *row);
+static void search_index_remove(search_index *ix, sqlite3_int64 id);
+static int search_word_cmp(const void *a, const void *b);
+static int search_index_sort(search_index *ix);
+static void search_index_query(search_index *ix, const search_query *q, search_hits *hits);
+static int search_postings(search_index *ix, const search_word *w, int exact, int step, int ncand);
+static void search_postings_scored(search_index *ix, const search_word *w, int exact, int step, int last, search_hits *hits);
+static void search_index_free(search_index *ix);
+static int search_hit_weaker(uint32_t score, sqlite3_int64 id, uint32_t than_score, sqlite3_int64 than_id);
+static int search_hits_wants(const search_hits *h, uint32_t score, sqlite3_int64 id);
+static void search_hits_offer(search_hits *h, vault_row *row, uint32_t score);
+static void search_hits_sift(search_hits *h, int n);
+static void search_hits_finish(search_hits *h);
+static void search_hits_scan(search_hits *h, vault_row **pinned, int n, entry_match match, const void *query);
+static int url_host(const char *url, char *host);
+static int url_suffix_cmp(const void *key, const void *entry);
+static int url_public_suffix(const char *suffix);
+static int url_site(const char *host, int len);
+static int url_parse(const char *url, url_query *q);
+static uint32_t url_match(const char *const *f, const void *query);
+static site *site_index_find(const site_index *ix, const char *name);
+static int site_index_add(site_index *ix, vault_row *row);
+static void site_index_remove(site_index *ix, const vault_row *row);
+static void site_index_free(site_index *ix);
+
+/* Sessions */
+static void session_init(void);
+static session_shard *session_shard_for(const unsigned char *token, session ***bucket);
+static void session_unlink(session_shard *s, session *se);
+static int session_create(sqlite3_int64 user_id, const char *username, const unsigned char *data_key, unsigned char *token);
+static int session_resume(const unsigned char *token, sqlite3_int64 *user_id, char *username, unsigned char *data_key);
+static void session_revoke(const unsigned char *token);
+static void session_free(session *se);
+static void session_revoke_user(sqlite3_int64 user_id);
+static void *session_run(void *arg);
+static void session_token_hex(const unsigned char *token, char *hex);
+static int session_token_parse(const char *hex, unsigned char *token);
+
+/* Watchers */
+static void watch_init(void);
+static watch_shard *watch_shard_for(sqlite3_int64 user_id, client_ctx ***bucket);
+static void watch_add(client_ctx *ctx);
+static void watch_remove(client_ctx *ctx);
+static void watch_notify(sqlite3_int64 user_id, sqlite3_int64 revision);
+
+/* Metrics */
+static thread_metrics *metrics_self(void);
+static void metrics_add(_Atomic uint64_t *counter, uint64_t v);
+static void metrics_record(const command_timing *t);
+static void metrics_db_begin(void);
+static void metrics_db_end(void);
+static uint64_t metrics_db_take(void);
+static int hist_index(uint64_t ns);
+static uint64_t hist_upper(int idx);
+static uint64_t hist_quantile(const uint64_t *hist, uint64_t count, double q);
+static metrics_totals *metrics_merge(void);
+static void metrics_prometheus(const metrics_totals *m, text_buf *out);
+static void metrics_summary(const metrics_totals *m, text_buf *out);
+static const char *metrics_slot_name(int slot);
+static void text_printf(text_buf *t, const char *fmt, ...);
+static int admin_listen(int port);
+static void *admin_run(void *arg);
 
 /* Database init and ops */
-static int init_db(const char *db_name);
-static int db_register(const char *username, const char *hashpass);
-static int db_register_with_security(const char *username, const char *securityQ, const char *hashpass, const char *hashAns);
-static int db_verify_security_answer(const char *username, const char *hashAns);
-static int db_login(client_ctx *ctx, const char *username, const char *hashpass);
-static int db_create_category(const char *username, const char *catName);
-static int db_fetch_categories(const char *username, char *out);
-static int db_insert_entry(const char *username, const char *cat, const char *title, const char *usr, const char *url, const char *notes, const char *pass);
-static int db_fetch_entries(const char *username, const char *cat, char *out);
-static int db_fetch_entry_by_title(const char *username, const char *title, char *out);
-static int db_update_entry(const char *username, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass);
-static int db_remove_entry(const char *username, const char *title);
+static int init_db(const char *db_name, int pool_size);
+static int db_migrate(sqlite3 *db);
+static int db_check_query_plans(sqlite3 *db);
+static int db_pool_init(const char *db_name, int pool_size);
+static int db_open(const char *db_name, int flags, sqlite3 **db);
+static db_conn *db_acquire(void);
+static void db_release(db_conn *c);
+static void db_pool_usage(int *in_use, int *total);
+static int db_write(write_op *op);
+static void *db_commit_run(void *arg);
+static int db_wal_hook(void *arg, sqlite3 *db, const char *name, int pages);
+static void *db_checkpoint_run(void *arg);
+static sqlite3_stmt *db_stmt(db_conn *c, enum stmt_id id);
+static void db_stmt_done(sqlite3_stmt *res);
+static int db_register(const char *username, const char *hashpass, const unsigned char *wrapped);
+static int db_register_with_security(const char *username, const char *securityQ, const char *hashpass, const char *hashAns, const unsigned char *const *wrapped);
+static int db_fetch_credentials(const char *username, credentials *cred);
+static int db_rehash(sqlite3_int64 user_id, int answer, const char *old_hash, const char *new_hash, const unsigned char *old_wrapped, const unsigned char *new_wrapped);
+static int db_create_category(sqlite3_int64 user_id, const char *catName);
+static int db_fetch_categories(sqlite3_int64 user_id, sqlite3_int64 after_id, int limit, reply_stream *rs, sqlite3_int64 *next_cursor);
+static int db_insert_entry(sqlite3_int64 user_id, const unsigned char *key, sqlite3_int64 cat_id, const char *title, const char *usr, const char *url, const char *notes, const char *pass);
+static int db_fetch_entries(sqlite3_int64 user_id, const unsigned char *key, const char *cat, sqlite3_int64 after_id, int limit, reply_stream *rs, sqlite3_int64 *next_cursor);
+static int db_match_entries(sqlite3_int64 user_id, const unsigned char *key, entry_match match, const void *query, search_hits *hits);
+static int db_fetch_entry_by_title(sqlite3_int64 user_id, const char *title);
+static int db_update_entry(sqlite3_int64 user_id, const unsigned char *key, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass);
+static int db_remove_entry(sqlite3_int64 user_id, const char *title);
 static int db_see_security_question(const char *username, char *out);
-static int db_update_password(const char *username, const char *newPass);
+static int db_update_password(const char *username, const char *newPass, const unsigned char *old_wrapped, const unsigned char *new_wrapped);
 static int db_fetch_user_by_username(const char *username);
-static int db_fetch_category_by_name(const char *username, const char *catName, char *out);
-static int db_remove_category(const char *username, const char *catName);
-
-/* Simple hash for demonstration */
+static int db_fetch_category_by_name(sqlite3_int64 user_id, const char *catName, sqlite3_int64 *cat_id);
+static int db_remove_category(sqlite3_int64 user_id, sqlite3_int64 cat_id);
+static int db_insert_entry_batch(sqlite3_int64 user_id, const unsigned char *key, const batch_item *items, int count, unsigned char *status, int create_categories);
+static int db_apply_register(db_conn *c, write_op *op);
+static int db_apply_register_with_security(db_conn *c, write_op *op);
+static int db_apply_create_category(db_conn *c, write_op *op);
+static int db_apply_insert_entry(db_conn *c, write_op *op);
+static int db_apply_update_entry(db_conn *c, write_op *op);
+static int db_apply_update_password(db_conn *c, write_op *op);
+static int db_apply_rehash(db_conn *c, write_op *op);
+static int db_apply_remove_entry(db_conn *c, write_op *op);
+static int db_apply_remove_category(db_conn *c, write_op *op);
+static int db_apply_insert_entry_batch(db_conn *c, write_op *op);
+static int db_seal_legacy_entries(sqlite3_int64 user_id, const unsigned char *key);
+static int db_seal_entries(const sqlite3_int64 *ids, blob_ref *blobs, const unsigned char *buf, const size_t *at, int count);
+static int db_apply_seal_entries(db_conn *c, write_op *op);
+static int db_log_change(db_conn *c, write_op *op, enum change_kind kind, sqlite3_int64 id, int deleted);
+static int db_log_returned(db_conn *c, write_op *op, sqlite3_stmt *res, enum change_kind kind, int deleted, int rc);
+static int db_save_revision(db_conn *c, write_op *op);
+static int db_sync(sqlite3_int64 user_id, const unsigned char *key, sqlite3_int64 since, sqlite3_int64 after, int limit, reply_stream *rs, sqlite3_int64 *state, sqlite3_int64 *next_cursor);
+static int db_read_changes(sqlite3_int64 user_id, field_cipher *fc, sqlite3_int64 after, int want, sqlite3_int64 *state, sync_row *out, int *more);
+static int db_revision(sqlite3_int64 user_id, sqlite3_int64 *revision);
+static int db_compact_changes(time_t cutoff);
+static int db_apply_compact_changes(db_conn *c, write_op *op);
+static void *db_compact_run(void *arg);
+static void db_bind_blob(sqlite3_stmt *res, int idx, const blob_ref *b);
+static int db_export_entries(sqlite3_int64 user_id, const unsigned char *key, enum vault_format format, sqlite3_int64 *after, reply_stream *rs);
+static int db_read_export(sqlite3_int64 user_id, field_cipher *fc, sqlite3_int64 *after, vault_row **cats, vault_row **rows);
+static int db_load_vault(sqlite3_int64 user_id, const unsigned char *key, vault *v);
+
+/* Password hashing pool */
+static void *kdf_run(void *arg);
+static kdf_job *kdf_job_new(void (*done)(client_ctx *, kdf_job *, reply_buf *), const char *const *args, int nargs);
+static void kdf_job_add(kdf_job *kj, int arg, const char *stored);
+static void kdf_job_free(kdf_job *kj);
+static void kdf_park(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static void kdf_finish(client_ctx *ctx, kdf_job *kj, reply_buf *response);
+static int kdf_release(kdf_job *kj);
+static void kdf_task_run(kdf_task *t);
+static int kdf_hash(const char *secret, char *out, unsigned char *kek);
+static int kdf_verify(const char *secret, const char *stored, int *upgrade, unsigned char *kek);
+static int kdf_derive(const char *secret, const unsigned char *salt, int log_n, int r, int p, unsigned char *key);
+static int kdf_cost_ok(int log_n, int r, int p);
 static unsigned long simple_hash(const char *str);
-static const char *ulong_to_str(unsigned long val);
+
+/* Encryption at rest */
+static int crypt_init(void);
+static int field_cipher_init(field_cipher *fc, const unsigned char *key, sqlite3_int64 user_id, int encrypt);
+static void field_cipher_free(field_cipher *fc);
+static void seal_aad(sqlite3_int64 user_id, int column, unsigned char *aad);
+static int seal(EVP_CIPHER_CTX *evp, const unsigned char *aad, const unsigned char *nonce, const void *plain, int len, unsigned char *out);
+static int unseal(EVP_CIPHER_CTX *evp, const unsigned char *aad, const unsigned char *in, int len, unsigned char *out);
+static const char *field_open(field_cipher *fc, int column, const unsigned char *in, int len);
+static const char *field_column(field_cipher *fc, sqlite3_stmt *res, int col, int column);
+static unsigned char *field_seal_items(const unsigned char *key, sqlite3_int64 user_id, const batch_item *items, int count, const unsigned char *status, blob_ref *blobs);
+static int data_key_wrap(const unsigned char *kek, int which, const unsigned char *key, unsigned char *wrapped);
+static int data_key_unwrap(const unsigned char *kek, int which, const unsigned char *wrapped, unsigned char *key);
+static int data_key_open(const credentials *cred, const kdf_task *t, int which, unsigned char *key);
 
 /* Util function for password check */
-static int evaluate_password_strength(const char *pass, char *response);
+static int evaluate_password_strength(client_ctx *ctx, const char *pass, reply_buf *response);
+static int parse_page(const char *limit_str, const char *cursor_str, int *limit, sqlite3_int64 *after_id);
 
-int main()
+int main(int argc, char *argv[])
 {
-    if (init_db("PasswordManager.db") != SQLITE_OK)
+    int workers = DEFAULT_WORKERS;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    int cache_mb = DEFAULT_CACHE_MB;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int kdf_threads = cores > 0 ? (int)cores : 1;
+    int opt;
+
+    int admin_port = DEFAULT_ADMIN_PORT;
+    const char *cert_file = NULL, *key_file = NULL;
+    while ((opt = getopt(argc, argv, "w:q:c:k:s:t:r:a:T:K:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'c':
+            cache_mb = atoi(optarg);
+            break;
+        case 'k':
+            kdf_threads = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%d,%d,%d", &kdf_log_n, &kdf_r, &kdf_p) != 3)
+            {
+                kdf_log_n = 0;
+            }
+            break;
+        case 't':
+            session_ttl = atoi(optarg);
+            break;
+        case 'r':
+            tombstone_ttl = atoi(optarg);
+            break;
+        case 'a':
+            admin_port = atoi(optarg);
+            break;
+        case 'T':
+            cert_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w workers] [-q queue_depth] [-c cache_mb] [-k kdf_threads] [-s log2_N,r,p] [-t session_ttl_sec] [-r tombstone_ttl_sec] [-a admin_port, 0 for none] [-T cert.pem [-K key.pem]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (workers <= 0 || queue_depth <= 0 || cache_mb < 0 || kdf_threads <= 0 || session_ttl <= 0 || tombstone_ttl <= 0)
+    {
+        fprintf(stderr, "Worker count, queue depth and TTLs must be positive.\n");
+        return 1;
+    }
+    if (!kdf_cost_ok(kdf_log_n, kdf_r, kdf_p))
+    {
+        fprintf(stderr, "scrypt cost must be log2_N,r,p with 128*r*N within %llu MiB.\n", KDF_MAX_MEM >> 20);
+        return 1;
+    }
+    vault_cache_init((size_t)cache_mb << 20);
+    session_init();
+    watch_init();
+    commands_init();
+    if (crypt_init() != 0)
+    {
+        fprintf(stderr, "AES-256-GCM is not available from OpenSSL.\n");
+        return 1;
+    }
+    if (cert_file && tls_init(cert_file, key_file ? key_file : cert_file) != 0)
+    {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "TLS setup from %s failed.\n", cert_file);
+        return 1;
+    }
+
+    if (init_db(DB_NAME, workers) != SQLITE_OK)
     {
         fprintf(stderr, "Database initialization failed.\n");
         return 1;
     }
 
-    struct sockaddr_in server_addr, client_addr;
-    int sd;
+    struct sockaddr_in server_addr;
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    if (job_queue_init(&jobs, queue_depth) != 0 || job_queue_init(&kdf_jobs, KDF_QUEUE_DEPTH) != 0)
+    {
+        perror("Job queue init error.\n");
+        return errno;
+    }
+
+    pthread_t tid;
+    for (int i = 0; i < workers; ++i)
+    {
+        pthread_create(&tid, NULL, worker_run, NULL);
+    }
+    for (int i = 0; i < kdf_threads; ++i)
+    {
+        pthread_create(&tid, NULL, kdf_run, NULL);
+    }
+    pthread_create(&tid, NULL, pool_stats_run, NULL);
+    pthread_create(&tid, NULL, vault_cache_run, NULL);
+    pthread_create(&tid, NULL, session_run, NULL);
+    pthread_create(&tid, NULL, db_compact_run, NULL);
+    if (admin_port > 0)
+    {
+        int admin_fd = admin_listen(admin_port);
+        if (admin_fd < 0)
+        {
+            perror("Admin port error.\n");
+            return errno;
+        }
+        pthread_create(&tid, NULL, admin_run, (void *)(intptr_t)admin_fd);
+        printf("Metrics on http://127.0.0.1:%d/metrics\n", admin_port);
+    }
 
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
     {
         perror("Server socket error.\n");
         return errno;
     }
 
-    int opt = 1;
-    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     server_addr.sin_port = htons(SERVER_PORT);
 
-    if (bind(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
     {
         perror("Bind error.\n");
         return errno;
     }
 
-    if (listen(sd, 10) == -1)
+    if (listen(listen_fd, SOMAXCONN) == -1)
     {
         perror("Listen error.\n");
         return errno;
     }
 
-    printf("PasswordManager Server running on port %d...\n", SERVER_PORT);
+    int nloops = cores > 0 ? (int)cores : 1;
+    event_loop *loops = calloc(nloops, sizeof(event_loop));
 
-    int i = 0;
-    pthread_t threads[100];
+    for (int i = 0; i < nloops; ++i)
+    {
+        loops[i].id = i;
+        if (event_loop_init(&loops[i]) != 0)
+        {
+            perror("Event loop init error.\n");
+            return errno;
+        }
+    }
+
+    printf("PasswordManager Server running on port %d with %d event loop(s), %d worker(s), queue depth %d...\n",
+           SERVER_PORT, nloops, workers, queue_depth);
+    printf("Password hashing: %d thread(s), scrypt ln=%d r=%d p=%d\n", kdf_threads, kdf_log_n, kdf_r, kdf_p);
+    if (tls_ctx)
+    {
+        printf("TLS 1.3 with session tickets, kernel TLS where the kernel offers it\n");
+    }
+
+    for (int i = 1; i < nloops; ++i)
+    {
+        pthread_create(&loops[i].thread, NULL, event_loop_run, &loops[i]);
+    }
+    event_loop_run(&loops[0]);
+
+    close(listen_fd);
+    return 0;
+}
+
+/* Lets one process hold as many client sockets as the hard limit allows */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Worker pool */
+
+static int job_queue_init(job_queue *q, int depth)
+{
+    size_t cap = 2;
+    while (cap < (size_t)depth)
+    {
+        cap <<= 1;
+    }
+
+    q->cells = calloc(cap, sizeof(job_cell));
+    if (q->cells == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < cap; ++i)
+    {
+        atomic_store_explicit(&q->cells[i].seq, i, memory_order_relaxed);
+    }
+    q->mask = cap - 1;
+    atomic_store(&q->enqueue_pos, 0);
+    atomic_store(&q->dequeue_pos, 0);
+    return sem_init(&q->ready, 0, 0);
+}
+
+/* Never blocks; returns -1 when the ring is full */
+static int job_queue_push(job_queue *q, const job *j)
+{
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    job_cell *cell;
 
     while (1)
     {
-        socklen_t c_len = sizeof(client_addr);
-        int client_fd = accept(sd, (struct sockaddr *)&client_addr, &c_len);
-        if (client_fd < 0)
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
         {
-            perror("Accept error.\n");
-            continue;
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return -1;
         }
+        else
+        {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
 
-        client_ctx *ctx = (client_ctx *)malloc(sizeof(client_ctx));
-        ctx->thread_id = i++;
-        ctx->client_fd = client_fd;
-        ctx->active_user[0] = '\0';
+    cell->value = *j;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    sem_post(&q->ready);
+    return 0;
+}
 
-        pthread_create(&threads[i], NULL, client_handler, (void *)ctx);
+/* Sleeps on the semaphore until a job has been published, then claims it */
+static void job_queue_pop(job_queue *q, job *j)
+{
+    while (sem_wait(&q->ready) != 0)
+    {
     }
 
-    close(sd);
-    return 0;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    job_cell *cell;
+
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else
+        {
+            /* A producer claimed this slot but has not published it yet */
+            if (diff < 0)
+            {
+                sched_yield();
+            }
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *j = cell->value;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+}
+
+static void *worker_run(void *arg)
+{
+    (void)arg;
+    job j;
+
+    while (1)
+    {
+        job_queue_pop(&jobs, &j);
+        pool_stats_record(&stats, j.enqueued_ns);
+        conn_run_commands(j.ctx);
+    }
+    return NULL;
 }
 
-static void *client_handler(void *arg)
+static void pool_stats_record(pool_stats *s, uint64_t enqueued_ns)
 {
-    client_ctx *ctx = (client_ctx *)arg;
-    pthread_detach(pthread_self());
+    unsigned long long waited = now_ns() - enqueued_ns;
+    atomic_fetch_add_explicit(&s->jobs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->wait_ns_total, waited, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&s->wait_ns_max, memory_order_relaxed);
+    while (waited > max && !atomic_compare_exchange_weak_explicit(&s->wait_ns_max, &max, waited, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
 
-    char buffer[4096];
+static void *pool_stats_run(void *arg)
+{
+    (void)arg;
+    unsigned long last_jobs = 0;
 
     while (1)
     {
-        int rbytes = read(ctx->client_fd, buffer, sizeof(buffer) - 1);
-        if (rbytes <= 0)
+        sleep(STATS_INTERVAL_SEC);
+
+        unsigned long done = atomic_load_explicit(&stats.jobs, memory_order_relaxed);
+        if (done == last_jobs)
         {
-            perror("Client read error.\n");
-            break;
+            continue;
+        }
+        unsigned long long total = atomic_load_explicit(&stats.wait_ns_total, memory_order_relaxed);
+        printf("[Pool] jobs=%lu rejected=%lu avg_wait_us=%.1f max_wait_us=%.1f\n",
+               done,
+               atomic_load_explicit(&stats.rejected, memory_order_relaxed),
+               total / 1000.0 / done,
+               atomic_load_explicit(&stats.wait_ns_max, memory_order_relaxed) / 1000.0);
+
+        unsigned long hashed = atomic_load_explicit(&kdf_stats.jobs, memory_order_relaxed);
+        if (hashed > 0)
+        {
+            printf("[KDF] jobs=%lu rejected=%lu avg_wait_us=%.1f max_wait_us=%.1f\n",
+                   hashed,
+                   atomic_load_explicit(&kdf_stats.rejected, memory_order_relaxed),
+                   atomic_load_explicit(&kdf_stats.wait_ns_total, memory_order_relaxed) / 1000.0 / hashed,
+                   atomic_load_explicit(&kdf_stats.wait_ns_max, memory_order_relaxed) / 1000.0);
+        }
+
+        size_t cached = 0;
+        for (int i = 0; i < VAULT_SHARDS; ++i)
+        {
+            pthread_mutex_lock(&vault_shards[i].lock);
+            cached += vault_shards[i].bytes;
+            pthread_mutex_unlock(&vault_shards[i].lock);
+        }
+        printf("[Cache] hits=%lu misses=%lu evictions=%lu bytes=%zu\n",
+               atomic_load_explicit(&cache_hits, memory_order_relaxed),
+               atomic_load_explicit(&cache_misses, memory_order_relaxed),
+               atomic_load_explicit(&cache_evictions, memory_order_relaxed),
+               cached);
+        fflush(stdout);
+        last_jobs = done;
+    }
+    return NULL;
+}
+
+/* Runs every command buffered on ctx, then gives the connection back to its loop. Once the client is
+   STREAM_HIGH_WATER behind, the rest waits for it to read: the connection stays busy and stalled, and the loop
+   requeues it on EPOLLOUT */
+static void conn_run_commands(client_ctx *ctx)
+{
+    reply_buf *response = &ctx->reply;
+    char *cmd = NULL;
+    size_t len;
+    kdf_job *parked;
+
+resume:
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->kdf || ctx->stream ||
+           (ctx->out_len <= STREAM_HIGH_WATER && (cmd = conn_take_command(ctx, &len)) != NULL))
+    {
+        stream_job *sj = ctx->stream;
+        int dropped = sj && ctx->closing;
+        ctx->stream = NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        int exit_req = 0;
+        kdf_job *kj = ctx->kdf;
+        if (kj)
+        {
+            /* The hash the last command parked on is ready */
+            ctx->kdf = NULL;
+            kdf_finish(ctx, kj, response);
+        }
+        else if (dropped)
+        {
+            /* Nobody is left to read the rest */
+            free(sj);
+        }
+        else if (sj)
+        {
+            stream_job_run(ctx, sj);
+        }
+        else if ((exit_req = strcmp(cmd, "EXIT") == 0))
+        {
+            printf("[Client %d] Client requested disconnect.\n", ctx->conn_id);
+        }
+        else
+        {
+            reply_open(response);
+            process_command(ctx, cmd, len, response);
         }
-        buffer[rbytes] = '\0';
+        cmd = NULL;
 
-        if (strcmp(buffer, "EXIT") == 0)
+        pthread_mutex_lock(&ctx->lock);
+        if (exit_req)
+        {
+            ctx->closing = 1;
+            break;
+        }
+        if (ctx->kdf || ctx->stream)
         {
-            printf("[Thread %d] Client requested disconnect.\n", ctx->thread_id);
+            /* Later commands wait behind the parked one so replies stay in order */
             break;
         }
+        /* Streamed replies closed their last frame already */
+        reply_close(response, 0);
+    }
 
-        char response[4096];
-        response[0] = '\0';
+    /* Replies to every pipelined frame in this batch go out in one write, with any push the loop held back;
+       a push never goes out in the middle of a stream */
+    if (conn_queue_reply(ctx) != 0 || (!ctx->stream && conn_push_change(ctx) != 0) || conn_flush(ctx) != 0)
+    {
+        ctx->closing = 1;
+    }
+
+    /* A closing, parked or stalled connection stays busy so only the reap path or the resumed command can release it */
+    int closing = ctx->closing;
+    parked = ctx->kdf;
+    int more = !closing && !parked && (ctx->stream || ctx->run_off < ctx->run_len || conn_peek_frame(ctx) > 0);
+    if (more && ctx->out_len <= STREAM_LOW_WATER)
+    {
+        pthread_mutex_unlock(&ctx->lock);
+        goto resume;
+    }
+    ctx->stalled = more;
+    if (!closing && !parked && !more)
+    {
+        ctx->busy = 0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (parked)
+    {
+        if (kdf_release(parked))
+        {
+            goto resume;
+        }
+        return;
+    }
+    if (closing)
+    {
+        event_loop_reap(ctx->loop, ctx);
+    }
+}
+
+static void conn_login(client_ctx *ctx, const char *username, sqlite3_int64 user_id, const unsigned char *data_key)
+{
+    strncpy(ctx->active_user, username, sizeof(ctx->active_user) - 1);
+    ctx->active_user[sizeof(ctx->active_user) - 1] = '\0';
+    ctx->user_id = user_id;
+    memcpy(ctx->data_key, data_key, DATA_KEY_LEN);
+}
+
+/* Event loops */
+
+static int event_loop_init(event_loop *loop)
+{
+    loop->epfd = epoll_create1(0);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epfd == -1 || loop->wake_fd == -1)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&loop->reap_lock, NULL);
+    loop->reap_list = NULL;
+    loop->resume_list = NULL;
+    atomic_init(&loop->notify_list, NULL);
+
+    /* Every loop watches the listener; EPOLLEXCLUSIVE wakes only one of them per connection */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+    {
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+}
+
+static void *event_loop_run(void *arg)
+{
+    event_loop *loop = (event_loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int waiting = 0; /* connections on resume_list, retried every RESUME_RETRY_MS */
+
+    while (1)
+    {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, waiting ? RESUME_RETRY_MS : -1);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("Epoll wait error.\n");
+            }
+            continue;
+        }
+
+        int woken = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL)
+            {
+                event_loop_accept(loop);
+                continue;
+            }
+            if (ptr == loop)
+            {
+                woken = 1;
+                continue;
+            }
+
+            client_ctx *ctx = (client_ctx *)ptr;
+            int close_now = 0;
+            /* A handshake can stall on either direction; tls_ready is only written by this thread */
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || (ctx->tls && !ctx->tls_ready))
+            {
+                close_now = conn_on_readable(ctx);
+            }
+            if (!close_now && (events[i].events & EPOLLOUT))
+            {
+                pthread_mutex_lock(&ctx->lock);
+                if (conn_flush(ctx) != 0)
+                {
+                    ctx->closing = 1;
+                }
+                /* The client caught up with a stalled connection, so a worker carries on with it */
+                int resume = ctx->stalled && !ctx->closing && ctx->out_len <= STREAM_LOW_WATER;
+                if (resume)
+                {
+                    ctx->stalled = 0;
+                }
+                close_now = ctx->closing && (!ctx->busy || ctx->stalled);
+                pthread_mutex_unlock(&ctx->lock);
+                if (resume)
+                {
+                    event_loop_resume(loop, ctx);
+                }
+            }
+            if (close_now)
+            {
+                conn_close(ctx);
+            }
+        }
+
+        /* Reaped connections are freed only after the batch that may still reference them */
+        if (woken)
+        {
+            event_loop_drain_reaps(loop);
+            event_loop_drain_notify(loop);
+        }
+        if (woken || waiting)
+        {
+            waiting = event_loop_drain_resumes(loop);
+        }
+    }
+    return NULL;
+}
+
+static void event_loop_accept(event_loop *loop)
+{
+    while (1)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t c_len = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &c_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Accept error.\n");
+            }
+            return;
+        }
+
+        /* Streamed replies end with a short frame that Nagle would hold back until the client's delayed ACK */
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        client_ctx *ctx = (client_ctx *)calloc(1, sizeof(client_ctx));
+        ctx->conn_id = __atomic_fetch_add(&next_conn_id, 1, __ATOMIC_RELAXED);
+        ctx->client_fd = client_fd;
+        ctx->loop = loop;
+        ctx->active_user[0] = '\0';
+        ctx->loopback = (ntohl(client_addr.sin_addr.s_addr) >> 24) == 127;
+        pthread_mutex_init(&ctx->lock, NULL);
+        atomic_fetch_add_explicit(&open_conns, 1, memory_order_relaxed);
+        if (tls_ctx && ((ctx->tls = SSL_new(tls_ctx)) == NULL || SSL_set_fd(ctx->tls, client_fd) != 1))
+        {
+            conn_close(ctx);
+            continue;
+        }
+        if (ctx->tls)
+        {
+            SSL_set_accept_state(ctx->tls);
+        }
+
+        /* Edge-triggered: the connection is drained fully on every wakeup */
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = ctx;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_fd, &ev) == -1)
+        {
+            perror("Epoll add error.\n");
+            conn_close(ctx);
+        }
+    }
+}
+
+/* Called by workers: hands a finished connection back to its loop for closing */
+static void event_loop_reap(event_loop *loop, client_ctx *ctx)
+{
+    pthread_mutex_lock(&loop->reap_lock);
+    ctx->reap_next = loop->reap_list;
+    loop->reap_list = ctx;
+    pthread_mutex_unlock(&loop->reap_lock);
+
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0)
+    {
+        perror("Event loop wake error.\n");
+    }
+}
+
+static void event_loop_drain_reaps(event_loop *loop)
+{
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("Event loop wake error.\n");
+    }
+
+    pthread_mutex_lock(&loop->reap_lock);
+    client_ctx *ctx = loop->reap_list;
+    loop->reap_list = NULL;
+    pthread_mutex_unlock(&loop->reap_lock);
+
+    while (ctx)
+    {
+        client_ctx *next = ctx->reap_next;
+        conn_close(ctx);
+        ctx = next;
+    }
+}
+
+/* Hands a connection that is still busy back to the worker pool; one the full queue turns away waits on the loop's
+   resume_list instead of running here. Safe to call from any thread */
+static void event_loop_resume(event_loop *loop, client_ctx *ctx)
+{
+    job j = {ctx, now_ns()};
+    if (job_queue_push(&jobs, &j) == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&loop->reap_lock);
+    ctx->resume_next = loop->resume_list;
+    loop->resume_list = ctx;
+    pthread_mutex_unlock(&loop->reap_lock);
+
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0)
+    {
+        perror("Event loop wake error.\n");
+    }
+}
+
+/* Retries the connections waiting for room in the job queue; returns 1 while some still wait */
+static int event_loop_drain_resumes(event_loop *loop)
+{
+    pthread_mutex_lock(&loop->reap_lock);
+    client_ctx *ctx = loop->resume_list;
+    loop->resume_list = NULL;
+    pthread_mutex_unlock(&loop->reap_lock);
+
+    client_ctx *left = NULL, *last = NULL;
+    while (ctx)
+    {
+        client_ctx *next = ctx->resume_next;
+        job j = {ctx, now_ns()};
+        if (job_queue_push(&jobs, &j) != 0)
+        {
+            ctx->resume_next = left;
+            left = ctx;
+            last = last ? last : ctx;
+        }
+        ctx = next;
+    }
+
+    pthread_mutex_lock(&loop->reap_lock);
+    if (left)
+    {
+        last->resume_next = loop->resume_list;
+        loop->resume_list = left;
+    }
+    int waiting = loop->resume_list != NULL;
+    pthread_mutex_unlock(&loop->reap_lock);
+    return waiting;
+}
+
+/* Commit thread: queues a watcher on its loop without a lock; only the push that finds the list empty wakes the loop,
+   since the loop reads wake_fd before it takes the list */
+static void event_loop_notify(event_loop *loop, client_ctx *ctx)
+{
+    client_ctx *head = atomic_load_explicit(&loop->notify_list, memory_order_relaxed);
+    do
+    {
+        ctx->notify_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&loop->notify_list, &head, ctx, memory_order_release, memory_order_relaxed));
+
+    uint64_t one = 1;
+    if (head == NULL && write(loop->wake_fd, &one, sizeof(one)) < 0)
+    {
+        perror("Event loop wake error.\n");
+    }
+}
+
+/* Pushes the revisions queued for this loop's watchers; one a worker holds is pushed when the worker lets go */
+static void event_loop_drain_notify(event_loop *loop)
+{
+    client_ctx *ctx = atomic_exchange_explicit(&loop->notify_list, NULL, memory_order_acquire);
+    while (ctx)
+    {
+        client_ctx *next = ctx->notify_next;
+        /* Cleared before watch_rev is read, so a commit landing from here on queues ctx again */
+        atomic_exchange_explicit(&ctx->watch_queued, 0, memory_order_acq_rel);
+
+        /* A connection already closing is left to whoever marked it */
+        pthread_mutex_lock(&ctx->lock);
+        int close_now = 0;
+        if (!ctx->busy && !ctx->closing && (conn_push_change(ctx) != 0 || conn_flush(ctx) != 0))
+        {
+            ctx->closing = close_now = 1;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        if (close_now)
+        {
+            conn_close(ctx);
+        }
+        ctx = next;
+    }
+}
+
+/* Connection I/O */
+
+/* Grows *buf so it can hold need bytes; a NULL buffer is allocated on first use */
+static int buf_reserve(char **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap)
+    {
+        return 0;
+    }
+    size_t ncap = *cap ? *cap : READ_CHUNK;
+    while (ncap < need)
+    {
+        ncap *= 2;
+    }
+    char *nbuf = realloc(*buf, ncap);
+    if (nbuf == NULL)
+    {
+        return -1;
+    }
+    *buf = nbuf;
+    *cap = ncap;
+    return 0;
+}
+
+/* Drains the socket and queues complete frames for a worker; returns 1 when the loop should close ctx */
+static int conn_on_readable(client_ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (conn_read_available(ctx) != 0)
+    {
+        ctx->closing = 1;
+    }
+
+    long frame = conn_peek_frame(ctx);
+    if (frame < 0 && !ctx->closing)
+    {
+        conn_queue_frame(ctx, OVERSIZE_REPLY, strlen(OVERSIZE_REPLY), 0);
+        conn_flush(ctx);
+        ctx->closing = 1;
+    }
+
+    int dispatch = !ctx->busy && !ctx->closing && frame > 0;
+    if (dispatch)
+    {
+        ctx->busy = 1;
+    }
+    int close_now = ctx->closing && (!ctx->busy || ctx->stalled);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!dispatch)
+    {
+        return close_now;
+    }
+
+    job j = {ctx, now_ns()};
+    if (job_queue_push(&jobs, &j) == 0)
+    {
+        return 0;
+    }
+
+    /* Backpressure: the pool is saturated, so refuse the request instead of queueing more */
+    atomic_fetch_add_explicit(&stats.rejected, 1, memory_order_relaxed);
+    pthread_mutex_lock(&ctx->lock);
+    char *cmd;
+    size_t len;
+    while ((cmd = conn_take_command(ctx, &len)) != NULL)
+    {
+        char busy[16];
+        size_t busy_len = strlen(BUSY_REPLY);
+        if (ctx->binary)
+        {
+            const unsigned char *p = (const unsigned char *)cmd + 1;
+            uint64_t req_id = 0;
+            if (len > 0)
+            {
+                varint_get(&p, (const unsigned char *)cmd + len, &req_id);
+            }
+            busy_len = encode_status(busy, req_id, ST_BUSY);
+        }
+        if (conn_queue_frame(ctx, ctx->binary ? busy : BUSY_REPLY, busy_len, 0) != 0)
+        {
+            ctx->closing = 1;
+            break;
+        }
+    }
+    if (conn_flush(ctx) != 0)
+    {
+        ctx->closing = 1;
+    }
+    ctx->busy = 0;
+    close_now = ctx->closing;
+    pthread_mutex_unlock(&ctx->lock);
+    return close_now;
+}
+
+/* Reads until EAGAIN; returns 1 on EOF or a socket error. Caller holds ctx->lock */
+static int conn_read_available(client_ctx *ctx)
+{
+    if (ctx->tls && !ctx->tls_ready)
+    {
+        int rc = conn_tls_handshake(ctx);
+        if (rc != 0 || !ctx->tls_ready)
+        {
+            return rc;
+        }
+    }
+    while (1)
+    {
+        /* A client that outruns its workers this far is not pipelining, it is flooding */
+        if (ctx->in_len > MAX_INPUT_BUFFERED ||
+            buf_reserve(&ctx->in, &ctx->in_cap, ctx->in_len + READ_CHUNK) != 0)
+        {
+            return 1;
+        }
+        ssize_t rbytes = conn_recv(ctx, ctx->in + ctx->in_len, ctx->in_cap - ctx->in_len);
+        if (rbytes > 0)
+        {
+            ctx->in_len += rbytes;
+            continue;
+        }
+        if (rbytes == 0)
+        {
+            return 1;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        perror("Client read error.\n");
+        return 1;
+    }
+}
+
+/* Size of the complete frame at p, 0 if it is still partial, -1 if oversized */
+static long frame_size(const char *p, size_t avail)
+{
+    if (avail < FRAME_HEADER_LEN)
+    {
+        return 0;
+    }
+
+    uint32_t len;
+    memcpy(&len, p, sizeof(len));
+    len = ntohl(len);
+    if (len > MAX_FRAME_LEN)
+    {
+        return -1;
+    }
+    return avail - FRAME_HEADER_LEN >= len ? (long)(FRAME_HEADER_LEN + len) : 0;
+}
+
+/* Size of the complete frame at the head of the unread input */
+static long conn_peek_frame(const client_ctx *ctx)
+{
+    return frame_size(ctx->in, ctx->in_len);
+}
+
+/* Hands the complete frames read so far to the worker: in and run trade places, and the partial frame behind them
+   is copied to the head of the new in. Returns -1 when there is nothing to take. Caller holds ctx->lock */
+static int conn_swap_input(client_ctx *ctx)
+{
+    size_t end = 0;
+    long frame;
+    while ((frame = frame_size(ctx->in + end, ctx->in_len - end)) > 0)
+    {
+        end += frame;
+    }
+    /* The last command's terminator goes at end */
+    if (end == 0 || buf_reserve(&ctx->in, &ctx->in_cap, end + 1) != 0)
+    {
+        return -1;
+    }
+
+    size_t tail = ctx->in_len - end;
+    if (ctx->run_cap > INPUT_KEEP_MAX)
+    {
+        free(ctx->run);
+        ctx->run = NULL;
+        ctx->run_cap = 0;
+    }
+    if (buf_reserve(&ctx->run, &ctx->run_cap, tail + READ_CHUNK) != 0)
+    {
+        return -1;
+    }
+    memcpy(ctx->run, ctx->in + end, tail);
+
+    char *buf = ctx->run;
+    size_t cap = ctx->run_cap;
+    ctx->run = ctx->in;
+    ctx->run_cap = ctx->in_cap;
+    ctx->run_off = 0;
+    ctx->run_len = end;
+    ctx->in = buf;
+    ctx->in_cap = cap;
+    ctx->in_len = tail;
+    return 0;
+}
+
+/* Returns the next complete frame as a NUL-terminated command split in place, or NULL if none. The command stays
+   valid until the next call; only the worker holding busy may take commands. Caller holds ctx->lock */
+static char *conn_take_command(client_ctx *ctx, size_t *len)
+{
+    if (ctx->run_end)
+    {
+        ctx->run[ctx->run_end] = ctx->run_saved;
+        ctx->run_end = 0;
+    }
+    if (ctx->run_off == ctx->run_len && conn_swap_input(ctx) != 0)
+    {
+        return NULL;
+    }
+
+    uint32_t n;
+    memcpy(&n, ctx->run + ctx->run_off, sizeof(n));
+    *len = ntohl(n);
+    char *cmd = ctx->run + ctx->run_off + FRAME_HEADER_LEN;
+    ctx->run_off += FRAME_HEADER_LEN + *len;
+    ctx->run_end = ctx->run_off;
+    ctx->run_saved = ctx->run[ctx->run_end];
+    cmd[*len] = '\0';
+    return cmd;
+}
+
+/* Copies data behind the queued output, for the short replies sent outside a worker's reply_buf */
+static int conn_queue_output(client_ctx *ctx, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        reply_chunk *c = ctx->out_tail;
+        if (c == NULL || c->len == c->cap)
+        {
+            if ((c = chunk_get(len)) == NULL)
+            {
+                return -1;
+            }
+            if (ctx->out_tail)
+            {
+                ctx->out_tail->next = c;
+            }
+            else
+            {
+                ctx->out_head = c;
+            }
+            ctx->out_tail = c;
+        }
+        size_t n = c->cap - c->len < len ? c->cap - c->len : len;
+        memcpy(c->data + c->len, data, n);
+        c->len += n;
+        ctx->out_len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int conn_queue_frame(client_ctx *ctx, const char *data, size_t len, uint32_t flags)
+{
+    uint32_t header = htonl((uint32_t)len | flags);
+    if (conn_queue_output(ctx, (const char *)&header, FRAME_HEADER_LEN) != 0)
+    {
+        return -1;
+    }
+    return conn_queue_output(ctx, data, len);
+}
+
+/* Moves every closed frame of the worker's reply_buf to the output queue without copying. Caller holds ctx->lock */
+static int conn_queue_reply(client_ctx *ctx)
+{
+    reply_buf *rb = &ctx->reply;
+    reply_chunk *keep = NULL;
+    if (rb->failed)
+    {
+        reply_discard(rb);
+        return -1;
+    }
+    if (rb->head == NULL)
+    {
+        return 0;
+    }
+
+    if (rb->open)
+    {
+        /* A parked command has started its reply: that much is copied to a chunk that stays behind */
+        size_t n = FRAME_HEADER_LEN + rb->frame_len;
+        if ((keep = chunk_get(n)) == NULL)
+        {
+            reply_discard(rb);
+            return -1;
+        }
+        size_t off = rb->frame_off;
+        for (reply_chunk *c = rb->frame; c; c = c->next, off = 0)
+        {
+            memcpy(keep->data + keep->len, c->data + off, c->len - off);
+            keep->len += c->len - off;
+        }
+        chunk_put(rb->frame->next);
+        rb->frame->next = NULL;
+        rb->frame->len = rb->frame_off;
+        rb->tail = rb->frame;
+    }
+
+    /* Small replies behind unsent output are copied into its last chunk rather than queued a chunk each */
+    reply_chunk *tail = ctx->out_tail;
+    if (keep == NULL && rb->head == rb->tail && tail && rb->head->len <= REPLY_COPY_MAX &&
+        rb->head->len <= tail->cap - tail->len)
+    {
+        memcpy(tail->data + tail->len, rb->head->data, rb->head->len);
+        tail->len += rb->head->len;
+        ctx->out_len += rb->head->len;
+        rb->head->len = 0;
+        return 0;
+    }
+
+    for (reply_chunk *c = rb->head; c; c = c->next)
+    {
+        ctx->out_len += c->len;
+    }
+    if (ctx->out_tail)
+    {
+        ctx->out_tail->next = rb->head;
+    }
+    else
+    {
+        ctx->out_head = rb->head;
+    }
+    ctx->out_tail = rb->tail;
+
+    rb->head = rb->tail = rb->frame = keep;
+    rb->frame_off = 0;
+    return 0;
+}
+
+/* Queues the newest revision the commit thread left for a watcher as one push frame. Caller holds ctx->lock,
+   and no reply may be part way out, since a push must not split a streamed reply */
+static int conn_push_change(client_ctx *ctx)
+{
+    if (atomic_load_explicit(&ctx->watch_rev, memory_order_relaxed) == 0)
+    {
+        return 0;
+    }
+    sqlite3_int64 revision = atomic_exchange_explicit(&ctx->watch_rev, 0, memory_order_relaxed);
+    if (revision == 0)
+    {
+        return 0;
+    }
+
+    char buf[128];
+    size_t len;
+    if (ctx->binary)
+    {
+        len = encode_push(buf, sizeof(buf), ST_VAULT_CHANGED, (long long)revision);
+    }
+    else
+    {
+        len = snprintf(buf, sizeof(buf), reply_defs[ST_VAULT_CHANGED].text, (long long)revision);
+    }
+    atomic_fetch_add_explicit(&watch_pushes, 1, memory_order_relaxed);
+    return conn_queue_frame(ctx, buf, len, FRAME_PUSH);
+}
+
+/* Drops n sent bytes from the front of the output queue and recycles the chunks they emptied */
+static void conn_consume(client_ctx *ctx, size_t n)
+{
+    reply_chunk *done = NULL, **done_tail = &done;
+    ctx->out_len -= n;
+    while (ctx->out_head && ctx->out_off + n >= ctx->out_head->len)
+    {
+        reply_chunk *c = ctx->out_head;
+        n -= c->len - ctx->out_off;
+        ctx->out_off = 0;
+        ctx->out_head = c->next;
+        c->next = NULL;
+        *done_tail = c;
+        done_tail = &c->next;
+    }
+    if (ctx->out_head == NULL)
+    {
+        ctx->out_tail = NULL;
+    }
+    ctx->out_off += n;
+    chunk_put(done);
+}
+
+/* Writes as much pending output as the socket takes, a batch of chunks per call; the rest waits for EPOLLOUT */
+static int conn_flush(client_ctx *ctx)
+{
+    conn_consume(ctx, 0);
+    while (ctx->out_head)
+    {
+        struct iovec iov[FLUSH_IOV];
+        int n = 0;
+        size_t off = ctx->out_off;
+        for (reply_chunk *c = ctx->out_head; c && n < FLUSH_IOV; c = c->next, off = 0)
+        {
+            if (c->len > off)
+            {
+                iov[n].iov_base = c->data + off;
+                iov[n].iov_len = c->len - off;
+                n++;
+            }
+        }
+        ssize_t wbytes = conn_sendv(ctx, iov, n);
+        if (wbytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        conn_consume(ctx, wbytes);
+    }
+    return 0;
+}
+
+static void conn_close(client_ctx *ctx)
+{
+    /* Once unregistered the commit thread cannot queue ctx again; if it is queued, the list is drained before ctx goes */
+    watch_remove(ctx);
+    if (atomic_load(&ctx->watch_queued))
+    {
+        event_loop_drain_notify(ctx->loop);
+    }
+    if (ctx->user_id)
+    {
+        vault_cache_logout(ctx->user_id);
+    }
+    if (ctx->tls)
+    {
+        /* Best effort close_notify; the socket is non-blocking and about to close anyway */
+        if (ctx->tls_ready)
+        {
+            ERR_clear_error();
+            SSL_shutdown(ctx->tls);
+        }
+        SSL_free(ctx->tls);
+    }
+    close(ctx->client_fd);
+    pthread_mutex_destroy(&ctx->lock);
+    if (ctx->import)
+    {
+        free(ctx->import->carry);
+        free(ctx->import);
+    }
+    free(ctx->in);
+    free(ctx->run);
+    free(ctx->stream);
+    chunk_put(ctx->out_head);
+    reply_discard(&ctx->reply);
+    OPENSSL_cleanse(ctx->data_key, DATA_KEY_LEN);
+    free(ctx);
+    atomic_fetch_sub_explicit(&open_conns, 1, memory_order_relaxed);
+}
+
+/* TLS */
+
+static int tls_init(const char *cert_file, const char *key_file)
+{
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL || SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION) != 1 ||
+        SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls_ctx) != 1)
+    {
+        return 1;
+    }
+
+    /* Bytes queued behind a write that would block are offered again with more appended;
+       idle connections give their TLS record buffers back */
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    /* Clients that just close, as client.c does on EXIT, read as EOF rather than an error.
+       With kTLS the kernel encrypts records, so long listings and exports go out without a user-space copy */
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_ENABLE_KTLS);
+    /* Stateless tickets, one per handshake: a reconnecting client presents it and skips the certificate exchange */
+    SSL_CTX_set_num_tickets(tls_ctx, 1);
+    SSL_CTX_set_timeout(tls_ctx, session_ttl);
+    return 0;
+}
+
+/* Advances the handshake; 0 while it is pending or done (tls_ready), 1 if it failed. Caller holds ctx->lock */
+static int conn_tls_handshake(client_ctx *ctx)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ctx->tls);
+    if (ret != 1)
+    {
+        return tls_io_result(ctx->tls, ret) < 0 && errno == EAGAIN ? 0 : 1;
+    }
+
+    ctx->tls_ready = 1;
+    atomic_fetch_add_explicit(&tls_handshakes, 1, memory_order_relaxed);
+    if (SSL_session_reused(ctx->tls))
+    {
+        atomic_fetch_add_explicit(&tls_resumed, 1, memory_order_relaxed);
+    }
+    if (BIO_get_ktls_send(SSL_get_wbio(ctx->tls)))
+    {
+        atomic_fetch_add_explicit(&tls_ktls, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+/* read() or SSL_read(): bytes read, 0 at EOF, or -1 with errno set (EAGAIN when TLS waits on the socket) */
+static ssize_t conn_recv(client_ctx *ctx, char *buf, size_t len)
+{
+    if (ctx->tls == NULL)
+    {
+        return read(ctx->client_fd, buf, len);
+    }
+    size_t n;
+    ERR_clear_error();
+    int ret = SSL_read_ex(ctx->tls, buf, len, &n);
+    return ret == 1 ? (ssize_t)n : tls_io_result(ctx->tls, ret);
+}
+
+/* sendmsg() with the iovecs, or one SSL_write per iovec: bytes sent, or -1 with errno set when nothing was */
+static ssize_t conn_sendv(client_ctx *ctx, const struct iovec *iov, int n)
+{
+    if (ctx->tls == NULL)
+    {
+        struct msghdr msg = {.msg_iov = (struct iovec *)iov, .msg_iovlen = n};
+        return sendmsg(ctx->client_fd, &msg, MSG_NOSIGNAL);
+    }
+    size_t total = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        size_t sent;
+        ERR_clear_error();
+        int ret = SSL_write_ex(ctx->tls, iov[i].iov_base, iov[i].iov_len, &sent);
+        if (ret != 1)
+        {
+            ssize_t err = tls_io_result(ctx->tls, ret);
+            return total > 0 ? (ssize_t)total : err;
+        }
+        total += sent;
+        if (sent < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+    return total;
+}
+
+/* Maps a failed TLS call onto the read()/write() conventions the callers already handle */
+static ssize_t tls_io_result(SSL *ssl, int ret)
+{
+    switch (SSL_get_error(ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0)
+        {
+            return 0;
+        }
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/* Reply buffers */
+
+/* A chunk with room for need bytes: from the pool unless need is more than REPLY_CHUNK */
+static reply_chunk *chunk_get(size_t need)
+{
+    reply_chunk *c = NULL;
+    if (need <= REPLY_CHUNK)
+    {
+        pthread_mutex_lock(&chunk_pool.lock);
+        if ((c = chunk_pool.free) != NULL)
+        {
+            chunk_pool.free = c->next;
+            chunk_pool.count--;
+        }
+        pthread_mutex_unlock(&chunk_pool.lock);
+        need = REPLY_CHUNK;
+    }
+    if (c == NULL)
+    {
+        if ((c = malloc(sizeof(reply_chunk) + need)) == NULL)
+        {
+            return NULL;
+        }
+        c->cap = need;
+        atomic_fetch_add_explicit(&chunk_allocs, 1, memory_order_relaxed);
+    }
+    c->next = NULL;
+    c->len = 0;
+    return c;
+}
+
+/* Returns a list of chunks; the pool keeps up to REPLY_POOL_MAX and frees the rest */
+static void chunk_put(reply_chunk *list)
+{
+    reply_chunk *spare = NULL;
+    pthread_mutex_lock(&chunk_pool.lock);
+    while (list)
+    {
+        reply_chunk *c = list;
+        list = c->next;
+        if (c->cap == REPLY_CHUNK && chunk_pool.count < REPLY_POOL_MAX)
+        {
+            c->next = chunk_pool.free;
+            chunk_pool.free = c;
+            chunk_pool.count++;
+        }
+        else
+        {
+            c->next = spare;
+            spare = c;
+        }
+    }
+    pthread_mutex_unlock(&chunk_pool.lock);
+    while (spare)
+    {
+        reply_chunk *c = spare;
+        spare = c->next;
+        free(c);
+    }
+}
+
+/* Starts a frame; one that is already open is emptied instead, so a handler's last reply wins */
+static void reply_open(reply_buf *rb)
+{
+    if (rb->open)
+    {
+        chunk_put(rb->frame->next);
+        rb->frame->next = NULL;
+        rb->frame->len = rb->frame_off + FRAME_HEADER_LEN;
+        rb->tail = rb->frame;
+        rb->frame_len = 0;
+        return;
+    }
+    if (reply_reserve(rb, FRAME_HEADER_LEN) == NULL)
+    {
+        return;
+    }
+    rb->frame = rb->tail;
+    rb->frame_off = rb->tail->len;
+    rb->tail->len += FRAME_HEADER_LEN;
+    rb->frame_len = 0;
+    rb->open = 1;
+}
+
+/* Fills in the open frame's header now that its length is known */
+static void reply_close(reply_buf *rb, uint32_t flags)
+{
+    if (!rb->open)
+    {
+        return;
+    }
+    uint32_t header = htonl((uint32_t)rb->frame_len | flags);
+    memcpy(rb->frame->data + rb->frame_off, &header, FRAME_HEADER_LEN);
+    rb->open = 0;
+}
+
+/* n contiguous bytes at the end of the open frame, to be kept with reply_commit; NULL once out of memory */
+static char *reply_reserve(reply_buf *rb, size_t n)
+{
+    if (rb->failed)
+    {
+        return NULL;
+    }
+    if (rb->tail && rb->tail->cap - rb->tail->len >= n)
+    {
+        return rb->tail->data + rb->tail->len;
+    }
+    reply_chunk *c = chunk_get(n);
+    if (c == NULL)
+    {
+        rb->failed = 1;
+        return NULL;
+    }
+    if (rb->tail)
+    {
+        rb->tail->next = c;
+    }
+    else
+    {
+        rb->head = c;
+    }
+    rb->tail = c;
+    return c->data;
+}
+
+static void reply_commit(reply_buf *rb, size_t n)
+{
+    rb->tail->len += n;
+    rb->frame_len += n;
+}
+
+static void reply_append(reply_buf *rb, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        char *dst = reply_reserve(rb, 1);
+        if (dst == NULL)
+        {
+            return;
+        }
+        size_t n = rb->tail->cap - rb->tail->len;
+        n = n < len ? n : len;
+        memcpy(dst, p, n);
+        reply_commit(rb, n);
+        p += n;
+        len -= n;
+    }
+}
+
+/* Formats straight into the chunk; text that does not fit behind what is there moves to a fresh one */
+static void reply_vprintf(reply_buf *rb, const char *fmt, va_list ap)
+{
+    va_list again;
+    va_copy(again, ap);
+    char *dst = reply_reserve(rb, 1);
+    int n = dst ? vsnprintf(dst, rb->tail->cap - rb->tail->len, fmt, ap) : -1;
+    if (n >= 0 && (size_t)n >= rb->tail->cap - rb->tail->len)
+    {
+        dst = reply_reserve(rb, (size_t)n + 1);
+        n = dst ? vsnprintf(dst, (size_t)n + 1, fmt, again) : -1;
+    }
+    if (n > 0)
+    {
+        reply_commit(rb, n);
+    }
+    va_end(again);
+}
+
+/* The reply's values as typed items, then its STATUS */
+static void reply_encode(reply_buf *rb, enum reply_code code, va_list ap)
+{
+    /* Room for every value: tag and varint length around each string, tag, length and varint for numbers */
+    size_t bound = 64;
+    va_list sizes;
+    va_copy(sizes, ap);
+    for (const char *a = reply_defs[code].args; *a; ++a)
+    {
+        if (*a == 's')
+        {
+            bound += 11 + strlen(va_arg(sizes, const char *));
+        }
+        else
+        {
+            bound += 12;
+            if (*a == 'i')
+            {
+                (void)va_arg(sizes, int);
+            }
+            else if (*a == 'l')
+            {
+                (void)va_arg(sizes, long);
+            }
+            else
+            {
+                (void)va_arg(sizes, long long);
+            }
+        }
+    }
+    va_end(sizes);
+
+    unsigned char *p = (unsigned char *)reply_reserve(rb, bound);
+    if (p)
+    {
+        reply_commit(rb, encode_values(p, p + bound, code, ap) - p);
+    }
+}
+
+/* Gives every chunk back, open frame included */
+static void reply_discard(reply_buf *rb)
+{
+    chunk_put(rb->head);
+    memset(rb, 0, sizeof(*rb));
+}
+
+/* Streamed replies */
+
+/* Takes over the command's open frame, dropping anything the handler put in it */
+static void stream_begin(reply_stream *rs, client_ctx *ctx)
+{
+    rs->ctx = ctx;
+    rs->failed = 0;
+    rs->sent = 0;
+    rs->status_sent = 0;
+    rs->stalled = 0;
+    stream_head(rs);
+}
+
+/* An empty first frame; binary ones start with the request ID */
+static void stream_head(reply_stream *rs)
+{
+    reply_buf *rb = &rs->ctx->reply;
+    reply_open(rb);
+    rs->data_at = NULL;
+    unsigned char *p = (unsigned char *)reply_reserve(rb, 10);
+    if (rs->ctx->binary && p)
+    {
+        reply_commit(rb, varint_put(p, rs->ctx->req_id) - p);
+    }
+}
+
+/* Free-form output; binary replies carry it as DATA items */
+static void stream_append(reply_stream *rs, const char *data, size_t len)
+{
+    stream_copy(rs, data, len, rs->ctx->binary);
+}
+
+static void stream_copy(reply_stream *rs, const char *data, size_t len, int as_data)
+{
+    reply_buf *rb = &rs->ctx->reply;
+    while (len > 0)
+    {
+        if (as_data && rs->data_at == NULL)
+        {
+            stream_open_data(rs);
+        }
+        size_t room = rb->frame_len < STREAM_CHUNK ? STREAM_CHUNK - rb->frame_len : 0;
+        size_t n = len < room ? len : room;
+        reply_append(rb, data, n);
+        data += n;
+        len -= n;
+        if (rb->frame_len >= STREAM_CHUNK)
+        {
+            stream_flush(rs);
+        }
+    }
+}
+
+/* A DATA item's length is only known once its frame is sent, so room for the header is kept in front */
+static void stream_open_data(reply_stream *rs)
+{
+    reply_buf *rb = &rs->ctx->reply;
+    if (rb->frame_len + DATA_HEAD >= STREAM_CHUNK)
+    {
+        stream_flush(rs);
+    }
+    unsigned char *h = (unsigned char *)reply_reserve(rb, DATA_HEAD);
+    if (h == NULL)
+    {
+        return;
+    }
+    reply_commit(rb, DATA_HEAD);
+    rs->data_at = h;
+    rs->data_chunk = rb->tail;
+    rs->data_from = rb->frame_len;
+}
+
+static void stream_close_data(reply_stream *rs)
+{
+    reply_buf *rb = &rs->ctx->reply;
+    if (rs->data_at == NULL)
+    {
+        return;
+    }
+    size_t n = rb->frame_len - rs->data_from;
+    if (n == 0)
+    {
+        /* Nothing was written after the header, so it is still the last thing in its chunk */
+        rs->data_chunk->len -= DATA_HEAD;
+        rb->frame_len -= DATA_HEAD;
+    }
+    else
+    {
+        /* Padded varint, so the header is always DATA_HEAD bytes; a frame is at most one line past STREAM_CHUNK */
+        unsigned char *h = rs->data_at;
+        h[0] = TLV_DATA;
+        h[1] = 0x80 | (n & 0x7f);
+        h[2] = 0x80 | ((n >> 7) & 0x7f);
+        h[3] = (n >> 14) & 0x7f;
+    }
+    rs->data_at = NULL;
+}
+
+/* Drops everything buffered; only valid before the first frame went out */
+static void stream_rewind(reply_stream *rs)
+{
+    stream_head(rs);
+}
+
+/* Decoration such as a listing's header line, which binary replies leave out */
+static void stream_text(reply_stream *rs, const char *text, size_t len)
+{
+    if (!rs->ctx->binary)
+    {
+        stream_append(rs, text, len);
+    }
+}
+
+/* The closing message of a streamed reply; binary replies get its values and status code */
+static void stream_reply(reply_stream *rs, enum reply_code code, ...)
+{
+    va_list ap;
+    va_start(ap, code);
+    if (!rs->ctx->binary)
+    {
+        stream_vprintf(rs, reply_defs[code].text, ap);
+    }
+    else
+    {
+        stream_close_data(rs);
+        reply_encode(&rs->ctx->reply, code, ap);
+        rs->status_sent = 1;
+    }
+    va_end(ap);
+}
+
+/* One line of a batch result: a ROW of the line number and its status code */
+static void stream_result(reply_stream *rs, int line, enum reply_code code, const char *reason)
+{
+    if (!rs->ctx->binary)
+    {
+        if (code == ST_OK)
+        {
+            stream_printf(rs, "%d OK\n", line);
+        }
+        else
+        {
+            stream_printf(rs, "%d ERR %s\n", line, reason);
+        }
+        return;
+    }
+
+    unsigned char tmp[32], *p = tmp;
+    size_t n = varint_len(line);
+    *p++ = TLV_ROW;
+    p = varint_put(p, 2 + n + 3);
+    *p++ = TLV_INT;
+    p = varint_put(p, n);
+    p = varint_put(p, line);
+    *p++ = TLV_STATUS;
+    *p++ = 1;
+    *p++ = code;
+    stream_close_data(rs);
+    stream_copy(rs, (const char *)tmp, p - tmp, 0);
+}
+
+static void stream_category(reply_stream *rs, const char *name)
+{
+    if (!rs->ctx->binary)
+    {
+        stream_printf(rs, "%s\n", name);
+        return;
+    }
+
+    unsigned char head[16], *p = head;
+    size_t n = name ? strlen(name) : 0;
+    *p++ = TLV_STR;
+    p = varint_put(p, n);
+    stream_close_data(rs);
+    stream_copy(rs, (const char *)head, p - head, 0);
+    stream_copy(rs, name, n, 0);
+}
+
+/* f holds title, user, URL, notes and password; NULL columns go out as empty strings in binary */
+static void stream_entry(reply_stream *rs, const char *const *f)
+{
+    if (!rs->ctx->binary)
+    {
+        stream_printf(rs, "Title:%s, User:%s, URL:%s, Notes:%s, Pass:%s\n", f[0], f[1], f[2], f[3], f[4]);
+        return;
+    }
+
+    size_t len[5], inner = 0;
+    for (int i = 0; i < 5; ++i)
+    {
+        len[i] = f[i] ? strlen(f[i]) : 0;
+        inner += 1 + varint_len(len[i]) + len[i];
+    }
+    unsigned char head[16], *p = head;
+    *p++ = TLV_ROW;
+    p = varint_put(p, inner);
+    stream_close_data(rs);
+    stream_copy(rs, (const char *)head, p - head, 0);
+    for (int i = 0; i < 5; ++i)
+    {
+        p = head;
+        *p++ = TLV_STR;
+        p = varint_put(p, len[i]);
+        stream_copy(rs, (const char *)head, p - head, 0);
+        stream_copy(rs, f[i], len[i], 0);
+    }
+}
+
+/* One SYNC row. Binary: kind (+2 for a tombstone) and ID, then the category name, or the category ID and
+   the entry's five fields */
+static void stream_change(reply_stream *rs, enum change_kind kind, int deleted, sqlite3_int64 id, sqlite3_int64 cat_id, const char *const *f)
+{
+    if (!rs->ctx->binary)
+    {
+        if (deleted)
+        {
+            stream_printf(rs, "Deleted %s %lld\n", kind == CHANGE_ENTRY ? "entry" : "category", (long long)id);
+        }
+        else if (kind == CHANGE_CATEGORY)
+        {
+            stream_printf(rs, "Category %lld: %s\n", (long long)id, f[0]);
+        }
+        else
+        {
+            stream_printf(rs, "Entry %lld in %lld: Title:%s, User:%s, URL:%s, Notes:%s, Pass:%s\n", (long long)id,
+                          (long long)cat_id, f[0], f[1], f[2], f[3], f[4]);
+        }
+        return;
+    }
+
+    uint64_t ints[3] = {kind + (deleted ? 2 : 0), id, cat_id};
+    int nints = !deleted && kind == CHANGE_ENTRY ? 3 : 2;
+    int nstrs = deleted ? 0 : kind == CHANGE_ENTRY ? 5 : 1;
+    size_t len[5], inner = 0;
+    for (int i = 0; i < nints; ++i)
+    {
+        inner += 2 + varint_len(ints[i]);
+    }
+    for (int i = 0; i < nstrs; ++i)
+    {
+        len[i] = f[i] ? strlen(f[i]) : 0;
+        inner += 1 + varint_len(len[i]) + len[i];
+    }
+    unsigned char head[64], *p = head;
+    *p++ = TLV_ROW;
+    p = varint_put(p, inner);
+    for (int i = 0; i < nints; ++i)
+    {
+        *p++ = TLV_INT;
+        p = varint_put(p, varint_len(ints[i]));
+        p = varint_put(p, ints[i]);
+    }
+    stream_close_data(rs);
+    stream_copy(rs, (const char *)head, p - head, 0);
+    for (int i = 0; i < nstrs; ++i)
+    {
+        p = head;
+        *p++ = TLV_STR;
+        p = varint_put(p, len[i]);
+        stream_copy(rs, (const char *)head, p - head, 0);
+        stream_copy(rs, f[i], len[i], 0);
+    }
+}
+
+static void stream_printf(reply_stream *rs, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    stream_vprintf(rs, fmt, ap);
+    va_end(ap);
+}
+
+/* A formatted piece is never split, so a frame may run one line past STREAM_CHUNK */
+static void stream_vprintf(reply_stream *rs, const char *fmt, va_list ap)
+{
+    reply_buf *rb = &rs->ctx->reply;
+    if (rs->ctx->binary && rs->data_at == NULL)
+    {
+        stream_open_data(rs);
+    }
+    reply_vprintf(rb, fmt, ap);
+    if (rb->frame_len >= STREAM_CHUNK)
+    {
+        stream_flush(rs);
+    }
+}
+
+/* Sends what is buffered as a continuation frame. It never waits: a client more than STREAM_HIGH_WATER behind
+   marks the stream stalled, so the command stops at its next batch and the worker lets go */
+static void stream_flush(reply_stream *rs)
+{
+    client_ctx *ctx = rs->ctx;
+    reply_buf *rb = &ctx->reply;
+
+    stream_close_data(rs);
+    size_t len = rb->frame_len;
+    if (len == 0 || rs->failed)
+    {
+        reply_open(rb);
+        return;
+    }
+
+    reply_close(rb, FRAME_MORE);
+    pthread_mutex_lock(&ctx->lock);
+    if (conn_queue_reply(ctx) != 0 || conn_flush(ctx) != 0)
+    {
+        rs->failed = 1;
+    }
+    rs->stalled = rs->failed || ctx->out_len > STREAM_HIGH_WATER;
+    if (rs->failed)
+    {
+        ctx->closing = 1;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    rs->sent += len;
+    reply_open(rb);
+}
+
+/* Closes the final frame; it goes out with the rest of the batch's replies */
+static void stream_end(reply_stream *rs)
+{
+    client_ctx *ctx = rs->ctx;
+
+    if (ctx->binary && !rs->status_sent)
+    {
+        stream_reply(rs, ST_OK);
+    }
+    stream_close_data(rs);
+    reply_close(&ctx->reply, 0);
+}
+
+/* The reply starts now; step streams it and is run again whenever it stopped for the client. cat is copied */
+static stream_job *stream_job_new(client_ctx *ctx, int (*step)(client_ctx *, stream_job *), const char *cat)
+{
+    size_t len = cat ? strlen(cat) + 1 : 0;
+    stream_job *sj = calloc(1, sizeof(stream_job) + len);
+    if (sj == NULL)
+    {
+        return NULL;
+    }
+    sj->step = step;
+    if (cat)
+    {
+        memcpy(sj->data, cat, len);
+        sj->cat = sj->data;
+    }
+    stream_begin(&sj->rs, ctx);
+    return sj;
+}
+
+/* Runs the next stretch of a stream; one that stopped early is left on ctx for conn_run_commands to park */
+static void stream_job_run(client_ctx *ctx, stream_job *sj)
+{
+    sj->rs.stalled = 0;
+    if (sj->step(ctx, sj) && !sj->rs.failed)
+    {
+        /* The open frame is copied when the connection parks, so no DATA item may point into it */
+        stream_close_data(&sj->rs);
+        ctx->stream = sj;
+        return;
+    }
+    free(sj);
+}
+
+/* Replies */
+
+/* Makes the reply for code the whole of the command's frame, in the connection's protocol */
+static void reply(client_ctx *ctx, reply_buf *response, enum reply_code code, ...)
+{
+    va_list ap;
+    va_start(ap, code);
+    reply_format(ctx, response, 0, code, ap);
+    va_end(ap);
+}
+
+/* Like reply, but text clients keep what the frame already holds and get this message after it */
+static void reply_more(client_ctx *ctx, reply_buf *response, enum reply_code code, ...)
+{
+    va_list ap;
+    va_start(ap, code);
+    reply_format(ctx, response, 1, code, ap);
+    va_end(ap);
+}
+
+static void reply_format(client_ctx *ctx, reply_buf *response, int append, enum reply_code code, va_list ap)
+{
+    if (!append || ctx->binary)
+    {
+        reply_open(response);
+    }
+    if (!ctx->binary)
+    {
+        reply_vprintf(response, reply_defs[code].text, ap);
+        return;
+    }
+
+    unsigned char *p = (unsigned char *)reply_reserve(response, 10);
+    if (p)
+    {
+        reply_commit(response, varint_put(p, ctx->req_id) - p);
+        reply_encode(response, code, ap);
+    }
+}
+
+/* The reply's values as typed items, then its STATUS; strings are cut short to fit before end, which
+   reply_encode sizes so that they never are */
+static unsigned char *encode_values(unsigned char *p, unsigned char *end, enum reply_code code, va_list ap)
+{
+    for (const char *a = reply_defs[code].args; *a; ++a)
+    {
+        if (*a == 's')
+        {
+            const char *s = va_arg(ap, const char *);
+            size_t n = strlen(s);
+            size_t room = end - p - 64; /* the remaining values and the status */
+            n = n < room ? n : room;
+            *p++ = TLV_STR;
+            p = varint_put(p, n);
+            memcpy(p, s, n);
+            p += n;
+            continue;
+        }
+
+        uint64_t v = *a == 'i' ? (uint64_t)va_arg(ap, int) : *a == 'l' ? (uint64_t)va_arg(ap, long) : (uint64_t)va_arg(ap, long long);
+        *p++ = TLV_INT;
+        p = varint_put(p, varint_len(v));
+        p = varint_put(p, v);
+    }
+    *p++ = TLV_STATUS;
+    *p++ = 1;
+    *p++ = code;
+    return p;
+}
+
+/* A whole binary reply that is just a status, for replies sent outside a command handler */
+static size_t encode_status(char *buf, uint64_t req_id, enum reply_code code)
+{
+    unsigned char *p = varint_put((unsigned char *)buf, req_id);
+    *p++ = TLV_STATUS;
+    *p++ = 1;
+    *p++ = code;
+    return p - (unsigned char *)buf;
+}
+
+/* A whole binary push for code and its values, under request ID 0; cap leaves 64 bytes past any string */
+static size_t encode_push(char *buf, size_t cap, enum reply_code code, ...)
+{
+    va_list ap;
+    va_start(ap, code);
+    unsigned char *p = varint_put((unsigned char *)buf, 0);
+    p = encode_values(p, (unsigned char *)buf + cap, code, ap);
+    va_end(ap);
+    return p - (unsigned char *)buf;
+}
+
+static unsigned char *varint_put(unsigned char *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = 0x80 | (v & 0x7f);
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static int varint_get(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *v = x;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t varint_len(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+/* Adapters from parsed arguments to the command handlers */
+
+static void run_register(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_register_user(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_register_sec(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_register_user_with_security(ctx, a[0].p, a[1].p, a[2].p, a[3].p, response);
+}
+
+static void run_login(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_login_user(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_logout(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    (void)a;
+    cmd_logout_user(ctx, response);
+}
+
+static void run_sec_question(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_see_security_question(ctx, a[0].p, response);
+}
+
+static void run_recover_pass(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_recover_password(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_change_pass(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_change_password(ctx, a[0].p, a[1].p, a[2].p, response);
+}
+
+static void run_new_cat(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_new_category(ctx, a[0].p, response);
+}
+
+static void run_list_cats(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_list_categories(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_del_cat(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_del_category(ctx, a[0].p, response);
+}
+
+static void run_new_entry(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_new_entry(ctx, a[0].p, a[1].p, a[2].p, a[3].p, a[4].p, a[5].p, response);
+}
+
+static void run_list_entries(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_list_entries(ctx, a[0].p, a[1].p, a[2].p, response);
+}
+
+static void run_search(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_search(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_find_by_url(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_find_by_url(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_sync(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_sync(ctx, a[0].p, a[1].p, response);
+}
+
+static void run_watch(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    (void)a;
+    cmd_watch(ctx, response);
+}
+
+static void run_unwatch(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    (void)a;
+    cmd_unwatch(ctx, response);
+}
+
+static void run_mod_entry(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_mod_entry(ctx, a[0].p, a[1].p, a[2].p, a[3].p, a[4].p, a[5].p, response);
+}
+
+static void run_del_entry(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_del_entry(ctx, a[0].p, response);
+}
+
+static void run_batch_entries(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_batch_entries(ctx, a[0].p, response);
+}
+
+static void run_export(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_export(ctx, a[0].p, response);
+}
+
+static void run_import_begin(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_import_begin(ctx, a[0].p, response);
+}
+
+static void run_import_data(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_import_data(ctx, a[0].p, a[0].len, response);
+}
+
+static void run_import_end(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    (void)a;
+    cmd_import_end(ctx, response);
+}
+
+static void run_hello(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_hello(ctx, a[0].p, response);
+}
+
+static void run_resume(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    cmd_resume(ctx, a[0].p, response);
+}
+
+static void run_stats(client_ctx *ctx, cmd_field *a, reply_buf *response)
+{
+    (void)a;
+    cmd_stats(ctx, response);
+}
+
+#define ARGS(n) (1u << (n))
+
+static const command_def commands[] = {
+    {"REGISTER", 8, 1, ARGS(2), 0, 0, run_register},
+    {"REGISTER_SEC", 12, 2, ARGS(4), 0, 0, run_register_sec},
+    {"LOGIN", 5, 3, ARGS(2), 0, 0, run_login},
+    {"LOGOUT", 6, 4, ARGS(0), 0, 0, run_logout},
+    {"SEC_QUESTION", 12, 5, ARGS(1), 0, 0, run_sec_question},
+    {"RECOVER_PASS", 12, 6, ARGS(2), 0, 0, run_recover_pass},
+    {"CHANGE_PASS", 11, 7, ARGS(3), 0, 0, run_change_pass},
+    {"NEW_CAT", 7, 8, ARGS(1), ARGS(0), 0, run_new_cat},
+    {"LIST_CATS", 9, 9, ARGS(0) | ARGS(2), 0, 0, run_list_cats},
+    {"DEL_CAT", 7, 10, ARGS(1), 0, 0, run_del_cat},
+    {"NEW_ENTRY", 9, 11, ARGS(6), ARGS(0) | ARGS(1), 0, run_new_entry},
+    {"LIST_ENTRIES", 12, 12, ARGS(1) | ARGS(3), 0, 0, run_list_entries},
+    {"MOD_ENTRY", 9, 13, ARGS(6), ARGS(1), 0, run_mod_entry},
+    {"DEL_ENTRY", 9, 14, ARGS(1), 0, 0, run_del_entry},
+    {"BATCH_ENTRIES", 13, 15, ARGS(1), 0, 1, run_batch_entries},
+    {"EXPORT", 6, 16, ARGS(1), 0, 0, run_export},
+    {"IMPORT_BEGIN", 12, 17, ARGS(1), 0, 0, run_import_begin},
+    {"IMPORT_DATA", 11, 18, ARGS(1), 0, 1, run_import_data},
+    {"IMPORT_END", 10, 19, ARGS(0), 0, 0, run_import_end},
+    {"HELLO", 5, 20, ARGS(1), 0, 0, run_hello},
+    {"RESUME", 6, 21, ARGS(1), 0, 0, run_resume},
+    {"STATS", 5, 22, ARGS(0), 0, 0, run_stats},
+    {"SEARCH", 6, 23, ARGS(1) | ARGS(2), ARGS(0), 0, run_search},
+    {"FIND_BY_URL", 11, 24, ARGS(1) | ARGS(2), ARGS(0), 0, run_find_by_url},
+    {"SYNC", 4, 25, ARGS(1) | ARGS(2), ARGS(0), 0, run_sync},
+    {"WATCH", 5, 26, ARGS(0), 0, 0, run_watch},
+    {"UNWATCH", 7, 27, ARGS(0), 0, 0, run_unwatch},
+};
+
+/* Length, first and last byte hash every command name above to its own slot */
+#define COMMAND_SLOTS 64
+#define COMMAND_HASH(name, len) (((len) * 7 + (unsigned char)(name)[0] * 6 + (unsigned char)(name)[(len) - 1]) % COMMAND_SLOTS)
+
+static const command_def *command_slots[COMMAND_SLOTS];
+static const command_def *command_by_opcode[256];
+
+static void commands_init(void)
+{
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+    {
+        const command_def *def = &commands[i];
+        const command_def **slot = &command_slots[COMMAND_HASH(def->name, def->len)];
+        if (*slot != NULL || strlen(def->name) != def->len || def->opcode >= METRIC_SLOTS)
+        {
+            fprintf(stderr, "Command table: %s does not hash to a free slot\n", def->name);
+            exit(1);
+        }
+        *slot = def;
+        command_by_opcode[def->opcode] = def;
+    }
+}
+
+static const command_def *command_lookup(const char *name, size_t len)
+{
+    if (len == 0 || len > 16)
+    {
+        return NULL;
+    }
+    const command_def *def = command_slots[COMMAND_HASH(name, len)];
+    return (def && def->len == len && memcmp(def->name, name, len) == 0) ? def : NULL;
+}
+
+/*
+ * Splits s at every '|' in place and records each field; empty fields are kept, so "a||b" has three.
+ * Returns the field count, or -1 if there are more than max.
+ */
+static int split_fields(char *s, size_t len, cmd_field *fields, int max)
+{
+    char *end = s + len;
+    int count = 0;
+    while (1)
+    {
+        char *bar = memchr(s, '|', end - s);
+        char *stop = bar ? bar : end;
+        if (count == max)
+        {
+            return -1;
+        }
+        fields[count].p = s;
+        fields[count].len = stop - s;
+        count++;
+        *stop = '\0';
+        if (bar == NULL)
+        {
+            return count;
+        }
+        s = bar + 1;
+    }
+}
+
+/*
+ * Splits s into STR items in place: the byte after each value is the next item's tag, so it is read
+ * before being overwritten with the value's NUL. Returns the item count, or -1 if malformed.
+ */
+static int split_items(char *s, size_t len, cmd_field *fields, int max)
+{
+    unsigned char *p = (unsigned char *)s, *end = p + len;
+    int count = 0;
+    int tag = p < end ? *p : -1;
+    while (tag >= 0)
+    {
+        uint64_t n;
+        const unsigned char *q = p + 1;
+        if (tag != TLV_STR || count == max || varint_get(&q, end, &n) != 0 || n > (uint64_t)(end - q))
+        {
+            return -1;
+        }
+        p = (unsigned char *)q;
+        fields[count].p = (char *)p;
+        fields[count].len = n;
+        if (memchr(p, '\0', n) != NULL)
+        {
+            return -1;
+        }
+        p += n;
+        tag = p < end ? *p : -1;
+        *p = '\0'; /* at end this is the terminator conn_take_command leaves */
+        count++;
+    }
+    return count;
+}
+
+/* cmd is the NUL-terminated request, owned by the caller; it is tokenized in place */
+static void process_command(client_ctx *ctx, char *cmd, size_t len, reply_buf *response)
+{
+    if (ctx->binary)
+    {
+        process_binary(ctx, cmd, len, response);
+        return;
+    }
+    uint64_t started = now_ns();
+    if (len == 0)
+    {
+        reply(ctx, response, ST_EMPTY_COMMAND);
+        metrics_record(&(command_timing){.slot = 0, .started = started});
+        return;
+    }
+
+    cmd_field args[MAX_COMMAND_ARGS] = {{0}};
+    int count = 0;
+    const command_def *def = parse_command(cmd, len, args, &count);
+    if (def == NULL)
+    {
+        reply(ctx, response, ST_INVALID_COMMAND);
+        metrics_record(&(command_timing){.slot = 0, .started = started});
+        return;
+    }
+    run_command(ctx, def, args, count, response, started);
+}
+
+/* Looks up a text request's command and splits its arguments in place; NULL if there is no such command */
+static const command_def *parse_command(char *cmd, size_t len, cmd_field *args, int *count)
+{
+    /* BATCH_ENTRIES and IMPORT_DATA carry raw lines after a '\n', so only the name is split off */
+    size_t name_len = 0;
+    while (name_len < len && cmd[name_len] != '|' && cmd[name_len] != '\n')
+    {
+        name_len++;
+    }
+    const command_def *def = command_lookup(cmd, name_len);
+    int newline = name_len < len && cmd[name_len] == '\n';
+    if (def == NULL || def->raw != newline)
+    {
+        return NULL;
+    }
+
+    if (def->raw)
+    {
+        args[0].p = cmd + name_len + 1;
+        args[0].len = len - name_len - 1;
+        *count = 1;
+    }
+    else if (name_len < len)
+    {
+        cmd[name_len] = '\0';
+        *count = split_fields(cmd + name_len + 1, len - name_len - 1, args, MAX_COMMAND_ARGS);
+    }
+    return def;
+}
+
+/* Binary requests reach the same handlers; raw bodies such as BATCH_ENTRIES are a single STR item */
+static void process_binary(client_ctx *ctx, char *cmd, size_t len, reply_buf *response)
+{
+    const unsigned char *p = (const unsigned char *)cmd + 1;
+    const unsigned char *end = (const unsigned char *)cmd + len;
+    uint64_t started = now_ns();
+    ctx->req_id = 0;
+    if (len == 0 || varint_get(&p, end, &ctx->req_id) != 0)
+    {
+        reply(ctx, response, ST_INVALID_COMMAND);
+        metrics_record(&(command_timing){.slot = 0, .started = started});
+        return;
+    }
+
+    const command_def *def = command_by_opcode[(unsigned char)cmd[0]];
+    cmd_field args[MAX_COMMAND_ARGS] = {{0}};
+    int count = split_items((char *)p, end - p, args, MAX_COMMAND_ARGS);
+    if (def == NULL)
+    {
+        reply(ctx, response, ST_INVALID_COMMAND);
+        metrics_record(&(command_timing){.slot = 0, .started = started});
+        return;
+    }
+    run_command(ctx, def, args, count, response, started);
+}
+
+/* Everything up to here counts as parsing; the handler's time is split into DB and formatting */
+static void run_command(client_ctx *ctx, const command_def *def, cmd_field *args, int count, reply_buf *response, uint64_t started)
+{
+    command_timing t = {.slot = def->opcode, .started = started};
+    uint64_t ran = now_ns();
+    t.ns[PHASE_PARSE] = ran - started;
+    metrics_db_take();
+
+    int fields_ok = count >= 0 && (def->args_ok & ARGS(count));
+    if (!fields_ok)
+    {
+        reply(ctx, response, ST_INVALID_COMMAND);
+    }
+    for (int i = 0; fields_ok && i < count; ++i)
+    {
+        if ((def->required & ARGS(i)) && args[i].len == 0)
+        {
+            reply(ctx, response, ST_FIELDS_REQUIRED);
+            fields_ok = 0;
+        }
+    }
+    if (fields_ok)
+    {
+        def->run(ctx, args, response);
+    }
+
+    uint64_t end = now_ns();
+    t.ns[PHASE_DB] = metrics_db_take();
+    t.ns[PHASE_FORMAT] = end - ran - t.ns[PHASE_DB];
+    t.ns[PHASE_TOTAL] = end - started;
+    if (ctx->kdf)
+    {
+        /* Recorded when the command resumes, with the wait for the hash as its own phase */
+        ctx->kdf->timing = t;
+        ctx->kdf->parked_ns = end;
+        return;
+    }
+    metrics_record(&t);
+}
+
+/* Command Handlers */
+
+static int evaluate_password_strength(client_ctx *ctx, const char *pass, reply_buf *response)
+{
+    int len = strlen(pass);
+    int has_upper = 0, has_lower = 0, has_digit = 0, has_special = 0;
+
+    for (int i = 0; i < len; ++i)
+    {
+        if (isdigit(pass[i]))
+            has_digit = 1;
+        else if (isupper(pass[i]))
+            has_upper = 1;
+        else if (islower(pass[i]))
+            has_lower = 1;
+        else if (ispunct(pass[i]))
+            has_special = 1;
+    }
+
+    if (len >= 8 && has_upper && has_lower && has_digit && has_special)
+    {
+        reply(ctx, response, ST_PASSWORD_STRONG);
+        return 0;
+    }
+    else
+    {
+        reply(ctx, response, ST_PASSWORD_WEAK);
+        return 1;
+    }
+}
+
+/* Parses the limit|cursor pair of a paged listing; without one the whole list is streamed */
+static int parse_page(const char *limit_str, const char *cursor_str, int *limit, sqlite3_int64 *after_id)
+{
+    *limit = -1;
+    *after_id = 0;
+    if (limit_str == NULL)
+    {
+        return 0;
+    }
+
+    char *end;
+    long l = strtol(limit_str, &end, 10);
+    if (end == limit_str || *end || l <= 0 || l > MAX_PAGE_LIMIT)
+    {
+        return 1;
+    }
+    long long c = strtoll(cursor_str, &end, 10);
+    if (end == cursor_str || *end || c < 0)
+    {
+        return 1;
+    }
+
+    *limit = (int)l;
+    *after_id = c;
+    return 0;
+}
+
+/* Integrate this into the registration command */
+static void cmd_register_user(client_ctx *ctx, const char *username, const char *masterPass, reply_buf *response)
+{
+    if (username[0] == '\0' || masterPass[0] == '\0')
+    {
+        reply(ctx, response, ST_FIELDS_REQUIRED);
+        return;
+    }
+
+    int exists = db_fetch_user_by_username(username);
+    if (exists == 0)
+    {
+        reply(ctx, response, ST_USER_EXISTS);
+        return;
+    }
+
+    if (evaluate_password_strength(ctx, masterPass, response) != 0)
+    {
+        reply_more(ctx, response, ST_MASTER_REJECTED);
+        return;
+    }
+
+    const char *args[] = {username, masterPass};
+    kdf_job *kj = kdf_job_new(cmd_register_user_done, args, 2);
+    if (kj)
+    {
+        kdf_job_add(kj, 1, NULL);
+    }
+    kdf_park(ctx, kj, response);
+}
+
+static void cmd_register_user_done(client_ctx *ctx, kdf_job *kj, reply_buf *response)
+{
+    unsigned char key[DATA_KEY_LEN], wrapped[WRAPPED_KEY_LEN];
+    int rc = 1;
+    if (kj->task[0].ok && RAND_bytes(key, sizeof(key)) == 1 && data_key_wrap(kj->task[0].fresh_kek, 0, key, wrapped) == 0)
+    {
+        rc = db_register(kj->arg[0], kj->task[0].fresh, wrapped);
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    reply_more(ctx, response, rc == 0 ? ST_REGISTERED : ST_REGISTER_FAILED);
+}
+
+static void cmd_login_user(client_ctx *ctx, const char *username, const char *masterPass, reply_buf *response)
+{
+    if (ctx->active_user[0])
+    {
+        reply(ctx, response, ST_ALREADY_LOGGED_IN);
+        return;
+    }
+
+    /* An unknown user still costs a hash, so the reply time does not tell which names exist */
+    credentials cred = {0};
+    db_fetch_credentials(username, &cred);
+
+    const char *args[] = {username, masterPass};
+    kdf_job *kj = kdf_job_new(cmd_login_user_done, args, 2);
+    if (kj)
+    {
+        kj->cred = cred;
+        kdf_job_add(kj, 1, cred.master);
+    }
+    kdf_park(ctx, kj, response);
+}
+
+static void cmd_login_user_done(client_ctx *ctx, kdf_job *kj, reply_buf *response)
+{
+    const kdf_task *t = &kj->task[0];
+    unsigned char key[DATA_KEY_LEN];
+    int created = 0;
+    if (!t->ok || login_data_key(kj, t, key, &created) != 0)
+    {
+        OPENSSL_cleanse(key, sizeof(key));
+        reply(ctx, response, ST_LOGIN_FAILED);
+        return;
+    }
+    if (created && db_seal_legacy_entries(kj->cred.user_id, key) != 0)
+    {
+        fprintf(stderr, "Sealing the entries of user %lld failed; they stay readable in plain text.\n", (long long)kj->cred.user_id);
+    }
+
+    char hex[2 * SESSION_TOKEN_LEN + 1];
+    if (session_create(kj->cred.user_id, kj->arg[0], key, ctx->session) != 0)
+    {
+        OPENSSL_cleanse(key, sizeof(key));
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    ctx->has_session = 1;
+    session_token_hex(ctx->session, hex);
+    conn_login(ctx, kj->arg[0], kj->cred.user_id, key);
+    OPENSSL_cleanse(key, sizeof(key));
+    reply(ctx, response, ST_LOGIN_OK, kj->arg[0], hex);
+}
+
+/*
+ * The data key for a checked master password. An account from before encryption gets a fresh one (created);
+ * legacy and below-cost hashes are replaced while the password is at hand, with the key rewrapped to match.
+ */
+static int login_data_key(kdf_job *kj, const kdf_task *t, unsigned char *key, int *created)
+{
+    credentials *cred = &kj->cred;
+    int rc = data_key_open(cred, t, 0, key);
+    *created = rc == 1;
+    if (rc < 0 || (*created && RAND_bytes(key, DATA_KEY_LEN) != 1))
+    {
+        return 1;
+    }
+    if (!t->fresh[0] && !*created)
+    {
+        return 0;
+    }
+
+    unsigned char wrapped[WRAPPED_KEY_LEN];
+    const char *hash = t->fresh[0] ? t->fresh : t->stored;
+    if ((!t->fresh[0] && !t->has_kek) || data_key_wrap(t->fresh[0] ? t->fresh_kek : t->kek, 0, key, wrapped) != 0)
+    {
+        return *created;
+    }
+    /* Two first logins may race to create the key; the loser fails and its retry unwraps the winner's */
+    rc = db_rehash(cred->user_id, 0, t->stored, hash, cred->has_wrapped[0] ? cred->wrapped[0] : NULL, wrapped);
+    return *created && rc != 0;
+}
+
+/* Restores a login from its session token without the database or a password hash */
+static void cmd_resume(client_ctx *ctx, const char *token, reply_buf *response)
+{
+    if (ctx->active_user[0])
+    {
+        reply(ctx, response, ST_ALREADY_LOGGED_IN);
+        return;
+    }
+
+    unsigned char raw[SESSION_TOKEN_LEN], key[DATA_KEY_LEN];
+    char username[64];
+    sqlite3_int64 user_id;
+    if (session_token_parse(token, raw) != 0 || session_resume(raw, &user_id, username, key) != 0)
+    {
+        reply(ctx, response, ST_SESSION_INVALID);
+        return;
+    }
+
+    memcpy(ctx->session, raw, sizeof(raw));
+    ctx->has_session = 1;
+    conn_login(ctx, username, user_id, key);
+    OPENSSL_cleanse(key, sizeof(key));
+    reply(ctx, response, ST_RESUMED, username);
+}
+
+static void cmd_new_category(client_ctx *ctx, const char *catName, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    sqlite3_int64 cat_id;
+    int exists = db_fetch_category_by_name(ctx->user_id, catName, &cat_id);
+    if (exists == 0)
+    {
+        reply(ctx, response, ST_CATEGORY_EXISTS);
+        return;
+    }
+
+    int rc = db_create_category(ctx->user_id, catName);
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_CATEGORY_ADDED);
+    }
+    else
+    {
+        reply(ctx, response, ST_CATEGORY_ADD_FAILED);
+    }
+}
+
+static void cmd_list_categories(client_ctx *ctx, const char *limit, const char *cursor, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int page_limit;
+    sqlite3_int64 after_id;
+    if (parse_page(limit, cursor, &page_limit, &after_id) != 0)
+    {
+        reply(ctx, response, ST_INVALID_PAGE, MAX_PAGE_LIMIT);
+        return;
+    }
+
+    stream_job *sj = stream_job_new(ctx, stream_list_step, NULL);
+    if (sj == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    sj->since = sj->cursor[0] = after_id;
+    sj->limit = page_limit;
+    stream_text(&sj->rs, "Categories:\n", 12);
+    stream_job_run(ctx, sj);
+}
+
+static void cmd_new_entry(client_ctx *ctx, const char *cat, const char *title, const char *usr, const char *url, const char *notes, const char *pass, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int exists = db_fetch_entry_by_title(ctx->user_id, title);
+    if (exists == 0)
+    {
+        reply(ctx, response, ST_ENTRY_EXISTS);
+        return;
+    }
+    sqlite3_int64 cat_id;
+    exists = db_fetch_category_by_name(ctx->user_id, cat, &cat_id);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_CATEGORY_NOT_FOUND);
+        return;
+    }
+    int rc = db_insert_entry(ctx->user_id, ctx->data_key, cat_id, title, usr, url, notes, pass);
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_ENTRY_ADDED);
+    }
+    else
+    {
+        reply(ctx, response, ST_ENTRY_ADD_FAILED);
+    }
+}
+
+static void cmd_list_entries(client_ctx *ctx, const char *cat, const char *limit, const char *cursor, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int page_limit;
+    sqlite3_int64 after_id;
+    if (parse_page(limit, cursor, &page_limit, &after_id) != 0)
+    {
+        reply(ctx, response, ST_INVALID_PAGE, MAX_PAGE_LIMIT);
+        return;
+    }
+
+    stream_job *sj = stream_job_new(ctx, stream_list_step, cat);
+    if (sj == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    sj->since = sj->cursor[0] = after_id;
+    sj->limit = page_limit;
+    stream_text(&sj->rs, "Entries:\n", 9);
+    stream_job_run(ctx, sj);
+}
+
+/* LIST_CATEGORIES (cat == NULL) or LIST_ENTRIES from cursor[0]; since is the cursor the client asked from */
+static int stream_list_step(client_ctx *ctx, stream_job *sj)
+{
+    reply_stream *rs = &sj->rs;
+    sqlite3_int64 next_cursor;
+    int remaining = sj->limit < 0 ? -1 : sj->limit - sj->rows;
+    int rows = vault_list(ctx->user_id, ctx->data_key, sj->cat, sj->cursor[0], remaining, rs, &next_cursor);
+    if (rows > 0)
+    {
+        sj->rows += rows;
+    }
+    if (rows >= 0 && next_cursor && sj->rows != sj->limit)
+    {
+        /* Stopped short of the page for the client to catch up */
+        sj->cursor[0] = next_cursor;
+        return 1;
+    }
+
+    if (rows < 0 || sj->rows == 0)
+    {
+        /* Nothing was sent yet, so the header can still be dropped */
+        if (rs->sent == 0)
+        {
+            stream_rewind(rs);
+        }
+        if (rows < 0)
+        {
+            stream_reply(rs, sj->cat ? ST_ENTRIES_ERROR : ST_CATEGORIES_ERROR);
+        }
+        else if (sj->cat)
+        {
+            stream_reply(rs, sj->since ? ST_NO_MORE_ENTRIES : ST_NO_ENTRIES);
+        }
+        else
+        {
+            stream_reply(rs, sj->since ? ST_NO_MORE_CATEGORIES : ST_NO_CATEGORIES);
+        }
+    }
+    else if (next_cursor)
+    {
+        stream_reply(rs, ST_NEXT_CURSOR, (long long)next_cursor);
+    }
+    stream_end(rs);
+    return 0;
+}
+
+/* Best matches first, over titles, usernames, URLs and notes; passwords are never indexed */
+static void cmd_search(client_ctx *ctx, const char *query, const char *limit, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int page_limit;
+    sqlite3_int64 unused;
+    if (parse_page(limit, "0", &page_limit, &unused) != 0)
+    {
+        reply(ctx, response, ST_INVALID_PAGE, MAX_PAGE_LIMIT);
+        return;
+    }
+    search_query q;
+    if (search_parse(query, &q) == 0)
+    {
+        reply(ctx, response, ST_SEARCH_EMPTY);
+        return;
+    }
+
+    reply_stream rs;
+    stream_begin(&rs, ctx);
+    stream_text(&rs, "Matches:\n", 9);
+
+    int rows = vault_search(ctx->user_id, ctx->data_key, &q, page_limit < 0 ? SEARCH_DEFAULT_LIMIT : page_limit, &rs);
+    if (rows <= 0)
+    {
+        if (rs.sent == 0)
+        {
+            stream_rewind(&rs);
+        }
+        stream_reply(&rs, rows < 0 ? ST_ENTRIES_ERROR : ST_NO_MATCHES);
+    }
+    stream_end(&rs);
+}
+
+/* Autofill: the entries saved for a page's site (eTLD+1), those for its exact host first */
+static void cmd_find_by_url(client_ctx *ctx, const char *url, const char *limit, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int page_limit;
+    sqlite3_int64 unused;
+    if (parse_page(limit, "0", &page_limit, &unused) != 0)
+    {
+        reply(ctx, response, ST_INVALID_PAGE, MAX_PAGE_LIMIT);
+        return;
+    }
+    url_query q;
+    if (url_parse(url, &q) != 0)
+    {
+        reply(ctx, response, ST_URL_INVALID);
+        return;
+    }
+
+    reply_stream rs;
+    stream_begin(&rs, ctx);
+    stream_text(&rs, "Matches:\n", 9);
+
+    int rows = vault_find_url(ctx->user_id, ctx->data_key, &q, page_limit < 0 ? URL_DEFAULT_LIMIT : page_limit, &rs);
+    if (rows <= 0)
+    {
+        if (rs.sent == 0)
+        {
+            stream_rewind(&rs);
+        }
+        stream_reply(&rs, rows < 0 ? ST_ENTRIES_ERROR : ST_NO_MATCHES);
+    }
+    stream_end(&rs);
+}
+
+/* What changed since the client's revision, oldest first: live rows as they are now, deleted ones as tombstones.
+   SYNC|0 lists the whole vault; the closing revision is the one to send next time */
+static void cmd_sync(client_ctx *ctx, const char *since, const char *limit, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    char *end;
+    long long from = strtoll(since, &end, 10);
+    if (end == since || *end || from < 0)
+    {
+        reply(ctx, response, ST_INVALID_REVISION);
+        return;
+    }
+    int page_limit;
+    sqlite3_int64 unused;
+    if (parse_page(limit, "0", &page_limit, &unused) != 0)
+    {
+        reply(ctx, response, ST_INVALID_PAGE, MAX_PAGE_LIMIT);
+        return;
+    }
+
+    stream_job *sj = stream_job_new(ctx, stream_sync_step, NULL);
+    if (sj == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    sj->since = sj->cursor[0] = from;
+    sj->state[0] = -1;
+    sj->limit = page_limit;
+    stream_text(&sj->rs, "Changes:\n", 9);
+    stream_job_run(ctx, sj);
+}
+
+/* SYNC from revision cursor[0]; state keeps the revision its first snapshot capped the reply at */
+static int stream_sync_step(client_ctx *ctx, stream_job *sj)
+{
+    reply_stream *rs = &sj->rs;
+    sqlite3_int64 next_cursor;
+    int remaining = sj->limit < 0 ? -1 : sj->limit - sj->rows;
+    int rows = db_sync(ctx->user_id, ctx->data_key, sj->since, sj->cursor[0], remaining, rs, sj->state, &next_cursor);
+    int reset = sj->since && sj->since < sj->state[1];
+    if (rows > 0)
+    {
+        sj->rows += rows;
+    }
+    if (rows >= 0 && !reset && next_cursor && sj->rows != sj->limit)
+    {
+        sj->cursor[0] = next_cursor;
+        return 1;
+    }
+
+    if ((rows < 0 || sj->rows == 0) && rs->sent == 0)
+    {
+        stream_rewind(rs);
+    }
+    if (rows < 0)
+    {
+        stream_reply(rs, ST_ENTRIES_ERROR);
+    }
+    else if (reset)
+    {
+        stream_reply(rs, ST_SYNC_RESET, (long long)sj->state[1]);
+    }
+    else if (next_cursor)
+    {
+        stream_reply(rs, ST_NEXT_CURSOR, (long long)next_cursor);
+    }
+    else
+    {
+        stream_reply(rs, ST_SYNCED, (long long)sj->state[0]);
+    }
+    stream_end(rs);
+    return 0;
+}
+
+/* Every commit that changes the vault is pushed to this connection as its new revision until UNWATCH or LOGOUT;
+   the reply's revision tells the client whether it has to SYNC first */
+static void cmd_watch(client_ctx *ctx, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    /* Registered before the revision is read, so a write committing in between is pushed rather than missed */
+    watch_add(ctx);
+    sqlite3_int64 revision;
+    if (db_revision(ctx->user_id, &revision) != 0)
+    {
+        watch_remove(ctx);
+        reply(ctx, response, ST_WATCH_FAILED);
+        return;
+    }
+    reply(ctx, response, ST_WATCHING, (long long)revision);
+}
+
+static void cmd_unwatch(client_ctx *ctx, reply_buf *response)
+{
+    watch_remove(ctx);
+    reply(ctx, response, ST_UNWATCHED);
+}
+
+static void cmd_mod_entry(client_ctx *ctx, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int exists = db_fetch_entry_by_title(ctx->user_id, oldTitle);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_ENTRY_NOT_FOUND);
+        return;
+    }
+    int rc = db_update_entry(ctx->user_id, ctx->data_key, oldTitle, newTitle, newUsr, newURL, newNotes, newPass);
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_ENTRY_UPDATED);
+    }
+    else
+    {
+        reply(ctx, response, ST_ENTRY_UPDATE_FAILED);
+    }
+}
+
+static void cmd_del_entry(client_ctx *ctx, const char *title, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    int exists = db_fetch_entry_by_title(ctx->user_id, title);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_ENTRY_NOT_FOUND);
+        return;
+    }
+    int rc = db_remove_entry(ctx->user_id, title);
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_ENTRY_DELETED);
+    }
+    else
+    {
+        reply(ctx, response, ST_ENTRY_DELETE_FAILED);
+    }
+}
+
+static void cmd_logout_user(client_ctx *ctx, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_NOT_LOGGED_IN);
+        return;
+    }
+    vault_cache_logout(ctx->user_id);
+    watch_remove(ctx);
+    if (ctx->has_session)
+    {
+        session_revoke(ctx->session);
+        ctx->has_session = 0;
+    }
+    ctx->active_user[0] = '\0';
+    ctx->user_id = 0;
+    OPENSSL_cleanse(ctx->data_key, DATA_KEY_LEN);
+    if (ctx->import)
+    {
+        free(ctx->import->carry);
+        free(ctx->import);
+        ctx->import = NULL;
+    }
+    reply(ctx, response, ST_LOGGED_OUT);
+}
+
+static void cmd_register_user_with_security(client_ctx *ctx, const char *username, const char *masterPass, const char *securityQ, const char *securityA, reply_buf *response)
+{
+    if (!username[0] || !masterPass[0] || !securityQ[0] || !securityA[0])
+    {
+        reply(ctx, response, ST_FIELDS_REQUIRED);
+        return;
+    }
+
+    if (evaluate_password_strength(ctx, masterPass, response) == 1)
+    {
+        reply_more(ctx, response, ST_MASTER_REJECTED);
+        return;
+    }
+
+    int exists = db_fetch_user_by_username(username);
+    if (exists == 0)
+    {
+        reply(ctx, response, ST_USER_EXISTS);
+        return;
+    }
+
+    const char *args[] = {username, masterPass, securityQ, securityA};
+    kdf_job *kj = kdf_job_new(cmd_register_user_with_security_done, args, 4);
+    if (kj)
+    {
+        kdf_job_add(kj, 1, NULL);
+        kdf_job_add(kj, 3, NULL);
+    }
+    kdf_park(ctx, kj, response);
+}
+
+static void cmd_register_user_with_security_done(client_ctx *ctx, kdf_job *kj, reply_buf *response)
+{
+    /* The answer gets its own wrap of the data key, so RECOVER_PASS keeps the vault readable */
+    unsigned char key[DATA_KEY_LEN], wrapped[2][WRAPPED_KEY_LEN];
+    const unsigned char *wraps[2] = {wrapped[0], wrapped[1]};
+    int rc = 1;
+    if (kj->task[0].ok && kj->task[1].ok && RAND_bytes(key, sizeof(key)) == 1 &&
+        data_key_wrap(kj->task[0].fresh_kek, 0, key, wrapped[0]) == 0 &&
+        data_key_wrap(kj->task[1].fresh_kek, 1, key, wrapped[1]) == 0)
+    {
+        rc = db_register_with_security(kj->arg[0], kj->arg[2], kj->task[0].fresh, kj->task[1].fresh, wraps);
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_REGISTERED);
+    }
+    else
+    {
+        reply(ctx, response, ST_REGISTER_FAILED);
+    }
+}
+
+static void cmd_see_security_question(client_ctx *ctx, const char *username, reply_buf *response)
+{
+    if (ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGOUT_REQUIRED);
+        return;
+    }
+
+    if (!username[0])
+    {
+        reply(ctx, response, ST_USERNAME_REQUIRED);
+        return;
+    }
+
+    int exists = db_fetch_user_by_username(username);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_USER_NOT_FOUND);
+        return;
+    }
+
+    char securityQ[256];
+    int rc = db_see_security_question(username, securityQ);
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_SECURITY_QUESTION, securityQ);
+    }
+    else
+    {
+        reply(ctx, response, ST_NO_SECURITY_QUESTION);
+    }
+}
+
+// This function will set the password of the user to "password" if the security answer is correct
+static void cmd_recover_password(client_ctx *ctx, const char *username, const char *securityA, reply_buf *response)
+{
+    if (ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGOUT_REQUIRED);
+        return;
+    }
+
+    if (!username[0] || !securityA[0])
+    {
+        reply(ctx, response, ST_FIELDS_REQUIRED);
+        return;
+    }
+
+    int exists = db_fetch_user_by_username(username);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_USER_NOT_FOUND);
+        return;
+    }
+
+    char * buffer = malloc(256);
+    int has_security = db_see_security_question(username, buffer);
+    free(buffer);
+    if (has_security != 0)
+    {
+        reply(ctx, response, ST_NO_SECURITY_QUESTION);
+        return;
+    }
+
+    credentials cred = {0};
+    db_fetch_credentials(username, &cred);
+
+    /* The new password is only hashed once the answer checks out */
+    const char *args[] = {username, securityA, "password"};
+    kdf_job *kj = kdf_job_new(cmd_recover_password_done, args, 3);
+    if (kj)
+    {
+        kj->cred = cred;
+        kdf_job_add(kj, 1, cred.answer);
+        kdf_job_add(kj, 2, NULL);
+    }
+    kdf_park(ctx, kj, response);
+}
+
+static void cmd_recover_password_done(client_ctx *ctx, kdf_job *kj, reply_buf *response)
+{
+    const kdf_task *answer = &kj->task[0];
+    credentials *cred = &kj->cred;
+    if (!answer->ok)
+    {
+        reply(ctx, response, ST_BAD_SECURITY_ANSWER);
+        return;
+    }
+
+    /* The answer's wrap of the data key carries the vault over to the new password. An account that was
+       encrypted before it had one would lose its vault, so it is refused; one never encrypted has nothing to carry */
+    unsigned char key[DATA_KEY_LEN], wrapped[WRAPPED_KEY_LEN];
+    int rc = data_key_open(cred, answer, 1, key);
+    if (rc < 0 || (rc == 1 && cred->has_wrapped[0]))
+    {
+        reply(ctx, response, ST_RECOVERY_UNAVAILABLE);
+        return;
+    }
+    int has_key = rc == 0;
+
+    if (answer->fresh[0] && (!has_key || data_key_wrap(answer->fresh_kek, 1, key, wrapped) == 0))
+    {
+        db_rehash(cred->user_id, 1, answer->stored, answer->fresh, has_key ? cred->wrapped[1] : NULL, has_key ? wrapped : NULL);
+    }
+    rc = 1;
+    if (kj->task[1].ok && (!has_key || data_key_wrap(kj->task[1].fresh_kek, 0, key, wrapped) == 0))
+    {
+        rc = db_update_password(kj->arg[0], kj->task[1].fresh, cred->has_wrapped[0] > 0 ? cred->wrapped[0] : NULL,
+                                has_key ? wrapped : NULL);
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    if (rc == 0)
+    {
+        session_revoke_user(cred->user_id);
+        reply(ctx, response, ST_PASSWORD_RESET);
+    }
+    else
+    {
+        reply(ctx, response, ST_PASSWORD_RESET_FAILED);
+    }
+}
+
+static void cmd_change_password(client_ctx *ctx, const char *username, const char *oldPass, const char *newPass, reply_buf *response)
+{
+    if (ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGOUT_REQUIRED);
+        return;
+    }
+
+    if (!username[0] || !oldPass[0] || !newPass[0])
+    {
+        reply(ctx, response, ST_FIELDS_REQUIRED);
+        return;
+    }
+
+    int exists = db_fetch_user_by_username(username);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_USER_NOT_FOUND);
+        return;
+    }
+
+    if (evaluate_password_strength(ctx, newPass, response) == 1)
+    {
+        reply_more(ctx, response, ST_NEW_PASSWORD_REJECTED);
+        return;
+    }
+
+    credentials cred = {0};
+    db_fetch_credentials(username, &cred);
+
+    // Check old password, then hash the new one
+    const char *args[] = {username, oldPass, newPass};
+    kdf_job *kj = kdf_job_new(cmd_change_password_done, args, 3);
+    if (kj)
+    {
+        kj->cred = cred;
+        kdf_job_add(kj, 1, cred.master);
+        kdf_job_add(kj, 2, NULL);
+    }
+    kdf_park(ctx, kj, response);
+}
+
+static void cmd_change_password_done(client_ctx *ctx, kdf_job *kj, reply_buf *response)
+{
+    credentials *cred = &kj->cred;
+    if (!kj->task[0].ok)
+    {
+        reply(ctx, response, ST_BAD_OLD_PASSWORD);
+        return;
+    }
+    unsigned char key[DATA_KEY_LEN], wrapped[WRAPPED_KEY_LEN];
+    int rc = data_key_open(cred, &kj->task[0], 0, key);
+    int created = rc == 1 && RAND_bytes(key, sizeof(key)) == 1;
+    if (rc < 0 || (rc == 1 && !created))
+    {
+        reply(ctx, response, ST_PASSWORD_UPDATE_FAILED);
+        return;
+    }
+    /* Checking the old password has always signed the user in; a key made just now only counts once it is stored */
+    if (!created)
+    {
+        conn_login(ctx, kj->arg[0], cred->user_id, key);
+    }
+
+    // Update password, with the data key rewrapped under it
+    rc = 1;
+    if (kj->task[1].ok && data_key_wrap(kj->task[1].fresh_kek, 0, key, wrapped) == 0)
+    {
+        rc = db_update_password(kj->arg[0], kj->task[1].fresh, cred->has_wrapped[0] > 0 ? cred->wrapped[0] : NULL, wrapped);
+    }
+    if (rc == 0 && created)
+    {
+        conn_login(ctx, kj->arg[0], cred->user_id, key);
+        if (db_seal_legacy_entries(cred->user_id, key) != 0)
+        {
+            fprintf(stderr, "Sealing the entries of user %lld failed; they stay readable in plain text.\n", (long long)cred->user_id);
+        }
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    if (rc == 0)
+    {
+        /* Tokens issued under the old password stop working */
+        session_revoke_user(cred->user_id);
+        reply(ctx, response, ST_PASSWORD_UPDATED);
+    }
+    else
+    {
+        reply(ctx, response, ST_PASSWORD_UPDATE_FAILED);
+    }
+}
+
+static void cmd_del_category(client_ctx *ctx, const char *catName, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    sqlite3_int64 cat_id;
+    int exists = db_fetch_category_by_name(ctx->user_id, catName, &cat_id);
+    if (exists != 0)
+    {
+        reply(ctx, response, ST_CATEGORY_NOT_FOUND);
+        return;
+    }
+    int rc = db_remove_category(ctx->user_id, cat_id);
+    if (rc == 0)
+    {
+        reply(ctx, response, ST_CATEGORY_DELETED);
+    }
+    else
+    {
+        reply(ctx, response, ST_CATEGORY_DELETE_FAILED);
+    }
+}
+
+/* BATCH_ENTRIES, then one category|title|user|url|notes|password line per entry */
+static void cmd_batch_entries(client_ctx *ctx, char *body, reply_buf *response)
+{
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+
+    int max_items = 1;
+    for (const char *p = body; *p; ++p)
+    {
+        max_items += *p == '\n';
+    }
+    batch_item *items = calloc(max_items, sizeof(batch_item));
+    unsigned char *status = calloc(max_items, 1);
+    if (items == NULL || status == NULL)
+    {
+        free(items);
+        free(status);
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+
+    /* strsep keeps empty fields, so an entry may have no URL or notes */
+    int count = 0;
+    char *line;
+    while ((line = strsep(&body, "\n")) != NULL)
+    {
+        line[strcspn(line, "\r")] = '\0';
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+
+        char *fields[6];
+        int nfields = 0;
+        char *field;
+        while (nfields < 6 && (field = strsep(&line, "|")) != NULL)
+        {
+            fields[nfields++] = field;
+        }
+        if (nfields != 6 || line != NULL || !fields[0][0] || !fields[1][0])
+        {
+            status[count++] = BATCH_BAD_LINE;
+            continue;
+        }
+        items[count] = (batch_item){fields[0], fields[1], fields[2], fields[3], fields[4], fields[5]};
+        status[count++] = BATCH_OK;
+    }
+
+    if (count == 0)
+    {
+        reply(ctx, response, ST_EMPTY_BATCH);
+    }
+    else if (db_insert_entry_batch(ctx->user_id, ctx->data_key, items, count, status, 0) != 0)
+    {
+        reply(ctx, response, ST_BATCH_FAILED);
+    }
+    else
+    {
+        static const char *const reasons[] = {
+            [BATCH_BAD_LINE] = "Expected category|title|user|url|notes|password",
+            [BATCH_NO_CATEGORY] = "Category not found",
+            [BATCH_DUPLICATE] = "Entry with that title already exists",
+            [BATCH_FAILED] = "Failed to add entry",
+        };
+        static const enum reply_code codes[] = {
+            [BATCH_OK] = ST_OK,
+            [BATCH_BAD_LINE] = ST_BATCH_BAD_LINE,
+            [BATCH_NO_CATEGORY] = ST_CATEGORY_NOT_FOUND,
+            [BATCH_DUPLICATE] = ST_ENTRY_EXISTS,
+            [BATCH_FAILED] = ST_ENTRY_ADD_FAILED,
+        };
+        int added = 0;
+
+        reply_stream rs;
+        stream_begin(&rs, ctx);
+        for (int i = 0; i < count; ++i)
+        {
+            if (status[i] == BATCH_OK)
+            {
+                stream_result(&rs, i + 1, ST_OK, NULL);
+                added++;
+            }
+            else
+            {
+                stream_result(&rs, i + 1, codes[status[i]], reasons[status[i]]);
+            }
+        }
+        stream_reply(&rs, ST_BATCH_COMMITTED, added, count - added);
+        stream_end(&rs);
+    }
+
+    free(items);
+    free(status);
+}
+
+/* Vault import/export */
+
+static int parse_vault_format(const char *name, enum vault_format *format)
+{
+    if (strcmp(name, "csv") == 0)
+    {
+        *format = VAULT_CSV;
+        return 0;
+    }
+    if (strcmp(name, "json") == 0)
+    {
+        *format = VAULT_JSON;
+        return 0;
+    }
+    return 1;
+}
+
+/* EXPORT|csv or EXPORT|json (one object per line), streamed as the rows are read */
+static void cmd_export(client_ctx *ctx, const char *format, reply_buf *response)
+{
+    enum vault_format fmt;
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    if (parse_vault_format(format, &fmt) != 0)
+    {
+        reply(ctx, response, ST_UNKNOWN_FORMAT);
+        return;
+    }
+
+    stream_job *sj = stream_job_new(ctx, stream_export_step, NULL);
+    if (sj == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    sj->format = fmt;
+    stream_job_run(ctx, sj);
+}
+
+static int stream_export_step(client_ctx *ctx, stream_job *sj)
+{
+    reply_stream *rs = &sj->rs;
+    int rc = db_export_entries(ctx->user_id, ctx->data_key, sj->format, sj->cursor, rs);
+    if (rc > 0)
+    {
+        return 1;
+    }
+    if (rc < 0)
+    {
+        if (rs->sent == 0)
+        {
+            stream_rewind(rs);
+        }
+        stream_reply(rs, ST_EXPORT_ERROR);
+    }
+    stream_end(rs);
+    return 0;
+}
+
+static void cmd_import_begin(client_ctx *ctx, const char *format, reply_buf *response)
+{
+    enum vault_format fmt;
+    if (!ctx->active_user[0])
+    {
+        reply(ctx, response, ST_LOGIN_REQUIRED);
+        return;
+    }
+    if (ctx->import)
+    {
+        reply(ctx, response, ST_IMPORT_IN_PROGRESS);
+        return;
+    }
+    if (parse_vault_format(format, &fmt) != 0)
+    {
+        reply(ctx, response, ST_UNKNOWN_FORMAT);
+        return;
+    }
+
+    ctx->import = calloc(1, sizeof(import_state));
+    if (ctx->import == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    ctx->import->format = fmt;
+    reply(ctx, response, ST_IMPORT_STARTED);
+}
+
+/* Imports every complete record in carry + data in one transaction and keeps the partial tail */
+static void cmd_import_data(client_ctx *ctx, const char *data, size_t len, reply_buf *response)
+{
+    import_state *im = ctx->import;
+    if (im == NULL)
+    {
+        reply(ctx, response, ST_NO_IMPORT);
+        return;
+    }
+
+    char *buf = malloc(im->carry_len + len + 1);
+    if (buf == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    memcpy(buf, im->carry, im->carry_len);
+    memcpy(buf + im->carry_len, data, len);
+    size_t total = im->carry_len + len;
+    buf[total] = '\0';
+
+    long added = 0, skipped = 0;
+    int consumed = import_records(ctx, buf, total, 0, &added, &skipped);
+    if (consumed < 0)
+    {
+        reply(ctx, response, ST_IMPORT_CHUNK_FAILED);
+        free(buf);
+        return;
+    }
+
+    /* A single record may not outgrow one frame, which keeps the carry bounded */
+    size_t rest = total - consumed;
+    if (rest > MAX_FRAME_LEN)
+    {
+        free(buf);
+        free(im->carry);
+        free(im);
+        ctx->import = NULL;
+        reply(ctx, response, ST_IMPORT_TOO_LARGE);
+        return;
+    }
+    memmove(buf, buf + consumed, rest);
+    free(im->carry);
+    im->carry = buf;
+    im->carry_len = rest;
+
+    im->added += added;
+    im->skipped += skipped;
+    reply(ctx, response, ST_CHUNK_COMMITTED, added, skipped);
+}
+
+static void cmd_import_end(client_ctx *ctx, reply_buf *response)
+{
+    import_state *im = ctx->import;
+    if (im == NULL)
+    {
+        reply(ctx, response, ST_NO_IMPORT);
+        return;
+    }
+
+    long added = 0, skipped = 0;
+    if (im->carry_len > 0 && import_records(ctx, im->carry, im->carry_len, 1, &added, &skipped) < 0)
+    {
+        reply(ctx, response, ST_IMPORT_FINAL_FAILED);
+    }
+    else
+    {
+        reply(ctx, response, ST_IMPORT_FINISHED, im->added + added, im->skipped + skipped);
+    }
+
+    free(im->carry);
+    free(im);
+    ctx->import = NULL;
+}
+
+/* HELLO|bin1 switches to the binary protocol from the next request on; anything else selects text */
+static void cmd_hello(client_ctx *ctx, const char *version, reply_buf *response)
+{
+    int binary = strcmp(version, PROTO_BINARY) == 0;
+    reply(ctx, response, ST_HELLO, binary ? PROTO_BINARY : PROTO_TEXT);
+    ctx->binary = binary;
+}
+
+/* Per-command latency quantiles and the gauges, as plain text lines */
+static void cmd_stats(client_ctx *ctx, reply_buf *response)
+{
+    if (!ctx->loopback)
+    {
+        reply(ctx, response, ST_ADMIN_ONLY);
+        return;
+    }
+
+    metrics_totals *m = metrics_merge();
+    text_buf text = {0};
+    if (m == NULL)
+    {
+        reply(ctx, response, ST_OUT_OF_MEMORY);
+        return;
+    }
+    metrics_summary(m, &text);
+    free(m);
+
+    reply_stream rs;
+    stream_begin(&rs, ctx);
+    stream_append(&rs, text.p, text.len);
+    stream_end(&rs);
+    free(text.p);
+}
+
+/* Decodes the complete records of buf in place and inserts them; returns bytes consumed or -1 */
+static int import_records(client_ctx *ctx, char *buf, size_t len, int final, long *added, long *skipped)
+{
+    import_state *im = ctx->import;
+    char *p = buf, *end = buf + len;
+
+    int max_items = 1;
+    for (char *q = buf; q < end; ++q)
+    {
+        max_items += *q == '\n';
+    }
+    batch_item *items = calloc(max_items, sizeof(batch_item));
+    unsigned char *status = calloc(max_items, 1);
+    if (items == NULL || status == NULL)
+    {
+        free(items);
+        free(status);
+        return -1;
+    }
+
+    int count = 0;
+    while (p < end)
+    {
+        char *rec_end = im->format == VAULT_CSV ? csv_record_end(p, end, final) : memchr(p, '\n', end - p);
+        if (rec_end == NULL)
+        {
+            if (!final)
+            {
+                break;
+            }
+            rec_end = end;
+        }
+        char *next = rec_end < end ? rec_end + 1 : end;
+        if (rec_end > p && rec_end[-1] == '\r')
+        {
+            rec_end--;
+        }
+        if (rec_end == p)
+        {
+            p = next;
+            continue;
+        }
+
+        batch_item *it = &items[count];
+        int ok;
+        if (im->format == VAULT_CSV)
+        {
+            char *f[6];
+            ok = csv_decode_record(p, rec_end, f, 6) == 6;
+            if (ok && !im->header_checked && strcmp(f[0], "category") == 0 && strcmp(f[1], "title") == 0)
+            {
+                im->header_checked = 1;
+                p = next;
+                continue;
+            }
+            if (ok)
+            {
+                *it = (batch_item){f[0], f[1], f[2], f[3], f[4], f[5]};
+            }
+        }
+        else
+        {
+            ok = json_decode_record(p, rec_end, it) == 0;
+        }
+        im->header_checked = 1;
+
+        status[count++] = ok && it->cat[0] && it->title[0] ? BATCH_OK : BATCH_BAD_LINE;
+        p = next;
+    }
+
+    int rc = 0;
+    if (count > 0)
+    {
+        rc = db_insert_entry_batch(ctx->user_id, ctx->data_key, items, count, status, 1);
+    }
+    for (int i = 0; i < count && rc == 0; ++i)
+    {
+        if (status[i] == BATCH_OK)
+        {
+            (*added)++;
+        }
+        else
+        {
+            (*skipped)++;
+        }
+    }
+
+    free(items);
+    free(status);
+    return rc == 0 ? (int)(p - buf) : -1;
+}
+
+/* Finds the newline ending the CSV record at p, honouring quoted fields; NULL if it is incomplete */
+static char *csv_record_end(char *p, char *end, int final)
+{
+    int quoted = 0;
+    for (; p < end; ++p)
+    {
+        if (*p == '"')
+        {
+            quoted = !quoted;
+        }
+        else if (*p == '\n' && !quoted)
+        {
+            return p;
+        }
+    }
+    return final ? end : NULL;
+}
+
+/* Splits [p,end) into NUL-terminated fields, unquoting in place; returns the field count */
+static int csv_decode_record(char *p, char *end, char **fields, int max)
+{
+    int n = 0;
+    char *out = p;
+
+    while (n < max)
+    {
+        fields[n++] = out;
+        if (p < end && *p == '"')
+        {
+            for (++p; p < end; ++p)
+            {
+                if (*p == '"')
+                {
+                    if (p + 1 < end && p[1] == '"')
+                    {
+                        *out++ = *p++;
+                        continue;
+                    }
+                    ++p;
+                    break;
+                }
+                *out++ = *p;
+            }
+        }
+        while (p < end && *p != ',')
+        {
+            *out++ = *p++;
+        }
+        if (p >= end)
+        {
+            *out = '\0';
+            return n;
+        }
+        *out++ = '\0';
+        ++p;
+    }
+    return n + 1;
+}
+
+/* Reads a JSON string at *pp in place, leaving *pp after the closing quote; NULL if malformed */
+static char *json_decode_string(char **pp, char *end)
+{
+    char *p = *pp;
+    if (p >= end || *p != '"')
+    {
+        return NULL;
+    }
+    char *start = ++p, *out = p;
+
+    while (p < end && *p != '"')
+    {
+        if (*p != '\\')
+        {
+            *out++ = *p++;
+            continue;
+        }
+        if (++p >= end)
+        {
+            return NULL;
+        }
+        switch (*p++)
+        {
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'u':
+        {
+            unsigned cp;
+            if (end - p < 4 || sscanf(p, "%4x", &cp) != 1)
+            {
+                return NULL;
+            }
+            p += 4;
+            if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+            {
+                unsigned lo;
+                if (sscanf(p + 2, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000)
+                {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+            }
+            if (cp < 0x80)
+            {
+                *out++ = cp;
+            }
+            else if (cp < 0x800)
+            {
+                *out++ = 0xC0 | (cp >> 6);
+                *out++ = 0x80 | (cp & 0x3F);
+            }
+            else if (cp < 0x10000)
+            {
+                *out++ = 0xE0 | (cp >> 12);
+                *out++ = 0x80 | ((cp >> 6) & 0x3F);
+                *out++ = 0x80 | (cp & 0x3F);
+            }
+            else
+            {
+                *out++ = 0xF0 | (cp >> 18);
+                *out++ = 0x80 | ((cp >> 12) & 0x3F);
+                *out++ = 0x80 | ((cp >> 6) & 0x3F);
+                *out++ = 0x80 | (cp & 0x3F);
+            }
+            break;
+        }
+        default: *out++ = p[-1]; break;
+        }
+    }
+    if (p >= end)
+    {
+        return NULL;
+    }
+    *pp = p + 1;
+    *out = '\0';
+    return start;
+}
+
+/* Decodes one flat object of string members in place; unknown keys are ignored */
+static int json_decode_record(char *p, char *end, batch_item *item)
+{
+    static const char empty[] = "";
+    *item = (batch_item){empty, empty, empty, empty, empty, empty};
+
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+    if (p >= end || *p++ != '{')
+    {
+        return 1;
+    }
+
+    while (1)
+    {
+        while (p < end && (isspace((unsigned char)*p) || *p == ','))
+            p++;
+        if (p < end && *p == '}')
+        {
+            return 0;
+        }
+
+        char *key = json_decode_string(&p, end);
+        if (key == NULL)
+        {
+            return 1;
+        }
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+        if (p >= end || *p++ != ':')
+        {
+            return 1;
+        }
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+        char *value = json_decode_string(&p, end);
+        if (value == NULL)
+        {
+            return 1;
+        }
+
+        if (strcmp(key, "category") == 0)
+            item->cat = value;
+        else if (strcmp(key, "title") == 0)
+            item->title = value;
+        else if (strcmp(key, "user") == 0)
+            item->usr = value;
+        else if (strcmp(key, "url") == 0)
+            item->url = value;
+        else if (strcmp(key, "notes") == 0)
+            item->notes = value;
+        else if (strcmp(key, "password") == 0)
+            item->pass = value;
+    }
+}
+
+static void stream_csv_field(reply_stream *rs, const char *s, int last)
+{
+    if (s == NULL)
+    {
+        s = "";
+    }
+    if (s[strcspn(s, ",\"\r\n")] == '\0')
+    {
+        stream_append(rs, s, strlen(s));
+    }
+    else
+    {
+        stream_append(rs, "\"", 1);
+        for (const char *q; (q = strchr(s, '"')) != NULL; s = q + 1)
+        {
+            stream_append(rs, s, q - s + 1);
+            stream_append(rs, "\"", 1);
+        }
+        stream_append(rs, s, strlen(s));
+        stream_append(rs, "\"", 1);
+    }
+    stream_append(rs, last ? "\n" : ",", 1);
+}
+
+static void stream_json_string(reply_stream *rs, const char *key, const char *s, int last)
+{
+    stream_printf(rs, "\"%s\":\"", key);
+    for (const char *p = s ? s : ""; *p; ++p)
+    {
+        unsigned char ch = *p;
+        if (ch == '"' || ch == '\\')
+        {
+            char esc[2] = {'\\', ch};
+            stream_append(rs, esc, 2);
+        }
+        else if (ch == '\n')
+        {
+            stream_append(rs, "\\n", 2);
+        }
+        else if (ch < 0x20)
+        {
+            stream_printf(rs, "\\u%04x", ch);
+        }
+        else
+        {
+            stream_append(rs, p, 1);
+        }
+    }
+    stream_append(rs, last ? "\"}\n" : "\",", last ? 3 : 2);
+}
+
+/* Vault cache */
+
+static void vault_cache_init(size_t budget)
+{
+    vault_shard_budget = budget / VAULT_SHARDS;
+    for (int i = 0; i < VAULT_SHARDS; ++i)
+    {
+        pthread_mutex_init(&vault_shards[i].lock, NULL);
+    }
+}
+
+static vault_shard *vault_shard_for(sqlite3_int64 user_id)
+{
+    return &vault_shards[(uint64_t)user_id % VAULT_SHARDS];
+}
+
+/* Caller holds s->lock */
+static vault *vault_find(vault_shard *s, sqlite3_int64 user_id)
+{
+    vault *v = s->buckets[((uint64_t)user_id / VAULT_SHARDS) % VAULT_BUCKETS];
+    while (v && v->user_id != user_id)
+    {
+        v = v->hash_next;
+    }
+    return v;
+}
+
+/* Loads a vault from SQLite and installs it unless a write landed meanwhile; returns it with the shard locked, or NULL unlocked */
+static vault *vault_fill(sqlite3_int64 user_id, const unsigned char *key)
+{
+    vault_shard *s = vault_shard_for(user_id);
+    if (vault_shard_budget == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    unsigned long epoch = s->epoch;
+    pthread_mutex_unlock(&s->lock);
+
+    vault *v = calloc(1, sizeof(vault));
+    if (v == NULL)
+    {
+        return NULL;
+    }
+    v->user_id = user_id;
+    if (db_load_vault(user_id, key, v) != 0)
+    {
+        vault_free(v);
+        return NULL;
+    }
+    v->bytes = sizeof(vault) + (size_t)v->cats.cap * (sizeof(vault_row *) + sizeof(row_list));
+    for (int i = 0; i < v->cats.count; ++i)
+    {
+        v->bytes += v->cats.rows[i]->bytes + (size_t)v->entries[i].cap * sizeof(vault_row *);
+        for (int j = 0; j < v->entries[i].count; ++j)
+        {
+            v->bytes += v->entries[i].rows[j]->bytes;
+        }
+    }
+
+    /* A vault too big for its shard would only push everyone else out */
+    pthread_mutex_lock(&s->lock);
+    if (s->epoch != epoch || v->bytes > vault_shard_budget / 2 || vault_find(s, user_id))
+    {
+        pthread_mutex_unlock(&s->lock);
+        vault_free(v);
+        return NULL;
+    }
+
+    vault **bucket = &s->buckets[((uint64_t)user_id / VAULT_SHARDS) % VAULT_BUCKETS];
+    v->hash_next = *bucket;
+    *bucket = v;
+    v->lru_next = s->lru_head;
+    if (s->lru_head)
+    {
+        s->lru_head->lru_prev = v;
+    }
+    s->lru_head = v;
+    if (s->lru_tail == NULL)
+    {
+        s->lru_tail = v;
+    }
+    s->bytes += v->bytes;
+    v->expires = time(NULL) + VAULT_IDLE_SEC;
+
+    vault_evict(s, 0);
+    return v;
+}
+
+/* Touching a vault moves it to the front and pushes its expiry out; caller holds s->lock */
+static void vault_touch(vault_shard *s, vault *v)
+{
+    if (v != s->lru_head)
+    {
+        v->lru_prev->lru_next = v->lru_next;
+        if (v->lru_next)
+        {
+            v->lru_next->lru_prev = v->lru_prev;
+        }
+        else
+        {
+            s->lru_tail = v->lru_prev;
+        }
+        v->lru_prev = NULL;
+        v->lru_next = s->lru_head;
+        s->lru_head->lru_prev = v;
+        s->lru_head = v;
+    }
+    v->expires = time(NULL) + VAULT_IDLE_SEC;
+}
+
+/* Caller holds s->lock */
+static void vault_unlink(vault_shard *s, vault *v)
+{
+    vault **p = &s->buckets[((uint64_t)v->user_id / VAULT_SHARDS) % VAULT_BUCKETS];
+    while (*p != v)
+    {
+        p = &(*p)->hash_next;
+    }
+    *p = v->hash_next;
+
+    if (v->lru_prev)
+    {
+        v->lru_prev->lru_next = v->lru_next;
+    }
+    else
+    {
+        s->lru_head = v->lru_next;
+    }
+    if (v->lru_next)
+    {
+        v->lru_next->lru_prev = v->lru_prev;
+    }
+    else
+    {
+        s->lru_tail = v->lru_prev;
+    }
+    s->bytes -= v->bytes;
+}
+
+/* Rows still referenced by an in-flight listing stay alive until it lets go */
+static void vault_free(vault *v)
+{
+    for (int i = 0; i < v->cats.count; ++i)
+    {
+        vault_row_release(v->cats.rows[i]);
+        if (v->entries)
+        {
+            for (int j = 0; j < v->entries[i].count; ++j)
+            {
+                vault_row_release(v->entries[i].rows[j]);
+            }
+            free(v->entries[i].rows);
+        }
+    }
+    free(v->cats.rows);
+    free(v->entries);
+    search_index_free(v->index);
+    site_index_free(v->sites);
+    free(v);
+}
+
+/* Drops least recently used vaults while over budget, and any that expired before now (0: budget only); caller holds s->lock */
+static void vault_evict(vault_shard *s, time_t now)
+{
+    vault *v = s->lru_tail;
+    while (v && v != s->lru_head)
+    {
+        vault *prev = v->lru_prev;
+        if (s->bytes > vault_shard_budget || (now && v->expires <= now))
+        {
+            vault_unlink(s, v);
+            vault_free(v);
+            atomic_fetch_add_explicit(&cache_evictions, 1, memory_order_relaxed);
+        }
+        v = prev;
+    }
+    if (v && now && v->expires <= now)
+    {
+        vault_unlink(s, v);
+        vault_free(v);
+        atomic_fetch_add_explicit(&cache_evictions, 1, memory_order_relaxed);
+    }
+}
+
+static void *vault_cache_run(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        sleep(VAULT_SWEEP_SEC);
+        time_t now = time(NULL);
+        for (int i = 0; i < VAULT_SHARDS; ++i)
+        {
+            pthread_mutex_lock(&vault_shards[i].lock);
+            vault_evict(&vault_shards[i], now);
+            pthread_mutex_unlock(&vault_shards[i].lock);
+        }
+    }
+    return NULL;
+}
+
+/* A logged-out vault only lingers briefly, in case the user comes straight back */
+static void vault_cache_logout(sqlite3_int64 user_id)
+{
+    vault_shard *s = vault_shard_for(user_id);
+    pthread_mutex_lock(&s->lock);
+    vault *v = vault_find(s, user_id);
+    time_t soon = time(NULL) + VAULT_LOGOUT_IDLE_SEC;
+    if (v && v->expires > soon)
+    {
+        v->expires = soon;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Streams categories (cat == NULL) or one category's entries from the cache, same contract as
+ * db_fetch_categories/db_fetch_entries. Rows are pinned a batch at a time so the shard lock is
+ * never held while the client drains the reply. Falls back to SQLite when the vault cannot be cached.
+ * Once the stream stalls it stops after the batch, with *next_cursor set even though the page is not full.
+ */
+static int vault_list(sqlite3_int64 user_id, const unsigned char *key, const char *cat, sqlite3_int64 after_id, int limit, reply_stream *rs, sqlite3_int64 *next_cursor)
+{
+    vault_shard *s = vault_shard_for(user_id);
+    int rows = 0;
+    *next_cursor = 0;
+
+    for (int first = 1;; first = 0)
+    {
+        pthread_mutex_lock(&s->lock);
+        vault *v = vault_find(s, user_id);
+        if (first)
+        {
+            atomic_fetch_add_explicit(v ? &cache_hits : &cache_misses, 1, memory_order_relaxed);
+            if (v == NULL)
+            {
+                pthread_mutex_unlock(&s->lock);
+                v = vault_fill(user_id, key);
+            }
+        }
+        if (v == NULL)
+        {
+            /* Not cacheable, or evicted mid-listing: SQLite picks up after the last row sent */
+            if (!first)
+            {
+                pthread_mutex_unlock(&s->lock);
+            }
+            do
+            {
+                int want = limit < 0 || limit - rows > STREAM_BATCH ? STREAM_BATCH : limit - rows;
+                int n = cat ? db_fetch_entries(user_id, key, cat, after_id, want, rs, next_cursor)
+                            : db_fetch_categories(user_id, after_id, want, rs, next_cursor);
+                if (n < 0)
+                {
+                    return -1;
+                }
+                rows += n;
+                after_id = *next_cursor;
+            } while (*next_cursor && rows != limit && !rs->stalled);
+            return rows;
+        }
+
+        vault_touch(s, v);
+
+        const row_list *list = &v->cats;
+        if (cat)
+        {
+            int i = 0;
+            while (i < v->cats.count && strcmp(v->cats.rows[i]->f[0], cat) != 0)
+            {
+                i++;
+            }
+            if (i == v->cats.count)
+            {
+                pthread_mutex_unlock(&s->lock);
+                return rows;
+            }
+            list = &v->entries[i];
+        }
+
+        int pos;
+        row_list_find(list, after_id, &pos);
+        if (pos < list->count && list->rows[pos]->id == after_id)
+        {
+            pos++;
+        }
+        vault_row *batch[VAULT_BATCH];
+        int n = 0;
+        while (pos < list->count && n < VAULT_BATCH && (limit < 0 || rows + n < limit))
+        {
+            batch[n] = list->rows[pos++];
+            atomic_fetch_add_explicit(&batch[n]->refs, 1, memory_order_relaxed);
+            n++;
+        }
+        int more = pos < list->count;
+        pthread_mutex_unlock(&s->lock);
+
+        for (int i = 0; i < n; ++i)
+        {
+            const vault_row *r = batch[i];
+            if (cat)
+            {
+                stream_entry(rs, r->f);
+            }
+            else
+            {
+                stream_category(rs, r->f[0]);
+            }
+            after_id = r->id;
+            vault_row_release(batch[i]);
+        }
+        rows += n;
+
+        if (!more)
+        {
+            return rows;
+        }
+        if ((limit >= 0 && rows == limit) || rs->stalled)
+        {
+            *next_cursor = after_id;
+            return rows;
+        }
+    }
+}
+
+/* One allocation holds the row and copies of its fields; NULL columns stay NULL */
+static vault_row *vault_row_new(sqlite3_int64 id, const char *const *fields, int nfields)
+{
+    size_t len[5], total = sizeof(vault_row);
+    for (int i = 0; i < nfields; ++i)
+    {
+        len[i] = fields[i] ? strlen(fields[i]) + 1 : 0;
+        total += len[i];
+    }
+
+    vault_row *row = malloc(total);
+    if (row == NULL)
+    {
+        return NULL;
+    }
+    atomic_init(&row->refs, 1);
+    row->id = id;
+    row->bytes = total;
+
+    char *p = (char *)(row + 1);
+    for (int i = 0; i < 5; ++i)
+    {
+        row->f[i] = NULL;
+        if (i < nfields && fields[i])
+        {
+            memcpy(p, fields[i], len[i]);
+            row->f[i] = p;
+            p += len[i];
+        }
+    }
+    return row;
+}
+
+static void vault_row_release(vault_row *row)
+{
+    if (atomic_fetch_sub_explicit(&row->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(row);
+    }
+}
+
+static int row_list_append(row_list *l, vault_row *row)
+{
+    if (l->count == l->cap)
+    {
+        int cap = l->cap ? l->cap * 2 : 8;
+        vault_row **rows = realloc(l->rows, cap * sizeof(vault_row *));
+        if (rows == NULL)
+        {
+            vault_row_release(row);
+            return 1;
+        }
+        l->rows = rows;
+        l->cap = cap;
+    }
+    l->rows[l->count++] = row;
+    return 0;
+}
+
+static void row_list_free(row_list *l)
+{
+    for (int i = 0; i < l->count; ++i)
+    {
+        vault_row_release(l->rows[i]);
+    }
+    free(l->rows);
+}
+
+/* Binary search by ID; *pos is the match or the insertion point. Returns 0 when found */
+static int row_list_find(const row_list *l, sqlite3_int64 id, int *pos)
+{
+    int lo = 0, hi = l->count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (l->rows[mid]->id < id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return (lo < l->count && l->rows[lo]->id == id) ? 0 : 1;
+}
+
+/*
+ * Write-through: the commit thread calls these after a group commits, in commit order. Each bumps
+ * the shard epoch so a fill that read an older snapshot is discarded. When the cached copy cannot
+ * be patched (out of memory, or a title matched several rows), it is dropped and refilled on the next listing.
+ */
+
+static vault *vault_begin_update(const write_op *op, vault_shard **s)
+{
+    *s = vault_shard_for(op->id[0]);
+    pthread_mutex_lock(&(*s)->lock);
+    (*s)->epoch++;
+    return vault_find(*s, op->id[0]);
+}
+
+static void vault_end_update(vault_shard *s, vault *v, int failed)
+{
+    if (v && failed)
+    {
+        vault_unlink(s, v);
+        vault_free(v);
+    }
+    else if (v)
+    {
+        vault_evict(s, 0);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void vault_on_category_added(const write_op *op)
+{
+    vault_shard *s;
+    vault *v = vault_begin_update(op, &s);
+    int failed = 0;
+    if (v)
+    {
+        vault_row *row = vault_row_new(op->out[0], &op->text[0], 1);
+        int old_cap = v->cats.cap;
+        failed = row == NULL || row_list_append(&v->cats, row) != 0;
+        if (!failed && v->cats.cap != old_cap)
+        {
+            row_list *entries = realloc(v->entries, v->cats.cap * sizeof(row_list));
+            if (entries == NULL)
+            {
+                failed = 1;
+                v->cats.count--;
+                vault_row_release(row);
+            }
+            else
+            {
+                memset(entries + old_cap, 0, (v->cats.cap - old_cap) * sizeof(row_list));
+                v->entries = entries;
+                v->bytes += (v->cats.cap - old_cap) * (sizeof(vault_row *) + sizeof(row_list));
+                s->bytes += (v->cats.cap - old_cap) * (sizeof(vault_row *) + sizeof(row_list));
+            }
+        }
+        if (!failed)
+        {
+            v->bytes += row->bytes;
+            s->bytes += row->bytes;
+        }
+    }
+    vault_end_update(s, v, failed);
+}
+
+static void vault_on_category_removed(const write_op *op)
+{
+    vault_shard *s;
+    vault *v = vault_begin_update(op, &s);
+    int pos;
+    if (v && row_list_find(&v->cats, op->id[1], &pos) == 0)
+    {
+        row_list *entries = &v->entries[pos];
+        size_t freed = v->cats.rows[pos]->bytes;
+        for (int j = 0; j < entries->count; ++j)
+        {
+            vault_index_patch(s, v, entries->rows[j], NULL);
+            freed += entries->rows[j]->bytes;
+            vault_row_release(entries->rows[j]);
+        }
+        free(entries->rows);
+        vault_row_release(v->cats.rows[pos]);
+
+        memmove(&v->cats.rows[pos], &v->cats.rows[pos + 1], (v->cats.count - pos - 1) * sizeof(vault_row *));
+        memmove(&v->entries[pos], &v->entries[pos + 1], (v->cats.count - pos - 1) * sizeof(row_list));
+        v->cats.count--;
+        memset(&v->entries[v->cats.count], 0, sizeof(row_list));
+        v->bytes -= freed;
+        s->bytes -= freed;
+    }
+    vault_end_update(s, v, 0);
+}
+
+static void vault_on_entry_added(const write_op *op)
+{
+    vault_shard *s;
+    vault *v = vault_begin_update(op, &s);
+    int failed = 0, pos;
+    if (v && row_list_find(&v->cats, op->id[1], &pos) == 0)
+    {
+        vault_row *row = vault_row_new(op->out[0], op->text, 5);
+        failed = row == NULL || row_list_append(&v->entries[pos], row) != 0;
+        if (!failed)
+        {
+            v->bytes += row->bytes;
+            s->bytes += row->bytes;
+            vault_index_patch(s, v, NULL, row);
+        }
+    }
+    vault_end_update(s, v, failed);
+}
+
+static void vault_on_entry_updated(const write_op *op)
+{
+    vault_shard *s;
+    vault *v = vault_begin_update(op, &s);
+    int failed = op->out[0] < 0, cat_pos, pos;
+    if (v && !failed && row_list_find(&v->cats, op->out[1], &cat_pos) == 0 &&
+        row_list_find(&v->entries[cat_pos], op->out[0], &pos) == 0)
+    {
+        vault_row **slot = &v->entries[cat_pos].rows[pos];
+        vault_row *row = vault_row_new(op->out[0], op->text, 5);
+        failed = row == NULL;
+        if (!failed)
+        {
+            v->bytes += row->bytes - (*slot)->bytes;
+            s->bytes += row->bytes - (*slot)->bytes;
+            vault_index_patch(s, v, *slot, row);
+            vault_row_release(*slot);
+            *slot = row;
+        }
+    }
+    vault_end_update(s, v, failed);
+}
+
+static void vault_on_entry_removed(const write_op *op)
+{
+    vault_shard *s;
+    vault *v = vault_begin_update(op, &s);
+    int failed = op->out[0] < 0, cat_pos, pos;
+    if (v && op->out[0] > 0 && row_list_find(&v->cats, op->out[1], &cat_pos) == 0 &&
+        row_list_find(&v->entries[cat_pos], op->out[0], &pos) == 0)
+    {
+        row_list *l = &v->entries[cat_pos];
+        vault_index_patch(s, v, l->rows[pos], NULL);
+        v->bytes -= l->rows[pos]->bytes;
+        s->bytes -= l->rows[pos]->bytes;
+        vault_row_release(l->rows[pos]);
+        memmove(&l->rows[pos], &l->rows[pos + 1], (l->count - pos - 1) * sizeof(vault_row *));
+        l->count--;
+    }
+    vault_end_update(s, v, failed);
+}
+
+/* Bulk writes are rare; refilling is simpler than patching row by row */
+static void vault_on_invalidate(const write_op *op)
+{
+    vault_shard *s;
+    vault *v = vault_begin_update(op, &s);
+    vault_end_update(s, v, 1);
+}
+
+/*
+ * Keeps a cached vault's SEARCH and FIND_BY_URL indexes in step with a write; caller holds s->lock.
+ * An index that cannot be patched, or that has gathered too many empty slots, is dropped and rebuilt
+ * by the next command that needs it.
+ */
+static void vault_index_patch(vault_shard *s, vault *v, const vault_row *removed, vault_row *added)
+{
+    search_index *ix = v->index;
+    if (ix)
+    {
+        size_t before = ix->bytes;
+        if (removed)
+        {
+            search_index_remove(ix, removed->id);
+        }
+        if ((added && search_index_add(ix, added) != 0) || (ix->dead > SEARCH_TAIL && ix->dead * 2 > ix->nslots))
+        {
+            v->bytes -= before;
+            s->bytes -= before;
+            search_index_free(ix);
+            v->index = NULL;
+        }
+        else
+        {
+            v->bytes += ix->bytes - before;
+            s->bytes += ix->bytes - before;
+        }
+    }
+
+    site_index *sx = v->sites;
+    if (sx)
+    {
+        size_t before = sx->bytes;
+        if (removed)
+        {
+            site_index_remove(sx, removed);
+        }
+        if (added && site_index_add(sx, added) != 0)
+        {
+            v->bytes -= before;
+            s->bytes -= before;
+            site_index_free(sx);
+            v->sites = NULL;
+        }
+        else
+        {
+            v->bytes += sx->bytes - before;
+            s->bytes += sx->bytes - before;
+        }
+    }
+}
+
+/*
+ * Streams the user's best limit matches for q, best first; returns the row count or -1. Hits are
+ * pinned before the shard lock is dropped, like vault_list. A cached vault too big to index beside
+ * is scanned from its pinned rows, and one that cannot be cached at all from SQLite.
+ */
+static int vault_search(sqlite3_int64 user_id, const unsigned char *key, const search_query *q, int limit, reply_stream *rs)
+{
+    vault_row *rows[MAX_PAGE_LIMIT];
+    uint32_t score[MAX_PAGE_LIMIT];
+    search_hits hits = {rows, score, 0, limit};
+
+    vault_shard *s = vault_shard_for(user_id);
+    pthread_mutex_lock(&s->lock);
+    vault *v = vault_find(s, user_id);
+    atomic_fetch_add_explicit(v ? &cache_hits : &cache_misses, 1, memory_order_relaxed);
+    if (v == NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        v = vault_fill(user_id, key);
+    }
+
+    int failed = 0;
+    /* The index takes about as much memory as the rows it covers */
+    if (v && v->index == NULL && v->bytes * 2 > vault_shard_budget / 2)
+    {
+        vault_touch(s, v);
+        int n;
+        vault_row **pinned = vault_pin_entries(s, v, &n);
+        failed = pinned == NULL;
+        search_hits_scan(&hits, pinned, n, search_match, q);
+    }
+    else
+    {
+        if (v && v->index == NULL)
+        {
+            v = vault_index_build(s, v);
+        }
+        if (v)
+        {
+            /* A query may sort the index's newest words in */
+            size_t before = v->index->bytes;
+            vault_touch(s, v);
+            search_index_query(v->index, q, &hits);
+            v->bytes += v->index->bytes - before;
+            s->bytes += v->index->bytes - before;
+            pthread_mutex_unlock(&s->lock);
+        }
+        else
+        {
+            failed = db_match_entries(user_id, key, search_match, q, &hits) != 0;
+        }
+    }
+
+    search_hits_finish(&hits);
+    for (int i = 0; i < hits.count; ++i)
+    {
+        if (!failed)
+        {
+            stream_entry(rs, rows[i]->f);
+        }
+        vault_row_release(rows[i]);
+    }
+    return failed ? -1 : hits.count;
+}
+
+/* Pins every entry of v and drops s->lock; NULL (and *n 0) when out of memory */
+static vault_row **vault_pin_entries(vault_shard *s, vault *v, int *n)
+{
+    int total = 0;
+    for (int i = 0; i < v->cats.count; ++i)
+    {
+        total += v->entries[i].count;
+    }
+    vault_row **pinned = malloc((total ? total : 1) * sizeof(vault_row *));
+    *n = 0;
+    for (int i = 0; pinned && i < v->cats.count; ++i)
+    {
+        for (int j = 0; j < v->entries[i].count; ++j)
+        {
+            pinned[*n] = v->entries[i].rows[j];
+            atomic_fetch_add_explicit(&pinned[*n]->refs, 1, memory_order_relaxed);
+            (*n)++;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return pinned;
+}
+
+/*
+ * Indexes v from pinned rows with the shard lock dropped, then installs the index unless a write
+ * landed meanwhile. Called and returns with s->lock held and v indexed, or returns NULL unlocked.
+ */
+static vault *vault_index_build(vault_shard *s, vault *v)
+{
+    sqlite3_int64 user_id = v->user_id;
+    unsigned long epoch = s->epoch;
+    int n;
+    vault_row **pinned = vault_pin_entries(s, v, &n);
+    if (pinned == NULL)
+    {
+        return NULL;
+    }
+
+    search_index *ix = calloc(1, sizeof(search_index));
+    int failed = ix == NULL;
+    for (int i = 0; !failed && i < n; ++i)
+    {
+        failed = search_index_add(ix, pinned[i]) != 0;
+    }
+    failed = failed || search_index_sort(ix) != 0;
+
+    /* Same rule as vault_fill: a vault that outgrew half its shard would only push everyone else out */
+    pthread_mutex_lock(&s->lock);
+    v = vault_find(s, user_id);
+    if (v && v->index == NULL && !failed && s->epoch == epoch && v->bytes + ix->bytes <= vault_shard_budget / 2)
+    {
+        v->index = ix;
+        v->bytes += ix->bytes;
+        s->bytes += ix->bytes;
+        ix = NULL;
+        vault_touch(s, v);
+        vault_evict(s, 0);
+    }
+    search_index_free(ix);
+    if (v == NULL || v->index == NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        v = NULL;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        vault_row_release(pinned[i]);
+    }
+    free(pinned);
+    return v;
+}
+
+/*
+ * Streams the user's entries for the site of q's host, the page's own host first; returns the row
+ * count or -1. Same tiers as vault_search: the cached vault's site index, its pinned rows when no
+ * index fits beside it, or SQLite.
+ */
+static int vault_find_url(sqlite3_int64 user_id, const unsigned char *key, const url_query *q, int limit, reply_stream *rs)
+{
+    vault_row *rows[MAX_PAGE_LIMIT];
+    uint32_t score[MAX_PAGE_LIMIT];
+    search_hits hits = {rows, score, 0, limit};
+
+    vault_shard *s = vault_shard_for(user_id);
+    pthread_mutex_lock(&s->lock);
+    vault *v = vault_find(s, user_id);
+    atomic_fetch_add_explicit(v ? &cache_hits : &cache_misses, 1, memory_order_relaxed);
+    if (v == NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        v = vault_fill(user_id, key);
+    }
+    if (v && v->sites == NULL)
+    {
+        v = vault_sites_build(s, v);
+    }
+
+    int failed = 0;
+    if (v)
+    {
+        vault_touch(s, v);
+        site *st = site_index_find(v->sites, q->host + q->site);
+        for (int i = 0; st && i < st->count; ++i)
+        {
+            uint32_t match = url_match(st->rows[i]->f, q);
+            if (match && search_hits_wants(&hits, match, st->rows[i]->id))
+            {
+                search_hits_offer(&hits, st->rows[i], match);
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    else
+    {
+        failed = db_match_entries(user_id, key, url_match, q, &hits) != 0;
+    }
+
+    search_hits_finish(&hits);
+    for (int i = 0; i < hits.count; ++i)
+    {
+        if (!failed)
+        {
+            stream_entry(rs, rows[i]->f);
+        }
+        vault_row_release(rows[i]);
+    }
+    return failed ? -1 : hits.count;
+}
+
+/* vault_index_build for the site index */
+static vault *vault_sites_build(vault_shard *s, vault *v)
+{
+    sqlite3_int64 user_id = v->user_id;
+    unsigned long epoch = s->epoch;
+    int n;
+    vault_row **pinned = vault_pin_entries(s, v, &n);
+    if (pinned == NULL)
+    {
+        return NULL;
+    }
+
+    site_index *ix = calloc(1, sizeof(site_index));
+    int failed = ix == NULL;
+    for (int i = 0; !failed && i < n; ++i)
+    {
+        failed = site_index_add(ix, pinned[i]) != 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    v = vault_find(s, user_id);
+    if (v && v->sites == NULL && !failed && s->epoch == epoch && v->bytes + ix->bytes <= vault_shard_budget / 2)
+    {
+        v->sites = ix;
+        v->bytes += ix->bytes;
+        s->bytes += ix->bytes;
+        ix = NULL;
+        vault_touch(s, v);
+        vault_evict(s, 0);
+    }
+    site_index_free(ix);
+    if (v == NULL || v->sites == NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        v = NULL;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        vault_row_release(pinned[i]);
+    }
+    free(pinned);
+    return v;
+}
+
+/* Search index */
+
+/* Copies the next run of letters, digits and non-ASCII bytes at *p, lowercased and cut to SEARCH_WORD_MAX; returns its length, 0 at the end */
+static int search_next_word(const char **p, char *word)
+{
+    const unsigned char *c = (const unsigned char *)*p;
+    while (*c && !isalnum(*c) && *c < 0x80)
+    {
+        c++;
+    }
+    int len = 0;
+    while (*c && (isalnum(*c) || *c >= 0x80))
+    {
+        if (len < SEARCH_WORD_MAX)
+        {
+            word[len++] = (char)tolower(*c);
+        }
+        c++;
+    }
+    word[len] = '\0';
+    *p = (const char *)c;
+    return len;
+}
+
+/* Nothing the client sends is query syntax: every word is a prefix that must match. Returns the number of terms */
+static int search_parse(const char *query, search_query *q)
+{
+    q->count = 0;
+    while (q->count < SEARCH_MAX_TERMS && (q->len[q->count] = search_next_word(&query, q->term[q->count])) > 0)
+    {
+        q->count++;
+    }
+    return q->count;
+}
+
+/* Fields in a match mask are title, user, URL and notes from the low bit up; a title hit counts most */
+static unsigned search_weight(unsigned mask)
+{
+    return (mask & 1) * 8 + (mask & 2) * 2 + (mask & 4) / 2 + (mask & 8) / 8;
+}
+
+/* Scores one entry the way the index would: per term, every field a word starts with it and again every field holding it whole. 0 if a term is missing */
+static uint32_t search_match(const char *const *f, const void *query)
+{
+    const search_query *q = query;
+    unsigned mask[SEARCH_MAX_TERMS] = {0};
+    char word[SEARCH_WORD_MAX + 1];
+    for (int i = 0; i < 4; ++i)
+    {
+        const char *p = f[i];
+        int len;
+        while (p && (len = search_next_word(&p, word)) > 0)
+        {
+            for (int t = 0; t < q->count; ++t)
+            {
+                if (len >= q->len[t] && memcmp(word, q->term[t], q->len[t]) == 0)
+                {
+                    mask[t] |= (1u << i) | (len == q->len[t] ? 1u << (i + 4) : 0);
+                }
+            }
+        }
+    }
+
+    uint32_t score = 0;
+    for (int t = 0; t < q->count; ++t)
+    {
+        if (mask[t] == 0)
+        {
+            return 0;
+        }
+        score += search_weight(mask[t] & 15) + search_weight(mask[t] >> 4);
+    }
+    return score;
+}
+
+static uint32_t search_hash(const char *text)
+{
+    uint32_t h = 2166136261u;
+    for (; *text; ++text)
+    {
+        h = (h ^ (unsigned char)*text) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t search_id_hash(sqlite3_int64 id)
+{
+    return (uint32_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/* Finds or adds a word; NULL when out of memory */
+static search_word *search_index_word(search_index *ix, const char *text, int len)
+{
+    uint32_t mask = ix->word_cap * 2 - 1;
+    uint32_t h = ix->word_cap ? search_hash(text) & mask : 0;
+    while (ix->word_cap && ix->word_hash[h])
+    {
+        search_word *w = ix->words[ix->word_hash[h] - 1];
+        if (strcmp(w->text, text) == 0)
+        {
+            return w;
+        }
+        h = (h + 1) & mask;
+    }
+
+    if (ix->nwords == ix->word_cap)
+    {
+        int cap = ix->word_cap ? ix->word_cap * 2 : 256;
+        search_word **words = realloc(ix->words, cap * sizeof(search_word *));
+        if (words == NULL)
+        {
+            return NULL;
+        }
+        ix->words = words;
+        search_word **order = realloc(ix->order, cap * sizeof(search_word *));
+        uint32_t *table = calloc(cap * 2, sizeof(uint32_t));
+        if (order == NULL || table == NULL)
+        {
+            free(table);
+            if (order)
+            {
+                ix->order = order;
+            }
+            return NULL;
+        }
+        ix->order = order;
+        mask = cap * 2 - 1;
+        for (int i = 0; i < ix->nwords; ++i)
+        {
+            uint32_t j = search_hash(ix->words[i]->text) & mask;
+            while (table[j])
+            {
+                j = (j + 1) & mask;
+            }
+            table[j] = i + 1;
+        }
+        free(ix->word_hash);
+        ix->word_hash = table;
+        ix->bytes += (size_t)(cap - ix->word_cap) * (2 * sizeof(search_word *) + 2 * sizeof(uint32_t));
+        ix->word_cap = cap;
+        h = search_hash(text) & mask;
+        while (table[h])
+        {
+            h = (h + 1) & mask;
+        }
+    }
+
+    search_word *w = malloc(sizeof(search_word) + len + 1);
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->post = NULL;
+    w->count = w->cap = 0;
+    memcpy(w->text, text, len + 1);
+    ix->words[ix->nwords] = w;
+    ix->word_hash[h] = ++ix->nwords;
+    ix->bytes += sizeof(search_word) + len + 1;
+    return w;
+}
+
+/* Gives row the next slot and posts its words; 1 when out of memory, which leaves the index fit only for search_index_free */
+static int search_index_add(search_index *ix, vault_row *row)
+{
+    if (ix->nslots == ix->slot_cap)
+    {
+        int cap = ix->slot_cap ? ix->slot_cap * 2 : 64;
+        vault_row **slots = realloc(ix->slots, cap * sizeof(vault_row *));
+        if (slots == NULL)
+        {
+            return 1;
+        }
+        ix->slots = slots;
+        sqlite3_int64 *ids = realloc(ix->ids, cap * sizeof(sqlite3_int64));
+        if (ids == NULL)
+        {
+            return 1;
+        }
+        ix->ids = ids;
+        uint32_t *cand = realloc(ix->cand, cap * sizeof(uint32_t));
+        if (cand == NULL)
+        {
+            return 1;
+        }
+        ix->cand = cand;
+        search_acc *acc = realloc(ix->acc, cap * sizeof(search_acc));
+        uint32_t *table = calloc(cap * 2, sizeof(uint32_t));
+        if (acc == NULL || table == NULL)
+        {
+            free(table);
+            if (acc)
+            {
+                ix->acc = acc;
+            }
+            return 1;
+        }
+        memset(acc + ix->slot_cap, 0, (cap - ix->slot_cap) * sizeof(search_acc));
+        ix->acc = acc;
+        uint32_t mask = cap * 2 - 1;
+        for (int i = 0; i < ix->nslots; ++i)
+        {
+            if (ix->slots[i])
+            {
+                uint32_t j = search_id_hash(ix->ids[i]) & mask;
+                while (table[j])
+                {
+                    j = (j + 1) & mask;
+                }
+                table[j] = i + 1;
+            }
+        }
+        free(ix->by_id);
+        ix->by_id = table;
+        ix->bytes += (size_t)(cap - ix->slot_cap) * (sizeof(vault_row *) + sizeof(sqlite3_int64) + sizeof(search_acc) + 3 * sizeof(uint32_t));
+        ix->slot_cap = cap;
+    }
+
+    uint32_t slot = ix->nslots;
+    char word[SEARCH_WORD_MAX + 1];
+    for (int i = 0; i < 4; ++i)
+    {
+        const char *p = row->f[i];
+        int len;
+        while (p && (len = search_next_word(&p, word)) > 0)
+        {
+            search_word *w = search_index_word(ix, word, len);
+            if (w == NULL)
+            {
+                return 1;
+            }
+            /* A word seen again in the same entry only adds its field */
+            if (w->count && w->post[w->count - 1] >> 4 == slot)
+            {
+                w->post[w->count - 1] |= 1u << i;
+                continue;
+            }
+            if (w->count == w->cap)
+            {
+                int cap = w->cap ? w->cap * 2 : 2;
+                uint32_t *post = realloc(w->post, cap * sizeof(uint32_t));
+                if (post == NULL)
+                {
+                    return 1;
+                }
+                ix->bytes += (size_t)(cap - w->cap) * sizeof(uint32_t);
+                w->post = post;
+                w->cap = cap;
+            }
+            w->post[w->count++] = slot << 4 | 1u << i;
+        }
+    }
+
+    uint32_t mask = ix->slot_cap * 2 - 1;
+    uint32_t h = search_id_hash(row->id) & mask;
+    while (ix->by_id[h])
+    {
+        h = (h + 1) & mask;
+    }
+    ix->by_id[h] = slot + 1;
+    ix->slots[slot] = row;
+    ix->ids[slot] = row->id;
+    ix->nslots++;
+    return 0;
+}
+
+/* Empties the entry's slot; its postings stay behind and are skipped */
+static void search_index_remove(search_index *ix, sqlite3_int64 id)
+{
+    uint32_t mask = ix->slot_cap * 2 - 1;
+    for (uint32_t h = search_id_hash(id) & mask; ix->by_id[h]; h = (h + 1) & mask)
+    {
+        uint32_t slot = ix->by_id[h] - 1;
+        if (ix->slots[slot] && ix->ids[slot] == id)
+        {
+            ix->slots[slot] = NULL;
+            ix->dead++;
+            return;
+        }
+    }
+}
+
+static int search_word_cmp(const void *a, const void *b)
+{
+    return strcmp((*(search_word *const *)a)->text, (*(search_word *const *)b)->text);
+}
+
+/* Merges the unsorted newest words into order */
+static int search_index_sort(search_index *ix)
+{
+    int tail = ix->nwords - ix->sorted;
+    if (tail == 0)
+    {
+        return 0;
+    }
+    search_word **added = malloc(tail * sizeof(search_word *));
+    if (added == NULL)
+    {
+        return 1;
+    }
+    memcpy(added, ix->words + ix->sorted, tail * sizeof(search_word *));
+    qsort(added, tail, sizeof(search_word *), search_word_cmp);
+
+    /* Back to front, so the merge runs in place */
+    int a = ix->sorted - 1, b = tail - 1;
+    for (int out = ix->nwords - 1; b >= 0; --out)
+    {
+        if (a >= 0 && strcmp(ix->order[a]->text, added[b]->text) > 0)
+        {
+            ix->order[out] = ix->order[a--];
+        }
+        else
+        {
+            ix->order[out] = added[b--];
+        }
+    }
+    free(added);
+    ix->sorted = ix->nwords;
+    return 0;
+}
+
+/*
+ * Ranks every live entry that has, for each term, a word starting with it. Terms run rarest first;
+ * each one ORs the fields its words hit into the entries that matched every term so far, then
+ * scores those, so the cost follows the postings touched, not the vault size.
+ */
+static void search_index_query(search_index *ix, const search_query *q, search_hits *hits)
+{
+    if (ix->nwords - ix->sorted > SEARCH_TAIL)
+    {
+        search_index_sort(ix); /* if this fails the tail is only scanned for longer */
+    }
+
+    int lo[SEARCH_MAX_TERMS], hi[SEARCH_MAX_TERMS], by_cost[SEARCH_MAX_TERMS];
+    const search_word *only[SEARCH_MAX_TERMS]; /* the term's one word, if it has just one */
+    size_t cost[SEARCH_MAX_TERMS];
+    for (int t = 0; t < q->count; ++t)
+    {
+        const char *term = q->term[t];
+        size_t len = q->len[t];
+        int l = 0, h = ix->sorted;
+        while (l < h)
+        {
+            int mid = l + (h - l) / 2;
+            if (strcmp(ix->order[mid]->text, term) < 0)
+            {
+                l = mid + 1;
+            }
+            else
+            {
+                h = mid;
+            }
+        }
+        lo[t] = l;
+        cost[t] = 0;
+        int words = 0;
+        for (h = l; h < ix->sorted && strncmp(ix->order[h]->text, term, len) == 0; ++h)
+        {
+            cost[t] += ix->order[h]->count;
+            only[t] = ix->order[h];
+            words++;
+        }
+        hi[t] = h;
+        for (int i = ix->sorted; i < ix->nwords; ++i)
+        {
+            if (strncmp(ix->words[i]->text, term, len) == 0)
+            {
+                cost[t] += ix->words[i]->count;
+                only[t] = ix->words[i];
+                words++;
+            }
+        }
+        if (words > 1)
+        {
+            only[t] = NULL;
+        }
+        if (cost[t] == 0)
+        {
+            return;
+        }
+
+        int k = t;
+        for (; k > 0 && cost[by_cost[k - 1]] > cost[t]; --k)
+        {
+            by_cost[k] = by_cost[k - 1];
+        }
+        by_cost[k] = t;
+    }
+
+    if (++ix->gen == 0)
+    {
+        memset(ix->acc, 0, ix->slot_cap * sizeof(search_acc));
+        ix->gen = 1;
+    }
+    for (int step = 0; step < q->count; ++step)
+    {
+        int t = by_cost[step], ncand = 0;
+        if (only[t])
+        {
+            search_postings_scored(ix, only[t], only[t]->text[q->len[t]] == '\0', step, step == q->count - 1, hits);
+            continue;
+        }
+        for (int i = lo[t]; i < hi[t]; ++i)
+        {
+            const search_word *w = ix->order[i];
+            ncand = search_postings(ix, w, w->text[q->len[t]] == '\0', step, ncand);
+        }
+        for (int i = ix->sorted; i < ix->nwords; ++i)
+        {
+            const search_word *w = ix->words[i];
+            if (strncmp(w->text, q->term[t], q->len[t]) == 0)
+            {
+                ncand = search_postings(ix, w, w->text[q->len[t]] == '\0', step, ncand);
+            }
+        }
+
+        for (int i = 0; i < ncand; ++i)
+        {
+            uint32_t slot = ix->cand[i];
+            search_acc *a = &ix->acc[slot];
+            a->score += search_weight(a->mask & 15) + search_weight(a->mask >> 4);
+            a->mask = 0;
+            a->terms++;
+            if (step == q->count - 1 && search_hits_wants(hits, a->score, ix->ids[slot]))
+            {
+                search_hits_offer(hits, ix->slots[slot], a->score);
+            }
+        }
+    }
+}
+
+/* ORs a word's fields into the entries still in the running, listing each one the first time it is hit; returns the new candidate count */
+static int search_postings(search_index *ix, const search_word *w, int exact, int step, int ncand)
+{
+    for (int i = 0; i < w->count; ++i)
+    {
+        uint32_t slot = w->post[i] >> 4, fields = w->post[i] & 15;
+        search_acc *a = &ix->acc[slot];
+        if (a->gen != ix->gen)
+        {
+            if (step || (ix->dead && ix->slots[slot] == NULL))
+            {
+                continue;
+            }
+            a->gen = ix->gen;
+            a->terms = a->mask = 0;
+            a->score = 0;
+        }
+        if (a->terms != step)
+        {
+            continue;
+        }
+        if (a->mask == 0)
+        {
+            ix->cand[ncand++] = slot;
+        }
+        a->mask |= fields | (exact ? fields << 4 : 0);
+    }
+    return ncand;
+}
+
+/* search_postings for a term only one word matches: no entry can be hit twice, so each is scored on the spot */
+static void search_postings_scored(search_index *ix, const search_word *w, int exact, int step, int last, search_hits *hits)
+{
+    for (int i = 0; i < w->count; ++i)
+    {
+        uint32_t slot = w->post[i] >> 4, fields = w->post[i] & 15;
+        search_acc *a = &ix->acc[slot];
+        if (a->gen != ix->gen)
+        {
+            if (step || (ix->dead && ix->slots[slot] == NULL))
+            {
+                continue;
+            }
+            a->gen = ix->gen;
+            a->terms = 0;
+            a->score = 0;
+        }
+        if (a->terms != step)
+        {
+            continue;
+        }
+        a->score += search_weight(fields) * (exact ? 2 : 1);
+        a->terms++;
+        if (last && search_hits_wants(hits, a->score, ix->ids[slot]))
+        {
+            search_hits_offer(hits, ix->slots[slot], a->score);
+        }
+    }
+}
+
+static void search_index_free(search_index *ix)
+{
+    if (ix == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < ix->nwords; ++i)
+    {
+        free(ix->words[i]->post);
+        free(ix->words[i]);
+    }
+    free(ix->words);
+    free(ix->word_hash);
+    free(ix->order);
+    free(ix->slots);
+    free(ix->ids);
+    free(ix->acc);
+    free(ix->cand);
+    free(ix->by_id);
+    free(ix);
+}
+
+/* Higher scores win; on a tie the older entry does */
+static int search_hit_weaker(uint32_t score, sqlite3_int64 id, uint32_t than_score, sqlite3_int64 than_id)
+{
+    return score < than_score || (score == than_score && id > than_id);
+}
+
+static int search_hits_wants(const search_hits *h, uint32_t score, sqlite3_int64 id)
+{
+    return h->count < h->cap || search_hit_weaker(h->score[0], h->rows[0]->id, score, id);
+}
+
+/* Pins row in place of the weakest hit; callers check search_hits_wants first */
+static void search_hits_offer(search_hits *h, vault_row *row, uint32_t score)
+{
+    atomic_fetch_add_explicit(&row->refs, 1, memory_order_relaxed);
+    if (h->count == h->cap)
+    {
+        vault_row_release(h->rows[0]);
+        h->rows[0] = row;
+        h->score[0] = score;
+        search_hits_sift(h, h->count);
+        return;
+    }
+
+    int i = h->count++;
+    while (i > 0 && search_hit_weaker(score, row->id, h->score[(i - 1) / 2], h->rows[(i - 1) / 2]->id))
+    {
+        h->rows[i] = h->rows[(i - 1) / 2];
+        h->score[i] = h->score[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->rows[i] = row;
+    h->score[i] = score;
+}
+
+/* Moves the root of the first n hits down to its place */
+static void search_hits_sift(search_hits *h, int n)
+{
+    vault_row *row = h->rows[0];
+    uint32_t score = h->score[0];
+    int i = 0;
+    while (2 * i + 1 < n)
+    {
+        int c = 2 * i + 1;
+        if (c + 1 < n && search_hit_weaker(h->score[c + 1], h->rows[c + 1]->id, h->score[c], h->rows[c]->id))
+        {
+            c++;
+        }
+        if (!search_hit_weaker(h->score[c], h->rows[c]->id, score, row->id))
+        {
+            break;
+        }
+        h->rows[i] = h->rows[c];
+        h->score[i] = h->score[c];
+        i = c;
+    }
+    h->rows[i] = row;
+    h->score[i] = score;
+}
+
+/* Heapsort: leaves the hits best first */
+static void search_hits_finish(search_hits *h)
+{
+    for (int n = h->count - 1; n > 0; --n)
+    {
+        vault_row *row = h->rows[0];
+        uint32_t score = h->score[0];
+        h->rows[0] = h->rows[n];
+        h->score[0] = h->score[n];
+        h->rows[n] = row;
+        h->score[n] = score;
+        search_hits_sift(h, n);
+    }
+}
+
+/* Offers every pinned row that matches and drops the pins */
+static void search_hits_scan(search_hits *h, vault_row **pinned, int n, entry_match match, const void *query)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        uint32_t score = match(pinned[i]->f, query);
+        if (score && search_hits_wants(h, score, pinned[i]->id))
+        {
+            search_hits_offer(h, pinned[i], score);
+        }
+        vault_row_release(pinned[i]);
+    }
+    free(pinned);
+}
+
+/* Site index */
+
+/*
+ * Public suffixes of more than one label, sorted for bsearch. Anything not listed is taken to be a
+ * single-label TLD; the full Public Suffix List is not worth shipping for the handful that matter.
+ */
+static const char *const multi_label_suffixes[] = {
+    "ac.jp", "ac.uk", "appspot.com", "azurewebsites.net", "blogspot.com", "cloudfront.net", "co.id",
+    "co.il", "co.in", "co.jp", "co.kr", "co.nz", "co.th", "co.uk", "co.za", "com.ar", "com.au",
+    "com.br", "com.cn", "com.co", "com.hk", "com.mx", "com.my", "com.pl", "com.sg", "com.tr", "com.tw",
+    "com.ua", "com.vn", "edu.au", "github.io", "gitlab.io", "gov.au", "gov.uk", "herokuapp.com",
+    "ne.jp", "net.au", "net.br", "net.cn", "netlify.app", "or.jp", "org.au", "org.br", "org.uk",
+    "pages.dev", "vercel.app",
+};
+
+/*
+ * Lowercased host of a URL, without scheme, user info, port or a leading "www."; bare hosts like
+ * "example.com/login" work too. Returns its length, 0 if there is no plausible host.
+ */
+static int url_host(const char *url, char *host)
+{
+    const char *p = url + strspn(url, " \t");
+    const char *scheme = strstr(p, "://");
+    size_t end = strcspn(p, "/?#");
+    if (scheme && scheme + 1 == p + end)
+    {
+        p = scheme + 3;
+    }
+    else if (p[0] == '/' && p[1] == '/')
+    {
+        p += 2;
+    }
+    end = strcspn(p, "/?#");
+    const char *at = memrchr(p, '@', end);
+    if (at)
+    {
+        end -= at + 1 - p;
+        p = at + 1;
+    }
+
+    size_t len;
+    if (*p == '[')
+    {
+        const char *close = memchr(p, ']', end);
+        if (close == NULL)
+        {
+            return 0;
+        }
+        len = close + 1 - p;
+    }
+    else
+    {
+        len = strcspn(p, ":/?#");
+        len = len < end ? len : end;
+        while (len > 0 && p[len - 1] == '.')
+        {
+            len--;
+        }
+    }
+    if (len == 0 || len >= URL_HOST_MAX)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < len; ++i)
+    {
+        unsigned char c = (unsigned char)p[i];
+        if (!isalnum(c) && c < 0x80 && !strchr("-._[]:", c))
+        {
+            return 0;
+        }
+        host[i] = (char)tolower(c);
+    }
+    host[len] = '\0';
+    if (len > 4 && memcmp(host, "www.", 4) == 0)
+    {
+        memmove(host, host + 4, len - 3);
+        len -= 4;
+    }
+    return (int)len;
+}
+
+static int url_suffix_cmp(const void *key, const void *entry)
+{
+    return strcmp(key, *(const char *const *)entry);
+}
+
+static int url_public_suffix(const char *suffix)
+{
+    return bsearch(suffix, multi_label_suffixes, sizeof(multi_label_suffixes) / sizeof(multi_label_suffixes[0]),
+                   sizeof(multi_label_suffixes[0]), url_suffix_cmp) != NULL;
+}
+
+/* Offset of the registrable domain (eTLD+1) in host: one label more than its public suffix. IP literals stand alone */
+static int url_site(const char *host, int len)
+{
+    if (host[0] == '[' || strspn(host, "0123456789.") == (size_t)len)
+    {
+        return 0;
+    }
+    int dot[3], n = 0;
+    for (int i = len - 1; i >= 0 && n < 3; --i)
+    {
+        if (host[i] == '.')
+        {
+            dot[n++] = i;
+        }
+    }
+    if (n >= 1 && url_public_suffix(n >= 2 ? host + dot[1] + 1 : host))
+    {
+        return n >= 3 ? dot[2] + 1 : 0;
+    }
+    return n >= 2 ? dot[1] + 1 : 0;
+}
+
+static int url_parse(const char *url, url_query *q)
+{
+    q->len = url_host(url, q->host);
+    if (q->len == 0)
+    {
+        return 1;
+    }
+    q->site = url_site(q->host, q->len);
+    return 0;
+}
+
+/* Ranks an entry for FIND_BY_URL: the page's own host, then its parent domains nearest first, then the rest of the site */
+static uint32_t url_match(const char *const *f, const void *query)
+{
+    const url_query *q = query;
+    char host[URL_HOST_MAX];
+    int len = f[2] ? url_host(f[2], host) : 0;
+    if (len == 0 || strcmp(host + url_site(host, len), q->host + q->site) != 0)
+    {
+        return 0;
+    }
+    if (len == q->len && strcmp(host, q->host) == 0)
+    {
+        return 3u << 8;
+    }
+    if (len < q->len && q->host[q->len - len - 1] == '.' && strcmp(q->host + q->len - len, host) == 0)
+    {
+        return 2u << 8 | (uint32_t)len;
+    }
+    return 1u << 8;
+}
+
+/* NULL when no entry is filed under that registrable domain */
+static site *site_index_find(const site_index *ix, const char *name)
+{
+    if (ix->nbuckets == 0)
+    {
+        return NULL;
+    }
+    site *st = ix->buckets[search_hash(name) & (ix->nbuckets - 1)];
+    while (st && strcmp(st->name, name) != 0)
+    {
+        st = st->next;
+    }
+    return st;
+}
+
+/* Files row under its URL's registrable domain; entries without a usable URL are left out. 1 when out of memory */
+static int site_index_add(site_index *ix, vault_row *row)
+{
+    char host[URL_HOST_MAX];
+    int len = row->f[2] ? url_host(row->f[2], host) : 0;
+    if (len == 0)
+    {
+        return 0;
+    }
+    const char *name = host + url_site(host, len);
+
+    site *st = site_index_find(ix, name);
+    if (st == NULL)
+    {
+        if (ix->count >= ix->nbuckets)
+        {
+            int n = ix->nbuckets ? ix->nbuckets * 2 : 64;
+            site **buckets = calloc(n, sizeof(site *));
+            if (buckets == NULL)
+            {
+                return 1;
+            }
+            for (int i = 0; i < ix->nbuckets; ++i)
+            {
+                while (ix->buckets[i])
+                {
+                    site *next = ix->buckets[i]->next;
+                    site **b = &buckets[search_hash(ix->buckets[i]->name) & (n - 1)];
+                    ix->buckets[i]->next = *b;
+                    *b = ix->buckets[i];
+                    ix->buckets[i] = next;
+                }
+            }
+            free(ix->buckets);
+            ix->buckets = buckets;
+            ix->bytes += (size_t)(n - ix->nbuckets) * sizeof(site *);
+            ix->nbuckets = n;
+        }
+        size_t name_len = strlen(name);
+        st = calloc(1, sizeof(site) + name_len + 1);
+        if (st == NULL)
+        {
+            return 1;
+        }
+        memcpy(st->name, name, name_len + 1);
+        site **b = &ix->buckets[search_hash(name) & (ix->nbuckets - 1)];
+        st->next = *b;
+        *b = st;
+        ix->count++;
+        ix->bytes += sizeof(site) + name_len + 1;
+    }
+
+    if (st->count == st->cap)
+    {
+        int cap = st->cap ? st->cap * 2 : 4;
+        vault_row **rows = realloc(st->rows, cap * sizeof(vault_row *));
+        if (rows == NULL)
+        {
+            return 1;
+        }
+        ix->bytes += (size_t)(cap - st->cap) * sizeof(vault_row *);
+        st->rows = rows;
+        st->cap = cap;
+    }
+    st->rows[st->count++] = row;
+    return 0;
+}
+
+/* Sites are small, so the row is found by a walk and the last one moved into its place */
+static void site_index_remove(site_index *ix, const vault_row *row)
+{
+    char host[URL_HOST_MAX];
+    int len = row->f[2] ? url_host(row->f[2], host) : 0;
+    site *st = len ? site_index_find(ix, host + url_site(host, len)) : NULL;
+    for (int i = 0; st && i < st->count; ++i)
+    {
+        if (st->rows[i] == row)
+        {
+            st->rows[i] = st->rows[--st->count];
+            return;
+        }
+    }
+}
+
+static void site_index_free(site_index *ix)
+{
+    if (ix == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < ix->nbuckets; ++i)
+    {
+        while (ix->buckets[i])
+        {
+            site *next = ix->buckets[i]->next;
+            free(ix->buckets[i]->rows);
+            free(ix->buckets[i]);
+            ix->buckets[i] = next;
+        }
+    }
+    free(ix->buckets);
+    free(ix);
+}
+
+/* Sessions */
+static void session_init(void)
+{
+    for (int i = 0; i < SESSION_SHARDS; ++i)
+    {
+        pthread_mutex_init(&session_shards[i].lock, NULL);
+    }
+}
+
+/* Tokens are random, so their own bytes pick the shard and bucket */
+static session_shard *session_shard_for(const unsigned char *token, session ***bucket)
+{
+    session_shard *s = &session_shards[token[0] % SESSION_SHARDS];
+    *bucket = &s->buckets[(token[1] | token[2] << 8) % SESSION_BUCKETS];
+    return s;
+}
+
+/* Caller holds the shard lock */
+static void session_unlink(session_shard *s, session *se)
+{
+    session **pp;
+    session_shard_for(se->token, &pp);
+    while (*pp != se)
+    {
+        pp = &(*pp)->hnext;
+    }
+    *pp = se->hnext;
+
+    if (se->prev)
+        se->prev->next = se->next;
+    else
+        s->oldest = se->next;
+    if (se->next)
+        se->next->prev = se->prev;
+    else
+        s->newest = se->prev;
+    s->count--;
+}
+
+/* Fills token; a full shard drops its oldest session to make room */
+static int session_create(sqlite3_int64 user_id, const char *username, const unsigned char *data_key, unsigned char *token)
+{
+    session *se = calloc(1, sizeof(session));
+    if (se == NULL || RAND_bytes(se->token, SESSION_TOKEN_LEN) != 1)
+    {
+        free(se);
+        return 1;
+    }
+    se->user_id = user_id;
+    snprintf(se->username, sizeof(se->username), "%s", username);
+    memcpy(se->data_key, data_key, DATA_KEY_LEN);
+    se->expires = time(NULL) + session_ttl;
+    memcpy(token, se->token, SESSION_TOKEN_LEN);
+
+    session **bucket;
+    session_shard *s = session_shard_for(se->token, &bucket);
+    session *dropped = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->count >= SESSION_MAX_PER_SHARD)
+    {
+        dropped = s->oldest;
+        session_unlink(s, dropped);
+    }
+    se->hnext = *bucket;
+    *bucket = se;
+    se->prev = s->newest;
+    if (s->newest)
+        s->newest->next = se;
+    else
+        s->oldest = se;
+    s->newest = se;
+    s->count++;
+    pthread_mutex_unlock(&s->lock);
+
+    session_free(dropped);
+    return 0;
+}
+
+static int session_resume(const unsigned char *token, sqlite3_int64 *user_id, char *username, unsigned char *data_key)
+{
+    session **bucket;
+    session_shard *s = session_shard_for(token, &bucket);
+    time_t now = time(NULL);
+    int rc = 1;
+
+    pthread_mutex_lock(&s->lock);
+    for (session *se = *bucket; se; se = se->hnext)
+    {
+        if (CRYPTO_memcmp(se->token, token, SESSION_TOKEN_LEN) == 0)
+        {
+            if (se->expires > now)
+            {
+                *user_id = se->user_id;
+                memcpy(username, se->username, sizeof(se->username));
+                memcpy(data_key, se->data_key, DATA_KEY_LEN);
+                rc = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return rc;
+}
+
+static void session_revoke(const unsigned char *token)
+{
+    session **bucket;
+    session_shard *s = session_shard_for(token, &bucket);
+    session *found = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    for (session *se = *bucket; se; se = se->hnext)
+    {
+        if (memcmp(se->token, token, SESSION_TOKEN_LEN) == 0)
+        {
+            found = se;
+            session_unlink(s, se);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    session_free(found);
+}
+
+/* Sessions hold a data key, so it is wiped before the memory goes back */
+static void session_free(session *se)
+{
+    if (se)
+    {
+        OPENSSL_cleanse(se->data_key, DATA_KEY_LEN);
+        free(se);
+    }
+}
+
+/* Password changes are rare, so this walks every shard rather than keep a per-user index */
+static void session_revoke_user(sqlite3_int64 user_id)
+{
+    for (int i = 0; i < SESSION_SHARDS; ++i)
+    {
+        session_shard *s = &session_shards[i];
+        pthread_mutex_lock(&s->lock);
+        session *se = s->oldest;
+        while (se)
+        {
+            session *next = se->next;
+            if (se->user_id == user_id)
+            {
+                session_unlink(s, se);
+                session_free(se);
+            }
+            se = next;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Expired sessions sit at the old end of each shard's list */
+static void *session_run(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        sleep(SESSION_SWEEP_SEC);
+
+        time_t now = time(NULL);
+        for (int i = 0; i < SESSION_SHARDS; ++i)
+        {
+            session_shard *s = &session_shards[i];
+            session *expired = NULL;
+            pthread_mutex_lock(&s->lock);
+            while (s->oldest && s->oldest->expires <= now)
+            {
+                session *se = s->oldest;
+                session_unlink(s, se);
+                se->next = expired;
+                expired = se;
+            }
+            pthread_mutex_unlock(&s->lock);
+
+            while (expired)
+            {
+                session *next = expired->next;
+                session_free(expired);
+                expired = next;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void session_token_hex(const unsigned char *token, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SESSION_TOKEN_LEN; ++i)
+    {
+        hex[2 * i] = digits[token[i] >> 4];
+        hex[2 * i + 1] = digits[token[i] & 15];
+    }
+    hex[2 * SESSION_TOKEN_LEN] = '\0';
+}
+
+static int session_token_parse(const char *hex, unsigned char *token)
+{
+    if (strlen(hex) != 2 * SESSION_TOKEN_LEN)
+    {
+        return 1;
+    }
+    for (int i = 0; i < 2 * SESSION_TOKEN_LEN; ++i)
+    {
+        int c = tolower((unsigned char)hex[i]);
+        int v = isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0)
+        {
+            return 1;
+        }
+        token[i / 2] = i % 2 ? token[i / 2] | v : v << 4;
+    }
+    return 0;
+}
+
+/* Watchers */
+static void watch_init(void)
+{
+    for (int i = 0; i < WATCH_SHARDS; ++i)
+    {
+        pthread_mutex_init(&watch_shards[i].lock, NULL);
+    }
+}
+
+static watch_shard *watch_shard_for(sqlite3_int64 user_id, client_ctx ***bucket)
+{
+    watch_shard *s = &watch_shards[(uint64_t)user_id % WATCH_SHARDS];
+    *bucket = &s->buckets[((uint64_t)user_id / WATCH_SHARDS) % WATCH_BUCKETS];
+    return s;
+}
+
+/* Subscribes ctx to its logged-in user's changes; run by the worker holding ctx */
+static void watch_add(client_ctx *ctx)
+{
+    if (ctx->watch_user == ctx->user_id)
+    {
+        return;
+    }
+    watch_remove(ctx);
+
+    client_ctx **bucket;
+    watch_shard *s = watch_shard_for(ctx->user_id, &bucket);
+    pthread_mutex_lock(&s->lock);
+    ctx->watch_user = ctx->user_id;
+    ctx->watch_next = *bucket;
+    *bucket = ctx;
+    pthread_mutex_unlock(&s->lock);
+    atomic_fetch_add(&watchers, 1);
+}
+
+/* After this the commit thread cannot queue ctx again, though it may still be on its loop's notify_list */
+static void watch_remove(client_ctx *ctx)
+{
+    if (ctx->watch_user == 0)
+    {
+        return;
+    }
+    client_ctx **p;
+    watch_shard *s = watch_shard_for(ctx->watch_user, &p);
+    pthread_mutex_lock(&s->lock);
+    while (*p != ctx)
+    {
+        p = &(*p)->watch_next;
+    }
+    *p = ctx->watch_next;
+    pthread_mutex_unlock(&s->lock);
+
+    ctx->watch_user = 0;
+    ctx->watch_next = NULL;
+    atomic_store_explicit(&ctx->watch_rev, 0, memory_order_relaxed);
+    atomic_fetch_sub(&watchers, 1);
+}
+
+/* Commit thread, once revision is durable: every connection watching user_id gets it. A connection is queued on its
+   loop at most once however many commits land before the loop runs, and only the newest revision is pushed */
+static void watch_notify(sqlite3_int64 user_id, sqlite3_int64 revision)
+{
+    if (atomic_load(&watchers) == 0)
+    {
+        return;
+    }
+    client_ctx **bucket;
+    watch_shard *s = watch_shard_for(user_id, &bucket);
+    pthread_mutex_lock(&s->lock);
+    for (client_ctx *ctx = *bucket; ctx; ctx = ctx->watch_next)
+    {
+        if (ctx->watch_user != user_id)
+        {
+            continue;
+        }
+        atomic_store_explicit(&ctx->watch_rev, revision, memory_order_relaxed);
+        if (!atomic_exchange_explicit(&ctx->watch_queued, 1, memory_order_acq_rel))
+        {
+            event_loop_notify(ctx->loop, ctx);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Metrics */
+static thread_metrics *metrics_self(void)
+{
+    if (metrics_mine == NULL && (metrics_mine = calloc(1, sizeof(thread_metrics))) != NULL)
+    {
+        thread_metrics *head = atomic_load_explicit(&metrics_threads, memory_order_relaxed);
+        do
+        {
+            metrics_mine->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&metrics_threads, &head, metrics_mine, memory_order_release, memory_order_relaxed));
+    }
+    return metrics_mine;
+}
+
+/* Only the owning thread writes, so no read-modify-write instruction is needed */
+static void metrics_add(_Atomic uint64_t *counter, uint64_t v)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void metrics_record(const command_timing *t)
+{
+    thread_metrics *m = metrics_self();
+    if (m == NULL)
+    {
+        return;
+    }
+
+    uint64_t ns[PHASE_COUNT];
+    memcpy(ns, t->ns, sizeof(ns));
+    if (ns[PHASE_TOTAL] == 0)
+    {
+        ns[PHASE_TOTAL] = ns[PHASE_PARSE] = now_ns() - t->started;
+    }
+
+    metrics_add(&m->count[t->slot], 1);
+    for (int p = 0; p < PHASE_COUNT; ++p)
+    {
+        if (p == PHASE_KDF && ns[p] == 0)
+        {
+            continue;
+        }
+        metrics_add(&m->sum_ns[t->slot][p], ns[p]);
+        metrics_add(&m->hist[t->slot][p][hist_index(ns[p])], 1);
+    }
+}
+
+/* Time holding a pooled connection or waiting on the writer counts as the command's DB phase */
+static void metrics_db_begin(void)
+{
+    if (metrics_db_depth++ == 0)
+    {
+        metrics_db_since = now_ns();
+    }
+}
+
+static void metrics_db_end(void)
+{
+    if (--metrics_db_depth == 0)
+    {
+        metrics_db_ns += now_ns() - metrics_db_since;
+    }
+}
+
+static uint64_t metrics_db_take(void)
+{
+    uint64_t ns = metrics_db_ns;
+    metrics_db_ns = 0;
+    return ns;
+}
+
+/* Log-linear buckets: exact below 8 ns, then HIST_SUB per power of two */
+static int hist_index(uint64_t ns)
+{
+    if (ns < HIST_SUB)
+    {
+        return (int)ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    if (e > HIST_MAX_EXP)
+    {
+        return HIST_BUCKETS - 1;
+    }
+    return (e - 2) * HIST_SUB + (int)((ns >> (e - 3)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_upper(int idx)
+{
+    if (idx < HIST_SUB)
+    {
+        return idx;
+    }
+    int e = idx / HIST_SUB + 2;
+    uint64_t lower = (uint64_t)(HIST_SUB + idx % HIST_SUB) << (e - 3);
+    return lower + ((uint64_t)1 << (e - 3)) - 1;
+}
+
+static uint64_t hist_quantile(const uint64_t *hist, uint64_t count, double q)
+{
+    uint64_t rank = (uint64_t)(q * count + 0.5), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += hist[i];
+        if (seen >= rank && seen > 0)
+        {
+            return hist_upper(i);
+        }
+    }
+    return 0;
+}
+
+/* Sums every thread's counters and samples the gauges; the caller frees the result */
+static metrics_totals *metrics_merge(void)
+{
+    metrics_totals *m = calloc(1, sizeof(metrics_totals));
+    if (m == NULL)
+    {
+        return NULL;
+    }
+
+    for (thread_metrics *t = atomic_load_explicit(&metrics_threads, memory_order_acquire); t; t = t->next)
+    {
+        for (int slot = 0; slot < METRIC_SLOTS; ++slot)
+        {
+            uint64_t n = atomic_load_explicit(&t->count[slot], memory_order_relaxed);
+            if (n == 0)
+            {
+                continue;
+            }
+            m->count[slot] += n;
+            for (int p = 0; p < PHASE_COUNT; ++p)
+            {
+                m->sum_ns[slot][p] += atomic_load_explicit(&t->sum_ns[slot][p], memory_order_relaxed);
+                for (int i = 0; i < HIST_BUCKETS; ++i)
+                {
+                    m->hist[slot][p][i] += atomic_load_explicit(&t->hist[slot][p][i], memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    m->open_conns = atomic_load_explicit(&open_conns, memory_order_relaxed);
+    m->tls_handshakes = atomic_load_explicit(&tls_handshakes, memory_order_relaxed);
+    m->tls_resumed = atomic_load_explicit(&tls_resumed, memory_order_relaxed);
+    m->tls_ktls = atomic_load_explicit(&tls_ktls, memory_order_relaxed);
+    m->reply_chunks = atomic_load_explicit(&chunk_allocs, memory_order_relaxed);
+    m->watchers = atomic_load_explicit(&watchers, memory_order_relaxed);
+    m->watch_pushes = atomic_load_explicit(&watch_pushes, memory_order_relaxed);
+    for (int i = 0; i < SESSION_SHARDS; ++i)
+    {
+        pthread_mutex_lock(&session_shards[i].lock);
+        m->sessions += session_shards[i].count;
+        pthread_mutex_unlock(&session_shards[i].lock);
+    }
+    db_pool_usage(&m->db_in_use, &m->db_total);
+    return m;
+}
+
+/* Prometheus text format; histogram bounds are every fourth power of two from 256 ns */
+static void metrics_prometheus(const metrics_totals *m, text_buf *out)
+{
+    text_printf(out, "# TYPE pm_commands_total counter\n");
+    for (int slot = 0; slot < METRIC_SLOTS; ++slot)
+    {
+        if (m->count[slot])
+        {
+            text_printf(out, "pm_commands_total{command=\"%s\"} %llu\n", metrics_slot_name(slot), (unsigned long long)m->count[slot]);
+        }
+    }
+
+    text_printf(out, "# TYPE pm_command_duration_seconds histogram\n");
+    for (int slot = 0; slot < METRIC_SLOTS; ++slot)
+    {
+        for (int p = 0; m->count[slot] && p < PHASE_COUNT; ++p)
+        {
+            const uint64_t *hist = m->hist[slot][p];
+            const char *name = metrics_slot_name(slot);
+            uint64_t n = 0, seen = 0;
+            for (int i = 0; i < HIST_BUCKETS; ++i)
+            {
+                n += hist[i];
+            }
+            if (n == 0)
+            {
+                continue;
+            }
+            int i = 0;
+            for (int k = 8; k <= HIST_MAX_EXP; k += 2)
+            {
+                for (; i < (k - 2) * HIST_SUB; ++i)
+                {
+                    seen += hist[i];
+                }
+                text_printf(out, "pm_command_duration_seconds_bucket{command=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+                            name, phase_names[p], (double)((uint64_t)1 << k) / 1e9, (unsigned long long)seen);
+            }
+            text_printf(out, "pm_command_duration_seconds_bucket{command=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+                        name, phase_names[p], (unsigned long long)n);
+            text_printf(out, "pm_command_duration_seconds_sum{command=\"%s\",phase=\"%s\"} %.9f\n",
+                        name, phase_names[p], m->sum_ns[slot][p] / 1e9);
+            text_printf(out, "pm_command_duration_seconds_count{command=\"%s\",phase=\"%s\"} %llu\n",
+                        name, phase_names[p], (unsigned long long)n);
+        }
+    }
+
+    text_printf(out, "# TYPE pm_open_connections gauge\npm_open_connections %ld\n", m->open_conns);
+    text_printf(out, "# TYPE pm_active_sessions gauge\npm_active_sessions %ld\n", m->sessions);
+    text_printf(out, "# TYPE pm_db_connections_in_use gauge\npm_db_connections_in_use %d\n", m->db_in_use);
+    text_printf(out, "# TYPE pm_db_connections gauge\npm_db_connections %d\n", m->db_total);
+    text_printf(out, "# TYPE pm_reply_chunks_allocated_total counter\npm_reply_chunks_allocated_total %lu\n", m->reply_chunks);
+    text_printf(out, "# TYPE pm_watchers gauge\npm_watchers %ld\n", m->watchers);
+    text_printf(out, "# TYPE pm_watch_pushes_total counter\npm_watch_pushes_total %lu\n", m->watch_pushes);
+    if (tls_ctx)
+    {
+        text_printf(out, "# TYPE pm_tls_handshakes_total counter\npm_tls_handshakes_total{resumed=\"false\"} %lu\n"
+                         "pm_tls_handshakes_total{resumed=\"true\"} %lu\n",
+                    m->tls_handshakes - m->tls_resumed, m->tls_resumed);
+        text_printf(out, "# TYPE pm_tls_ktls_connections_total counter\npm_tls_ktls_connections_total %lu\n", m->tls_ktls);
+    }
+}
+
+/* One line per command and phase, for STATS */
+static void metrics_summary(const metrics_totals *m, text_buf *out)
+{
+    text_printf(out, "connections=%ld sessions=%ld db_in_use=%d/%d reply_chunks_allocated=%lu watchers=%ld pushes=%lu\n",
+                m->open_conns, m->sessions, m->db_in_use, m->db_total, m->reply_chunks, m->watchers, m->watch_pushes);
+    if (tls_ctx)
+    {
+        text_printf(out, "tls_handshakes=%lu resumed=%lu ktls=%lu\n", m->tls_handshakes, m->tls_resumed, m->tls_ktls);
+    }
+    for (int slot = 0; slot < METRIC_SLOTS; ++slot)
+    {
+        for (int p = 0; m->count[slot] && p < PHASE_COUNT; ++p)
+        {
+            uint64_t n = 0;
+            for (int i = 0; i < HIST_BUCKETS; ++i)
+            {
+                n += m->hist[slot][p][i];
+            }
+            if (n == 0)
+            {
+                continue;
+            }
+            text_printf(out, "%s %s count=%llu mean_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f\n",
+                        metrics_slot_name(slot), phase_names[p], (unsigned long long)n,
+                        m->sum_ns[slot][p] / 1e3 / n,
+                        hist_quantile(m->hist[slot][p], n, 0.5) / 1e3,
+                        hist_quantile(m->hist[slot][p], n, 0.99) / 1e3,
+                        hist_quantile(m->hist[slot][p], n, 0.999) / 1e3);
+        }
+    }
+}
+
+static const char *metrics_slot_name(int slot)
+{
+    return command_by_opcode[slot] ? command_by_opcode[slot]->name : "INVALID";
+}
+
+static void text_printf(text_buf *t, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buf_reserve(&t->p, &t->cap, t->len + n + 1) != 0)
+    {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(t->p + t->len, n + 1, fmt, ap);
+    va_end(ap);
+    t->len += n;
+}
+
+/* The admin port only listens on loopback */
+static int admin_listen(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Answers each HTTP request with the Prometheus text, one connection at a time */
+static void *admin_run(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+
+    while (1)
+    {
+        int c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (c < 0)
+        {
+            continue;
+        }
+        struct timeval tv = {.tv_sec = ADMIN_TIMEOUT_SEC};
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        /* The request itself does not matter; wait for its headers so the reply is not cut off by a reset */
+        char req[1024];
+        size_t got = 0;
+        ssize_t n;
+        while (got < sizeof(req) - 1 && (n = read(c, req + got, sizeof(req) - 1 - got)) > 0)
+        {
+            got += n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            {
+                break;
+            }
+        }
+
+        text_buf body = {0};
+        metrics_totals *m = metrics_merge();
+        if (m)
+        {
+            metrics_prometheus(m, &body);
+            free(m);
+        }
+        char head[160];
+        int head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body.len);
+        struct iovec iov[2] = {{head, head_len}, {body.p, body.len}};
+        if (writev(c, iov, body.len ? 2 : 1) < 0)
+        {
+            perror("Admin write error.\n");
+        }
+        free(body.p);
+        close(c);
+    }
+    return NULL;
+}
+
+/* Database setup and operations */
+
+static const char *stmt_sql[STMT_COUNT] = {
+    [STMT_REGISTER] = "INSERT INTO Users (Username, MasterHash, DataKey) VALUES (?, ?, ?);",
+    [STMT_REGISTER_SEC] =
+        "INSERT INTO Users (Username, MasterHash, SecurityQuestion, SecurityAnswerHash, DataKey, AnswerDataKey) "
+        "VALUES (?, ?, ?, ?, ?, ?);",
+    [STMT_SEC_QUESTION] = "SELECT SecurityQuestion FROM Users WHERE Username=?;",
+    [STMT_FETCH_CREDENTIALS] = "SELECT ID, MasterHash, SecurityAnswerHash, DataKey, AnswerDataKey FROM Users WHERE Username=?;",
+    [STMT_CREATE_CATEGORY] = "INSERT INTO Categories (Name, UserID) VALUES (?, ?);",
+    [STMT_FETCH_CATEGORIES] = "SELECT ID, Name FROM Categories WHERE UserID=? AND ID>? ORDER BY ID LIMIT ?;",
+    [STMT_FETCH_ENTRY_BY_TITLE] = "SELECT 1 FROM Entries WHERE Title=? AND UserID=?;",
+    [STMT_FETCH_ENTRIES] =
+        "SELECT ID, Title, EntryUser, URL, Notes, PassVal FROM Entries "
+        "WHERE UserID=?1 AND CategoryID=(SELECT ID FROM Categories WHERE Name=?2 AND UserID=?1) "
+        "AND ID>?3 ORDER BY ID LIMIT ?4;",
+    [STMT_UPDATE_ENTRY] =
+        "UPDATE Entries SET Title=?, EntryUser=?, URL=?, Notes=?, PassVal=? "
+        "WHERE Title=? AND UserID=? RETURNING ID, CategoryID;",
+    /* The wrapped data key is swapped only if it is still the one the command unwrapped */
+    [STMT_UPDATE_PASSWORD] = "UPDATE Users SET MasterHash=?1, DataKey=?2 WHERE Username=?3 AND DataKey IS ?4;",
+    [STMT_REHASH_MASTER] = "UPDATE Users SET MasterHash=?1, DataKey=?2 WHERE ID=?3 AND MasterHash=?4 AND DataKey IS ?5;",
+    [STMT_REHASH_ANSWER] =
+        "UPDATE Users SET SecurityAnswerHash=?1, AnswerDataKey=?2 "
+        "WHERE ID=?3 AND SecurityAnswerHash=?4 AND AnswerDataKey IS ?5;",
+    [STMT_REMOVE_ENTRY] = "DELETE FROM Entries WHERE Title=? AND UserID=? RETURNING ID, CategoryID;",
+    [STMT_FETCH_USER] = "SELECT ID FROM Users WHERE Username=?;",
+    [STMT_FETCH_CATEGORY] = "SELECT ID FROM Categories WHERE Name=? AND UserID=?;",
+    [STMT_REMOVE_CATEGORY_ENTRIES] = "DELETE FROM Entries WHERE UserID=? AND CategoryID=? RETURNING ID;",
+    [STMT_REMOVE_CATEGORY] = "DELETE FROM Categories WHERE ID=?;",
+    [STMT_INSERT_ENTRY] =
+        "INSERT INTO Entries (Title, EntryUser, URL, Notes, PassVal, UserID, CategoryID) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?);",
+    /* Resumes after a (category ID, entry ID) pair. Category order follows the (UserID, CategoryID) index, and the rest
+       of the current category and the categories after it are two seeks on it merged in order, so nothing is sorted */
+    [STMT_EXPORT_ENTRIES] =
+        "SELECT c.Name, e.Title, e.EntryUser, e.URL, e.Notes, e.PassVal, e.CategoryID, e.ID "
+        "FROM Entries e JOIN Categories c ON c.ID=e.CategoryID WHERE e.UserID=?1 AND e.CategoryID=?2 AND e.ID>?3 "
+        "UNION ALL "
+        "SELECT c.Name, e.Title, e.EntryUser, e.URL, e.Notes, e.PassVal, e.CategoryID, e.ID "
+        "FROM Entries e JOIN Categories c ON c.ID=e.CategoryID WHERE e.UserID=?1 AND e.CategoryID>?2 "
+        "ORDER BY 7, 8 LIMIT ?4;",
+    [STMT_LOAD_CATEGORIES] = "SELECT ID, Name FROM Categories WHERE UserID=? ORDER BY ID;",
+    [STMT_LOAD_ENTRIES] =
+        "SELECT ID, CategoryID, Title, EntryUser, URL, Notes, PassVal FROM Entries "
+        "WHERE UserID=? ORDER BY CategoryID, ID;",
+    [STMT_LOAD_PLAINTEXT] = "SELECT ID, Notes, PassVal FROM Entries WHERE UserID=? AND typeof(PassVal)='text';",
+    [STMT_SEAL_ENTRY] = "UPDATE Entries SET Notes=?, PassVal=? WHERE ID=? AND typeof(PassVal)='text';",
+    [STMT_SAVE_REVISION] = "UPDATE Users SET Revision=? WHERE ID=?;",
+    /* One row per category or entry: a later change replaces the earlier one, so the log never outgrows the vault and its tombstones */
+    [STMT_LOG_CHANGE] =
+        "INSERT INTO Changes (UserID, Kind, ObjectID, Revision, Deleted, Changed) VALUES (?1, ?2, ?3, ?4, ?5, ?6) "
+        "ON CONFLICT (UserID, Kind, ObjectID) DO UPDATE SET Revision=?4, Deleted=?5, Changed=?6;",
+    [STMT_SYNC_STATE] = "SELECT Revision, SyncFloor FROM Users WHERE ID=?;",
+    /* Entries whose category is gone come back without a category ID and are left out, as in LIST_ENTRIES */
+    [STMT_SYNC_CHANGES] =
+        "SELECT ch.Revision, ch.Kind, ch.ObjectID, ch.Deleted, c.Name, ec.ID, e.Title, e.EntryUser, e.URL, e.Notes, e.PassVal "
+        "FROM Changes ch "
+        "LEFT JOIN Categories c ON ch.Kind=0 AND c.ID=ch.ObjectID "
+        "LEFT JOIN Entries e ON ch.Kind=1 AND e.ID=ch.ObjectID "
+        "LEFT JOIN Categories ec ON ec.ID=e.CategoryID "
+        "WHERE ch.UserID=? AND ch.Revision>? AND ch.Revision<=? ORDER BY ch.Revision LIMIT ?;",
+    [STMT_OLD_TOMBSTONES] = "SELECT UserID, Kind, ObjectID, Revision FROM Changes WHERE Deleted=1 AND Changed<? ORDER BY Changed LIMIT ?;",
+    [STMT_RAISE_FLOOR] = "UPDATE Users SET SyncFloor=max(SyncFloor, ?) WHERE ID=?;",
+    [STMT_DROP_CHANGE] = "DELETE FROM Changes WHERE UserID=? AND Kind=? AND ObjectID=?;",
+};
+
+/* Schema upgrades, applied in order; PRAGMA user_version records how many have run */
+static const char *const migrations[] = {
+    /* 1: every data query filters on the owning user first */
+    "CREATE INDEX IF NOT EXISTS Categories_UserID ON Categories(UserID);"
+    "CREATE INDEX IF NOT EXISTS Entries_UserID_CategoryID ON Entries(UserID, CategoryID);",
+    /* 2: data keys; accounts created before it get theirs at their next LOGIN */
+    "ALTER TABLE Users ADD COLUMN DataKey BLOB;"
+    "ALTER TABLE Users ADD COLUMN AnswerDataKey BLOB;",
+    /* 3: change log for SYNC. Existing rows are logged once, categories before entries, and SyncFloor
+       is the newest revision whose tombstones may have been dropped */
+    "ALTER TABLE Users ADD COLUMN Revision INTEGER NOT NULL DEFAULT 0;"
+    "ALTER TABLE Users ADD COLUMN SyncFloor INTEGER NOT NULL DEFAULT 0;"
+    "CREATE TABLE Changes ("
+    "UserID INTEGER NOT NULL, "
+    "Kind INTEGER NOT NULL, "
+    "ObjectID INTEGER NOT NULL, "
+    "Revision INTEGER NOT NULL, "
+    "Deleted INTEGER NOT NULL, "
+    "Changed INTEGER NOT NULL, "
+    "PRIMARY KEY (UserID, Kind, ObjectID)) WITHOUT ROWID;"
+    "CREATE INDEX Changes_UserID_Revision ON Changes(UserID, Revision);"
+    "CREATE INDEX Changes_Tombstones ON Changes(Changed) WHERE Deleted=1;"
+    "INSERT INTO Changes SELECT UserID, 0, ID, ID, 0, 0 FROM Categories WHERE UserID IS NOT NULL;"
+    "INSERT INTO Changes SELECT UserID, 1, ID, ID + (SELECT ifnull(max(ID), 0) FROM Categories), 0, 0 "
+    "FROM Entries WHERE UserID IS NOT NULL;"
+    "UPDATE Users SET Revision=ifnull((SELECT max(Revision) FROM Changes WHERE UserID=Users.ID), 0);",
+};
+
+/* Read-only connections, one per worker; WAL lets them run alongside the writer */
+static db_conn *db_pool;
+static db_conn **db_idle;
+static int db_idle_count = 0;
+static int db_pool_size = 0;
+static pthread_mutex_t db_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t db_pool_cond = PTHREAD_COND_INITIALIZER;
+
+/* Only the commit thread touches the writer; everyone else queues a write_op */
+static db_conn db_writer;
+static write_op *commit_head, *commit_tail;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+static sqlite3 *db_checkpointer;
+static int wal_pages = 0;   /* WAL size after the last commit */
+static int wal_checked = 0; /* pages already copied back by the checkpointer */
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;
+
+static int init_db(const char *db_name, int pool_size)
+{
+    sqlite3 *db;
+    char *err_msg = NULL;
+    int rc = sqlite3_open(db_name, &db);
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_close(db);
+        return rc;
+    }
+
+    const char *sql =
+        "PRAGMA journal_mode=WAL;"
+
+        "CREATE TABLE IF NOT EXISTS Users ("
+        "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "Username TEXT UNIQUE, "
+        "MasterHash TEXT NOT NULL, "
+        "SecurityQuestion TEXT, "
+        "SecurityAnswerHash TEXT);"
+
+        "CREATE TABLE IF NOT EXISTS Categories ("
+        "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "Name TEXT, "
+        "UserID INTEGER, "
+        "UNIQUE(Name, UserID));"
+
+        "CREATE TABLE IF NOT EXISTS Entries ("
+        "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "Title TEXT, "
+        "EntryUser TEXT, "
+        "URL TEXT, "
+        "Notes TEXT, "
+        "PassVal TEXT, "
+        "UserID INTEGER, "
+        "CategoryID INTEGER, "
+        "UNIQUE(Title, UserID));";
+
+    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_free(err_msg);
+        sqlite3_close(db);
+        return rc;
+    }
+
+    rc = db_migrate(db);
+    if (rc == SQLITE_OK)
+    {
+        rc = db_check_query_plans(db);
+    }
+    sqlite3_close(db);
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+    return db_pool_init(db_name, pool_size);
+}
+
+/* Brings an existing database up to the current schema, one transaction per step */
+static int db_migrate(sqlite3 *db)
+{
+    sqlite3_stmt *res;
+    int version = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &res, NULL) != SQLITE_OK)
+    {
+        return SQLITE_ERROR;
+    }
+    if (sqlite3_step(res) == SQLITE_ROW)
+    {
+        version = sqlite3_column_int(res, 0);
+    }
+    sqlite3_finalize(res);
+
+    int target = sizeof(migrations) / sizeof(migrations[0]);
+    for (; version < target; ++version)
+    {
+        char bump[64];
+        snprintf(bump, sizeof(bump), "PRAGMA user_version=%d;", version + 1);
+
+        char *err_msg = NULL;
+        int rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, &err_msg);
+        if (rc == SQLITE_OK)
+        {
+            rc = sqlite3_exec(db, migrations[version], 0, 0, &err_msg);
+        }
+        if (rc == SQLITE_OK)
+        {
+            rc = sqlite3_exec(db, bump, 0, 0, &err_msg);
+        }
+        if (rc == SQLITE_OK)
+        {
+            rc = sqlite3_exec(db, "COMMIT;", 0, 0, &err_msg);
+        }
+        if (rc != SQLITE_OK)
+        {
+            fprintf(stderr, "Schema migration %d failed: %s\n", version + 1, err_msg ? err_msg : sqlite3_errmsg(db));
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+            return rc;
+        }
+    }
+    return SQLITE_OK;
+}
+
+/* Refuses to start if any statement would scan a whole table or sort before its first row */
+static int db_check_query_plans(sqlite3 *db)
+{
+    int rc = SQLITE_OK;
+    for (int id = 0; id < STMT_COUNT; ++id)
+    {
+        char sql[1024];
+        snprintf(sql, sizeof(sql), "EXPLAIN QUERY PLAN %s", stmt_sql[id]);
+
+        sqlite3_stmt *res;
+        if (sqlite3_prepare_v2(db, sql, -1, &res, NULL) != SQLITE_OK)
+        {
+            fprintf(stderr, "Prepare failed: %s\n", sqlite3_errmsg(db));
+            return SQLITE_ERROR;
+        }
+        while (sqlite3_step(res) == SQLITE_ROW)
+        {
+            /* EXPLAIN QUERY PLAN rows: id, parent, notused, detail */
+            const char *detail = (const char *)sqlite3_column_text(res, 3);
+            if (detail && ((strncmp(detail, "SCAN ", 5) == 0 && strcmp(detail, "SCAN CONSTANT ROW") != 0) ||
+                           strncmp(detail, "USE TEMP B-TREE", 15) == 0))
+            {
+                fprintf(stderr, "Query plan check: \"%s\" in %s\n", detail, stmt_sql[id]);
+                rc = SQLITE_ERROR;
+            }
+        }
+        sqlite3_finalize(res);
+    }
+    return rc;
+}
+
+/* Opens the writer, the checkpointer and one reader per worker; statements are prepared lazily on first use */
+static int db_pool_init(const char *db_name, int pool_size)
+{
+    db_pool = calloc(pool_size, sizeof(db_conn));
+    db_idle = calloc(pool_size, sizeof(db_conn *));
+    if (db_pool == NULL || db_idle == NULL)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    for (int i = 0; i < pool_size; ++i)
+    {
+        int rc = db_open(db_name, SQLITE_OPEN_READONLY, &db_pool[i].db);
+        if (rc != SQLITE_OK)
+        {
+            fprintf(stderr, "Pool connection %d: %s\n", i, sqlite3_errmsg(db_pool[i].db));
+            return rc;
+        }
+        db_idle[db_idle_count++] = &db_pool[i];
+        db_pool_size++;
+    }
+
+    int rc = db_open(db_name, SQLITE_OPEN_READWRITE, &db_writer.db);
+    if (rc == SQLITE_OK)
+    {
+        rc = db_open(db_name, SQLITE_OPEN_READWRITE, &db_checkpointer);
+    }
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "Writer connection: %s\n", sqlite3_errstr(rc));
+        return rc;
+    }
+
+    /* Each group commit syncs the WAL before anyone is acknowledged; checkpoints are left to a background thread */
+    rc = sqlite3_exec(db_writer.db, "PRAGMA synchronous=FULL; PRAGMA wal_autocheckpoint=0;", 0, 0, NULL);
+    if (rc == SQLITE_OK)
+    {
+        /* A connection only notices WAL mode once it has read the database */
+        rc = sqlite3_exec(db_checkpointer, "PRAGMA journal_mode=WAL;", 0, 0, NULL);
+    }
+    if (rc != SQLITE_OK)
+    {
+        return rc;
+    }
+    sqlite3_busy_timeout(db_checkpointer, WAL_TRUNCATE_WAIT_MS);
+    sqlite3_wal_hook(db_writer.db, db_wal_hook, NULL);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, db_checkpoint_run, NULL);
+    pthread_create(&tid, NULL, db_commit_run, NULL);
+    return SQLITE_OK;
+}
+
+static int db_open(const char *db_name, int flags, sqlite3 **db)
+{
+    int rc = sqlite3_open_v2(db_name, db, flags, NULL);
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_busy_timeout(*db, DB_BUSY_TIMEOUT_MS);
+    }
+    return rc;
+}
+
+/* Blocks until a pooled connection is free */
+static db_conn *db_acquire(void)
+{
+    pthread_mutex_lock(&db_pool_lock);
+    while (db_idle_count == 0)
+    {
+        pthread_cond_wait(&db_pool_cond, &db_pool_lock);
+    }
+    db_conn *c = db_idle[--db_idle_count];
+    pthread_mutex_unlock(&db_pool_lock);
+    metrics_db_begin();
+    return c;
+}
+
+static void db_release(db_conn *c)
+{
+    metrics_db_end();
+    pthread_mutex_lock(&db_pool_lock);
+    db_idle[db_idle_count++] = c;
+    pthread_cond_signal(&db_pool_cond);
+    pthread_mutex_unlock(&db_pool_lock);
+}
+
+static void db_pool_usage(int *in_use, int *total)
+{
+    pthread_mutex_lock(&db_pool_lock);
+    *total = db_pool_size;
+    *in_use = db_pool_size - db_idle_count;
+    pthread_mutex_unlock(&db_pool_lock);
+}
+
+/* Returns the cached statement for id, compiling it on first use; NULL on prepare failure */
+static sqlite3_stmt *db_stmt(db_conn *c, enum stmt_id id)
+{
+    if (c->stmts[id] == NULL)
+    {
+        if (sqlite3_prepare_v3(c->db, stmt_sql[id], -1, SQLITE_PREPARE_PERSISTENT, &c->stmts[id], NULL) != SQLITE_OK)
+        {
+            fprintf(stderr, "Prepare failed: %s\n", sqlite3_errmsg(c->db));
+            c->stmts[id] = NULL;
+        }
+    }
+    return c->stmts[id];
+}
+
+/* Resets a cached statement so the next caller can rebind it */
+static void db_stmt_done(sqlite3_stmt *res)
+{
+    sqlite3_reset(res);
+    sqlite3_clear_bindings(res);
+}
+
+/* Runs on the writer after each commit; wakes the checkpointer once the WAL has grown enough */
+static int db_wal_hook(void *arg, sqlite3 *db, const char *name, int pages)
+{
+    (void)arg;
+    (void)db;
+    (void)name;
+    pthread_mutex_lock(&wal_lock);
+    if (pages < wal_checked)
+    {
+        /* The writer restarted the log from the beginning */
+        wal_checked = 0;
+    }
+    wal_pages = pages;
+    if (pages - wal_checked >= CHECKPOINT_PAGES)
+    {
+        pthread_cond_signal(&wal_cond);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return SQLITE_OK;
+}
+
+/* Copies WAL pages back into the database without blocking readers or the writer */
+static void *db_checkpoint_run(void *arg)
+{
+    (void)arg;
+
+    while (1)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CHECKPOINT_INTERVAL_SEC;
+
+        pthread_mutex_lock(&wal_lock);
+        while (wal_pages - wal_checked < CHECKPOINT_PAGES &&
+               pthread_cond_timedwait(&wal_cond, &wal_lock, &deadline) != ETIMEDOUT)
+        {
+        }
+        int pending = wal_pages - wal_checked;
+        pthread_mutex_unlock(&wal_lock);
+
+        if (pending <= 0)
+        {
+            continue;
+        }
+
+        int log_pages = 0, done_pages = 0, truncated = 0, readers, total;
+        int rc = sqlite3_wal_checkpoint_v2(db_checkpointer, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_pages, &done_pages);
+        db_pool_usage(&readers, &total);
+        if (rc == SQLITE_OK && log_pages >= WAL_TRUNCATE_PAGES && readers == 0)
+        {
+            /* A reader checked out from here on delays the writers queued behind it by WAL_TRUNCATE_WAIT_MS at most */
+            rc = sqlite3_wal_checkpoint_v2(db_checkpointer, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+            truncated = rc == SQLITE_OK;
+        }
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+        {
+            fprintf(stderr, "Checkpoint failed: %s\n", sqlite3_errmsg(db_checkpointer));
+        }
+
+        pthread_mutex_lock(&wal_lock);
+        if (truncated)
+        {
+            wal_pages = 0;
+        }
+        wal_checked = done_pages < wal_pages ? done_pages : wal_pages;
+        pthread_mutex_unlock(&wal_lock);
+    }
+    return NULL;
+}
+
+/* Queues op for the commit thread and waits until its group is durable; returns op's result */
+static int db_write(write_op *op)
+{
+    metrics_db_begin();
+    sem_init(&op->done, 0, 0);
+    op->next = NULL;
+
+    pthread_mutex_lock(&commit_lock);
+    if (commit_tail)
+    {
+        commit_tail->next = op;
+    }
+    else
+    {
+        commit_head = op;
+        pthread_cond_signal(&commit_cond);
+    }
+    commit_tail = op;
+    pthread_mutex_unlock(&commit_lock);
+
+    while (sem_wait(&op->done) != 0 && errno == EINTR)
+    {
+    }
+    sem_destroy(&op->done);
+    metrics_db_end();
+    return op->rc;
+}
+
+/* Applies queued writes in one transaction until the group is full or its window closes, then commits once */
+static void *db_commit_run(void *arg)
+{
+    (void)arg;
+    int last_count = 0;
+
+    while (1)
+    {
+        pthread_mutex_lock(&commit_lock);
+        while (commit_head == NULL)
+        {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+        }
+        pthread_mutex_unlock(&commit_lock);
+
+        /* A lone writer is committed straight away; the window only opens while writes arrive concurrently */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += last_count > 1 ? GROUP_COMMIT_WINDOW_US * 1000L : 0;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int open = sqlite3_exec(db_writer.db, "BEGIN IMMEDIATE;", 0, 0, NULL) == SQLITE_OK;
+        write_op *group = NULL, **group_tail = &group;
+        int count = 0;
+
+        while (count < GROUP_COMMIT_MAX)
+        {
+            pthread_mutex_lock(&commit_lock);
+            while (commit_head == NULL &&
+                   pthread_cond_timedwait(&commit_cond, &commit_lock, &deadline) != ETIMEDOUT)
+            {
+            }
+            write_op *op = commit_head;
+            if (op)
+            {
+                commit_head = op->next;
+                if (commit_head == NULL)
+                {
+                    commit_tail = NULL;
+                }
+            }
+            pthread_mutex_unlock(&commit_lock);
+            if (op == NULL)
+            {
+                break;
+            }
+
+            /* A savepoint per write, so a failed one leaves no partial changes in the group */
+            op->rc = 1;
+            if (open && sqlite3_exec(db_writer.db, "SAVEPOINT op;", 0, 0, NULL) == SQLITE_OK)
+            {
+                op->rc = op->apply(&db_writer, op);
+                if (op->rc == 0 && op->revision)
+                {
+                    op->rc = db_save_revision(&db_writer, op);
+                }
+                if (op->rc != 0)
+                {
+                    sqlite3_exec(db_writer.db, "ROLLBACK TO op;", 0, 0, NULL);
+                }
+                sqlite3_exec(db_writer.db, "RELEASE op;", 0, 0, NULL);
+            }
+            op->next = NULL;
+            *group_tail = op;
+            group_tail = &op->next;
+            count++;
+        }
+        last_count = count;
+
+        /* One WAL sync covers the whole group */
+        if (open && sqlite3_exec(db_writer.db, "COMMIT;", 0, 0, NULL) != SQLITE_OK)
+        {
+            fprintf(stderr, "Group commit failed: %s\n", sqlite3_errmsg(db_writer.db));
+            sqlite3_exec(db_writer.db, "ROLLBACK;", 0, 0, NULL);
+            for (write_op *op = group; op; op = op->next)
+            {
+                op->rc = 1;
+            }
+        }
+        for (write_op *op = group; op; op = op->next)
+        {
+            if (op->rc == 0 && op->committed)
+            {
+                op->committed(op);
+            }
+            if (op->rc == 0 && op->revision)
+            {
+                watch_notify(op->id[0], op->revision);
+            }
+        }
+
+        while (group)
+        {
+            write_op *op = group;
+            group = op->next;
+            sem_post(&op->done);
+        }
+    }
+    return NULL;
+}
+
+static int db_register(const char *username, const char *hashpass, const unsigned char *wrapped)
+{
+    write_op op = {.apply = db_apply_register, .text = {username, hashpass}, .blob = {{wrapped, WRAPPED_KEY_LEN}}};
+    return db_write(&op);
+}
+
+static int db_apply_register(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_REGISTER);
+    int rc = SQLITE_ERROR;
+    if (res)
+    {
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 2, op->text[1], -1, SQLITE_STATIC);
+        db_bind_blob(res, 3, &op->blob[0]);
+
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
+    }
+
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+/* wrapped holds the data key under the master password and under the answer */
+static int db_register_with_security(const char *username, const char *securityQ, const char *hashpass, const char *hashAns, const unsigned char *const *wrapped)
+{
+    write_op op = {.apply = db_apply_register_with_security, .text = {username, hashpass, securityQ, hashAns},
+                   .blob = {{wrapped[0], WRAPPED_KEY_LEN}, {wrapped[1], WRAPPED_KEY_LEN}}};
+    return db_write(&op);
+}
+
+static int db_apply_register_with_security(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_REGISTER_SEC);
+    int rc = SQLITE_ERROR;
+    if (res)
+    {
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 2, op->text[1], -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 3, op->text[2], -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 4, op->text[3], -1, SQLITE_STATIC);
+        db_bind_blob(res, 5, &op->blob[0]);
+        db_bind_blob(res, 6, &op->blob[1]);
+
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
+    }
+
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+static int db_see_security_question(const char *username, char *out)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_SEC_QUESTION);
+    if (res == NULL)
+    {
+        db_release(c);
+        return 1;
+    }
+
+    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
+
+    int found = 1;
+    if (sqlite3_step(res) == SQLITE_ROW && sqlite3_column_text(res, 0) != NULL)
+    {
+        strcpy(out, (const char *)sqlite3_column_text(res, 0));
+        found = 0;
+    }
+
+    db_stmt_done(res);
+    db_release(c);
+    return found;
+}
+
+/* Fills cred; an unknown user leaves it as it was */
+static int db_fetch_credentials(const char *username, credentials *cred)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_FETCH_CREDENTIALS);
+    if (res == NULL)
+    {
+        db_release(c);
+        return 1;
+    }
 
-        process_command(ctx, buffer, response);
+    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
 
-        if (write(ctx->client_fd, response, strlen(response)) <= 0)
+    int rc = sqlite3_step(res);
+    if (rc == SQLITE_ROW)
+    {
+        const char *m = (const char *)sqlite3_column_text(res, 1);
+        const char *a = (const char *)sqlite3_column_text(res, 2);
+        cred->user_id = sqlite3_column_int64(res, 0);
+        snprintf(cred->master, KDF_HASH_LEN, "%s", m ? m : "");
+        snprintf(cred->answer, KDF_HASH_LEN, "%s", a ? a : "");
+        for (int i = 0; i < 2; ++i)
         {
-            perror("Client write error.\n");
-            break;
+            int len = sqlite3_column_bytes(res, i + 3);
+            cred->has_wrapped[i] = sqlite3_column_type(res, i + 3) == SQLITE_NULL ? 0 : len == WRAPPED_KEY_LEN ? 1 : -1;
+            if (cred->has_wrapped[i] > 0)
+            {
+                memcpy(cred->wrapped[i], sqlite3_column_blob(res, i + 3), WRAPPED_KEY_LEN);
+            }
         }
     }
 
-    close(ctx->client_fd);
-    free(ctx);
-    return NULL;
+    db_stmt_done(res);
+    db_release(c);
+    return rc == SQLITE_ROW ? 0 : 1;
 }
 
-static void process_command(client_ctx *ctx, const char *cmd, char *response)
+static int db_create_category(sqlite3_int64 user_id, const char *catName)
 {
-    // Split by '|'
-    char copy[4096];
-    strncpy(copy, cmd, sizeof(copy));
-    copy[sizeof(copy) - 1] = '\0';
+    write_op op = {.apply = db_apply_create_category, .committed = vault_on_category_added,
+                   .text = {catName}, .id = {user_id}};
+    return db_write(&op);
+}
 
-    char *tokens[16];
-    int count = 0;
-    char *tok = strtok(copy, "|");
-    while (tok && count < 16)
+static int db_apply_create_category(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_CREATE_CATEGORY);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        tokens[count++] = tok;
-        tok = strtok(NULL, "|");
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        sqlite3_bind_int64(res, 2, op->id[0]);
+
+        rc = sqlite3_step(res);
+        op->out[0] = sqlite3_last_insert_rowid(c->db);
+        db_stmt_done(res);
     }
 
-    // for (int i = 0; i<count; i++)
-    // {
-    //     printf("Token %d: %s\n", i, tokens[i]);
-    // }
+    if (rc != SQLITE_DONE)
+    {
+        return 1;
+    }
+    return db_log_change(c, op, CHANGE_CATEGORY, op->out[0], 0);
+}
 
-    if (count == 0)
+/* Streams up to limit rows after after_id (limit < 0: all of them); returns the row count or -1.
+   The page is read into memory first, so a slow client never holds a pooled reader or its snapshot */
+static int db_fetch_categories(sqlite3_int64 user_id, sqlite3_int64 after_id, int limit, reply_stream *rs, sqlite3_int64 *next_cursor)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_FETCH_CATEGORIES);
+    if (res == NULL)
     {
-        strcpy(response, "Empty command.\n");
-        return;
+        db_release(c);
+        return -1;
     }
 
-    if (strcmp(tokens[0], "REGISTER") == 0 && count == 3)
+    /* One row past the page tells whether a next cursor is needed */
+    sqlite3_bind_int64(res, 1, user_id);
+    sqlite3_bind_int64(res, 2, after_id);
+    sqlite3_bind_int(res, 3, limit < 0 ? -1 : limit + 1);
+
+    row_list page = {0};
+    int rc, failed = 0;
+    *next_cursor = 0;
+    while (!failed && (rc = sqlite3_step(res)) == SQLITE_ROW)
     {
-        cmd_register_user(ctx, tokens[1], tokens[2], response);
+        if (page.count == limit)
+        {
+            *next_cursor = page.rows[limit - 1]->id;
+            break;
+        }
+        const char *name = (const char *)sqlite3_column_text(res, 1);
+        vault_row *row = vault_row_new(sqlite3_column_int64(res, 0), &name, 1);
+        failed = row == NULL || row_list_append(&page, row) != 0;
     }
-    else if (strcmp(tokens[0], "LOGIN") == 0 && count == 3)
+    db_stmt_done(res);
+    db_release(c);
+
+    failed |= rc != SQLITE_ROW && rc != SQLITE_DONE;
+    for (int i = 0; i < page.count && !failed; ++i)
     {
-        cmd_login_user(ctx, tokens[1], tokens[2], response);
+        stream_category(rs, page.rows[i]->f[0]);
     }
-    else if (strcmp(tokens[0], "NEW_CAT") == 0 && count == 2)
+    int rows = page.count;
+    row_list_free(&page);
+    return failed ? -1 : rows;
+}
+
+static int db_fetch_entry_by_title(sqlite3_int64 user_id, const char *title)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_FETCH_ENTRY_BY_TITLE);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        cmd_new_category(ctx, tokens[1], response);
+        sqlite3_bind_text(res, 1, title, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(res, 2, user_id);
+
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
     }
-    else if (strcmp(tokens[0], "LIST_CATS") == 0 && count == 1)
+    db_release(c);
+
+    return rc == SQLITE_ROW ? 0 : 1;
+}
+
+/* Notes and password are sealed here, on the worker; the cache hook still gets them in the clear */
+static int db_insert_entry(sqlite3_int64 user_id, const unsigned char *key, sqlite3_int64 cat_id, const char *title, const char *usr, const char *url, const char *notes, const char *pass)
+{
+    batch_item it = {.notes = notes, .pass = pass};
+    write_op op = {.apply = db_apply_insert_entry, .committed = vault_on_entry_added,
+                   .text = {title, usr, url, notes, pass}, .id = {user_id, cat_id}};
+    unsigned char *sealed = field_seal_items(key, user_id, &it, 1, NULL, op.blob);
+    if (sealed == NULL)
     {
-        cmd_list_categories(ctx, response);
+        return 1;
     }
-    else if (strcmp(tokens[0], "NEW_ENTRY") == 0 && count == 7)
+    int rc = db_write(&op);
+    free(sealed);
+    return rc;
+}
+
+static int db_apply_insert_entry(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_INSERT_ENTRY);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        cmd_new_entry(ctx, tokens[1], tokens[2], tokens[3], tokens[4], tokens[5], tokens[6], response);
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 2, op->text[1], -1, SQLITE_STATIC);
+        sqlite3_bind_text(res, 3, op->text[2], -1, SQLITE_STATIC);
+        db_bind_blob(res, 4, &op->blob[0]);
+        db_bind_blob(res, 5, &op->blob[1]);
+        sqlite3_bind_int64(res, 6, op->id[0]);
+        sqlite3_bind_int64(res, 7, op->id[1]);
+
+        rc = sqlite3_step(res);
+        op->out[0] = sqlite3_last_insert_rowid(c->db);
+        db_stmt_done(res);
     }
-    else if (strcmp(tokens[0], "LIST_ENTRIES") == 0 && count == 2)
+
+    if (rc != SQLITE_DONE)
     {
-        cmd_list_entries(ctx, tokens[1], response);
+        return 1;
     }
-    else if (strcmp(tokens[0], "MOD_ENTRY") == 0 && count == 7)
+    return db_log_change(c, op, CHANGE_ENTRY, op->out[0], 0);
+}
+
+/* Streams up to limit rows after after_id (limit < 0: all of them), read into memory first like db_fetch_categories;
+   returns the row count or -1 */
+static int db_fetch_entries(sqlite3_int64 user_id, const unsigned char *key, const char *cat, sqlite3_int64 after_id, int limit, reply_stream *rs, sqlite3_int64 *next_cursor)
+{
+    field_cipher fc;
+    if (field_cipher_init(&fc, key, user_id, 0) != 0)
     {
-        cmd_mod_entry(ctx, tokens[1], tokens[2], tokens[3], tokens[4], tokens[5], tokens[6], response);
+        field_cipher_free(&fc);
+        return -1;
     }
-    else if (strcmp(tokens[0], "DEL_ENTRY") == 0 && count == 2)
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_FETCH_ENTRIES);
+    if (res == NULL)
     {
-        cmd_del_entry(ctx, tokens[1], response);
+        db_release(c);
+        field_cipher_free(&fc);
+        return -1;
     }
-    else if (strcmp(tokens[0], "LOGOUT") == 0 && count == 1)
+
+    /* One row past the page tells whether a next cursor is needed */
+    sqlite3_bind_int64(res, 1, user_id);
+    sqlite3_bind_text(res, 2, cat, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(res, 3, after_id);
+    sqlite3_bind_int(res, 4, limit < 0 ? -1 : limit + 1);
+
+    row_list page = {0};
+    int rc, failed = 0;
+    *next_cursor = 0;
+    while (!failed && (rc = sqlite3_step(res)) == SQLITE_ROW)
     {
-        cmd_logout_user(ctx, response);
+        if (page.count == limit)
+        {
+            *next_cursor = page.rows[limit - 1]->id;
+            break;
+        }
+        const char *fields[5];
+        for (int i = 0; i < 3; ++i)
+        {
+            fields[i] = (const char *)sqlite3_column_text(res, i + 1);
+        }
+        fields[3] = field_column(&fc, res, 4, SEAL_NOTES);
+        fields[4] = field_column(&fc, res, 5, SEAL_PASS);
+        if (fields[3] == NULL || fields[4] == NULL)
+        {
+            rc = SQLITE_CORRUPT;
+            break;
+        }
+        vault_row *row = vault_row_new(sqlite3_column_int64(res, 0), fields, 5);
+        failed = row == NULL || row_list_append(&page, row) != 0;
     }
-    else if (strcmp(tokens[0], "REGISTER_SEC") == 0 && count == 5)
+    db_stmt_done(res);
+    db_release(c);
+    field_cipher_free(&fc);
+
+    failed |= rc != SQLITE_ROW && rc != SQLITE_DONE;
+    for (int i = 0; i < page.count && !failed; ++i)
     {
-        cmd_register_user_with_security(ctx, tokens[1], tokens[2], tokens[3], tokens[4], response);
+        stream_entry(rs, page.rows[i]->f);
     }
-    else if (strcmp(tokens[0], "SEC_QUESTION") == 0 && count == 2)
+    int rows = page.count;
+    row_list_free(&page);
+    return failed ? -1 : rows;
+}
+
+/* SEARCH and FIND_BY_URL for a vault the cache cannot hold: walks the caller's entries and scores them like the indexes; returns 0 or 1 */
+static int db_match_entries(sqlite3_int64 user_id, const unsigned char *key, entry_match match, const void *query, search_hits *hits)
+{
+    field_cipher fc;
+    if (field_cipher_init(&fc, key, user_id, 0) != 0)
     {
-        cmd_see_security_question(ctx, tokens[1], response);
+        field_cipher_free(&fc);
+        return 1;
     }
-    else if (strcmp(tokens[0], "RECOVER_PASS") == 0 && count == 3)
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_LOAD_ENTRIES);
+    if (res == NULL)
     {
-        cmd_recover_password(ctx, tokens[1], tokens[2], response);
+        db_release(c);
+        field_cipher_free(&fc);
+        return 1;
     }
-    else if (strcmp(tokens[0], "CHANGE_PASS") == 0 && count == 4)
+
+    /* Notes are matched, so every row is opened; the password only for rows that make the list */
+    sqlite3_bind_int64(res, 1, user_id);
+    int rc;
+    while ((rc = sqlite3_step(res)) == SQLITE_ROW)
     {
-        cmd_change_password(ctx, tokens[1], tokens[2], tokens[3], response);
+        const char *fields[5] = {NULL};
+        for (int i = 0; i < 3; ++i)
+        {
+            fields[i] = (const char *)sqlite3_column_text(res, i + 2);
+        }
+        fields[3] = field_column(&fc, res, 5, SEAL_NOTES);
+        if (fields[3] == NULL)
+        {
+            rc = SQLITE_CORRUPT;
+            break;
+        }
+        sqlite3_int64 id = sqlite3_column_int64(res, 0);
+        uint32_t score = match(fields, query);
+        if (score && search_hits_wants(hits, score, id))
+        {
+            fields[4] = field_column(&fc, res, 6, SEAL_PASS);
+            if (fields[4] == NULL)
+            {
+                rc = SQLITE_CORRUPT;
+                break;
+            }
+            vault_row *row = vault_row_new(id, fields, 5);
+            if (row == NULL)
+            {
+                break;
+            }
+            search_hits_offer(hits, row, score);
+            vault_row_release(row);
+        }
     }
-    else if (strcmp(tokens[0], "DEL_CAT") == 0 && count == 2)
+
+    db_stmt_done(res);
+    db_release(c);
+    field_cipher_free(&fc);
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+static int db_update_entry(sqlite3_int64 user_id, const unsigned char *key, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass)
+{
+    batch_item it = {.notes = newNotes, .pass = newPass};
+    write_op op = {.apply = db_apply_update_entry, .committed = vault_on_entry_updated,
+                   .text = {newTitle, newUsr, newURL, newNotes, newPass, oldTitle},
+                   .id = {user_id}};
+    unsigned char *sealed = field_seal_items(key, user_id, &it, 1, NULL, op.blob);
+    if (sealed == NULL)
     {
-        cmd_del_category(ctx, tokens[1], response);
+        return 1;
     }
-    else
+    int rc = db_write(&op);
+    free(sealed);
+    return rc;
+}
+
+static int db_apply_update_entry(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_UPDATE_ENTRY);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        strcpy(response, "Invalid command or parameters.\n");
+        for (int i = 0; i < 6; ++i)
+        {
+            if (i == 3 || i == 4)
+            {
+                db_bind_blob(res, i + 1, &op->blob[i - 3]);
+            }
+            else
+            {
+                sqlite3_bind_text(res, i + 1, op->text[i], -1, SQLITE_STATIC);
+            }
+        }
+        sqlite3_bind_int64(res, 7, op->id[0]);
+
+        /* RETURNING yields the updated rows, so no row means nothing matched; titles need not be unique */
+        rc = sqlite3_step(res);
+        if (rc == SQLITE_ROW)
+        {
+            op->out[0] = sqlite3_column_int64(res, 0);
+            op->out[1] = sqlite3_column_int64(res, 1);
+        }
+        rc = db_log_returned(c, op, res, CHANGE_ENTRY, 0, rc);
+        db_stmt_done(res);
     }
+
+    return rc == SQLITE_DONE && op->out[0] != 0 ? 0 : 1;
 }
 
-/* Command Handlers */
+/* Fails if the wrapped data key is no longer old_wrapped (NULL: none), so a key another login just created is never lost */
+static int db_update_password(const char *username, const char *newPass, const unsigned char *old_wrapped, const unsigned char *new_wrapped)
+{
+    write_op op = {.apply = db_apply_update_password, .text = {newPass, username},
+                   .blob = {{new_wrapped, WRAPPED_KEY_LEN}, {old_wrapped, WRAPPED_KEY_LEN}}};
+    return db_write(&op);
+}
 
-static int evaluate_password_strength(const char *pass, char *response)
+/* Swaps in a stronger hash, or a first data key, unless the hash or wrapped key changed since they were read */
+static int db_rehash(sqlite3_int64 user_id, int answer, const char *old_hash, const char *new_hash, const unsigned char *old_wrapped, const unsigned char *new_wrapped)
 {
-    int len = strlen(pass);
-    int has_upper = 0, has_lower = 0, has_digit = 0, has_special = 0;
+    write_op op = {.apply = db_apply_rehash, .text = {new_hash, old_hash}, .id = {user_id}, .flag = answer,
+                   .blob = {{new_wrapped, WRAPPED_KEY_LEN}, {old_wrapped, WRAPPED_KEY_LEN}}};
+    return db_write(&op);
+}
 
-    for (int i = 0; i < len; ++i)
+static int db_apply_update_password(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_UPDATE_PASSWORD);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        if (isdigit(pass[i]))
-            has_digit = 1;
-        else if (isupper(pass[i]))
-            has_upper = 1;
-        else if (islower(pass[i]))
-            has_lower = 1;
-        else if (ispunct(pass[i]))
-            has_special = 1;
-    }
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        db_bind_blob(res, 2, &op->blob[0]);
+        sqlite3_bind_text(res, 3, op->text[1], -1, SQLITE_STATIC);
+        db_bind_blob(res, 4, &op->blob[1]);
 
-    if (len >= 8 && has_upper && has_lower && has_digit && has_special)
-    {
-        strcpy(response, "Password strength: Strong\n");
-        return 0;
-    }
-    else
-    {
-        strcpy(response, "Password strength: Weak - Consider using a longer password with uppercase, lowercase, digits, and special characters.\n");
-        return 1;
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
     }
+
+    return rc == SQLITE_DONE && sqlite3_changes(c->db) == 1 ? 0 : 1;
 }
 
-/* Integrate this into the registration command */
-static void cmd_register_user(client_ctx *ctx, const char *username, const char *masterPass, char *response)
+static int db_apply_rehash(db_conn *c, write_op *op)
 {
-    char strength_response[256];
-    if (username[0] == '\0' || masterPass[0] == '\0')
+    sqlite3_stmt *res = db_stmt(c, op->flag ? STMT_REHASH_ANSWER : STMT_REHASH_MASTER);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        strcpy(response, "All fields are required.\n");
-        return;
-    }
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        db_bind_blob(res, 2, &op->blob[0]);
+        sqlite3_bind_int64(res, 3, op->id[0]);
+        sqlite3_bind_text(res, 4, op->text[1], -1, SQLITE_STATIC);
+        db_bind_blob(res, 5, &op->blob[1]);
 
-    int exists = db_fetch_user_by_username(username);
-    if (exists == 0)
-    {
-        strcpy(response, "User already exists.\n");
-        return;
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
     }
 
-    if (evaluate_password_strength(masterPass, strength_response) == 0)
+    return rc == SQLITE_DONE && sqlite3_changes(c->db) == 1 ? 0 : 1;
+}
+
+static int db_remove_entry(sqlite3_int64 user_id, const char *title)
+{
+    write_op op = {.apply = db_apply_remove_entry, .committed = vault_on_entry_removed,
+                   .text = {title}, .id = {user_id}};
+    return db_write(&op);
+}
+
+static int db_apply_remove_entry(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_REMOVE_ENTRY);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        strcat(response, strength_response);
+        sqlite3_bind_text(res, 1, op->text[0], -1, SQLITE_STATIC);
+        sqlite3_bind_int64(res, 2, op->id[0]);
+
+        rc = sqlite3_step(res);
+        if (rc == SQLITE_ROW)
+        {
+            op->out[0] = sqlite3_column_int64(res, 0);
+            op->out[1] = sqlite3_column_int64(res, 1);
+        }
+        rc = db_log_returned(c, op, res, CHANGE_ENTRY, 1, rc);
+        db_stmt_done(res);
     }
-    else
+
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+static int db_fetch_user_by_username(const char *username)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_FETCH_USER);
+    if (res == NULL)
     {
-        strcat(response, strength_response);
-        strcat(response, "\nMaster password not accepted.\n");
-        return;
+        db_release(c);
+        return 1;
     }
 
-    unsigned long hash = simple_hash(masterPass);
-    const char *hash_str = ulong_to_str(hash);
-    int rc = db_register(username, hash_str);
-    if (rc == 0)
+    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
+
+    int rc = sqlite3_step(res);
+
+    db_stmt_done(res);
+    db_release(c);
+    return rc == SQLITE_ROW ? 0 : 1;
+}
+
+static int db_fetch_category_by_name(sqlite3_int64 user_id, const char *catName, sqlite3_int64 *cat_id)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_FETCH_CATEGORY);
+    if (res == NULL)
     {
-        strcat(response, "Registration successful.\n");
+        db_release(c);
+        return 1;
     }
-    else
+
+    sqlite3_bind_text(res, 1, catName, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(res, 2, user_id);
+
+    int rc = sqlite3_step(res);
+    if (rc == SQLITE_ROW)
     {
-        strcat(response, "Registration failed, possibly user exists.\n");
+        *cat_id = sqlite3_column_int64(res, 0);
     }
+
+    db_stmt_done(res);
+    db_release(c);
+    return rc == SQLITE_ROW ? 0 : 1;
 }
 
-static void cmd_login_user(client_ctx *ctx, const char *username, const char *masterPass, char *response)
+
+// This function will delete the category and any entries associated with it
+static int db_remove_category(sqlite3_int64 user_id, sqlite3_int64 cat_id)
 {
-    unsigned long hash = simple_hash(masterPass);
-    const char *hash_str = ulong_to_str(hash);
+    write_op op = {.apply = db_apply_remove_category, .committed = vault_on_category_removed,
+                   .id = {user_id, cat_id}};
+    return db_write(&op);
+}
 
-    if (ctx->active_user[0])
+static int db_apply_remove_category(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_REMOVE_CATEGORY_ENTRIES);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        strcpy(response, "Already logged in.\n");
-        return;
-    }
+        sqlite3_bind_int64(res, 1, op->id[0]);
+        sqlite3_bind_int64(res, 2, op->id[1]);
 
-    int rc = db_login(ctx, username, hash_str);
-    if (rc == 0)
-    {
-        sprintf(response, "Login successful: %s\n", username);
-    }
-    else
-    {
-        strcpy(response, "Login failed: invalid credentials.\n");
+        rc = db_log_returned(c, op, res, CHANGE_ENTRY, 1, sqlite3_step(res));
+        db_stmt_done(res);
     }
-}
 
-static void cmd_new_category(client_ctx *ctx, const char *catName, char *response)
-{
-    if (!ctx->active_user[0])
+    if (rc != SQLITE_DONE)
     {
-        strcpy(response, "Login required.\n");
-        return;
+        return 1;
     }
-    int exists = db_fetch_category_by_name(ctx->active_user, catName, response);
-    if (exists == 0)
+
+    res = db_stmt(c, STMT_REMOVE_CATEGORY);
+    rc = SQLITE_ERROR;
+    if (res)
     {
-        strcpy(response, "Category already exists.\n");
-        return;
+        sqlite3_bind_int64(res, 1, op->id[1]);
+
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
     }
 
-    int rc = db_create_category(ctx->active_user, catName);
-    if (rc == 0)
+    if (rc != SQLITE_DONE)
     {
-        strcpy(response, "Category added.\n");
+        return 1;
     }
-    else
+    return db_log_change(c, op, CHANGE_CATEGORY, op->id[1], 1);
+}
+
+/* Inserts every well-formed item as one write with one reused statement; returns 0 once committed */
+static int db_insert_entry_batch(sqlite3_int64 user_id, const unsigned char *key, const batch_item *items, int count, unsigned char *status, int create_categories)
+{
+    /* Sealing happens before the commit thread sees the batch, so it never holds up other writers */
+    blob_ref *blobs = malloc(2 * (size_t)count * sizeof(blob_ref));
+    unsigned char *sealed = blobs ? field_seal_items(key, user_id, items, count, status, blobs) : NULL;
+    if (sealed == NULL)
     {
-        strcpy(response, "Failed to add category. It may already exist.\n");
+        free(blobs);
+        return 1;
     }
+    write_op op = {.apply = db_apply_insert_entry_batch, .committed = vault_on_invalidate, .id = {user_id},
+                   .items = items, .blobs = blobs, .status = status, .count = count, .flag = create_categories};
+    int rc = db_write(&op);
+    free(sealed);
+    free(blobs);
+    return rc;
 }
 
-static void cmd_list_categories(client_ctx *ctx, char *response)
+static int db_apply_insert_entry_batch(db_conn *c, write_op *op)
 {
-    if (!ctx->active_user[0])
+    sqlite3_stmt *category = db_stmt(c, STMT_FETCH_CATEGORY);
+    sqlite3_stmt *insert = db_stmt(c, STMT_INSERT_ENTRY);
+    if (category == NULL || insert == NULL)
     {
-        strcpy(response, "Login required.\n");
-        return;
+        return 1;
     }
-    char out[2048] = "";
-    if (db_fetch_categories(ctx->active_user, out) == 0)
+    sqlite3_int64 user_id = op->id[0];
+    unsigned char *status = op->status;
+
+    /* Imports are usually grouped by category, so remember the last lookup */
+    sqlite3_stmt *create;
+    const char *last_cat = NULL;
+    sqlite3_int64 cat_id = 0;
+
+    for (int i = 0; i < op->count; ++i)
     {
-        if (strlen(out) == 0)
+        if (status[i] != BATCH_OK)
         {
-            strcpy(response, "No categories found.\n");
+            continue;
         }
-        else
+        const batch_item *it = &op->items[i];
+
+        if (last_cat == NULL || strcmp(last_cat, it->cat) != 0)
         {
-            sprintf(response, "Categories:\n%s", out);
+            sqlite3_bind_text(category, 1, it->cat, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(category, 2, user_id);
+            cat_id = sqlite3_step(category) == SQLITE_ROW ? sqlite3_column_int64(category, 0) : 0;
+            db_stmt_done(category);
+            last_cat = it->cat;
+
+            if (cat_id == 0 && op->flag && (create = db_stmt(c, STMT_CREATE_CATEGORY)) != NULL)
+            {
+                sqlite3_bind_text(create, 1, it->cat, -1, SQLITE_STATIC);
+                sqlite3_bind_int64(create, 2, user_id);
+                if (sqlite3_step(create) == SQLITE_DONE)
+                {
+                    cat_id = sqlite3_last_insert_rowid(c->db);
+                }
+                db_stmt_done(create);
+                if (cat_id && db_log_change(c, op, CHANGE_CATEGORY, cat_id, 0) != 0)
+                {
+                    return 1;
+                }
+            }
+        }
+        if (cat_id == 0)
+        {
+            status[i] = BATCH_NO_CATEGORY;
+            continue;
+        }
+
+        sqlite3_bind_text(insert, 1, it->title, -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert, 2, it->usr, -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert, 3, it->url, -1, SQLITE_STATIC);
+        db_bind_blob(insert, 4, &op->blobs[2 * i]);
+        db_bind_blob(insert, 5, &op->blobs[2 * i + 1]);
+        sqlite3_bind_int64(insert, 6, user_id);
+        sqlite3_bind_int64(insert, 7, cat_id);
+
+        int rc = sqlite3_step(insert);
+        if (rc != SQLITE_DONE)
+        {
+            status[i] = (rc & 0xff) == SQLITE_CONSTRAINT ? BATCH_DUPLICATE : BATCH_FAILED;
+        }
+        db_stmt_done(insert);
+        if (rc == SQLITE_DONE && db_log_change(c, op, CHANGE_ENTRY, sqlite3_last_insert_rowid(c->db), 0) != 0)
+        {
+            return 1;
         }
     }
-    else
-    {
-        strcpy(response, "Error retrieving categories.\n");
-    }
+    return 0;
 }
 
-static void cmd_new_entry(client_ctx *ctx, const char *cat, const char *title, const char *usr, const char *url, const char *notes, const char *pass, char *response)
+/* Change log */
+
+/* Records that a row of op's user (id[0], as in every vault write) changed, at the user's next revision; 0 once logged.
+   The counter is read on the write's first change and stored once by db_save_revision after the last */
+static int db_log_change(db_conn *c, write_op *op, enum change_kind kind, sqlite3_int64 id, int deleted)
 {
-    if (!ctx->active_user[0])
+    sqlite3_stmt *log = db_stmt(c, STMT_LOG_CHANGE);
+    if (log == NULL)
     {
-        strcpy(response, "Login required.\n");
-        return;
+        return 1;
     }
-    int exists = db_fetch_entry_by_title(ctx->active_user, title, response);
-    if (exists == 0)
+    if (op->revision == 0)
     {
-        strcpy(response, "Entry with that title already exists.\n");
-        return;
+        sqlite3_stmt *res = db_stmt(c, STMT_SYNC_STATE);
+        int rc = SQLITE_ERROR;
+        if (res)
+        {
+            sqlite3_bind_int64(res, 1, op->id[0]);
+            rc = sqlite3_step(res);
+            if (rc == SQLITE_ROW)
+            {
+                op->revision = sqlite3_column_int64(res, 0);
+            }
+            db_stmt_done(res);
+        }
+        if (rc != SQLITE_ROW)
+        {
+            return 1;
+        }
     }
-    exists = db_fetch_category_by_name(ctx->active_user, cat, response);
-    if (exists != 0)
+    op->revision++;
+
+    sqlite3_bind_int64(log, 1, op->id[0]);
+    sqlite3_bind_int(log, 2, kind);
+    sqlite3_bind_int64(log, 3, id);
+    sqlite3_bind_int64(log, 4, op->revision);
+    sqlite3_bind_int(log, 5, deleted);
+    sqlite3_bind_int64(log, 6, (sqlite3_int64)time(NULL));
+    int rc = sqlite3_step(log);
+    db_stmt_done(log);
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+static int db_save_revision(db_conn *c, write_op *op)
+{
+    sqlite3_stmt *res = db_stmt(c, STMT_SAVE_REVISION);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        strcpy(response, "Category not found.\n");
-        return;
+        sqlite3_bind_int64(res, 1, op->revision);
+        sqlite3_bind_int64(res, 2, op->id[0]);
+
+        rc = sqlite3_step(res);
+        db_stmt_done(res);
     }
-    int rc = db_insert_entry(ctx->active_user, cat, title, usr, url, notes, pass);
-    if (rc == 0)
+
+    return rc == SQLITE_DONE ? 0 : 1;
+}
+
+/* Logs every row a RETURNING statement yields (ID first), starting with the row its first step, rc, produced.
+   Returns the last step's result; past one row, out[0] becomes -1 so the cache hooks know */
+static int db_log_returned(db_conn *c, write_op *op, sqlite3_stmt *res, enum change_kind kind, int deleted, int rc)
+{
+    int rows = 0;
+    for (; rc == SQLITE_ROW; rc = sqlite3_step(res))
     {
-        strcpy(response, "Entry added.\n");
+        if (db_log_change(c, op, kind, sqlite3_column_int64(res, 0), deleted) != 0)
+        {
+            return SQLITE_ERROR;
+        }
+        if (++rows > 1)
+        {
+            op->out[0] = -1;
+        }
     }
-    else
+    return rc;
+}
+
+static int db_revision(sqlite3_int64 user_id, sqlite3_int64 *revision)
+{
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_SYNC_STATE);
+    int rc = SQLITE_ERROR;
+    if (res)
     {
-        strcpy(response, "Failed to add entry.\n");
+        sqlite3_bind_int64(res, 1, user_id);
+
+        rc = sqlite3_step(res);
+        if (rc == SQLITE_ROW)
+        {
+            *revision = sqlite3_column_int64(res, 0);
+        }
+        db_stmt_done(res);
     }
+    db_release(c);
+
+    return rc == SQLITE_ROW ? 0 : 1;
 }
 
-static void cmd_list_entries(client_ctx *ctx, const char *cat, char *response)
+/* Streams up to limit log rows after revision after (limit < 0: all of them) and returns how many were read, or -1;
+   since is the revision the client asked from. state gets the user's revision, unless state[0] already holds one, and
+   SyncFloor; below the floor, deletions may be missing and nothing more is streamed.
+   Each batch is read in its own short snapshot that ends before any of it is streamed; only revisions up to the first
+   snapshot's are sent, so whatever changes meanwhile is logged past the revision the client keeps and comes next time.
+   A stalled stream stops after the batch with *next_cursor set */
+static int db_sync(sqlite3_int64 user_id, const unsigned char *key, sqlite3_int64 since, sqlite3_int64 after, int limit, reply_stream *rs, sqlite3_int64 *state, sqlite3_int64 *next_cursor)
 {
-    if (!ctx->active_user[0])
+    field_cipher fc;
+    if (field_cipher_init(&fc, key, user_id, 0) != 0)
     {
-        strcpy(response, "Login required.\n");
-        return;
+        field_cipher_free(&fc);
+        return -1;
     }
-    char out[4096] = "";
-    if (db_fetch_entries(ctx->active_user, cat, out) == 0)
+
+    int rows = 0, n, more, reset;
+    *next_cursor = 0;
+    do
     {
-        if (strlen(out) == 0)
+        sync_row batch[STREAM_BATCH];
+        int want = limit < 0 || limit - rows > STREAM_BATCH ? STREAM_BATCH : limit - rows;
+        n = db_read_changes(user_id, &fc, after, want, state, batch, &more);
+        reset = since && since < state[1];
+        for (int i = 0; i < n; ++i)
         {
-            strcpy(response, "No entries in that category.\n");
+            sync_row *r = &batch[i];
+            /* A client starting from nothing has nothing to delete */
+            if (!reset && (r->deleted ? since != 0 : r->row != NULL))
+            {
+                stream_change(rs, r->kind, r->deleted, r->id, r->cat_id, r->row ? r->row->f : NULL);
+            }
+            if (r->row)
+            {
+                vault_row_release(r->row);
+            }
         }
-        else
+        if (n < 0 || reset)
         {
-            sprintf(response, "Entries:\n%s", out);
+            break;
         }
-    }
-    else
+        rows += n;
+        if (n > 0)
+        {
+            after = batch[n - 1].revision;
+        }
+    } while (more && rows != limit && !rs->stalled);
+
+    if (n >= 0 && !reset && more)
     {
-        strcpy(response, "Error retrieving entries.\n");
+        *next_cursor = after;
     }
+    field_cipher_free(&fc);
+    return n < 0 ? -1 : rows;
 }
 
-static void cmd_mod_entry(client_ctx *ctx, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass, char *response)
+/* Reads up to want log rows after revision after, in one snapshot that also reads the user's SyncFloor into state[1]
+   and, on the first batch (state[0] < 0), the revision that caps this and later batches into state[0].
+   Sets *more if rows remain below the cap; returns the count or -1 */
+static int db_read_changes(sqlite3_int64 user_id, field_cipher *fc, sqlite3_int64 after, int want, sqlite3_int64 *state, sync_row *out, int *more)
 {
-    if (!ctx->active_user[0])
+    db_conn *c = db_acquire();
+    sqlite3_stmt *head = db_stmt(c, STMT_SYNC_STATE);
+    sqlite3_stmt *res = db_stmt(c, STMT_SYNC_CHANGES);
+    if (head == NULL || res == NULL || sqlite3_exec(c->db, "BEGIN;", 0, 0, NULL) != SQLITE_OK)
     {
-        strcpy(response, "Login required.\n");
-        return;
+        db_release(c);
+        return -1;
     }
-    int exists = db_fetch_entry_by_title(ctx->active_user, oldTitle, response);
-    if (exists != 0)
+
+    sqlite3_bind_int64(head, 1, user_id);
+    int rc = sqlite3_step(head);
+    if (rc == SQLITE_ROW)
     {
-        strcpy(response, "Entry not found.\n");
-        return;
+        if (state[0] < 0)
+        {
+            state[0] = sqlite3_column_int64(head, 0);
+        }
+        state[1] = sqlite3_column_int64(head, 1);
     }
-    int rc = db_update_entry(ctx->active_user, oldTitle, newTitle, newUsr, newURL, newNotes, newPass);
-    if (rc == 0)
+    db_stmt_done(head);
+
+    int n = 0;
+    *more = 0;
+    if (rc != SQLITE_ROW)
     {
-        strcpy(response, "Entry updated.\n");
+        rc = SQLITE_ERROR;
     }
     else
     {
-        strcpy(response, "Failed to update entry.\n");
-    }
-}
+        /* One row past the batch tells whether there is more */
+        sqlite3_bind_int64(res, 1, user_id);
+        sqlite3_bind_int64(res, 2, after);
+        sqlite3_bind_int64(res, 3, state[0]);
+        sqlite3_bind_int(res, 4, want + 1);
 
-static void cmd_del_entry(client_ctx *ctx, const char *title, char *response)
-{
-    if (!ctx->active_user[0])
-    {
-        strcpy(response, "Login required.\n");
-        return;
-    }
-    int exists = db_fetch_entry_by_title(ctx->active_user, title, response);
-    if (exists != 0)
-    {
-        strcpy(response, "Entry not found.\n");
-        return;
-    }
-    int rc = db_remove_entry(ctx->active_user, title);
-    if (rc == 0)
-    {
-        strcpy(response, "Entry deleted.\n");
+        while ((rc = sqlite3_step(res)) == SQLITE_ROW)
+        {
+            if (n == want)
+            {
+                *more = 1;
+                break;
+            }
+            sync_row *r = &out[n];
+            r->revision = sqlite3_column_int64(res, 0);
+            r->kind = sqlite3_column_int(res, 1);
+            r->id = sqlite3_column_int64(res, 2);
+            r->deleted = sqlite3_column_int(res, 3);
+            r->cat_id = 0;
+            r->row = NULL;
+
+            const char *fields[5];
+            if (!r->deleted && r->kind == CHANGE_CATEGORY)
+            {
+                fields[0] = (const char *)sqlite3_column_text(res, 4);
+                if (fields[0] && (r->row = vault_row_new(r->id, fields, 1)) == NULL)
+                {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+            }
+            else if (!r->deleted && sqlite3_column_type(res, 5) != SQLITE_NULL)
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    fields[i] = (const char *)sqlite3_column_text(res, i + 6);
+                }
+                fields[3] = field_column(fc, res, 9, SEAL_NOTES);
+                fields[4] = field_column(fc, res, 10, SEAL_PASS);
+                if (fields[3] == NULL || fields[4] == NULL)
+                {
+                    rc = SQLITE_CORRUPT;
+                    break;
+                }
+                r->cat_id = sqlite3_column_int64(res, 5);
+                if ((r->row = vault_row_new(r->id, fields, 5)) == NULL)
+                {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+            }
+            n++;
+        }
+        db_stmt_done(res);
     }
-    else
+
+    sqlite3_exec(c->db, "COMMIT;", 0, 0, NULL);
+    db_release(c);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
     {
-        strcpy(response, "Failed to delete entry.\n");
+        for (int i = 0; i < n; ++i)
+        {
+            if (out[i].row)
+            {
+                vault_row_release(out[i].row);
+            }
+        }
+        return -1;
     }
+    return n;
 }
 
-static void cmd_logout_user(client_ctx *ctx, char *response)
+/* Drops up to COMPACT_BATCH tombstones logged before cutoff; returns how many, or -1 */
+static int db_compact_changes(time_t cutoff)
 {
-    if (!ctx->active_user[0])
-    {
-        strcpy(response, "Not logged in.\n");
-        return;
-    }
-    ctx->active_user[0] = '\0';
-    strcpy(response, "Logged out.\n");
+    write_op op = {.apply = db_apply_compact_changes, .id = {(sqlite3_int64)cutoff}};
+    return db_write(&op) == 0 ? (int)op.out[0] : -1;
 }
 
-static void cmd_register_user_with_security(client_ctx *ctx, const char *username, const char *masterPass, const char *securityQ, const char *securityA, char *response)
+/* Each user's SyncFloor rises to the newest tombstone dropped, so SYNC from before it asks for a full copy */
+static int db_apply_compact_changes(db_conn *c, write_op *op)
 {
-    if (!username[0] || !masterPass[0] || !securityQ[0] || !securityA[0])
+    sqlite3_stmt *old = db_stmt(c, STMT_OLD_TOMBSTONES);
+    sqlite3_stmt *raise = db_stmt(c, STMT_RAISE_FLOOR);
+    sqlite3_stmt *drop = db_stmt(c, STMT_DROP_CHANGE);
+    sqlite3_int64 (*rows)[4] = malloc(COMPACT_BATCH * sizeof(*rows));
+    if (old == NULL || raise == NULL || drop == NULL || rows == NULL)
     {
-        strcpy(response, "All fields are required.\n");
-        return;
+        free(rows);
+        return 1;
     }
 
-    if (evaluate_password_strength(masterPass, response) == 1)
+    /* Read first, then delete, so the scan never runs over rows it is removing */
+    int n = 0, rc;
+    sqlite3_bind_int64(old, 1, op->id[0]);
+    sqlite3_bind_int(old, 2, COMPACT_BATCH);
+    while ((rc = sqlite3_step(old)) == SQLITE_ROW)
     {
-        strcat(response, "Master password not accepted.\n");
-        return;
+        for (int i = 0; i < 4; ++i)
+        {
+            rows[n][i] = sqlite3_column_int64(old, i);
+        }
+        n++;
     }
+    db_stmt_done(old);
 
-    int exists = db_fetch_user_by_username(username);
-    if (exists == 0)
+    for (int i = 0; i < n && rc == SQLITE_DONE; ++i)
     {
-        strcpy(response, "User already exists.\n");
-        return;
+        sqlite3_bind_int64(raise, 1, rows[i][3]);
+        sqlite3_bind_int64(raise, 2, rows[i][0]);
+        rc = sqlite3_step(raise);
+        db_stmt_done(raise);
+        if (rc == SQLITE_DONE)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                sqlite3_bind_int64(drop, k + 1, rows[i][k]);
+            }
+            rc = sqlite3_step(drop);
+            db_stmt_done(drop);
+        }
     }
+    free(rows);
+    op->out[0] = n;
+    return rc == SQLITE_DONE ? 0 : 1;
+}
 
-    unsigned long hashPass = simple_hash(masterPass);
-    unsigned long hashAns = simple_hash(securityA);
-
-    char hashPassStr[32], hashAnsStr[32];
-    snprintf(hashPassStr, sizeof(hashPassStr), "%lu", hashPass);
-    snprintf(hashAnsStr, sizeof(hashAnsStr), "%lu", hashAns);
-
+/* Wakes every COMPACT_INTERVAL_SEC and drops expired tombstones, one short write per batch */
+static void *db_compact_run(void *arg)
+{
+    (void)arg;
 
-    int rc = db_register_with_security(username, securityQ, hashPassStr, hashAnsStr);
-    if (rc == 0)
-    {
-        strcpy(response, "Registration successful.\n");
-    }
-    else
+    while (1)
     {
-        strcpy(response, "Registration failed, possibly user exists.\n");
+        sleep(COMPACT_INTERVAL_SEC);
+        time_t cutoff = time(NULL) - tombstone_ttl;
+        while (db_compact_changes(cutoff) == COMPACT_BATCH)
+        {
+        }
     }
+    return NULL;
 }
 
-static void cmd_see_security_question(client_ctx *ctx, const char *username, char *response)
+/* Streams every entry of the user after the (category ID, entry ID) cursor, grouped by category, as CSV or JSON lines.
+   Rows are read STREAM_BATCH at a time and each batch goes out only once its reader is back in the pool.
+   Returns 0 when done, -1 on error, and 1 when the stream stalled, with after moved past the last row sent */
+static int db_export_entries(sqlite3_int64 user_id, const unsigned char *key, enum vault_format format, sqlite3_int64 *after, reply_stream *rs)
 {
-    if (ctx->active_user[0])
-    {
-        strcpy(response, "Logout required.\n");
-        return;
-    }
+    static const char *const keys[] = {"category", "title", "user", "url", "notes", "password"};
 
-    if (!username[0])
+    field_cipher fc;
+    if (field_cipher_init(&fc, key, user_id, 0) != 0)
     {
-        strcpy(response, "Username is required.\n");
-        return;
+        field_cipher_free(&fc);
+        return -1;
     }
 
-    int exists = db_fetch_user_by_username(username);
-    if (exists != 0)
+    if (format == VAULT_CSV && after[0] == 0 && after[1] == 0)
     {
-        strcpy(response, "User not found.\n");
-        return;
+        stream_printf(rs, "category,title,user,url,notes,password\n");
     }
 
-    char securityQ[256];
-    int rc = db_see_security_question(username, securityQ);
-    if (rc == 0)
-    {
-        sprintf(response, "Security question: %s\n", securityQ);
-    }
-    else
+    int n;
+    do
     {
-        strcpy(response, "User does not have a security question.\n");
-    }
+        vault_row *cats[STREAM_BATCH], *rows[STREAM_BATCH];
+        n = db_read_export(user_id, &fc, after, cats, rows);
+        for (int r = 0; r < n; ++r)
+        {
+            if (format == VAULT_JSON)
+            {
+                stream_append(rs, "{", 1);
+            }
+            for (int i = 0; i < 6; ++i)
+            {
+                const char *val = i == 0 ? cats[r]->f[0] : rows[r]->f[i - 1];
+                if (format == VAULT_CSV)
+                {
+                    stream_csv_field(rs, val, i == 5);
+                }
+                else
+                {
+                    stream_json_string(rs, keys[i], val, i == 5);
+                }
+            }
+            vault_row_release(cats[r]);
+            vault_row_release(rows[r]);
+        }
+    } while (n == STREAM_BATCH && !rs->stalled);
+
+    field_cipher_free(&fc);
+    return n < 0 ? -1 : n == STREAM_BATCH;
 }
 
-// This function will set the password of the user to "password" if the security answer is correct
-static void cmd_recover_password(client_ctx *ctx, const char *username, const char *securityA, char *response)
+/* Reads up to STREAM_BATCH export rows after the (category ID, entry ID) cursor, moving it to the last one.
+   cats gets each row's category name, shared by consecutive entries, and rows its five fields; returns the count or -1 */
+static int db_read_export(sqlite3_int64 user_id, field_cipher *fc, sqlite3_int64 *after, vault_row **cats, vault_row **rows)
 {
-    if (ctx->active_user[0])
-    {
-        strcpy(response, "Logout required.\n");
-        return;
-    }
-
-    if (!username[0] || !securityA[0])
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_EXPORT_ENTRIES);
+    if (res == NULL)
     {
-        strcpy(response, "All fields are required.\n");
-        return;
+        db_release(c);
+        return -1;
     }
 
-    int exists = db_fetch_user_by_username(username);
-    if (exists != 0)
-    {
-        strcpy(response, "User not found.\n");
-        return;
-    }
+    sqlite3_bind_int64(res, 1, user_id);
+    sqlite3_bind_int64(res, 2, after[0]);
+    sqlite3_bind_int64(res, 3, after[1]);
+    sqlite3_bind_int(res, 4, STREAM_BATCH);
 
-    char * buffer = malloc(256);
-    int has_security = db_see_security_question(username, buffer);
-    if (has_security != 0)
+    int rc, n = 0;
+    while ((rc = sqlite3_step(res)) == SQLITE_ROW)
     {
-        strcpy(response, "User does not have a security question.\n");
-        return;
-    }
-
-    unsigned long hashAns = simple_hash(securityA);
+        const char *fields[5];
+        for (int i = 0; i < 3; ++i)
+        {
+            fields[i] = (const char *)sqlite3_column_text(res, i + 1);
+        }
+        fields[3] = field_column(fc, res, 4, SEAL_NOTES);
+        fields[4] = field_column(fc, res, 5, SEAL_PASS);
+        if (fields[3] == NULL || fields[4] == NULL)
+        {
+            rc = SQLITE_CORRUPT;
+            break;
+        }
 
-    int rc = db_verify_security_answer(username, ulong_to_str(hashAns));
-    if (rc == 0)
-    {
-        rc = db_update_password(username, ulong_to_str(simple_hash("password")));
-        if (rc == 0)
+        sqlite3_int64 cat_id = sqlite3_column_int64(res, 6);
+        if (n > 0 && cat_id == after[0])
         {
-            strcpy(response, "Password reset to 'password'.\n");
+            cats[n] = cats[n - 1];
+            atomic_fetch_add_explicit(&cats[n]->refs, 1, memory_order_relaxed);
         }
         else
         {
-            strcpy(response, "Failed to reset password.\n");
+            const char *name = (const char *)sqlite3_column_text(res, 0);
+            cats[n] = vault_row_new(cat_id, &name, 1);
         }
+        rows[n] = vault_row_new(sqlite3_column_int64(res, 7), fields, 5);
+        if (cats[n] == NULL || rows[n] == NULL)
+        {
+            if (cats[n])
+            {
+                vault_row_release(cats[n]);
+            }
+            if (rows[n])
+            {
+                vault_row_release(rows[n]);
+            }
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        after[0] = cat_id;
+        after[1] = rows[n]->id;
+        n++;
     }
-    else
+    db_stmt_done(res);
+    db_release(c);
+
+    if (rc != SQLITE_DONE)
     {
-        strcpy(response, "Invalid security answer.\n");
+        for (int i = 0; i < n; ++i)
+        {
+            vault_row_release(cats[i]);
+            vault_row_release(rows[i]);
+        }
+        return -1;
     }
+    return n;
 }
 
-static void cmd_change_password(client_ctx *ctx, const char *username, const char *oldPass, const char *newPass, char *response)
+/* Reads a user's categories and entries in one snapshot; entries arrive grouped by category, like v->cats.
+   The whole vault is opened with one key schedule, so later listings from the cache pay nothing for encryption */
+static int db_load_vault(sqlite3_int64 user_id, const unsigned char *key, vault *v)
 {
-    if (ctx->active_user[0])
-    {
-        strcpy(response, "Logout required.\n");
-        return;
-    }
-
-    if (!username[0] || !oldPass[0] || !newPass[0])
+    field_cipher fc;
+    if (field_cipher_init(&fc, key, user_id, 0) != 0)
     {
-        strcpy(response, "All fields are required.\n");
-        return;
+        field_cipher_free(&fc);
+        return 1;
     }
-
-    int exists = db_fetch_user_by_username(username);
-    if (exists != 0)
+    db_conn *c = db_acquire();
+    sqlite3_stmt *cats = db_stmt(c, STMT_LOAD_CATEGORIES);
+    sqlite3_stmt *entries = db_stmt(c, STMT_LOAD_ENTRIES);
+    if (cats == NULL || entries == NULL || sqlite3_exec(c->db, "BEGIN;", 0, 0, NULL) != SQLITE_OK)
     {
-        strcpy(response, "User not found.\n");
-        return;
+        db_release(c);
+        field_cipher_free(&fc);
+        return 1;
     }
 
-    if (evaluate_password_strength(newPass, response) == 1)
+    int rc, failed = 0;
+    sqlite3_bind_int64(cats, 1, user_id);
+    while (!failed && (rc = sqlite3_step(cats)) == SQLITE_ROW)
     {
-        strcat(response, "New password not accepted.\n");
-        return;
+        const char *name = (const char *)sqlite3_column_text(cats, 1);
+        vault_row *row = vault_row_new(sqlite3_column_int64(cats, 0), &name, 1);
+        failed = row == NULL || row_list_append(&v->cats, row) != 0;
     }
+    failed |= rc != SQLITE_DONE && rc != SQLITE_ROW;
+    db_stmt_done(cats);
 
-    unsigned long hashOld = simple_hash(oldPass);
-    unsigned long hashNew = simple_hash(newPass);
+    v->entries = calloc(v->cats.cap ? v->cats.cap : 1, sizeof(row_list));
+    failed |= v->entries == NULL;
 
-    // Check old password
-    int rc = db_login(ctx, username, ulong_to_str(hashOld));
-    if (rc != 0)
+    int pos = 0;
+    sqlite3_bind_int64(entries, 1, user_id);
+    while (!failed && (rc = sqlite3_step(entries)) == SQLITE_ROW)
     {
-        strcpy(response, "Invalid old password.\n");
-        return;
+        /* Rows whose category is gone are invisible to LIST_ENTRIES as well */
+        sqlite3_int64 cat_id = sqlite3_column_int64(entries, 1);
+        if (pos >= v->cats.count || v->cats.rows[pos]->id != cat_id)
+        {
+            if (row_list_find(&v->cats, cat_id, &pos) != 0)
+            {
+                continue;
+            }
+        }
+        const char *fields[5];
+        for (int i = 0; i < 3; ++i)
+        {
+            fields[i] = (const char *)sqlite3_column_text(entries, i + 2);
+        }
+        fields[3] = field_column(&fc, entries, 5, SEAL_NOTES);
+        fields[4] = field_column(&fc, entries, 6, SEAL_PASS);
+        if (fields[3] == NULL || fields[4] == NULL)
+        {
+            failed = 1;
+            break;
+        }
+        vault_row *row = vault_row_new(sqlite3_column_int64(entries, 0), fields, 5);
+        failed = row == NULL || row_list_append(&v->entries[pos], row) != 0;
     }
+    failed |= rc != SQLITE_DONE && rc != SQLITE_ROW;
+    db_stmt_done(entries);
 
-    // Update password
-    rc = db_update_password(username, ulong_to_str(hashNew));
-    if (rc == 0)
-    {
-        strcpy(response, "Password updated.\n");
-    }
-    else
-    {
-        strcpy(response, "Failed to update password.\n");
-    }
+    sqlite3_exec(c->db, "COMMIT;", 0, 0, NULL);
+    db_release(c);
+    field_cipher_free(&fc);
+    return failed;
 }
 
-static void cmd_del_category(client_ctx *ctx, const char *catName, char *response)
+/*
+ * Seals Notes and PassVal of rows written before encryption. Runs once, when LOGIN creates the user's data key;
+ * until it finishes, readers take plain text columns as they are. Rows are read from one snapshot and
+ * written SEAL_BATCH at a time; a row a newer write already sealed is left alone.
+ */
+static int db_seal_legacy_entries(sqlite3_int64 user_id, const unsigned char *key)
 {
-    if (!ctx->active_user[0])
+    field_cipher fc;
+    if (field_cipher_init(&fc, key, user_id, 1) != 0)
     {
-        strcpy(response, "Login required.\n");
-        return;
+        field_cipher_free(&fc);
+        return 1;
     }
-    int exists = db_fetch_category_by_name(ctx->active_user, catName, response);
-    if (exists != 0)
+    db_conn *c = db_acquire();
+    sqlite3_stmt *res = db_stmt(c, STMT_LOAD_PLAINTEXT);
+    sqlite3_int64 *ids = malloc(SEAL_BATCH * sizeof(sqlite3_int64));
+    blob_ref *blobs = malloc(2 * SEAL_BATCH * sizeof(blob_ref));
+    size_t *at = malloc(2 * SEAL_BATCH * sizeof(size_t));
+    unsigned char *nonces = malloc(2 * SEAL_BATCH * SEAL_NONCE_LEN);
+    unsigned char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int rc = SQLITE_ERROR, n = 0, failed = res == NULL || ids == NULL || blobs == NULL || at == NULL || nonces == NULL;
+
+    unsigned char aad[2][SEAL_AAD_LEN];
+    seal_aad(user_id, SEAL_NOTES, aad[SEAL_NOTES]);
+    seal_aad(user_id, SEAL_PASS, aad[SEAL_PASS]);
+    if (!failed)
     {
-        strcpy(response, "Category not found.\n");
-        return;
+        sqlite3_bind_int64(res, 1, user_id);
     }
-    int rc = db_remove_category(ctx->active_user, catName);
-    if (rc == 0)
+    while (!failed)
     {
-        strcpy(response, "Category deleted.\n");
+        rc = sqlite3_step(res);
+        if (rc != SQLITE_ROW)
+        {
+            break;
+        }
+        if (n == 0 && RAND_bytes(nonces, 2 * SEAL_BATCH * SEAL_NONCE_LEN) != 1)
+        {
+            failed = 1;
+            break;
+        }
+        ids[n] = sqlite3_column_int64(res, 0);
+        for (int k = 0; k < 2 && !failed; ++k)
+        {
+            const char *plain = (const char *)sqlite3_column_text(res, k + 1);
+            int plain_len = plain ? sqlite3_column_bytes(res, k + 1) : 0;
+            if (len + plain_len + SEAL_OVERHEAD > cap)
+            {
+                cap = (len + plain_len + SEAL_OVERHEAD) * 2;
+                unsigned char *bigger = realloc(buf, cap);
+                failed = bigger == NULL;
+                buf = bigger ? bigger : buf;
+            }
+            failed = failed || seal(fc.evp, aad[k], nonces + (2 * n + k) * SEAL_NONCE_LEN, plain ? plain : "", plain_len, buf + len) != 0;
+            at[2 * n + k] = len;
+            blobs[2 * n + k].len = plain_len + SEAL_OVERHEAD;
+            len += plain_len + SEAL_OVERHEAD;
+        }
+        if (!failed && ++n == SEAL_BATCH)
+        {
+            failed = db_seal_entries(ids, blobs, buf, at, n) != 0;
+            n = 0;
+            len = 0;
+        }
     }
-    else
+    if (!failed && n > 0)
     {
-        strcpy(response, "Failed to delete category.\n");
+        failed = db_seal_entries(ids, blobs, buf, at, n) != 0;
     }
-}
-
-/* Database setup and operations */
 
-static int init_db(const char *db_name)
-{
-    sqlite3 *db;
-    char *err_msg = NULL;
-    int rc = sqlite3_open(db_name, &db);
-    if (rc != SQLITE_OK)
+    if (res)
     {
-        sqlite3_close(db);
-        return rc;
+        db_stmt_done(res);
     }
+    db_release(c);
+    field_cipher_free(&fc);
+    free(ids);
+    free(blobs);
+    free(at);
+    free(nonces);
+    free(buf);
+    return failed || rc != SQLITE_DONE;
+}
 
-    const char *sql =
-        "CREATE TABLE IF NOT EXISTS Users ("
-        "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "Username TEXT UNIQUE, "
-        "MasterHash TEXT NOT NULL, "
-        "SecurityQuestion TEXT, "
-        "SecurityAnswerHash TEXT);"
-
-        "CREATE TABLE IF NOT EXISTS Categories ("
-        "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "Name TEXT, "
-        "UserID INTEGER, "
-        "UNIQUE(Name, UserID));"
-
-        "CREATE TABLE IF NOT EXISTS Entries ("
-        "ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "Title TEXT, "
-        "EntryUser TEXT, "
-        "URL TEXT, "
-        "Notes TEXT, "
-        "PassVal TEXT, "
-        "UserID INTEGER, "
-        "CategoryID INTEGER, "
-        "UNIQUE(Title, UserID));";
-
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    if (rc != SQLITE_OK)
+/* Writes count sealed rows; blobs are pointed into buf only now, since buf may have moved while they were sealed */
+static int db_seal_entries(const sqlite3_int64 *ids, blob_ref *blobs, const unsigned char *buf, const size_t *at, int count)
+{
+    for (int i = 0; i < 2 * count; ++i)
     {
-        sqlite3_free(err_msg);
-        sqlite3_close(db);
-        return rc;
+        blobs[i].p = buf + at[i];
     }
-
-    sqlite3_close(db);
-    return SQLITE_OK;
+    write_op op = {.apply = db_apply_seal_entries, .ids = ids, .blobs = blobs, .count = count};
+    return db_write(&op);
 }
 
-static int db_register(const char *username, const char *hashpass)
+static int db_apply_seal_entries(db_conn *c, write_op *op)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    char sql[256];
-    snprintf(sql, sizeof(sql), "INSERT INTO Users (Username, MasterHash) VALUES ('%s','%s');", username, hashpass);
-
-    char *err_msg = NULL;
-    int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    if (rc != SQLITE_OK)
+    sqlite3_stmt *res = db_stmt(c, STMT_SEAL_ENTRY);
+    if (res == NULL)
     {
-        sqlite3_free(err_msg);
+        return 1;
     }
-    sqlite3_close(db);
-
-    return rc == SQLITE_OK ? 0 : 1;
+    for (int i = 0; i < op->count; ++i)
+    {
+        db_bind_blob(res, 1, &op->blobs[2 * i]);
+        db_bind_blob(res, 2, &op->blobs[2 * i + 1]);
+        sqlite3_bind_int64(res, 3, op->ids[i]);
+        int rc = sqlite3_step(res);
+        db_stmt_done(res);
+        if (rc != SQLITE_DONE)
+        {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-static int db_register_with_security(const char *username, const char *securityQ, const char *hashpass, const char *hashAns)
+static void db_bind_blob(sqlite3_stmt *res, int idx, const blob_ref *b)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    char sql[256];
-    snprintf(sql, sizeof(sql), "INSERT INTO Users (Username, MasterHash, SecurityQuestion, SecurityAnswerHash) VALUES ('%s','%s','%s','%s');", username, hashpass, securityQ, hashAns);
-
-    char *err_msg = NULL;
-    int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    if (rc != SQLITE_OK)
+    if (b->p)
     {
-        sqlite3_free(err_msg);
+        sqlite3_bind_blob(res, idx, b->p, b->len, SQLITE_STATIC);
+    }
+    else
+    {
+        sqlite3_bind_null(res, idx);
     }
-    sqlite3_close(db);
-
-    return rc == SQLITE_OK ? 0 : 1;
 }
 
-static int db_see_security_question(const char *username, char *out)
+/* Password hashing pool */
+static void *kdf_run(void *arg)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "SELECT SecurityQuestion FROM Users WHERE Username=?;";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
+    (void)arg;
+    job j;
 
-    if (rc != SQLITE_OK)
+    while (1)
     {
-        sqlite3_close(db);
-        return 1;
-    }
-
-    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
+        job_queue_pop(&kdf_jobs, &j);
+        pool_stats_record(&kdf_stats, j.enqueued_ns);
 
-    rc = sqlite3_step(res);
-    if (rc == SQLITE_ROW)
-    {
-        if (sqlite3_column_text(res, 0) == NULL)
+        /* A failed check skips the rest, so a wrong password never pays for hashing the new one */
+        kdf_job *kj = j.ctx->kdf;
+        for (int i = 0; i < kj->ntasks; ++i)
+        {
+            kdf_task_run(&kj->task[i]);
+            if (!kj->task[i].ok)
+            {
+                break;
+            }
+        }
+
+        /* The command still holds its connection; a full job queue leaves it waiting on its loop, never run here */
+        if (kdf_release(kj))
         {
-            sqlite3_finalize(res);
-            sqlite3_close(db);
-            return 1;
+            event_loop_resume(j.ctx->loop, j.ctx);
         }
-        strcpy(out, (const char *)sqlite3_column_text(res, 0));
-        sqlite3_finalize(res);
-        sqlite3_close(db);
-        return 0;
     }
-
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return 1;
+    return NULL;
 }
 
-static int db_verify_security_answer(const char *username, const char *hashAns)
+/* The fields are copied, since the command buffer is gone by the time the hash is ready */
+static kdf_job *kdf_job_new(void (*done)(client_ctx *, kdf_job *, reply_buf *), const char *const *args, int nargs)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "SELECT ID FROM Users WHERE Username=? AND SecurityAnswerHash=?;";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-
-    if (rc != SQLITE_OK)
+    size_t size = 0;
+    for (int i = 0; i < nargs; ++i)
     {
-        sqlite3_close(db);
-        return 1;
+        size += strlen(args[i]) + 1;
     }
 
-    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(res, 2, hashAns, -1, SQLITE_STATIC);
-
-    rc = sqlite3_step(res);
-    if (rc == SQLITE_ROW)
+    kdf_job *kj = calloc(1, sizeof(kdf_job) + size);
+    if (kj == NULL)
     {
-        sqlite3_finalize(res);
-        sqlite3_close(db);
-        return 0;
+        return NULL;
     }
+    kj->done = done;
+    kj->size = size;
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return 1;
+    char *p = kj->data;
+    for (int i = 0; i < nargs; ++i)
+    {
+        size_t len = strlen(args[i]) + 1;
+        memcpy(p, args[i], len);
+        kj->arg[i] = p;
+        p += len;
+    }
+    return kj;
 }
 
-static int db_login(client_ctx *ctx, const char *username, const char *hashpass)
+/* Queues a check of arg against stored, or a fresh hash of it if stored is NULL */
+static void kdf_job_add(kdf_job *kj, int arg, const char *stored)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "SELECT ID FROM Users WHERE Username=? AND MasterHash=?;";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-
-    if (rc != SQLITE_OK)
+    kdf_task *t = &kj->task[kj->ntasks++];
+    t->secret = kj->arg[arg];
+    t->verify = stored != NULL;
+    if (stored)
     {
-        sqlite3_close(db);
-        return 1;
+        snprintf(t->stored, sizeof(t->stored), "%s", stored);
     }
+}
 
-    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(res, 2, hashpass, -1, SQLITE_STATIC);
+static void kdf_job_free(kdf_job *kj)
+{
+    OPENSSL_cleanse(kj->data, kj->size);
+    OPENSSL_cleanse(kj->task, sizeof(kj->task));
+    free(kj);
+}
 
-    rc = sqlite3_step(res);
-    if (rc == SQLITE_ROW)
+/* Hands the command to the KDF pool; the worker moves on and the reply, still open in ctx->reply, is finished
+   once the hash is ready */
+static void kdf_park(client_ctx *ctx, kdf_job *kj, reply_buf *response)
+{
+    if (kj == NULL)
     {
-        strncpy(ctx->active_user, username, sizeof(ctx->active_user) - 1);
-        ctx->active_user[sizeof(ctx->active_user) - 1] = '\0';
-        sqlite3_finalize(res);
-        sqlite3_close(db);
-        return 0;
+        reply(ctx, response, ST_BUSY);
+        return;
     }
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return 1;
+    atomic_store_explicit(&kj->holds, 2, memory_order_relaxed);
+    ctx->kdf = kj;
+    job j = {.ctx = ctx, .enqueued_ns = now_ns()};
+    if (job_queue_push(&kdf_jobs, &j) != 0)
+    {
+        /* Hashing is bounded by its own queue; past it, logins are refused like any other overload */
+        ctx->kdf = NULL;
+        kdf_job_free(kj);
+        atomic_fetch_add_explicit(&kdf_stats.rejected, 1, memory_order_relaxed);
+        reply(ctx, response, ST_BUSY);
+    }
 }
 
-static int db_create_category(const char *username, const char *catName)
+/* Finishes a parked command where its handler left off */
+static void kdf_finish(client_ctx *ctx, kdf_job *kj, reply_buf *response)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
+    uint64_t resumed = now_ns();
+    metrics_db_take();
+
+    kj->done(ctx, kj, response);
+
+    command_timing *t = &kj->timing;
+    uint64_t end = now_ns();
+    uint64_t db = metrics_db_take();
+    t->ns[PHASE_DB] += db;
+    t->ns[PHASE_FORMAT] += end - resumed - db;
+    t->ns[PHASE_KDF] = resumed - kj->parked_ns;
+    t->ns[PHASE_TOTAL] = end - t->started;
+    metrics_record(t);
+    kdf_job_free(kj);
+}
 
-    const char *stmt =
-        "INSERT INTO Categories (Name, UserID) VALUES "
-        "(?, (SELECT ID FROM Users WHERE Username=?));";
+/* Returns 1 to whichever of the parking worker and the KDF thread finishes last */
+static int kdf_release(kdf_job *kj)
+{
+    return atomic_fetch_sub_explicit(&kj->holds, 1, memory_order_acq_rel) == 1;
+}
 
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+static void kdf_task_run(kdf_task *t)
+{
+    t->fresh[0] = '\0';
+    if (!t->verify)
     {
-        sqlite3_bind_text(res, 1, catName, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
+        t->ok = kdf_hash(t->secret, t->fresh, t->fresh_kek) == 0;
+        return;
     }
-    sqlite3_finalize(res);
-    sqlite3_close(db);
 
-    return rc == SQLITE_DONE ? 0 : 1;
+    int upgrade = 0;
+    t->ok = kdf_verify(t->secret, t->stored, &upgrade, t->kek) == 0;
+    t->has_kek = t->ok && t->stored[0] == '$';
+    if (t->ok && upgrade && kdf_hash(t->secret, t->fresh, t->fresh_kek) != 0)
+    {
+        t->fresh[0] = '\0';
+    }
 }
 
-static int db_fetch_categories(const char *username, char *out)
+/* Writes "$scrypt$ln=<log2 N>,r=<r>,p=<p>$<salt>$<key>" at the current cost, and the matching KEK unless kek is NULL */
+static int kdf_hash(const char *secret, char *out, unsigned char *kek)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
+    unsigned char salt[KDF_SALT_LEN], key[2 * KDF_KEY_LEN];
+    char salt_b64[B64_LEN(KDF_SALT_LEN) + 1], key_b64[B64_LEN(KDF_KEY_LEN) + 1];
 
-    const char *stmt = "SELECT Name FROM Categories WHERE UserID=(SELECT ID FROM Users WHERE Username=?);";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc != SQLITE_OK)
+    if (RAND_bytes(salt, sizeof(salt)) != 1 || kdf_derive(secret, salt, kdf_log_n, kdf_r, kdf_p, key) != 0)
     {
-        sqlite3_close(db);
         return 1;
     }
-
-    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
-
-    while ((rc = sqlite3_step(res)) == SQLITE_ROW)
+    EVP_EncodeBlock((unsigned char *)salt_b64, salt, sizeof(salt));
+    EVP_EncodeBlock((unsigned char *)key_b64, key, KDF_KEY_LEN);
+    if (kek)
     {
-        strcat(out, (const char *)sqlite3_column_text(res, 0));
-        strcat(out, "\n");
+        memcpy(kek, key + KDF_KEY_LEN, KDF_KEY_LEN);
     }
+    OPENSSL_cleanse(key, sizeof(key));
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
+    snprintf(out, KDF_HASH_LEN, "$scrypt$ln=%d,r=%d,p=%d$%s$%s", kdf_log_n, kdf_r, kdf_p, salt_b64, key_b64);
     return 0;
 }
 
-static int db_fetch_entry_by_title(const char *username, const char *title, char *out)
+/* 0 if secret matches, with the KEK in kek unless it is NULL; legacy djb2 hashes have no KEK, and they and ones below the current cost ask to be upgraded */
+static int kdf_verify(const char *secret, const char *stored, int *upgrade, unsigned char *kek)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
+    if (isdigit((unsigned char)stored[0]))
+    {
+        char legacy[32];
+        size_t len = snprintf(legacy, sizeof(legacy), "%lu", simple_hash(secret));
+        *upgrade = 1;
+        return strlen(stored) == len && CRYPTO_memcmp(stored, legacy, len) == 0 ? 0 : 1;
+    }
 
-    const char *stmt =
-        "SELECT Title, EntryUser, URL, Notes, PassVal FROM Entries "
-        "WHERE Title=? AND UserID=(SELECT ID FROM Users WHERE Username=?);";
+    int log_n, r, p, n = 0;
+    const size_t salt_b64 = B64_LEN(KDF_SALT_LEN), key_b64 = B64_LEN(KDF_KEY_LEN);
+    unsigned char salt[B64_LEN(KDF_SALT_LEN)], key[B64_LEN(KDF_KEY_LEN)], check[2 * KDF_KEY_LEN];
 
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+    if (sscanf(stored, "$scrypt$ln=%d,r=%d,p=%d$%n", &log_n, &r, &p, &n) != 3 || n == 0 ||
+        !kdf_cost_ok(log_n, r, p) || strlen(stored + n) != salt_b64 + 1 + key_b64 || stored[n + salt_b64] != '$' ||
+        EVP_DecodeBlock(salt, (const unsigned char *)stored + n, salt_b64) < KDF_SALT_LEN ||
+        EVP_DecodeBlock(key, (const unsigned char *)stored + n + salt_b64 + 1, key_b64) < KDF_KEY_LEN)
     {
-        sqlite3_bind_text(res, 1, title, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
-        if (rc == SQLITE_ROW)
-        {
-            snprintf(out, 512, "Title:%s, User:%s, URL:%s, Notes:%s, Pass:%s\n",
-                     sqlite3_column_text(res, 0),
-                     sqlite3_column_text(res, 1),
-                     sqlite3_column_text(res, 2),
-                     sqlite3_column_text(res, 3),
-                     sqlite3_column_text(res, 4));
-        }
+        /* No such user, or nothing usable stored: spend the same time and fail */
+        char scratch[KDF_HASH_LEN];
+        kdf_hash(secret, scratch, NULL);
+        return 1;
     }
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return rc == SQLITE_ROW ? 0 : 1;
+    if (kdf_derive(secret, salt, log_n, r, p, check) != 0)
+    {
+        return 1;
+    }
+    int rc = CRYPTO_memcmp(check, key, KDF_KEY_LEN) == 0 ? 0 : 1;
+    if (rc == 0 && kek)
+    {
+        memcpy(kek, check + KDF_KEY_LEN, KDF_KEY_LEN);
+    }
+    OPENSSL_cleanse(check, sizeof(check));
+    *upgrade = log_n < kdf_log_n || r < kdf_r || p < kdf_p;
+    return rc;
 }
 
-static int db_insert_entry(const char *username, const char *cat, const char *title, const char *usr, const char *url, const char *notes, const char *pass)
+/*
+ * Fills 2 * KDF_KEY_LEN bytes: the stored verifier, then the KEK. scrypt ends in PBKDF2, whose output blocks are
+ * independent, so the first half is what a KDF_KEY_LEN derivation always gave and the KEK cannot be computed from it.
+ */
+static int kdf_derive(const char *secret, const unsigned char *salt, int log_n, int r, int p, unsigned char *key)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt =
-        "INSERT INTO Entries (Title, EntryUser, URL, Notes, PassVal, UserID, CategoryID) "
-        "VALUES (?, ?, ?, ?, ?, "
-        "(SELECT ID FROM Users WHERE Username=?), "
-        "(SELECT ID FROM Categories WHERE Name=? AND UserID=(SELECT ID FROM Users WHERE Username=?)));";
-
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
-    {
-        sqlite3_bind_text(res, 1, title, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, usr, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 3, url, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 4, notes, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 5, pass, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 6, username, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 7, cat, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 8, username, -1, SQLITE_STATIC);
+    uint64_t n = (uint64_t)1 << log_n;
+    uint64_t mem = 128ull * r * (n + p + 2);
+    return EVP_PBE_scrypt(secret, strlen(secret), salt, KDF_SALT_LEN, n, r, p, mem, key, 2 * KDF_KEY_LEN) == 1 ? 0 : 1;
+}
 
-        rc = sqlite3_step(res);
-    }
+/* Bounds both the configured cost and what a stored hash may ask for */
+static int kdf_cost_ok(int log_n, int r, int p)
+{
+    return log_n >= 1 && log_n <= 30 && r >= 1 && r <= 64 && p >= 1 && p <= 16 &&
+           128ull * r * ((1ull << log_n) + p + 2) <= KDF_MAX_MEM;
+}
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return rc == SQLITE_DONE ? 0 : 1;
+/* The original djb2 hash; still recognised so existing accounts can log in once and be upgraded */
+static unsigned long simple_hash(const char *str)
+{
+    unsigned long h = 5381;
+    int c;
+    while ((c = (unsigned char)*str++))
+        h = ((h << 5) + h) + c;
+    return h;
 }
 
-static int db_fetch_entries(const char *username, const char *cat, char *out)
+/* Encryption at rest */
+static int crypt_init(void)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
+    seal_cipher = EVP_CIPHER_fetch(NULL, "AES-256-GCM", NULL);
+    return seal_cipher ? 0 : 1;
+}
 
-    const char *stmt =
-        "SELECT Title, EntryUser, URL, Notes, PassVal FROM Entries "
-        "WHERE UserID=(SELECT ID FROM Users WHERE Username=?) "
-        "AND CategoryID=(SELECT ID FROM Categories WHERE Name=? AND UserID=(SELECT ID FROM Users WHERE Username=?));";
+/* Expands the key once; seal and unseal then only set a nonce per value */
+static int field_cipher_init(field_cipher *fc, const unsigned char *key, sqlite3_int64 user_id, int encrypt)
+{
+    memset(fc, 0, sizeof(*fc));
+    fc->user_id = user_id;
+    fc->evp = EVP_CIPHER_CTX_new();
+    return fc->evp && EVP_CipherInit_ex2(fc->evp, seal_cipher, key, NULL, encrypt, NULL) == 1 ? 0 : 1;
+}
 
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+static void field_cipher_free(field_cipher *fc)
+{
+    EVP_CIPHER_CTX_free(fc->evp);
+    for (int i = 0; i < 2; ++i)
     {
-        sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, cat, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 3, username, -1, SQLITE_STATIC);
-
-        while ((rc = sqlite3_step(res)) == SQLITE_ROW)
+        if (fc->scratch[i])
         {
-            char line[512];
-            snprintf(line, sizeof(line), "Title:%s, User:%s, URL:%s, Notes:%s, Pass:%s\n",
-                     sqlite3_column_text(res, 0),
-                     sqlite3_column_text(res, 1),
-                     sqlite3_column_text(res, 2),
-                     sqlite3_column_text(res, 3),
-                     sqlite3_column_text(res, 4));
-            strcat(out, line);
+            OPENSSL_cleanse(fc->scratch[i], fc->cap[i]);
+            free(fc->scratch[i]);
         }
     }
-
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return 0;
 }
 
-static int db_update_entry(const char *username, const char *oldTitle, const char *newTitle, const char *newUsr, const char *newURL, const char *newNotes, const char *newPass)
+static void seal_aad(sqlite3_int64 user_id, int column, unsigned char *aad)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt =
-        "UPDATE Entries SET Title=?, EntryUser=?, URL=?, Notes=?, PassVal=? "
-        "WHERE Title=? AND UserID=(SELECT ID FROM Users WHERE Username=?);";
-
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+    for (int i = 0; i < 8; ++i)
     {
-        sqlite3_bind_text(res, 1, newTitle, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, newUsr, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 3, newURL, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 4, newNotes, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 5, newPass, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 6, oldTitle, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 7, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
+        aad[i] = (unsigned char)((uint64_t)user_id >> (8 * i));
     }
-
-    int changes = sqlite3_changes(db);
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return (rc == SQLITE_DONE && changes > 0) ? 0 : 1;
+    aad[8] = (unsigned char)column;
 }
 
-static int db_update_password(const char *username, const char *newPass)
+/* Writes len + SEAL_OVERHEAD bytes to out. Nonces are random, so one key never repeats one in practice */
+static int seal(EVP_CIPHER_CTX *evp, const unsigned char *aad, const unsigned char *nonce, const void *plain, int len, unsigned char *out)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "UPDATE Users SET MasterHash=? WHERE Username=?;";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
-    {
-        sqlite3_bind_text(res, 1, newPass, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
-    }
-
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return rc == SQLITE_DONE ? 0 : 1;
+    unsigned char *body = out + 1 + SEAL_NONCE_LEN;
+    int n;
+    out[0] = SEAL_VERSION;
+    memcpy(out + 1, nonce, SEAL_NONCE_LEN);
+    return EVP_CipherInit_ex2(evp, NULL, NULL, nonce, -1, NULL) == 1 &&
+                   EVP_EncryptUpdate(evp, NULL, &n, aad, SEAL_AAD_LEN) == 1 &&
+                   EVP_EncryptUpdate(evp, body, &n, plain, len) == 1 && EVP_EncryptFinal_ex(evp, body + n, &n) == 1 &&
+                   EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_LEN, body + len) == 1
+               ? 0
+               : 1;
 }
 
-static int db_remove_entry(const char *username, const char *title)
+/* Writes len - SEAL_OVERHEAD bytes to out, or fails if in was not sealed with this key, user and column */
+static int unseal(EVP_CIPHER_CTX *evp, const unsigned char *aad, const unsigned char *in, int len, unsigned char *out)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "DELETE FROM Entries WHERE Title=? AND UserID=(SELECT ID FROM Users WHERE Username=?);";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+    const unsigned char *nonce = in + 1, *body = nonce + SEAL_NONCE_LEN;
+    int n, body_len = len - SEAL_OVERHEAD;
+    if (body_len < 0 || in[0] != SEAL_VERSION)
     {
-        sqlite3_bind_text(res, 1, title, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
+        return 1;
     }
-
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return rc == SQLITE_DONE ? 0 : 1;
+    return EVP_CipherInit_ex2(evp, NULL, NULL, nonce, -1, NULL) == 1 &&
+                   EVP_DecryptUpdate(evp, NULL, &n, aad, SEAL_AAD_LEN) == 1 &&
+                   EVP_DecryptUpdate(evp, out, &n, body, body_len) == 1 &&
+                   EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG_LEN, (void *)(body + body_len)) == 1 &&
+                   EVP_DecryptFinal_ex(evp, out + n, &n) == 1
+               ? 0
+               : 1;
 }
 
-static int db_fetch_user_by_username(const char *username)
+/* Opens a sealed Notes or PassVal into the cipher's scratch for that column, valid until the next one; NULL if it does not authenticate */
+static const char *field_open(field_cipher *fc, int column, const unsigned char *in, int len)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "SELECT ID FROM Users WHERE Username=?;";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc != SQLITE_OK)
+    size_t need = len > SEAL_OVERHEAD ? (size_t)(len - SEAL_OVERHEAD) + 1 : 1;
+    if (need > fc->cap[column])
     {
-        sqlite3_close(db);
-        return 1;
+        size_t cap = need < 256 ? 256 : need * 2;
+        char *bigger = malloc(cap);
+        if (bigger == NULL)
+        {
+            return NULL;
+        }
+        if (fc->scratch[column])
+        {
+            OPENSSL_cleanse(fc->scratch[column], fc->cap[column]);
+            free(fc->scratch[column]);
+        }
+        fc->scratch[column] = bigger;
+        fc->cap[column] = cap;
     }
 
-    sqlite3_bind_text(res, 1, username, -1, SQLITE_STATIC);
-
-    rc = sqlite3_step(res);
-    if (rc == SQLITE_ROW)
+    unsigned char aad[SEAL_AAD_LEN];
+    seal_aad(fc->user_id, column, aad);
+    if (unseal(fc->evp, aad, in, len, (unsigned char *)fc->scratch[column]) != 0)
     {
-        sqlite3_finalize(res);
-        sqlite3_close(db);
-        return 0;
+        return NULL;
     }
-
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return 1;
+    fc->scratch[column][need - 1] = '\0';
+    return fc->scratch[column];
 }
 
-static int db_fetch_category_by_name(const char *username, const char *catName, char *out)
+/* A Notes or PassVal column: opened if sealed, as stored if written before encryption; NULL if it does not authenticate */
+static const char *field_column(field_cipher *fc, sqlite3_stmt *res, int col, int column)
 {
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    const char *stmt = "SELECT ID FROM Categories WHERE Name=? AND UserID=(SELECT ID FROM Users WHERE Username=?);";
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc != SQLITE_OK)
+    if (sqlite3_column_type(res, col) != SQLITE_BLOB)
     {
-        sqlite3_close(db);
-        return 1;
-    }
-
-    sqlite3_bind_text(res, 1, catName, -1, SQLITE_STATIC);
-    sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-    rc = sqlite3_step(res);
-    if (rc == SQLITE_ROW)
-    {
-        sqlite3_finalize(res);
-        sqlite3_close(db);
-        return 0;
+        const char *text = (const char *)sqlite3_column_text(res, col);
+        return text ? text : "";
     }
-
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-    return 1;
+    return field_open(fc, column, sqlite3_column_blob(res, col), sqlite3_column_bytes(res, col));
 }
 
-
-// This function will delete the category and any entries associated with it
-static int db_remove_category(const char *username, const char *catName)
+/* Seals the notes and password of every item still BATCH_OK (status may be NULL) into one buffer, which the caller frees;
+   blobs[2 * i] and blobs[2 * i + 1] point into it. One RAND_bytes call covers every nonce, since a call costs far more than a seal */
+static unsigned char *field_seal_items(const unsigned char *key, sqlite3_int64 user_id, const batch_item *items, int count, const unsigned char *status, blob_ref *blobs)
 {
-    const char *stmt = "DELETE FROM Entries WHERE CategoryID=(SELECT ID FROM Categories WHERE Name=? AND UserID=(SELECT ID FROM Users WHERE Username=?));";
-    sqlite3 *db;
-    sqlite3_open("PasswordManager.db", &db);
-
-    sqlite3_stmt *res;
-    int rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+    size_t total = 0, values = 0;
+    for (int i = 0; i < count; ++i)
     {
-        sqlite3_bind_text(res, 1, catName, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
+        if (status == NULL || status[i] == BATCH_OK)
+        {
+            total += strlen(items[i].notes) + strlen(items[i].pass) + 2 * SEAL_OVERHEAD;
+            values += 2;
+        }
     }
 
-    sqlite3_finalize(res);
-    sqlite3_close(db);
-
-    if (rc != SQLITE_DONE)
+    field_cipher fc = {0};
+    unsigned char *buf = malloc(total + values * SEAL_NONCE_LEN + 1), *p = buf;
+    unsigned char *nonce = buf + total;
+    int failed = buf == NULL || RAND_bytes(nonce, (int)(values * SEAL_NONCE_LEN)) != 1 ||
+                 field_cipher_init(&fc, key, user_id, 1) != 0;
+    unsigned char aad[2][SEAL_AAD_LEN];
+    seal_aad(user_id, SEAL_NOTES, aad[SEAL_NOTES]);
+    seal_aad(user_id, SEAL_PASS, aad[SEAL_PASS]);
+    for (int i = 0; i < count && !failed; ++i)
     {
-        return 1;
+        if (status && status[i] != BATCH_OK)
+        {
+            continue;
+        }
+        const char *plain[2] = {items[i].notes, items[i].pass};
+        for (int k = 0; k < 2 && !failed; ++k)
+        {
+            int len = (int)strlen(plain[k]);
+            failed = seal(fc.evp, aad[k], nonce, plain[k], len, p) != 0;
+            blobs[2 * i + k] = (blob_ref){p, len + SEAL_OVERHEAD};
+            p += len + SEAL_OVERHEAD;
+            nonce += SEAL_NONCE_LEN;
+        }
     }
-
-    stmt = "DELETE FROM Categories WHERE Name=? AND UserID=(SELECT ID FROM Users WHERE Username=?);";
-    sqlite3_open("PasswordManager.db", &db);
-
-    rc = sqlite3_prepare_v2(db, stmt, -1, &res, NULL);
-    if (rc == SQLITE_OK)
+    if (fc.evp)
     {
-        sqlite3_bind_text(res, 1, catName, -1, SQLITE_STATIC);
-        sqlite3_bind_text(res, 2, username, -1, SQLITE_STATIC);
-
-        rc = sqlite3_step(res);
+        field_cipher_free(&fc);
     }
+    if (failed)
+    {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
 
-    sqlite3_finalize(res);
-
-    return rc == SQLITE_DONE ? 0 : 1;
+/* which is 0 for the master password's KEK, 1 for the security answer's; wrapped gets WRAPPED_KEY_LEN bytes */
+static int data_key_wrap(const unsigned char *kek, int which, const unsigned char *key, unsigned char *wrapped)
+{
+    field_cipher fc;
+    unsigned char aad[SEAL_AAD_LEN], nonce[SEAL_NONCE_LEN];
+    seal_aad(0, SEAL_MASTER_KEY + which, aad);
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+    {
+        return 1;
+    }
+    int rc = field_cipher_init(&fc, kek, 0, 1) != 0 || seal(fc.evp, aad, nonce, key, DATA_KEY_LEN, wrapped) != 0;
+    field_cipher_free(&fc);
+    return rc;
 }
 
-/* Simple hashing for demonstration */
-static unsigned long simple_hash(const char *str)
+static int data_key_unwrap(const unsigned char *kek, int which, const unsigned char *wrapped, unsigned char *key)
 {
-    unsigned long h = 5381;
-    int c;
-    while ((c = (unsigned char)*str++))
-        h = ((h << 5) + h) + c;
-    return h;
+    field_cipher fc;
+    unsigned char aad[SEAL_AAD_LEN];
+    seal_aad(0, SEAL_MASTER_KEY + which, aad);
+    int rc = field_cipher_init(&fc, kek, 0, 0) != 0 || unseal(fc.evp, aad, wrapped, WRAPPED_KEY_LEN, key) != 0;
+    field_cipher_free(&fc);
+    return rc;
 }
-static const char tmp_buf[32];
-static const char *ulong_to_str(unsigned long val)
+
+/* 0: key is the stored data key, unwrapped with t's KEK; 1: none is stored yet; -1: the stored one does not open */
+static int data_key_open(const credentials *cred, const kdf_task *t, int which, unsigned char *key)
 {
-    static char buf[32];
-    snprintf(buf, sizeof(buf), "%lu", val);
-    return buf;
+    if (cred->has_wrapped[which] == 0)
+    {
+        return 1;
+    }
+    return cred->has_wrapped[which] > 0 && t->has_kek &&
+                   data_key_unwrap(t->kek, which, cred->wrapped[which], key) == 0
+               ? 0
+               : -1;
 }
+static const char tmp_buf[32];